@@ -60,6 +60,7 @@ extern void dologout (int);
 extern void fatal (const char *);
 extern int ftpd_pclose (FILE *);
 extern FILE *ftpd_popen (char *, const char *);
+extern void ls_cache_flush (void);
 #if !HAVE_DECL_GETUSERSHELL
 extern char *getusershell (void);
 #endif
@@ -110,8 +111,13 @@ extern char proctitle[];
 extern int usedefault;
 extern char tmpline[];
 
+/* Exported from popen.c.  */
+extern unsigned long ls_cache_hits;
+extern unsigned long ls_cache_misses;
+
 /* Exported from ftpcmd.y.  */
 extern off_t restart_point;
+extern off_t alloc_size;
 
 /* Distinguish passive address modes.  */
 #define PASSIVE_PASV 0
@@ -120,6 +126,7 @@ extern off_t restart_point;
 
 /* Exported from server_mode.c.  */
 extern int usefamily;
+extern int prefork;
 extern int server_mode (const char *pidfile, struct sockaddr *phis_addr,
 			socklen_t *phis_addrlen, char *argv[]);
 
@@ -110,6 +110,7 @@
 #endif
 
 off_t restart_point;
+off_t alloc_size;
 
 static char cbuf[512];           /* Command Buffer.  */
 static char *fromname;
@@ -310,13 +311,21 @@ cmd
 			    reply (502, "Unimplemented MODE type.");
 			  }
 		}
-	| ALLO SP NUMBER CRLF
+	| ALLO check_login SP NUMBER CRLF
 		{
-			reply (202, "ALLO command ignored.");
+			if ($2)
+			  {
+			    alloc_size = $4;
+			    reply (200, "ALLO command successful.");
+			  }
 		}
-	| ALLO SP NUMBER SP R SP NUMBER CRLF
+	| ALLO check_login SP NUMBER SP R SP NUMBER CRLF
 		{
-			reply (202, "ALLO command ignored.");
+			if ($2)
+			  {
+			    alloc_size = $4;
+			    reply (200, "ALLO command successful.");
+			  }
 		}
 	| RETR check_login SP pathname CRLF
 		{
@@ -538,7 +547,10 @@ cmd
 			    else if (chmod ($8, $6) < 0)
 			      perror_reply (550, $8);
 			    else
-			      reply (200, "CHMOD command successful.");
+			      {
+				ls_cache_flush ();
+				reply (200, "CHMOD command successful.");
+			      }
 			  }
 			free ($8);
 		}
@@ -1340,7 +1352,7 @@ static struct tab cmdtab[] = {
   { "STOR", STOR, STR1, 1,	"<sp> file-name" },
   { "STOU", STOU, STR1, 1,	"<sp> file-name" },
   { "APPE", APPE, STR1, 1,	"<sp> file-name" },
-  { "ALLO", ALLO, ARGS, 1,	"allocate storage (vacuously)" },
+  { "ALLO", ALLO, ARGS, 1,	"allocate storage" },
   { "REST", REST, ARGS, 1,	"<sp> offset (restart command)" },
   { "RNFR", RNFR, STR1, 1,	"<sp> file-name" },
   { "RNTO", RNTO, STR1, 1,	"<sp> file-name" },
@@ -81,6 +81,7 @@
 #include <signal.h>
 #include <grp.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -91,6 +92,16 @@
 #ifdef HAVE_MMAP
 # include <sys/mman.h>
 #endif
+#if defined HAVE_SYS_SENDFILE_H && defined HAVE_SENDFILE
+# include <sys/sendfile.h>
+# define WITH_SENDFILE 1
+#endif
+#if defined HAVE_SPLICE && defined SPLICE_F_MOVE
+# define WITH_SPLICE 1
+#endif
+#ifdef HAVE_SYS_STATVFS_H
+# include <sys/statvfs.h>
+#endif
 /* Include glob.h last, because it may define "const" which breaks
    system headers on some platforms. */
 #include <glob.h>
@@ -263,6 +274,7 @@ const char doc[] =
 
 enum {
   OPT_NONRFC2577 = CHAR_MAX + 1,
+  OPT_PREFORK,
 };
 
 static struct argp_option options[] = {
@@ -285,6 +297,9 @@ static struct argp_option options[] = {
   { "logging", 'l', NULL, 0,
     "increase verbosity of syslog messages",
     GRID+1 },
+  { "prefork", OPT_PREFORK, "NUM", 0,
+    "keep NUM daemon processes waiting for connections",
+    GRID+1 },
   { "pidfile", 'p', "PIDFILE", OPTION_ARG_OPTIONAL,
     "change default location of pidfile",
     GRID+1 },
@@ -428,6 +443,18 @@ parse_opt (int key, char *arg, struct argp_state *state)
       rfc2577 = 0;
       break;
 
+    case OPT_PREFORK:
+      {
+	long val;
+
+	val = strtol (arg, &arg, 10);
+	if (*arg != '\0' || val < 0 || val > 1024)
+	  argp_error (state, "bad value for --prefork");
+	else
+	  prefork = val;
+	break;
+      }
+
     default:
       return ARGP_ERR_UNKNOWN;
     }
@@ -862,6 +889,8 @@ end_login (struct credentials *pcred)
   char *remotehost = pcred->remotehost;
   int atype = pcred->auth_type;
 
+  /* Listings were made with the credentials now given up.  */
+  ls_cache_flush ();
   seteuid ((uid_t) 0);
   if (pcred->logged_in)
     {
@@ -1053,13 +1082,61 @@ done:
   (*closefunc) (fin);
 }
 
+#if defined HAVE_FALLOCATE && defined FALLOC_FL_KEEP_SIZE
+/* Reserve up to SIZE bytes from POS in FOUT, but no more than half
+   of the space left in its file system.  Return the end of the
+   reservation, or 0.  */
+static off_t
+reserve_space (FILE *fout, off_t pos, off_t size)
+{
+# ifdef HAVE_SYS_STATVFS_H
+  struct statvfs vfs;
+  uintmax_t avail;
+
+  if (fstatvfs (fileno (fout), &vfs) < 0)
+    return 0;
+  avail = (uintmax_t) vfs.f_bavail * vfs.f_frsize / 2;
+  if ((uintmax_t) size > avail)
+    size = avail;
+# endif
+  if (size <= 0)
+    return 0;
+  if (fallocate (fileno (fout), FALLOC_FL_KEEP_SIZE, pos, size) < 0)
+    {
+      if (debug)
+	syslog (LOG_DEBUG, "fallocate: %m");
+      return 0;
+    }
+  return pos + size;
+}
+
+/* Give back what was reserved up to END in FOUT beyond the data
+   actually stored.  */
+static void
+release_space (FILE *fout, off_t end)
+{
+  struct stat st;
+
+  fflush (fout);
+  if (fstat (fileno (fout), &st) < 0 || st.st_size >= end)
+    return;
+  /* Truncating to the same size drops the blocks beyond it, where
+     some file systems ignore FALLOC_FL_PUNCH_HOLE.  */
+  if (ftruncate (fileno (fout), st.st_size) < 0 && debug)
+    syslog (LOG_DEBUG, "ftruncate: %m");
+}
+#endif
+
 void
 store (const char *name, const char *mode, int unique)
 {
   FILE *fout, *din;
   struct stat st;
   int (*closefunc) (FILE *);
+  off_t reserve = alloc_size, reserved = 0;
 
+  alloc_size = 0;		/* ALLO applies to this transfer only.  */
+  ls_cache_flush ();
   if (unique && stat (name, &st) == 0)
     {
       const char *name_unique = gunique (name);
@@ -1126,6 +1203,18 @@ store (const char *name, const char *mode, int unique)
 	  goto done;
 	}
     }
+#if defined HAVE_FALLOCATE && defined FALLOC_FL_KEEP_SIZE
+  /* Reserve the space announced by ALLO, but leave the file size
+     to the data actually received.  */
+  if (reserve > 0)
+    {
+      off_t pos = (*mode == 'a') ? st.st_size
+	: lseek (fileno (fout), 0, SEEK_CUR);
+
+      if (pos >= 0)
+	reserved = reserve_space (fout, pos, reserve);
+    }
+#endif
   din = dataconn (name, (off_t) - 1, "r");
   if (din == NULL)
     goto done;
@@ -1140,6 +1229,10 @@ store (const char *name, const char *mode, int unique)
   data = -1;
   pdata = -1;
 done:
+#if defined HAVE_FALLOCATE && defined FALLOC_FL_KEEP_SIZE
+  if (reserved > 0)
+    release_space (fout, reserved);
+#endif
   LOGBYTES (*mode == 'w' ? "put" : "append", name, byte_count);
   (*closefunc) (fout);
 }
@@ -1310,6 +1403,160 @@ dataconn (const char *name, off_t size, const char *mode)
 
 #define IU_MMAP_SIZE 0x800000	/* 8 MByte */
 
+#ifdef WITH_SENDFILE
+# define IU_SENDFILE_SIZE 0x100000	/* 1 MByte per system call */
+
+/* Let the kernel copy the remainder of FILEFD to NETFD, starting at
+   the present file offset.  A restart point set up by REST is thus
+   honoured for files of any size.  Return 0 when the transfer is
+   complete, and -1 on failure.  Return 1 if sendfile() is refused
+   before any data was moved, so that the caller may fall back to
+   copying through user space.  */
+static int
+sendfile_data (int netfd, int filefd)
+{
+  ssize_t cnt;
+  int moved = 0;
+
+  for (;;)
+    {
+      cnt = sendfile (netfd, filefd, NULL, IU_SENDFILE_SIZE);
+      if (cnt > 0)
+	{
+	  byte_count += cnt;
+	  moved = 1;
+	  continue;
+	}
+      if (cnt == 0)
+	return 0;
+      if (errno == EINTR)
+	continue;
+      if (!moved && (errno == EINVAL || errno == ENOSYS
+#ifdef EOPNOTSUPP
+		     || errno == EOPNOTSUPP
+#endif
+		     ))
+	return 1;
+      return -1;
+    }
+}
+#endif /* WITH_SENDFILE */
+
+#ifdef WITH_SPLICE
+# define IU_SPLICE_SIZE 0x100000	/* 1 MByte pipe capacity */
+
+/* The pipe of splice_data().  It is kept here, so that it can be
+   closed after ABOR has jumped out of the transfer.  */
+static int splice_pipe[2] = { -1, -1 };
+
+static void
+splice_close (void)
+{
+  int save_errno = errno;
+
+  if (splice_pipe[0] >= 0)
+    close (splice_pipe[0]);
+  if (splice_pipe[1] >= 0)
+    close (splice_pipe[1]);
+  splice_pipe[0] = splice_pipe[1] = -1;
+  errno = save_errno;
+}
+
+/* Move everything arriving at NETFD into FILEFD through a pipe, so
+   that the data never enters user space.  Return 0 when the peer
+   has closed the connection, -1 on a network error, and -2 on a
+   file error.  Return 1 if splice() is refused before any data was
+   written to FILEFD, in which case anything already taken from the
+   socket has been written to FILEFD by ordinary means, and the
+   caller may continue copying through user space.  */
+static int
+splice_data (int netfd, int filefd)
+{
+  int *pfd = splice_pipe, ret = 0, moved = 0;
+  ssize_t cnt, n;
+  struct timeval start, end;
+
+  if (pipe (pfd) < 0)
+    {
+      pfd[0] = pfd[1] = -1;
+      return 1;
+    }
+# ifdef F_SETPIPE_SZ
+  fcntl (pfd[1], F_SETPIPE_SZ, IU_SPLICE_SIZE);
+# endif
+  if (debug)
+    gettimeofday (&start, NULL);
+
+  for (;;)
+    {
+      cnt = splice (netfd, NULL, pfd[1], NULL, IU_SPLICE_SIZE,
+		    SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (cnt == 0)
+	break;
+      if (cnt < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  ret = (!moved && (errno == EINVAL || errno == ENOSYS)) ? 1 : -1;
+	  break;
+	}
+
+      while (cnt > 0)
+	{
+	  n = splice (pfd[0], NULL, filefd, NULL, cnt,
+		      SPLICE_F_MOVE | SPLICE_F_MORE);
+	  if (n > 0)
+	    {
+	      cnt -= n;
+	      byte_count += n;
+	      moved = 1;
+	      continue;
+	    }
+	  if (n < 0 && errno == EINTR)
+	    continue;
+	  if (n < 0 && !moved && errno == EINVAL)
+	    {
+	      /* The file system does not take part; rescue what
+		 is held in the pipe.  */
+	      char buf[BUFSIZ];
+
+	      ret = 1;
+	      while (cnt > 0 && (n = read (pfd[0], buf, sizeof buf)) > 0)
+		{
+		  if (write (filefd, buf, n) != n)
+		    {
+		      ret = -2;
+		      break;
+		    }
+		  cnt -= n;
+		  byte_count += n;
+		}
+	    }
+	  else
+	    ret = -2;
+	  break;
+	}
+      if (ret != 0)
+	break;
+    }
+
+  splice_close ();
+
+  if (debug && ret == 0)
+    {
+      double secs;
+
+      gettimeofday (&end, NULL);
+      secs = (end.tv_sec - start.tv_sec)
+	+ (end.tv_usec - start.tv_usec) / 1000000.0;
+      syslog (LOG_DEBUG, "Received %s bytes by splice in %.3f s (%.0f kB/s).",
+	      off_to_str (byte_count), secs,
+	      secs > 0 ? byte_count / secs / 1024 : 0.0);
+    }
+  return ret;
+}
+#endif /* WITH_SPLICE */
+
 /* Tranfer the contents of "instr" to "outstr" peer using the appropriate
    encapsulation of the data subject * to Mode, Structure, and Type.
 
@@ -1317,7 +1564,7 @@ dataconn (const char *name, off_t size, const char *mode)
 static void
 send_data (FILE * instr, FILE * outstr, off_t blksize)
 {
-  int c, cnt, filefd, netfd;
+  int cnt, filefd, netfd;
   char *buf = MAP_FAILED, *bp;
   off_t curpos;
   off_t len, filesize;
@@ -1331,6 +1578,31 @@ send_data (FILE * instr, FILE * outstr, off_t blksize)
 
   netfd = fileno (outstr);
   filefd = fileno (instr);
+#ifdef WITH_SENDFILE
+  /* Image transfers of plain files avoid user space entirely.  */
+  if ((type == TYPE_I || type == TYPE_L) && file_size >= 0)
+    {
+      if (debug)
+	syslog (LOG_DEBUG, "Reading file as image in sendfile mode.");
+      switch (sendfile_data (netfd, filefd))
+	{
+	case 0:
+	  transflag = 0;
+	  reply (226, "Transfer complete.");
+	  return;
+
+	case -1:
+	  if (errno == EIO)
+	    goto file_err;
+	  goto data_err;
+
+	default:
+	  if (debug)
+	    syslog (LOG_DEBUG, "sendfile refused: %m");
+	  break;
+	}
+    }
+#endif
 #ifdef HAVE_MMAP
   /* Last argument in mmap() must be page aligned,
    * at least for Solaris and Linux, so use mmap()
@@ -1359,47 +1631,41 @@ send_data (FILE * instr, FILE * outstr, off_t blksize)
 	{
 	  if (debug)
 	    syslog (LOG_DEBUG, "Reading file as ascii in mmap mode.");
-	  len = 0;
-	  while (len < filesize)
-	    {
-	      byte_count++;
-	      if (buf[len] == '\n')
-		{
-		  if (ferror (outstr))
-		    break;
-		  putc ('\r', outstr);
-		}
-	      putc (buf[len], outstr);
-	      len++;
-	    }
-	  fflush (outstr);
+	  len = crlf_write (netfd, buf, filesize);
 	  transflag = 0;
 	  munmap (buf, filesize);
-	  if (ferror (outstr))
+	  if (len < 0)
 	    goto data_err;
+	  byte_count += filesize;
 	  reply (226, "Transfer complete.");
 	  return;
 	}
 #endif
       if (debug)
-	syslog (LOG_DEBUG, "Reading file as ascii in byte mode.");
-      while ((c = getc (instr)) != EOF)
+	syslog (LOG_DEBUG, "Reading file as ascii in block mode.");
+
+      /* Read through the stream, since a restart point was
+	 located by getc() and data may already be buffered.  */
+      buf = malloc ((u_int) blksize);
+      if (buf == NULL)
 	{
-	  byte_count++;
-	  if (c == '\n')
+	  transflag = 0;
+	  perror_reply (451, "Local resource failure: malloc");
+	  return;
+	}
+      while ((cnt = fread (buf, 1, (u_int) blksize, instr)) > 0)
+	{
+	  if (crlf_write (netfd, buf, cnt) < 0)
 	    {
-	      if (ferror (outstr))
-		goto data_err;
-	      putc ('\r', outstr);
+	      free (buf);
+	      goto data_err;
 	    }
-	  putc (c, outstr);
+	  byte_count += cnt;
 	}
-      fflush (outstr);
       transflag = 0;
+      free (buf);
       if (ferror (instr))
 	goto file_err;
-      if (ferror (outstr))
-	goto data_err;
       reply (226, "Transfer complete.");
       return;
 
@@ -1446,18 +1712,17 @@ send_data (FILE * instr, FILE * outstr, off_t blksize)
 	  perror_reply (451, "Local resource failure: malloc");
 	  return;
 	}
-      while ((cnt = read (filefd, buf, (u_int) blksize)) > 0 &&
+      /* A listing produced in memory has no descriptor.  */
+      while ((cnt = fread (buf, 1, (u_int) blksize, instr)) > 0 &&
 	     write (netfd, buf, cnt) == cnt)
 	byte_count += cnt;
 
       transflag = 0;
       free (buf);
+      if (ferror (instr))
+	goto file_err;
       if (cnt != 0)
-	{
-	  if (cnt < 0)
-	    goto file_err;
-	  goto data_err;
-	}
+	goto data_err;
       reply (226, "Transfer complete.");
       return;
     default:
@@ -1483,13 +1748,16 @@ file_err:
 static int
 receive_data (FILE * instr, FILE * outstr, off_t blksize)
 {
-  int c;
-  int cnt, bare_lfs = 0;
+  int cnt, pending_cr = 0;
+  size_t len, bare_lfs = 0;
   char *buf;
 
   transflag++;
   if (setjmp (urgcatch))
     {
+#ifdef WITH_SPLICE
+      splice_close ();
+#endif
       transflag = 0;
       return -1;
     }
@@ -1497,6 +1765,25 @@ receive_data (FILE * instr, FILE * outstr, off_t blksize)
     {
     case TYPE_I:
     case TYPE_L:
+#ifdef WITH_SPLICE
+      switch (splice_data (fileno (instr), fileno (outstr)))
+	{
+	case 0:
+	  transflag = 0;
+	  return 0;
+
+	case -1:
+	  goto data_err;
+
+	case -2:
+	  goto file_err;
+
+	default:
+	  if (debug)
+	    syslog (LOG_DEBUG, "splice refused: %m");
+	  break;
+	}
+#endif
       buf = malloc ((u_int) blksize);
       if (buf == NULL)
 	{
@@ -1526,35 +1813,37 @@ receive_data (FILE * instr, FILE * outstr, off_t blksize)
       return -1;
 
     case TYPE_A:
-      while ((c = getc (instr)) != EOF)
+      /* One spare byte in front allows conversion in place.  */
+      buf = malloc ((u_int) blksize + 1);
+      if (buf == NULL)
+	{
+	  transflag = 0;
+	  perror_reply (451, "Local resource failure: malloc");
+	  return -1;
+	}
+
+      while ((cnt = read (fileno (instr), buf + 1, blksize)) > 0)
 	{
-	  byte_count++;
-	  if (c == '\n')
-	    bare_lfs++;
-	  while (c == '\r')
+	  byte_count += cnt;
+	  len = crlf_strip (buf, buf + 1, cnt, &pending_cr, &bare_lfs);
+	  if (fwrite (buf, 1, len, outstr) != len)
 	    {
-	      if (ferror (outstr))
-		goto data_err;
-	      c = getc (instr);
-	      if (c != '\n')
-		{
-		  putc ('\r', outstr);
-		  if (c == '\0' || c == EOF)
-		    goto contin2;
-		}
+	      free (buf);
+	      goto file_err;
 	    }
-	  putc (c, outstr);
-	contin2:;
 	}
-      fflush (outstr);
-      if (ferror (instr))
+      free (buf);
+      if (cnt < 0)
 	goto data_err;
+      if (pending_cr)
+	putc ('\r', outstr);
+      fflush (outstr);
       if (ferror (outstr))
 	goto file_err;
       transflag = 0;
       if (bare_lfs)
 	{
-	  lreply (226, "WARNING! %d bare linefeeds received in ASCII mode",
+	  lreply (226, "WARNING! %zu bare linefeeds received in ASCII mode",
 		  bare_lfs);
 	  printf ("   File may not have transferred correctly.\r\n");
 	}
@@ -1674,6 +1963,9 @@ statcmd (void)
     }
   else
     printf ("     No data connection\r\n");
+  if (ls_cache_hits || ls_cache_misses)
+    printf ("     Listing cache: %lu hits, %lu misses\r\n",
+	    ls_cache_hits, ls_cache_misses);
   reply (211, "End of status");
 }
 
@@ -1777,6 +2069,7 @@ delete (const char *name)
   struct stat st;
 
   LOGCMD ("delete", name);
+  ls_cache_flush ();
   if (stat (name, &st) < 0)
     {
       perror_reply (550, name);
@@ -1813,6 +2106,7 @@ void
 makedir (const char *name)
 {
   LOGCMD ("mkdir", name);
+  ls_cache_flush ();
   if (mkdir (name, 0777) < 0)
     perror_reply (550, name);
   else if (name[0] == '/')
@@ -1838,6 +2132,7 @@ void
 removedir (const char *name)
 {
   LOGCMD ("rmdir", name);
+  ls_cache_flush ();
   if (rmdir (name) < 0)
     perror_reply (550, name);
   else
@@ -1876,6 +2171,7 @@ void
 renamecmd (const char *from, const char *to)
 {
   LOGCMD2 ("rename", from, to);
+  ls_cache_flush ();
   if (rename (from, to) < 0)
     perror_reply (550, "rename");
   else
@@ -51,14 +51,18 @@
 #include <config.h>
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 
+#include <dirent.h>
 #include <errno.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <xgetcwd.h>
 /* Include glob.h last, because it may define "const" which breaks
    system headers on some platforms. */
 #include <glob.h>
@@ -74,11 +78,18 @@
 #define MAX_ARGC 100
 #define MAX_GARGC 1000
 
+#if defined WITH_LIBLS && defined HAVE_OPEN_MEMSTREAM && defined HAVE_FMEMOPEN
+# define WITH_LS_CACHE 1
+#endif
+
 struct file_pid
 {
   FILE *file;
-  pid_t pid;
+  pid_t pid;			/* Zero for an in-process listing.  */
   struct file_pid *next;
+#ifdef WITH_LS_CACHE
+  struct ls_entry *listing;
+#endif
 };
 
 /* A linked list associating ftpd_popen'd FILEs with pids.  */
@@ -88,6 +99,332 @@ struct file_pid *file_pids = 0;
 extern int ls_main (int argc, char *argv[]);
 #endif
 
+unsigned long ls_cache_hits;
+unsigned long ls_cache_misses;
+
+#ifdef WITH_LS_CACHE
+extern int ls_fmain (FILE *out, int argc, char *argv[]);
+
+/*
+ * Small listings are produced by libls within the session process,
+ * and are kept for reuse by that session.  An entry is keyed on the
+ * working directory and on the arguments to ls, and is valid as long
+ * as each listed path keeps its inode and modification time.  Age and
+ * total size are bounded, and the entries are flushed whenever this
+ * session changes a file.  Recursive listings, and those of more than
+ * LS_CACHE_NAMES names, are streamed from a child as before, so that
+ * they take no memory and can be aborted.
+ */
+
+#define LS_CACHE_ENTRIES 16
+#define LS_CACHE_BYTES 0x800000	/* 8 MByte */
+#define LS_CACHE_NAMES 4096
+#define LS_CACHE_TTL 30		/* seconds */
+
+struct ls_stamp
+{
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+  long mtime_nsec;
+};
+
+struct ls_entry
+{
+  char *key;			/* Directory and arguments, NUL separated.  */
+  size_t keylen;
+  struct ls_stamp *stamps;
+  int nstamps;
+  time_t created;
+  int status;			/* Exit value of the listing.  */
+  char *text;
+  size_t len;
+  int users;			/* Open streams reading TEXT.  */
+  int cached;			/* Entry is on the cache list.  */
+  struct ls_entry *next;
+};
+
+/* Most recently used entry first.  */
+static struct ls_entry *ls_cache;
+static int ls_cache_count;
+static size_t ls_cache_size;
+
+static void
+ls_entry_free (struct ls_entry *ent)
+{
+  free (ent->key);
+  free (ent->stamps);
+  free (ent->text);
+  free (ent);
+}
+
+static void
+ls_cache_unlink (struct ls_entry **pent)
+{
+  struct ls_entry *ent = *pent;
+
+  *pent = ent->next;
+  ent->cached = 0;
+  ls_cache_count--;
+  ls_cache_size -= ent->len;
+  if (ent->users == 0)
+    ls_entry_free (ent);
+}
+
+/* Forget all listings, since this server has altered a file.  */
+void
+ls_cache_flush (void)
+{
+  while (ls_cache)
+    ls_cache_unlink (&ls_cache);
+}
+
+static void
+ls_stamp_set (struct ls_stamp *sp, struct stat *st)
+{
+  sp->dev = st->st_dev;
+  sp->ino = st->st_ino;
+  sp->size = st->st_size;
+  sp->mtime = st->st_mtime;
+# ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+  sp->mtime_nsec = st->st_mtim.tv_nsec;
+# else
+  sp->mtime_nsec = 0;
+# endif
+}
+
+/* Return the number of names listed for the path NAME, which has the
+   state ST, counting no further than LIMIT.  */
+static int
+ls_names (const char *name, struct stat *st, int limit)
+{
+  DIR *dirp;
+  int n = 0;
+
+  if (!S_ISDIR (st->st_mode))
+    return 1;
+  dirp = opendir (name);
+  if (dirp == NULL)
+    return 1;
+  while (n <= limit && readdir (dirp) != NULL)
+    n++;
+  closedir (dirp);
+  return n;
+}
+
+/* Record the state of every path named in ARGV, or of the working
+   directory if there are none.  Return the number of stamps, and -1
+   if the listing is recursive or too long to be kept.  */
+static int
+ls_stamps (int argc, char **argv, struct ls_stamp **pstamps)
+{
+  struct ls_stamp *stamps;
+  struct stat st;
+  int i, n = 0, opts = 1, names = 0;
+
+  stamps = calloc (argc, sizeof (*stamps));
+  if (stamps == NULL)
+    return -1;
+
+  for (i = 1; i < argc; i++)
+    {
+      if (opts && argv[i][0] == '-' && argv[i][1] != '\0')
+	{
+	  if (strcmp (argv[i], "--") == 0)
+	    opts = 0;
+	  else if (strchr (argv[i], 'R'))
+	    break;		/* Subdirectories are not tracked.  */
+	  continue;
+	}
+      if (stat (argv[i], &st) < 0)
+	break;
+      ls_stamp_set (&stamps[n++], &st);
+      names += ls_names (argv[i], &st, LS_CACHE_NAMES - names);
+      if (names > LS_CACHE_NAMES)
+	break;
+    }
+
+  if (i == argc && n == 0 && stat (".", &st) == 0)
+    {
+      ls_stamp_set (&stamps[n++], &st);
+      names = ls_names (".", &st, LS_CACHE_NAMES);
+    }
+
+  if (i < argc || n == 0 || names > LS_CACHE_NAMES)
+    {
+      free (stamps);
+      return -1;
+    }
+  *pstamps = stamps;
+  return n;
+}
+
+static char *
+ls_key (int argc, char **argv, size_t *plen)
+{
+  char *cwd, *key;
+  size_t len, n;
+  int i;
+
+  cwd = xgetcwd ();
+  if (cwd == NULL)
+    return NULL;
+
+  len = strlen (cwd) + 1;
+  for (i = 1; i < argc; i++)
+    len += strlen (argv[i]) + 1;
+
+  key = malloc (len);
+  if (key != NULL)
+    {
+      len = strlen (cwd) + 1;
+      memcpy (key, cwd, len);
+      for (i = 1; i < argc; i++)
+	{
+	  n = strlen (argv[i]) + 1;
+	  memcpy (key + len, argv[i], n);
+	  len += n;
+	}
+      *plen = len;
+    }
+  free (cwd);
+  return key;
+}
+
+/* Return a listing for ARGV, taken from the cache when still valid,
+   and otherwise produced by libls without any fork.  Return NULL if
+   the listing is to be streamed instead.  */
+static struct ls_entry *
+ls_cache_get (int argc, char **argv)
+{
+  struct ls_entry *ent, **pent;
+  struct ls_stamp *stamps = NULL;
+  char *key;
+  size_t keylen;
+  int nstamps;
+  time_t now = time (NULL);
+  FILE *out;
+
+  nstamps = ls_stamps (argc, argv, &stamps);
+  if (nstamps < 0)
+    return NULL;
+  key = ls_key (argc, argv, &keylen);
+  if (key == NULL)
+    {
+      free (stamps);
+      return NULL;
+    }
+
+  for (pent = &ls_cache; *pent; pent = &(*pent)->next)
+    {
+      ent = *pent;
+      if (ent->keylen != keylen || memcmp (ent->key, key, keylen))
+	continue;
+
+      if (nstamps == ent->nstamps
+	  && now - ent->created < LS_CACHE_TTL
+	  && memcmp (stamps, ent->stamps, nstamps * sizeof (*stamps)) == 0)
+	{
+	  /* Move to front.  */
+	  *pent = ent->next;
+	  ent->next = ls_cache;
+	  ls_cache = ent;
+	  ls_cache_hits++;
+	  free (key);
+	  free (stamps);
+	  return ent;
+	}
+
+      ls_cache_unlink (pent);	/* Stale.  */
+      break;
+    }
+
+  ls_cache_misses++;
+  ent = calloc (1, sizeof (*ent));
+  if (ent == NULL)
+    {
+      free (key);
+      free (stamps);
+      return NULL;
+    }
+  ent->key = key;
+  ent->keylen = keylen;
+  ent->stamps = stamps;
+  ent->nstamps = nstamps;
+  ent->created = now;
+
+  out = open_memstream (&ent->text, &ent->len);
+  if (out == NULL)
+    {
+      ls_entry_free (ent);
+      return NULL;
+    }
+  optind = 0;
+  ent->status = ls_fmain (out, argc, argv);
+  if (fclose (out) != 0)
+    {
+      ls_entry_free (ent);
+      return NULL;
+    }
+
+  /* Keep only complete listings of reasonable size.  */
+  if (ent->status == 0 && ent->len <= LS_CACHE_BYTES / 2)
+    {
+      while (ls_cache
+	     && (ls_cache_count >= LS_CACHE_ENTRIES
+		 || ls_cache_size + ent->len > LS_CACHE_BYTES))
+	{
+	  /* Drop the least recently used entry.  */
+	  for (pent = &ls_cache; (*pent)->next; pent = &(*pent)->next)
+	    ;
+	  ls_cache_unlink (pent);
+	}
+      ent->next = ls_cache;
+      ls_cache = ent;
+      ent->cached = 1;
+      ls_cache_count++;
+      ls_cache_size += ent->len;
+    }
+
+  return ent;
+}
+
+/* Open the text of ENT for reading.  */
+static FILE *
+ls_cache_open (struct ls_entry *ent)
+{
+  int pdes[2];
+  FILE *fp;
+
+  /* A buffer of size zero is not portable with fmemopen().  */
+  if (ent->len == 0)
+    {
+      if (pipe (pdes) < 0)
+	return NULL;
+      close (pdes[1]);
+      fp = fdopen (pdes[0], "r");
+      if (fp == NULL)
+	close (pdes[0]);
+      return fp;
+    }
+
+  return fmemopen (ent->text, ent->len, "r");
+}
+
+static void
+ls_cache_release (struct ls_entry *ent)
+{
+  if (--ent->users == 0 && !ent->cached)
+    ls_entry_free (ent);
+}
+#else /* !WITH_LS_CACHE */
+void
+ls_cache_flush (void)
+{
+}
+#endif /* !WITH_LS_CACHE */
+
 FILE *
 ftpd_popen (char *program, const char *type)
 {
@@ -100,9 +437,6 @@ ftpd_popen (char *program, const char *type)
   if (((*type != 'r') && (*type != 'w')) || type[1])
     return (NULL);
 
-  if (pipe (pdes) < 0)
-    return (NULL);
-
   /* break up string into pieces */
   for (argc = 0, cp = program; argc < MAX_ARGC - 1; cp = NULL, argc++)
     if (!(argv[argc] = strtok (cp, " \t\n")))
@@ -138,6 +472,44 @@ ftpd_popen (char *program, const char *type)
 
   iop = NULL;
 
+#ifdef WITH_LS_CACHE
+  if (*type == 'r' && strcmp (gargv[0], "/bin/ls") == 0)
+    {
+      struct ls_entry *ent = ls_cache_get (gargc, gargv);
+
+      if (ent == NULL)
+	goto stream;
+      iop = ls_cache_open (ent);
+      if (iop == NULL)
+	{
+	  ent->users++;
+	  ls_cache_release (ent);
+	  goto pfree;
+	}
+
+      fpid = (struct file_pid *) malloc (sizeof (struct file_pid));
+      if (fpid == NULL)
+	{
+	  fclose (iop);
+	  iop = NULL;
+	  ent->users++;
+	  ls_cache_release (ent);
+	  goto pfree;
+	}
+      ent->users++;
+      fpid->file = iop;
+      fpid->pid = 0;
+      fpid->listing = ent;
+      fpid->next = file_pids;
+      file_pids = fpid;
+      goto pfree;
+    }
+stream:
+#endif
+
+  if (pipe (pdes) < 0)
+    goto pfree;
+
 #ifdef WITH_LIBLS
   /* Do not use vfork() for internal ls.  */
   pid = (strcmp (gargv[0], "/bin/ls") == 0) ? fork () : vfork ();
@@ -200,6 +572,9 @@ ftpd_popen (char *program, const char *type)
     {
       fpid->file = iop;
       fpid->pid = pid;
+#ifdef WITH_LS_CACHE
+      fpid->listing = NULL;
+#endif
       fpid->next = file_pids;
       file_pids = fpid;
     }
@@ -240,6 +615,15 @@ ftpd_pclose (FILE * iop)
     file_pids = fpid->next;
 
   fclose (iop);
+#ifdef WITH_LS_CACHE
+  if (fpid->pid == 0)
+    {
+      status = fpid->listing->status;
+      ls_cache_release (fpid->listing);
+      free (fpid);
+      return status;
+    }
+#endif
 #ifdef HAVE_SIGACTION
   sigemptyset (&sigs);
   sigaddset (&sigs, SIGINT);
@@ -31,6 +31,8 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
 
 #ifdef HAVE_TCPD_H
 # include <tcpd.h>
@@ -40,6 +42,7 @@
 #include "attribute.h"
 
 int usefamily = AF_UNSPEC;	/* Address family for daemon.  */
+int prefork;			/* Idle listeners kept ready, or zero.  */
 
 static void reapchild (int);
 
@@ -104,6 +107,144 @@ reapchild (int signo MAYBE_UNUSED)
   errno = save_errno;
 }
 
+#ifdef HAVE_FORK
+static volatile sig_atomic_t pool_done;
+
+static void
+pool_quit (int signo MAYBE_UNUSED)
+{
+  pool_done = 1;
+}
+
+/* Fork a process which waits in accept() on CTL_SOCK.  As soon as
+   a client has been accepted, the process reports its pid on STATFD
+   and continues as the server of that single session.  Since the
+   session changes credentials and possibly root directory, it is
+   never returned to the pool.  The new process is added to IDLE.
+   Only the child returns, with the accepted socket.  */
+static int
+pool_spawn (int ctl_sock, int statfd, pid_t *idle, int *nidle,
+	    struct sockaddr *phis_addr, socklen_t *phis_addrlen)
+{
+  socklen_t saved_addrlen = *phis_addrlen;
+  pid_t pid;
+  int fd;
+
+  pid = fork ();
+  if (pid < 0)
+    {
+      syslog (LOG_ERR, "fork: %m");
+      return -1;
+    }
+  if (pid > 0)
+    {
+      idle[(*nidle)++] = pid;
+      return -1;
+    }
+
+  signal (SIGTERM, SIG_DFL);
+  signal (SIGINT, SIG_DFL);
+  for (;;)
+    {
+      *phis_addrlen = saved_addrlen;
+      fd = accept (ctl_sock, phis_addr, phis_addrlen);
+      if (fd >= 0)
+	break;
+      if (errno != EINTR && errno != ECONNABORTED)
+	{
+	  syslog (LOG_ERR, "accept: %m");
+	  sleep (1);
+	}
+    }
+
+  /* The pool counts this process as idle until it reports.  */
+  pid = getpid ();
+  while (write (statfd, &pid, sizeof (pid)) != sizeof (pid))
+    if (errno != EINTR)
+      {
+	syslog (LOG_ERR, "worker pool: cannot report session: %m");
+	break;
+      }
+  close (statfd);
+  return fd;
+}
+
+/* Keep PREFORK processes waiting for connections at CTL_SOCK, each
+   ready to serve as soon as a client arrives.  This takes the cost
+   of fork() out of the path of a new connection.  The return value
+   is the accepted socket, and is seen only in a pool process.  */
+static int
+pool_run (int ctl_sock, struct sockaddr *phis_addr, socklen_t *phis_addrlen)
+{
+  pid_t *idle, pid;
+  int nidle = 0, i, fd;
+  int pfd[2];
+  struct pollfd pollfd;
+
+  idle = calloc (prefork, sizeof (*idle));
+  if (idle == NULL || pipe (pfd) < 0)
+    {
+      syslog (LOG_ERR, "worker pool: %m");
+      exit (EXIT_FAILURE);
+    }
+
+  /* Children are reaped below, to keep track of idle workers.  */
+  signal (SIGCHLD, SIG_DFL);
+  signal (SIGTERM, pool_quit);
+  signal (SIGINT, pool_quit);
+
+  pollfd.fd = pfd[0];
+  pollfd.events = POLLIN;
+
+  while (!pool_done)
+    {
+      while (nidle < prefork)
+	{
+	  fd = pool_spawn (ctl_sock, pfd[1], idle, &nidle,
+			   phis_addr, phis_addrlen);
+	  if (fd >= 0)
+	    {
+	      free (idle);
+	      close (pfd[0]);
+	      return fd;
+	    }
+	  if (nidle < prefork)
+	    {
+	      /* Fork failed; retry on the next round.  */
+	      sleep (1);
+	      break;
+	    }
+	}
+
+      /* Wake up at least once a second to reap sessions.  */
+      if (poll (&pollfd, 1, 1000) > 0
+	  && read (pfd[0], &pid, sizeof (pid)) == sizeof (pid))
+	{
+	  for (i = 0; i < nidle; i++)
+	    if (idle[i] == pid)
+	      {
+		idle[i] = idle[--nidle];
+		break;
+	      }
+	}
+
+      /* A worker dying before any client arrived must be replaced.  */
+      while ((pid = waitpid (-1, NULL, WNOHANG)) > 0)
+	for (i = 0; i < nidle; i++)
+	  if (idle[i] == pid)
+	    {
+	      idle[i] = idle[--nidle];
+	      break;
+	    }
+    }
+
+  /* Idle workers must not outlive the daemon.  */
+  for (i = 0; i < nidle; i++)
+    kill (idle[i], SIGTERM);
+  exit (EXIT_SUCCESS);
+}
+#endif /* HAVE_FORK */
+
 /* The parameter '*phis_addrlen' must be initiated
    with the space available at calling time.
    The size of used space will then be returned.
@@ -213,6 +354,16 @@ server_mode (const char *pidfile, struct sockaddr *phis_addr,
       }
   }
 
+#ifdef HAVE_FORK
+  if (prefork > 0)
+    {
+      fd = pool_run (ctl_sock, phis_addr, phis_addrlen);
+      dup2 (fd, 0);
+      dup2 (fd, 1);
+      close (ctl_sock);
+    }
+  else
+#endif
   /* Loop forever accepting connection requests and forking off
      children to handle them.  */
   while (1)
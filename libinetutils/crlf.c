@@ -0,0 +1,195 @@
+/* crlf.c - Block oriented line end conversion for ASCII transfers
+  Copyright (C) 2026 Free Software Foundation, Inc.
+
+  This file is part of GNU Inetutils.
+
+  GNU Inetutils is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at
+  your option) any later version.
+
+  GNU Inetutils is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see `http://www.gnu.org/licenses/'. */
+
+/*
+ * The network representation of text is NVT-ASCII, where every
+ * line ends in CR LF.  Converting a file one character at a time
+ * through getc() and putc() costs a function call per byte.  The
+ * routines below instead locate line ends with memchr(), which the
+ * C library implements with wide or vector instructions, and move
+ * the text between them as whole blocks.
+ */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libinetutils.h"
+
+/* Upper bound on the size of a single vector handed to writev().  */
+#define CRLF_IOVCNT 1024
+
+/* Write all of the vectors IOV[0..CNT-1] to FD, resuming after
+   short writes.  Return 0 on success, -1 on error.  */
+static int
+writev_all (int fd, struct iovec *iov, int cnt)
+{
+  ssize_t n;
+
+  while (cnt > 0)
+    {
+      n = writev (fd, iov, cnt);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -1;
+	}
+
+      while (cnt > 0 && (size_t) n >= iov->iov_len)
+	{
+	  n -= iov->iov_len;
+	  iov++;
+	  cnt--;
+	}
+      if (cnt > 0)
+	{
+	  iov->iov_base = (char *) iov->iov_base + n;
+	  iov->iov_len -= n;
+	}
+    }
+
+  return 0;
+}
+
+/* Write LEN bytes of text at BUF to the descriptor FD, expanding
+   every LF into the pair CR LF.  The text between line ends is
+   passed on unchanged by scatter/gather output, so no copy is made.
+   Return LEN on success, or -1 on write error with errno set.  */
+ssize_t
+crlf_write (int fd, const char *buf, size_t len)
+{
+  static char crlf[] = "\r\n";
+  struct iovec iov[CRLF_IOVCNT];
+  const char *p = buf, *end = buf + len, *nl;
+  int cnt, max = CRLF_IOVCNT;
+
+#if defined IOV_MAX
+  if (IOV_MAX < max)
+    max = IOV_MAX;
+#endif
+
+  while (p < end)
+    {
+      cnt = 0;
+      while (p < end && cnt + 2 <= max)
+	{
+	  nl = memchr (p, '\n', end - p);
+	  if (nl == NULL)
+	    {
+	      iov[cnt].iov_base = (char *) p;
+	      iov[cnt++].iov_len = end - p;
+	      p = end;
+	      break;
+	    }
+	  if (nl > p)
+	    {
+	      iov[cnt].iov_base = (char *) p;
+	      iov[cnt++].iov_len = nl - p;
+	    }
+	  iov[cnt].iov_base = crlf;
+	  iov[cnt++].iov_len = 2;
+	  p = nl + 1;
+	}
+
+      if (writev_all (fd, iov, cnt) < 0)
+	return -1;
+    }
+
+  return len;
+}
+
+/* Convert LEN bytes of NVT-ASCII at SRC to local text at DST, and
+   return the number of bytes stored.  CR LF becomes LF, CR NUL
+   becomes CR, and any other CR is kept.  Every LF that is not
+   preceded by CR is counted in *BARE_LFS.
+
+   The state in *PENDING_CR carries a CR that ended the previous
+   block; it must be zero before the first call, and when it is set
+   after the last block, the caller shall emit a final CR.  Up to
+   LEN + 1 bytes are stored at DST.  Conversion in place is allowed
+   provided that DST is at least one byte below SRC.  */
+size_t
+crlf_strip (char *dst, const char *src, size_t len,
+	    int *pending_cr, size_t *bare_lfs)
+{
+  const char *end = src + len, *cr, *nl;
+  char *out = dst;
+  size_t seg;
+
+  if (len == 0)
+    return 0;
+
+  if (*pending_cr)
+    {
+      *pending_cr = 0;
+      if (*src == '\n')
+	{
+	  *out++ = '\n';
+	  src++;
+	}
+      else
+	{
+	  *out++ = '\r';
+	  if (*src == '\0')
+	    src++;
+	}
+    }
+
+  while (src < end)
+    {
+      cr = memchr (src, '\r', end - src);
+      seg = (cr ? cr : end) - src;
+
+      for (nl = memchr (src, '\n', seg); nl;
+	   nl = memchr (nl + 1, '\n', src + seg - nl - 1))
+	++*bare_lfs;
+
+      if (out != src)
+	memmove (out, src, seg);
+      out += seg;
+      src += seg;
+
+      if (cr == NULL)
+	break;
+
+      /* SRC is now at a CR.  */
+      if (src + 1 == end)
+	{
+	  *pending_cr = 1;
+	  break;
+	}
+      if (src[1] == '\n')
+	{
+	  *out++ = '\n';
+	  src += 2;
+	}
+      else
+	{
+	  *out++ = '\r';
+	  src += (src[1] == '\0') ? 2 : 1;
+	}
+    }
+
+  return out - dst;
+}
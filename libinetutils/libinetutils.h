@@ -20,6 +20,7 @@
 #error "<config.h> has not been included; please included it"
 #endif
 
+#include <sys/types.h>
 #include "argp-version-etc.h"
 #include <signal.h>
 
@@ -31,6 +32,9 @@ char *localhost (void);
 void logwtmp (const char *, const char *, const char *);
 void cleanup_session (char *tty, int pty_fd);
 void logwtmp_keep_open (char *line, char *name, char *host);
+ssize_t crlf_write (int fd, const char *buf, size_t len);
+size_t crlf_strip (char *dst, const char *src, size_t len,
+		   int *pending_cr, size_t *bare_lfs);
 
 #ifndef HAVE_STRUCT_IF_NAMEINDEX
 struct if_nameindex
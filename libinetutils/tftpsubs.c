@@ -68,6 +68,7 @@
 #include <arpa/tftp.h>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 #include "tftpsubs.h"
@@ -80,22 +81,79 @@
 struct bf
 {
   int counter;			/* size of data in buffer, or flag */
-  char buf[PKTSIZE];		/* room for data packet */
-} bfs[2];
+  char *buf;			/* room for data packet */
+};
 
 				/* Values for bf.counter  */
 #define BF_ALLOC -3		/* alloc'd but not yet filled */
 #define BF_FREE  -2		/* free */
-/* [-1 .. SEGSIZE] = size of data in the data buffer */
+/* [-1 .. segsize] = size of data in the data buffer */
 
-static int nextone;		/* index of next buffer to use */
-static int current;		/* index of buffer in use */
-
-				/* control flags for crlf conversions */
-int newline = 0;		/* fillbuf: in middle of newline expansion */
-int prevchar = -1;		/* putbuf: previous char (cr check) */
+/* The state of the only transfer of a client, or of a server
+   serving one at a time.  Others are selected with rw_select().  */
+static struct rw_state rw_default = { NULL, 0, SEGSIZE, 0, 0, 0, 0, -1 };
+static struct rw_state *rw = &rw_default;
 
 static struct tftphdr *rw_init (int);
+static int fill (FILE *, char *, int);
+
+/* Size the buffers for data packets of BLKSIZE bytes, keeping WINDOW
+   of them for readblock().  Takes effect with the next r_init() or
+   w_init().  Return zero, or -1 when out of memory.  */
+int
+rw_setsize (int blksize, int window)
+{
+  /* Keep every packet header aligned.  */
+  size_t stride = (blksize + 4 + 7) & ~7;
+  struct bf *b;
+  char *p;
+  int i, n = window < 2 ? 2 : window;
+
+  if (rw->bfs && blksize == rw->segsize && n == rw->nbfs)
+    return 0;
+
+  b = malloc (n * sizeof (*b));
+  p = malloc (n * stride);
+  if (b == NULL || p == NULL)
+    {
+      free (b);
+      free (p);
+      return -1;
+    }
+  for (i = 0; i < n; i++)
+    b[i].buf = p + i * stride;
+
+  if (rw->bfs)
+    {
+      free (rw->bfs[0].buf);
+      free (rw->bfs);
+    }
+  rw->bfs = b;
+  rw->nbfs = n;
+  rw->segsize = blksize;
+  return 0;
+}
+
+/* Use the buffers and conversion state in STATE from now on, or
+   those of a single transfer when STATE is NULL.  A new STATE must
+   be zeroed, and is set up by rw_setsize(), r_init() or w_init().  */
+void
+rw_select (struct rw_state *state)
+{
+  rw = state ? state : &rw_default;
+}
+
+/* Release the buffers of STATE, which must not be in use.  */
+void
+rw_free (struct rw_state *state)
+{
+  if (state->bfs)
+    {
+      free (state->bfs[0].buf);
+      free (state->bfs);
+      state->bfs = NULL;
+    }
+}
 
 struct tftphdr *
 w_init (void)
@@ -113,13 +171,20 @@ r_init (void)
 static struct tftphdr *
 rw_init (int x)
 {
-  newline = 0;			/* init crlf flag */
-  prevchar = -1;
-  bfs[0].counter = BF_ALLOC;	/* pass out the first buffer */
-  current = 0;
-  bfs[1].counter = BF_FREE;
-  nextone = x;			/* ahead or behind? */
-  return (struct tftphdr *) bfs[0].buf;
+  int i;
+
+  if (rw->bfs == NULL && rw_setsize (SEGSIZE, 2) < 0)
+    return NULL;
+
+  rw->newline = 0;		/* init crlf flag */
+  rw->prevchar = -1;
+  rw->bfs[0].counter = BF_ALLOC;	/* pass out the first buffer */
+  rw->current = 0;
+  for (i = 1; i < rw->nbfs; i++)
+    rw->bfs[i].counter = BF_FREE;
+  rw->nextone = x;		/* ahead or behind? */
+  rw->lastblock = 0;
+  return (struct tftphdr *) rw->bfs[0].buf;
 }
 
 
@@ -133,10 +198,10 @@ readit (FILE * file, struct tftphdr **dpp, int convert)
 {
   struct bf *b;
 
-  bfs[current].counter = BF_FREE;	/* free old one */
-  current = !current;		/* "incr" current */
+  rw->bfs[rw->current].counter = BF_FREE;	/* free old one */
+  rw->current = !rw->current;		/* "incr" current */
 
-  b = &bfs[current];		/* look at new buffer */
+  b = &rw->bfs[rw->current];		/* look at new buffer */
   if (b->counter == BF_FREE)	/* if it's empty */
     read_ahead (file, convert);	/* fill it */
   /*      assert(b->counter != BF_FREE); *//* check */
@@ -153,35 +218,58 @@ readit (FILE * file, struct tftphdr **dpp, int convert)
 void
 read_ahead (FILE * file, int convert)
 {
-  register int i;
-  register char *p;
-  register int c;
   struct bf *b;
   struct tftphdr *dp;
 
-  b = &bfs[nextone];		/* look at "next" buffer */
+  b = &rw->bfs[rw->nextone];		/* look at "next" buffer */
   if (b->counter != BF_FREE)	/* nop if not free */
     return;
-  nextone = !nextone;		/* "incr" next buffer ptr */
+  rw->nextone = !rw->nextone;		/* "incr" next buffer ptr */
 
   dp = (struct tftphdr *) b->buf;
+  b->counter = fill (file, dp->th_data, convert);
+}
 
-  if (convert == 0)
+/* Return in *DPP the packet for block BLOCK of a sliding window, and
+   the size of its data.  Blocks are counted from one after r_init().
+   Only the block following the highest one so far is read from FILE,
+   the earlier ones are kept for retransmission, as many as the window
+   given to rw_setsize().  */
+int
+readblock (FILE * file, struct tftphdr **dpp, unsigned long block,
+	   int convert)
+{
+  struct bf *b = &rw->bfs[block % rw->nbfs];
+
+  *dpp = (struct tftphdr *) b->buf;
+  if (block > rw->lastblock)
     {
-      b->counter = read (fileno (file), dp->th_data, SEGSIZE);
-      return;
+      b->counter = fill (file, (*dpp)->th_data, convert);
+      rw->lastblock = block;
     }
+  return b->counter;
+}
+
+/* Read data for one packet into P, and return its size.  */
+static int
+fill (FILE * file, char *p, int convert)
+{
+  register int i;
+  register int c;
+  char *start = p;
+
+  if (convert == 0)
+    return read (fileno (file), p, rw->segsize);
 
-  p = dp->th_data;
-  for (i = 0; i < SEGSIZE; i++)
+  for (i = 0; i < rw->segsize; i++)
     {
-      if (newline)
+      if (rw->newline)
 	{
-	  if (prevchar == '\n')
+	  if (rw->prevchar == '\n')
 	    c = '\n';		/* lf to cr,lf */
 	  else
 	    c = '\0';		/* cr to cr,nul */
-	  newline = 0;
+	  rw->newline = 0;
 	}
       else
 	{
@@ -190,14 +278,14 @@ read_ahead (FILE * file, int convert)
 	    break;
 	  if (c == '\n' || c == '\r')
 	    {
-	      prevchar = c;
+	      rw->prevchar = c;
 	      c = '\r';
-	      newline = 1;
+	      rw->newline = 1;
 	    }
 	}
       *p++ = c;
     }
-  b->counter = (int) (p - dp->th_data);
+  return (int) (p - start);
 }
 
 /* Update count associated with the buffer, get new buffer
@@ -207,12 +295,12 @@ read_ahead (FILE * file, int convert)
 int
 writeit (FILE * file, struct tftphdr **dpp, int ct, int convert)
 {
-  bfs[current].counter = ct;	/* set size of data to write */
-  current = !current;		/* switch to other buffer */
-  if (bfs[current].counter != BF_FREE)	/* if not free */
+  rw->bfs[rw->current].counter = ct;	/* set size of data to write */
+  rw->current = !rw->current;		/* switch to other buffer */
+  if (rw->bfs[rw->current].counter != BF_FREE)	/* if not free */
     write_behind (file, convert);	/* flush it */
-  bfs[current].counter = BF_ALLOC;	/* mark as alloc'd */
-  *dpp = (struct tftphdr *) bfs[current].buf;
+  rw->bfs[rw->current].counter = BF_ALLOC;	/* mark as alloc'd */
+  *dpp = (struct tftphdr *) rw->bfs[rw->current].buf;
   return ct;			/* this is a lie of course */
 }
 
@@ -233,14 +321,14 @@ write_behind (FILE * file, int convert)
   struct bf *b;
   struct tftphdr *dp;
 
-  b = &bfs[nextone];
+  b = &rw->bfs[rw->nextone];
   if (b->counter < -1)		/* anything to flush? */
     return 0;			/* just nop if nothing to do */
 
   count = b->counter;		/* remember byte count */
   b->counter = BF_FREE;		/* reset flag */
   dp = (struct tftphdr *) b->buf;
-  nextone = !nextone;		/* incr for next time */
+  rw->nextone = !rw->nextone;		/* incr for next time */
   buf = dp->th_data;
 
   if (count <= 0)
@@ -254,7 +342,7 @@ write_behind (FILE * file, int convert)
   while (ct--)
     {				/* loop over the buffer */
       c = *p++;			/* pick up a character */
-      if (prevchar == '\r')
+      if (rw->prevchar == '\r')
 	{			/* if prev char was cr */
 	  if (c == '\n')	/* if have cr,lf then just */
 	    fseeko (file, -1, 1);	/* smash lf on top of the cr */
@@ -264,7 +352,7 @@ write_behind (FILE * file, int convert)
 	}
       putc (c, file);
     skipit:
-      prevchar = c;
+      rw->prevchar = c;
     }
   return count;
 }
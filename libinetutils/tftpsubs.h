@@ -45,13 +45,49 @@
  * SUCH DAMAGE.
  */
 
+/*
+ * Option negotiation, RFC 2347 to 2349 and RFC 7440.
+ */
+#ifndef OACK
+# define OACK	06		/* option acknowledgement */
+#endif
+#ifndef EOPTNEG
+# define EOPTNEG	8	/* option negotiation failed */
+#endif
+
+#define MINBLKSIZE	8	/* smallest and largest block size */
+#define MAXBLKSIZE	65464
+#define MAXWINDOW	64	/* blocks kept for retransmission */
+
+/*
+ * Buffers and line end conversion state of a transfer.  A server
+ * running several transfers at once keeps one for each, and selects
+ * it with rw_select() before calling the subroutines below.
+ */
+struct rw_state
+{
+  struct bf *bfs;		/* at least two buffers */
+  int nbfs;			/* number of buffers */
+  int segsize;			/* size of data in a full packet */
+  int nextone;			/* index of next buffer to use */
+  int current;			/* index of buffer in use */
+  unsigned long lastblock;	/* highest block read by readblock */
+  int newline;			/* fillbuf: in middle of newline expansion */
+  int prevchar;			/* putbuf: previous char (cr check) */
+};
+
 /*
  * Prototypes for read-ahead/write-behind subroutines for tftp user and
  * server.
  */
+int rw_setsize (int, int);
+void rw_select (struct rw_state *);
+void rw_free (struct rw_state *);
+
 struct tftphdr *r_init (void);
 void read_ahead (FILE *, int);
 int readit (FILE *, struct tftphdr **, int);
+int readblock (FILE *, struct tftphdr **, unsigned long, int);
 
 int synchnet (int);
 
@@ -53,6 +53,7 @@
 #include <sys/stat.h>
 
 #include <fts_.h>
+#include <stdio.h>
 #include <string.h>
 
 #include "ls.h"
@@ -85,6 +85,9 @@ int sortkey = BY_NAME;
 
 static int output;		/* If anything was output. */
 
+FILE *lsout;			/* Listing output. */
+FILE *lserr;			/* Diagnostic output. */
+
 /* flags */
 int f_accesstime;		/* use time of last access */
 int f_column;			/* columnated format */
@@ -112,8 +115,30 @@ int f_whiteout;			/* show whiteout entries */
 
 int rval;
 
+static int ls_run (int, char **);
+
 int
 ls_main (int argc, char **argv)
+{
+  lsout = stdout;
+  lserr = stderr;
+  return ls_run (argc, argv);
+}
+
+/*
+ * Produce the listing on OUT, diagnostics included, rather than on
+ * standard output.  This allows a server to list directories within
+ * its own process, and to keep the result.
+ */
+int
+ls_fmain (FILE *out, int argc, char **argv)
+{
+  lsout = lserr = out;
+  return ls_run (argc, argv);
+}
+
+static int
+ls_run (int argc, char **argv)
 {
   static char dot[] = ".", *dotav[] = { dot, NULL };
   struct winsize win;
@@ -124,6 +149,9 @@ ls_main (int argc, char **argv)
    * Clear all settings made in any previous call.
    */
   output = 0;
+  rval = 0;
+  blocksize = 0;
+  sortkey = BY_NAME;
 
   f_accesstime = f_column = f_columnacross = f_flags = f_inode = 0;
   f_listdir = f_listdot = f_longform = f_newline = 0;
@@ -133,7 +161,7 @@ ls_main (int argc, char **argv)
   f_type = f_typedir = f_whiteout = 0;
 
   /* Terminal defaults to -Cq, non-terminal defaults to -1. */
-  if (isatty (STDOUT_FILENO))
+  if (lsout == stdout && isatty (STDOUT_FILENO))
     {
       p = getenv ("COLUMNS");
       if (p != NULL)
@@ -367,14 +395,17 @@ traverse (int argc, char **argv, int options)
   ftsp = fts_open (argv, options, f_nosort ? NULL : mastercmp);
   if (ftsp == NULL)
     {
-      fprintf (stderr, "%s: fts_open: %s", argv[0], strerror (errno));
+      fprintf (lserr, "%s: fts_open: %s", argv[0], strerror (errno));
       rval = EXIT_FAILURE;
       return;
     }
 
   display (NULL, fts_children (ftsp, 0));
   if (f_listdir)
-    return;
+    {
+      fts_close (ftsp);
+      return;
+    }
 
   /*
    * If not recursing down this tree and don't need stat info, just get
@@ -396,10 +427,10 @@ traverse (int argc, char **argv, int options)
 	 * directory with its name.
 	 */
 	if (output)
-	  printf ("\n%s:\n", p->fts_path);
+	  fprintf (lsout, "\n%s:\n", p->fts_path);
 	else if (argc > 1)
 	  {
-	    printf ("%s:\n", p->fts_path);
+	    fprintf (lsout, "%s:\n", p->fts_path);
 	    output = 1;
 	  }
 
@@ -410,20 +441,20 @@ traverse (int argc, char **argv, int options)
 	  fts_set (ftsp, p, FTS_SKIP);
 	break;
       case FTS_DC:
-	fprintf (stderr, "%s: directory causes a cycle", p->fts_name);
+	fprintf (lserr, "%s: directory causes a cycle", p->fts_name);
 	break;
       case FTS_DNR:
       case FTS_ERR:
-	fprintf (stderr, "%s: %s\n", p->fts_name, strerror (p->fts_errno));
+	fprintf (lserr, "%s: %s\n", p->fts_name, strerror (p->fts_errno));
 	rval = 1;
 	break;
       }
   if (errno)
     {
-      fprintf (stderr, "fts_read: %s", strerror (errno));
+      fprintf (lserr, "fts_read: %s", strerror (errno));
       rval = EXIT_FAILURE;
-      return;
     }
+  fts_close (ftsp);
 }
 
 /*
@@ -468,7 +499,7 @@ display (FTSENT *p, FTSENT *list)
     {
       if (cur->fts_info == FTS_ERR || cur->fts_info == FTS_NS)
 	{
-	  fprintf (stderr, "%s: %s\n",
+	  fprintf (lserr, "%s: %s\n",
 		   cur->fts_name, strerror (cur->fts_errno));
 	  cur->fts_number = NO_PRINT;
 	  rval = 1;
@@ -553,7 +584,7 @@ display (FTSENT *p, FTSENT *list)
 	      np = malloc (sizeof (NAMES) + ulen + glen + flen + 3);
 	      if (np == NULL)
 		{
-		  fprintf (stderr, "malloc: %s", strerror (errno));
+		  fprintf (lserr, "malloc: %s", strerror (errno));
 		  rval = EXIT_FAILURE;
 		  return;
 		}
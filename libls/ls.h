@@ -52,6 +52,9 @@
 
 extern long blocksize;		/* block size units */
 
+extern FILE *lsout;		/* listing output */
+extern FILE *lserr;		/* diagnostic output */
+
 extern int f_accesstime;	/* use time of last access */
 extern int f_flags;		/* show flags associated with a file */
 extern int f_inode;		/* print inode */
@@ -104,7 +104,7 @@ printscol (DISPLAY *dp)
       if (IS_NOPRINT (p))
 	continue;
       printaname (p, dp->s_inode, dp->s_block);
-      putchar ('\n');
+      putc ('\n', lsout);
     }
 }
 
@@ -117,7 +117,7 @@ printlong (DISPLAY *dp)
   char buf[20];
 
   if (dp->list->fts_level != FTS_ROOTLEVEL && (f_longform || f_size))
-    printf ("total %lu\n", howmany (dp->btotal, blocksize));
+    fprintf (lsout, "total %lu\n", howmany (dp->btotal, blocksize));
 
   for (p = dp->list; p; p = p->fts_link)
     {
@@ -125,24 +125,25 @@ printlong (DISPLAY *dp)
 	continue;
       sp = p->fts_statp;
       if (f_inode)
-	printf ("%*lu ", dp->s_inode, (unsigned long) sp->st_ino);
+	fprintf (lsout, "%*lu ", dp->s_inode, (unsigned long) sp->st_ino);
       if (f_size)
-	printf ("%*llu ",
+	fprintf (lsout, "%*llu ",
 		dp->s_block, (long long) howmany (sp->st_blocks, blocksize));
       strmode (sp->st_mode, buf);
       np = p->fts_pointer;
-      printf ("%s %*d %-*s  %-*s  ",
+      fprintf (lsout, "%s %*d %-*s  %-*s  ",
 	      buf, dp->s_nlink, (int) sp->st_nlink,
 	      dp->s_user, np->user, dp->s_group, np->group);
       if (f_flags)
-	printf ("%-*s ", dp->s_flags, np->flags);
+	fprintf (lsout, "%-*s ", dp->s_flags, np->flags);
       if (S_ISCHR (sp->st_mode) || S_ISBLK (sp->st_mode))
-	printf ("%3d, %3d ", (int) major (sp->st_rdev), (int) minor (sp->st_rdev));
+	fprintf (lsout, "%3d, %3d ", (int) major (sp->st_rdev),
+		 (int) minor (sp->st_rdev));
       else if (dp->bcfile)
-	printf ("%*s%*llu ",
+	fprintf (lsout, "%*s%*llu ",
 		8 - dp->s_size, "", dp->s_size, (long long) sp->st_size);
       else
-	printf ("%*llu ", dp->s_size, (long long) sp->st_size);
+	fprintf (lsout, "%*llu ", dp->s_size, (long long) sp->st_size);
       if (f_accesstime)
 	printtime (sp->st_atime);
       else if (f_statustime)
@@ -154,7 +155,7 @@ printlong (DISPLAY *dp)
 	printtype (sp->st_mode);
       if (S_ISLNK (sp->st_mode))
 	printlink (p);
-      putchar ('\n');
+      putc ('\n', lsout);
     }
 }
 
@@ -207,7 +208,7 @@ printcol (DISPLAY *dp)
 
       if ((a = realloc (array, dp->entries * sizeof (FTSENT *))) == NULL)
 	{
-	  fprintf (stderr, "realloci: %s \n", strerror (errno));
+	  fprintf (lserr, "realloci: %s \n", strerror (errno));
 	  printscol (dp);
 	  return;
 	}
@@ -223,7 +224,7 @@ printcol (DISPLAY *dp)
     ++numrows;
 
   if (dp->list->fts_level != FTS_ROOTLEVEL && (f_longform || f_size))
-    printf ("total %lu\n", howmany (dp->btotal, blocksize));
+    fprintf (lsout, "total %lu\n", howmany (dp->btotal, blocksize));
   for (row = 0; row < numrows; ++row)
     {
       for (base = row, col = 0;;)
@@ -234,9 +235,9 @@ printcol (DISPLAY *dp)
 	  if (++col == numcols)
 	    break;
 	  while (chcnt++ < colwidth)
-	    putchar (' ');
+	    putc (' ', lsout);
 	}
-      putchar ('\n');
+      putc ('\n', lsout);
     }
 }
 
@@ -253,9 +254,10 @@ printaname (FTSENT *p, unsigned long inodefield, unsigned long sizefield)
   sp = p->fts_statp;
   chcnt = 0;
   if (f_inode)
-    chcnt += printf ("%*lu ", (int) inodefield, (unsigned long) sp->st_ino);
+    chcnt += fprintf (lsout, "%*lu ", (int) inodefield,
+		      (unsigned long) sp->st_ino);
   if (f_size)
-    chcnt += printf ("%*llu ",
+    chcnt += fprintf (lsout, "%*llu ",
 		     (int) sizefield, (long long) howmany (sp->st_blocks,
 							   blocksize));
   chcnt += putname (p->fts_name);
@@ -272,22 +274,22 @@ printtime (time_t ftime)
 
   longstring = ctime (&ftime);
   for (i = 4; i < 11; ++i)
-    putchar (longstring[i]);
+    putc (longstring[i], lsout);
 
 #define SIXMONTHS	((DAYSPERNYEAR / 2) * SECSPERDAY)
   if (f_sectime)
     for (i = 11; i < 24; i++)
-      putchar (longstring[i]);
+      putc (longstring[i], lsout);
   else if (ftime + SIXMONTHS > time (NULL))
     for (i = 11; i < 16; ++i)
-      putchar (longstring[i]);
+      putc (longstring[i], lsout);
   else
     {
-      putchar (' ');
+      putc (' ', lsout);
       for (i = 20; i < 24; ++i)
-	putchar (longstring[i]);
+	putc (longstring[i], lsout);
     }
-  putchar (' ');
+  putc (' ', lsout);
 }
 
 void
@@ -301,7 +303,8 @@ printacol (DISPLAY *dp)
     return;
 
   if (dp->list->fts_level != FTS_ROOTLEVEL && (f_longform || f_size))
-    printf ("total %llu\n", (long long) (howmany (dp->btotal, blocksize)));
+    fprintf (lsout, "total %llu\n",
+	     (long long) (howmany (dp->btotal, blocksize)));
   col = 0;
   for (p = dp->list; p; p = p->fts_link)
     {
@@ -310,15 +313,15 @@ printacol (DISPLAY *dp)
       if (col >= numcols)
 	{
 	  col = 0;
-	  putchar ('\n');
+	  putc ('\n', lsout);
 	}
       chcnt = printaname (p, dp->s_inode, dp->s_block);
       col++;
       if (col < numcols)
 	while (chcnt++ < colwidth)
-	  putchar (' ');
+	  putc (' ', lsout);
     }
-  putchar ('\n');
+  putc ('\n', lsout);
 }
 
 void
@@ -343,15 +346,15 @@ printstream (DISPLAY *dp)
 	continue;
       if (col > 0)
 	{
-	  putchar (','), col++;
+	  putc (',', lsout), col++;
 	  if (col + 1 + extwidth + p->fts_namelen >= termwidth)
-	    putchar ('\n'), col = 0;
+	    putc ('\n', lsout), col = 0;
 	  else
-	    putchar (' '), col++;
+	    putc (' ', lsout), col++;
 	}
       col += printaname (p, dp->s_inode, dp->s_block);
     }
-  putchar ('\n');
+  putc ('\n', lsout);
 }
 
 static int
@@ -360,21 +363,21 @@ printtype (u_int mode)
   switch (mode & S_IFMT)
     {
     case S_IFDIR:
-      putchar ('/');
+      putc ('/', lsout);
       return (1);
     case S_IFIFO:
-      putchar ('|');
+      putc ('|', lsout);
       return (1);
     case S_IFLNK:
-      putchar ('@');
+      putc ('@', lsout);
       return (1);
     case S_IFSOCK:
-      putchar ('=');
+      putc ('=', lsout);
       return (1);
     }
   if (mode & (S_IXUSR | S_IXGRP | S_IXOTH))
     {
-      putchar ('*');
+      putc ('*', lsout);
       return (1);
     }
   return (0);
@@ -396,10 +399,10 @@ printlink (FTSENT *p)
 	      "%s/%s", p->fts_parent->fts_accpath, p->fts_name);
   if ((lnklen = readlink (name, path, sizeof (path) - 1)) == -1)
     {
-      fprintf (stderr, "\nls: %s: %s\n", name, strerror (errno));
+      fprintf (lserr, "\nls: %s: %s\n", name, strerror (errno));
       return;
     }
   path[lnklen] = '\0';
-  printf (" -> ");
+  fprintf (lsout, " -> ");
   putname (path);
 }
@@ -67,13 +67,13 @@ putname (char *name)
   int len;
 
   for (len = 0; *name; len++, name++)
-    putchar ((!isprint (*name) && f_nonprint) ? '?' : *name);
+    putc ((!isprint (*name) && f_nonprint) ? '?' : *name, lsout);
   return len;
 }
 
 int
 usage (void)
 {
-  fprintf (stderr, "usage: ls [-1ACFLRSTWacdfiklmnopqrstux] [file ...]\n");
+  fprintf (lserr, "usage: ls [-1ACFLRSTWacdfiklmnopqrstux] [file ...]\n");
   return (EXIT_FAILURE);
 }
@@ -113,10 +113,12 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -130,6 +132,32 @@
 #include <progname.h>
 #include <sys/select.h>
 #include <grp.h>
+#if defined HAVE_SYS_EPOLL_H && defined HAVE_EPOLL_CREATE1
+# include <sys/epoll.h>
+# define USE_EPOLL 1
+#endif
+#ifdef HAVE_POSIX_SPAWN
+# include <spawn.h>
+#endif
+#if defined HAVE_SYS_SENDFILE_H && defined HAVE_SENDFILE
+# include <sys/sendfile.h>
+# define WITH_SENDFILE 1
+#endif
+#if defined HAVE_SPLICE && defined SPLICE_F_MOVE
+# define WITH_SPLICE 1
+#endif
+#ifdef HAVE_MEMFD_CREATE
+# include <sys/mman.h>
+#endif
+#ifdef HAVE_SCHED_SETAFFINITY
+# include <sched.h>
+#endif
+#ifdef HAVE_SYS_PRCTL_H
+# include <sys/prctl.h>
+#endif
+#ifdef SO_REUSEPORT
+# define WITH_ACCEPTORS 1
+#endif
 
 #include "libinetutils.h"
 #include "argcv.h"
@@ -141,7 +169,17 @@
 #endif
 
 #define TOOMANY		1000	/* don't start more than TOOMANY */
+#define MAXCONNS	1024	/* connections to built-in stream services */
 #define CNT_INTVL	60	/* servers in CNT_INTVL sec. */
+#define CHILD_HASH	256	/* buckets of the table of children */
+#define CLIENT_HASH	256	/* buckets of a table of clients */
+#define CLIENT_MAX	4096	/* clients remembered per service */
+#define SERV_HASH	1024	/* buckets of the index of services */
+#define CONF_HASH	256	/* buckets of the table of files */
+#define MUX_HASH	64	/* buckets of the index of tcpmux services */
+#define TCPMUX_TIMEOUT	30	/* seconds to name a tcpmux service */
+#define MAXACCEPTORS	64	/* sockets of a stream service */
+#define WORKER_MINLIFE	10	/* seconds a worker should survive */
 #define RETRYTIME	(60*10)	/* retry after bind or server fail */
 
 #ifndef SIGCHLD
@@ -151,10 +189,32 @@
 
 bool debug = false;
 int nsock, maxsock;
-fd_set allsock;
+fd_set allsock, allwrite;
+#ifdef USE_EPOLL
+int epfd = -1;			/* epoll instance, or -1 to use select */
+# define EPOLL_EVENTS	64	/* events taken at each wakeup */
+#endif
+volatile sig_atomic_t config_gen;	/* incremented by every reload */
+volatile sig_atomic_t reload_pending;	/* SIGHUP has arrived */
 int options;
 int timingout;
 unsigned toomany = TOOMANY;
+unsigned max_conns = MAXCONNS;
+unsigned max_children;		/* running servers per service, or 0 */
+unsigned client_rate;		/* invocations per client, or 0 */
+unsigned npaused;		/* services paused by their rate limit */
+unsigned acceptors = 1;		/* sockets per nowait stream service */
+unsigned worker;		/* number of this acceptor, 0 in inetd */
+pid_t inetd_pid;		/* process of acceptor 0 */
+pid_t workers[MAXACCEPTORS];	/* processes of the other acceptors */
+time_t worker_start[MAXACCEPTORS];
+short worker_failed[MAXACCEPTORS];	/* not restarted until reload */
+volatile sig_atomic_t workers_lost;	/* a worker has died */
+unsigned workers_reach;		/* acceptors below it changed by reload */
+#ifdef HAVE_SCHED_SETAFFINITY
+int acceptor_cpus[MAXACCEPTORS];	/* CPU of each acceptor */
+unsigned nacceptor_cpus;
+#endif
 char **Argv;
 char *LastArg;
 
@@ -162,6 +222,7 @@ char **config_files;
 
 static bool env_option = false;	       /* Set environment variables */
 static bool resolve_option = false;    /* Resolve IP addresses */
+static bool throughput_option = false; /* Report chargen and discard */
 static bool pidfile_option = true;     /* Record the PID in a file */
 static const char *pid_file = PATH_INETDPID;
 
@@ -171,7 +232,13 @@ const char doc[] = "Internet super-server.";
 /* Define keys for long options that do not have short counterparts. */
 enum {
   OPT_ENVIRON = 256,
-  OPT_RESOLVE
+  OPT_ACCEPTORS,
+  OPT_ACCEPTOR_CPUS,
+  OPT_RESOLVE,
+  OPT_BUILTIN_CONNECTIONS,
+  OPT_CLIENT_RATE,
+  OPT_MAX_CHILDREN,
+  OPT_THROUGHPUT
 };
 
 const char *program_authors[] = {
@@ -182,10 +249,26 @@ const char *program_authors[] = {
 
 static struct argp_option argp_options[] = {
 #define GRP 0
+#ifdef HAVE_SCHED_SETAFFINITY
+  {"acceptor-cpus", OPT_ACCEPTOR_CPUS, "LIST", 0,
+   "run the acceptor workers on the CPUs of LIST, given as numbers and "
+   "ranges separated by commas", GRP+1},
+#endif
+  {"acceptors", OPT_ACCEPTORS, "NUMBER", 0,
+   "number of processes accepting connections for each nowait "
+   "stream service (default 1)", GRP+1},
+  {"builtin-connections", OPT_BUILTIN_CONNECTIONS, "NUMBER", 0,
+   "maximum number of connections to built-in stream services "
+   "(default 1024)", GRP+1},
+  {"client-rate", OPT_CLIENT_RATE, "NUMBER", 0,
+   "maximum invocation rate of a service by one client address "
+   "(per minute)", GRP+1},
   {"debug", 'd', NULL, 0,
    "turn on debugging, run in foreground mode", GRP+1},
   {"environment", OPT_ENVIRON, NULL, 0,
    "pass local and remote socket information in environment variables", GRP+1},
+  {"max-children", OPT_MAX_CHILDREN, "NUMBER", 0,
+   "maximum number of running servers of a service", GRP+1},
   { "pidfile", 'p', "PIDFILE", OPTION_ARG_OPTIONAL,
     "override pidfile (default: \"" PATH_INETDPID "\")",
     GRP+1 },
@@ -194,13 +277,15 @@ static struct argp_option argp_options[] = {
   {"resolve", OPT_RESOLVE, NULL, 0,
    "resolve IP addresses when setting environment variables "
    "(see --environment)", GRP+1},
+  {"throughput", OPT_THROUGHPUT, NULL, 0,
+   "log the throughput of each chargen and discard connection "
+   "when it ends", GRP+1},
 #undef GRP
   {NULL, 0, NULL, 0, NULL, 0}
 };
 
 static error_t
-parse_opt (int key, char *arg,
-	   struct argp_state *state MAYBE_UNUSED)
+parse_opt (int key, char *arg, struct argp_state *state)
 {
   char *p;
   int number;
@@ -235,6 +320,61 @@ parse_opt (int key, char *arg,
       resolve_option = true;
       break;
 
+    case OPT_ACCEPTORS:
+      number = strtol (arg, &p, 0);
+      if (number < 1 || number > MAXACCEPTORS || *p)
+	argp_error (state, "invalid number of acceptors: %s", arg);
+      acceptors = number;
+      break;
+
+#ifdef HAVE_SCHED_SETAFFINITY
+    case OPT_ACCEPTOR_CPUS:
+      nacceptor_cpus = 0;
+      for (p = arg; ; p++)
+	{
+	  char *q;
+	  long lo, hi;
+
+	  lo = hi = strtol (p, &q, 10);
+	  if (q != p && *q == '-')
+	    hi = strtol (p = q + 1, &q, 10);
+	  if (q == p || lo < 0 || hi < lo || hi >= CPU_SETSIZE
+	      || (*q && *q != ','))
+	    argp_error (state, "invalid list of CPUs: %s", arg);
+	  for (; lo <= hi && nacceptor_cpus < MAXACCEPTORS; lo++)
+	    acceptor_cpus[nacceptor_cpus++] = lo;
+	  p = q;
+	  if (*p == 0)
+	    break;
+	}
+      break;
+#endif
+
+    case OPT_BUILTIN_CONNECTIONS:
+      number = strtol (arg, &p, 0);
+      if (number < 1 || *p)
+	argp_error (state, "invalid number of connections: %s", arg);
+      max_conns = number;
+      break;
+
+    case OPT_CLIENT_RATE:
+      number = strtol (arg, &p, 0);
+      if (number < 0 || *p)
+	argp_error (state, "invalid client rate: %s", arg);
+      client_rate = number;
+      break;
+
+    case OPT_MAX_CHILDREN:
+      number = strtol (arg, &p, 0);
+      if (number < 0 || *p)
+	argp_error (state, "invalid number of children: %s", arg);
+      max_children = number;
+      break;
+
+    case OPT_THROUGHPUT:
+      throughput_option = true;
+      break;
+
     default:
       return ARGP_ERR_UNKNOWN;
     }
@@ -246,35 +386,82 @@ static struct argp argp =
   {argp_options, parse_opt, args_doc, doc, NULL, NULL, NULL};
 
 
+/* Objects watched by the main loop begin with their kind.  */
+#define WATCH_SERVICE	0	/* struct servtab */
+#define WATCH_CONN	1	/* struct biconn */
+
+/*
+ * A token bucket holds up to a number of tokens, refilled evenly over
+ * CNT_INTVL seconds, and every invocation takes one of them.
+ */
+struct bucket
+{
+  double bk_tokens;
+  struct timeval bk_stamp;	/* time of the last refill, or zero */
+};
+
+/* Invocations by a single client address.  */
+struct client
+{
+  struct client *cl_next;
+  sa_family_t cl_family;
+  unsigned char cl_addr[16];
+  struct bucket cl_bucket;
+  short cl_warned;		/* rejection has been logged */
+};
+
 struct servtab
 {
+  int se_kind;			/* WATCH_SERVICE */
   const char *se_file;
   int se_line;
+  struct conffile *se_conf;	/* file of the entry, or NULL */
   char *se_node;                /* node name */
   char *se_service;		/* name of service */
   int se_socktype;		/* type of socket to use */
   char *se_proto;		/* protocol used */
   pid_t se_wait;		/* single threaded server */
   unsigned se_max;              /* Maximum number of instances per CNT_INTVL */
+  unsigned se_maxchild;		/* running servers, or 0 for max_children */
+  unsigned se_maxclient;	/* per client, or 0 for client_rate */
+  unsigned se_acceptors;	/* sockets, or 0 for acceptors */
   short se_checked;		/* looked at during merge */
   char *se_user;		/* user name to run as */
   char *se_group;		/* group name to run as */
+  uid_t se_uid;			/* user ID of se_user */
+  gid_t se_gid;			/* group ID to run as */
+  gid_t *se_groups;		/* supplementary groups, or NULL */
+  int se_ngroups;		/* number of se_groups */
   struct biltin *se_bi;		/* if built-in, description */
   char *se_server;		/* server program */
   char **se_argv;		/* program arguments */
   size_t se_argc;		/* number of arguments */
   int se_fd;			/* open descriptor */
+  short se_watched;		/* se_fd is watched for requests */
   int se_type;			/* type */
   sa_family_t se_family;	/* address family of the socket */
   char se_v4mapped;		/* 1 = accept v4mapped connection, 0 = don't */
   struct sockaddr_storage se_ctrladdr;	/* bound address */
   socklen_t se_addrlen;		/* exact address length in use */
   unsigned se_refcnt;
-  unsigned se_count;			/* number started since se_time */
-  struct timeval se_time;	/* start of se_count */
+  struct bucket se_bucket;	/* rate of invocations */
+  short se_paused;		/* rate exceeded until se_resume */
+  struct timeval se_resume;
+  time_t se_warned;		/* last report of a limit */
+  unsigned se_children;		/* running servers of nowait service */
+  struct client **se_clients;	/* CLIENT_HASH chains, or NULL */
+  unsigned se_nclients;
   struct servtab *se_next;
+  struct servtab *se_hnext;	/* next with the same hash */
+  struct servtab *se_mnext;	/* next tcpmux service, same hash */
 } *servtab;
 
+/* Services by address, name and protocol.  */
+struct servtab *servhash[SERV_HASH];
+
+/* TCPMUX services by name, regardless of case.  */
+struct servtab *muxhash[MUX_HASH];
+
 #define NORM_TYPE	0
 #define MUX_TYPE	1
 #define MUXPLUS_TYPE	2
@@ -282,6 +469,12 @@ struct servtab
 			 ((sep)->se_type == MUXPLUS_TYPE))
 #define ISMUXPLUS(sep)	((sep)->se_type == MUXPLUS_TYPE)
 
+#define SE_RATE(sep)	((sep)->se_max ? (sep)->se_max : toomany)
+#define SE_CHILDREN(sep) ((sep)->se_maxchild ? (sep)->se_maxchild \
+			  : max_children)
+#define SE_CLIENTS(sep)	((sep)->se_maxclient ? (sep)->se_maxclient \
+			 : client_rate)
+
 
 /* Built-in services */
 void chargen_dg (int, struct servtab *);
@@ -302,26 +495,27 @@ struct biltin
   int bi_socktype;		/* type of socket supported */
   short bi_fork;		/* 1 if should fork before call */
   short bi_wait;		/* 1 if should wait for child */
+  short bi_loop;		/* 1 if served by the main loop */
   void (*bi_fn) (int s, struct servtab *);	/*function which performs it */
 } biltins[] =
   {
     /* Echo received data */
-    {"echo", SOCK_STREAM, 1, 0, echo_stream},
-    {"echo", SOCK_DGRAM, 0, 0, echo_dg},
+    {"echo", SOCK_STREAM, 0, 0, 1, echo_stream},
+    {"echo", SOCK_DGRAM, 0, 0, 0, echo_dg},
     /* Internet /dev/null */
-    {"discard", SOCK_STREAM, 1, 0, discard_stream},
-    {"discard", SOCK_DGRAM, 0, 0, discard_dg},
+    {"discard", SOCK_STREAM, 0, 0, 1, discard_stream},
+    {"discard", SOCK_DGRAM, 0, 0, 0, discard_dg},
     /* Return 32 bit time since 1900 */
-    {"time", SOCK_STREAM, 0, 0, machtime_stream},
-    {"time", SOCK_DGRAM, 0, 0, machtime_dg},
+    {"time", SOCK_STREAM, 0, 0, 0, machtime_stream},
+    {"time", SOCK_DGRAM, 0, 0, 0, machtime_dg},
     /* Return human-readable time */
-    {"daytime", SOCK_STREAM, 0, 0, daytime_stream},
-    {"daytime", SOCK_DGRAM, 0, 0, daytime_dg},
+    {"daytime", SOCK_STREAM, 0, 0, 0, daytime_stream},
+    {"daytime", SOCK_DGRAM, 0, 0, 0, daytime_dg},
     /* Familiar character generator */
-    {"chargen", SOCK_STREAM, 1, 0, chargen_stream},
-    {"chargen", SOCK_DGRAM, 0, 0, chargen_dg},
-    {"tcpmux", SOCK_STREAM, 1, 0, tcpmux},
-    {NULL, 0, 0, 0, NULL}
+    {"chargen", SOCK_STREAM, 0, 0, 1, chargen_stream},
+    {"chargen", SOCK_DGRAM, 0, 0, 0, chargen_dg},
+    {"tcpmux", SOCK_STREAM, 1, 0, 0, tcpmux},
+    {NULL, 0, 0, 0, 0, NULL}
   };
 
 #define NUMINT	(sizeof(intab) / sizeof(struct inent))
@@ -338,6 +532,22 @@ bi_lookup (const struct servtab *sep)
   return NULL;
 }
 
+/* Return the number of sockets of SEP, each served by an acceptor of
+   its own.  Only nowait stream services have more than one.  */
+unsigned
+service_acceptors (struct servtab *sep)
+{
+#ifdef WITH_ACCEPTORS
+  if (sep->se_wait == 0 && sep->se_socktype == SOCK_STREAM && !ISMUX (sep))
+    {
+      unsigned n = sep->se_acceptors ? sep->se_acceptors : acceptors;
+
+      return n < MAXACCEPTORS ? n : MAXACCEPTORS;
+    }
+#endif
+  return 1;
+}
+
 
 /* Signal handling */
 
@@ -410,11 +620,67 @@ signal_unblock (SIGSTATUS * status)
 #endif
 }
 
+#ifdef HAVE_SCHED_SETAFFINITY
+cpu_set_t inetd_cpus;		/* CPUs inetd was allowed to run on */
+bool acceptor_pinned;		/* this process runs on a single CPU */
+
+/* Run the worker K on its CPU from --acceptor-cpus, if any.  inetd
+   itself is not pinned, as it serves all other services, and starts
+   their servers with posix_spawn.  */
+void
+acceptor_pin (unsigned k)
+{
+  cpu_set_t set;
+  int cpu;
+
+  if (nacceptor_cpus == 0)
+    return;
+  if (!acceptor_pinned
+      && sched_getaffinity (0, sizeof (inetd_cpus), &inetd_cpus) < 0)
+    return;
+  cpu = acceptor_cpus[(k - 1) % nacceptor_cpus];
+  CPU_ZERO (&set);
+  CPU_SET (cpu, &set);
+  if (sched_setaffinity (0, sizeof (set), &set) < 0)
+    syslog (LOG_WARNING, "acceptor %u: cannot run on CPU %d: %m", k, cpu);
+  else
+    acceptor_pinned = true;
+}
+
+/* Servers run on all CPUs of inetd again.  */
+void
+acceptor_unpin (void)
+{
+  if (acceptor_pinned)
+    sched_setaffinity (0, sizeof (inetd_cpus), &inetd_cpus);
+}
+#else
+# define acceptor_pin(k)
+# define acceptor_unpin()
+# define acceptor_pinned false
+#endif
+
+/* Close the descriptors of inetd in a child, except KEEP.  */
+void
+close_fds (int keep)
+{
+  int sock;
+
+#ifdef HAVE_CLOSE_RANGE
+  if ((keep <= 3 || close_range (3, keep - 1, 0) == 0)
+      && close_range (keep < 3 ? 3 : keep + 1, ~0U, 0) == 0)
+    return;
+#endif
+  if (debug)
+    fprintf (stderr, "+ Closing from %d\n", maxsock);
+  for (sock = maxsock; sock > 2; sock--)
+    if (sock != keep)
+      close (sock);
+}
+
 void
 run_service (int ctrl, struct servtab *sep)
 {
-  struct passwd *pwd;
-  struct group *grp = NULL;
   char buf[50];
 
   if (sep->se_bi)
@@ -429,55 +695,36 @@ run_service (int ctrl, struct servtab *sep)
       close (ctrl);
       dup2 (0, 1);
       dup2 (0, 2);
-      pwd = getpwnam (sep->se_user);
-      if (pwd == NULL)
-	{
-	  syslog (LOG_ERR, "%s/%s: %s: No such user",
-		  sep->se_service, sep->se_proto, sep->se_user);
-	  if (sep->se_socktype != SOCK_STREAM)
-	    recv (0, buf, sizeof buf, 0);
-	  _exit (EXIT_FAILURE);
-	}
-      if (sep->se_group && *sep->se_group)
-	{
-	  grp = getgrnam (sep->se_group);
-	  if (grp == NULL)
-	    {
-	      syslog (LOG_ERR, "%s/%s: %s: No such group",
-		      sep->se_service, sep->se_proto, sep->se_group);
-	      if (sep->se_socktype != SOCK_STREAM)
-		recv (0, buf, sizeof buf, 0);
-	      _exit (EXIT_FAILURE);
-	    }
-	}
-      if (pwd->pw_uid)
+      /* The credentials were looked up when the service was read.  */
+      if (sep->se_uid)
 	{
-	  if (grp && grp->gr_gid)
-	    {
-	      if (setgid (grp->gr_gid) < 0)
-		{
-		  syslog (LOG_ERR, "%s: can't set gid %d: %m",
-			  sep->se_service, grp->gr_gid);
-		  _exit (EXIT_FAILURE);
-		}
-	    }
-	  else if (setgid (pwd->pw_gid) < 0)
+	  if (setgid (sep->se_gid) < 0)
 	    {
 	      syslog (LOG_ERR, "%s: can't set gid %d: %m",
-		      sep->se_service, pwd->pw_gid);
+		      sep->se_service, (int) sep->se_gid);
 	      _exit (EXIT_FAILURE);
 	    }
+#ifdef HAVE_GETGROUPLIST
+	  if (sep->se_groups)
+	    setgroups (sep->se_ngroups, sep->se_groups);
+	  else
+#endif
 #ifdef HAVE_INITGROUPS
-	  initgroups (pwd->pw_name,
-		      (grp && grp->gr_gid) ? grp->gr_gid : pwd->pw_gid);
+	    initgroups (sep->se_user, sep->se_gid);
 #endif
-	  if (setuid (pwd->pw_uid) < 0)
+	  if (setuid (sep->se_uid) < 0)
 	    {
 	      syslog (LOG_ERR, "%s: can't set uid %d: %m",
-		      sep->se_service, pwd->pw_uid);
+		      sep->se_service, (int) sep->se_uid);
 	      _exit (EXIT_FAILURE);
 	    }
 	}
+      /* Start the server with default signal handling, as exec
+	 and posix_spawn would.  */
+      signal_set_handler (SIGHUP, SIG_DFL);
+      signal_set_handler (SIGCHLD, SIG_DFL);
+      signal_set_handler (SIGALRM, SIG_DFL);
+      signal_unblock (NULL);
       execv (sep->se_server, sep->se_argv);
       if (sep->se_socktype != SOCK_STREAM)
 	recv (0, buf, sizeof buf, 0);
@@ -486,151 +733,609 @@ run_service (int ctrl, struct servtab *sep)
     }
 }
 
-void
-reapchild (int signo MAYBE_UNUSED)
+#ifdef HAVE_POSIX_SPAWN
+/*
+ * Start the server of SEP on CTRL without a copy of inetd.  This is
+ * possible when no credentials need to change, which is the case
+ * for servers running as root.  All other descriptors of inetd are
+ * closed on exec.  Return the process ID, or -1 after logging the
+ * failure.
+ */
+pid_t
+spawn_service (int ctrl, struct servtab *sep)
 {
-  int status;
+  extern char **environ;
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t empty;
+  short flags = POSIX_SPAWN_SETSIGMASK;
   pid_t pid;
-  struct servtab *sep;
+  int err;
 
-  for (;;)
+  if (debug)
+    fprintf (stderr, "spawn %s\n", sep->se_server);
+
+  posix_spawn_file_actions_init (&actions);
+  posix_spawn_file_actions_adddup2 (&actions, ctrl, 0);
+  posix_spawn_file_actions_adddup2 (&actions, 0, 1);
+  posix_spawn_file_actions_adddup2 (&actions, 0, 2);
+  if (ctrl > 2)
+    posix_spawn_file_actions_addclose (&actions, ctrl);
+
+  posix_spawnattr_init (&attr);
+  sigemptyset (&empty);
+  posix_spawnattr_setsigmask (&attr, &empty);
+# ifdef POSIX_SPAWN_SETSID
+  if (debug)
+    flags |= POSIX_SPAWN_SETSID;
+# endif
+  posix_spawnattr_setflags (&attr, flags);
+
+  err = posix_spawn (&pid, sep->se_server, &actions, &attr,
+		     sep->se_argv, environ);
+  posix_spawnattr_destroy (&attr);
+  posix_spawn_file_actions_destroy (&actions);
+
+  if (err)
     {
-#ifdef HAVE_WAIT3
-      pid = wait3 (&status, WNOHANG, NULL);
-#else
-      pid = wait (&status);
-#endif
-      if (pid <= 0)
-	break;
-      if (debug)
-	fprintf (stderr, "%d reaped, status %#x\n", (int) pid, status);
-      for (sep = servtab; sep; sep = sep->se_next)
-	if (sep->se_wait == pid)
-	  {
-	    if (status)
-	      syslog (LOG_WARNING, "%s: exit status 0x%x",
-		      sep->se_server, status);
-	    if (debug)
-	      fprintf (stderr, "restored %s, fd %d\n",
-		       sep->se_service, sep->se_fd);
-	    FD_SET (sep->se_fd, &allsock);
-	    nsock++;
-	    sep->se_wait = 1;
-	  }
+      char buf[50];
+
+      errno = err;
+      syslog (LOG_ERR, "cannot execute %s: %m", sep->se_server);
+      if (sep->se_socktype != SOCK_STREAM)
+	recv (ctrl, buf, sizeof buf, MSG_DONTWAIT);
+      return -1;
     }
+  return pid;
 }
 
-
+/* Return true if the server of SEP can be started by spawn_service.  */
+bool
+spawnable (struct servtab *sep)
+{
+  /* The CPU of an acceptor is not passed on.  */
+  return sep->se_bi == NULL && !acceptor_pinned
+    && (sep->se_uid == 0
+	|| (sep->se_uid == geteuid () && sep->se_gid == getegid ()));
+}
+#endif /* HAVE_POSIX_SPAWN */
 
-char *
-newstr (const char *cp)
+/*
+ * Watch the socket of SEP for requests.  With epoll, the entry
+ * itself is returned with each event, so no search is needed.
+ */
+void
+sock_add (struct servtab *sep)
 {
-  char *s;
-  s = strdup (cp ? cp : "");
-  if (s != NULL)
-    return s;
-  syslog (LOG_ERR, "strdup: %m");
-  exit (-1);
+  if (sep->se_watched)
+    return;
+#ifdef USE_EPOLL
+  if (epfd >= 0)
+    {
+      struct epoll_event ev;
+
+      memset (&ev, 0, sizeof (ev));
+      ev.events = EPOLLIN;
+      ev.data.ptr = sep;
+      if (epoll_ctl (epfd, EPOLL_CTL_ADD, sep->se_fd, &ev) < 0)
+	{
+	  syslog (LOG_ERR, "%s/%s: epoll_ctl: %m",
+		  sep->se_service, sep->se_proto);
+	  return;
+	}
+    }
+  else
+#endif
+  if (sep->se_fd >= FD_SETSIZE)
+    {
+      syslog (LOG_ERR, "%s/%s: descriptor %d exceeds FD_SETSIZE",
+	      sep->se_service, sep->se_proto, sep->se_fd);
+      return;
+    }
+  else
+    FD_SET (sep->se_fd, &allsock);
+  sep->se_watched = 1;
+  nsock++;
 }
 
+/* Stop watching the socket of SEP.  */
 void
-dupmem (void **pptr, size_t size)
+sock_del (struct servtab *sep)
 {
-  void *ptr = malloc (size);
-  if (!ptr)
+  if (!sep->se_watched)
+    return;
+#ifdef USE_EPOLL
+  if (epfd >= 0)
     {
-      syslog (LOG_ERR, "dupmem: %m");
-      exit (-1);
+      /* A running server may share the socket, so it does not leave
+	 the epoll set by being closed here.  */
+      struct epoll_event ev;
+
+      memset (&ev, 0, sizeof (ev));
+      epoll_ctl (epfd, EPOLL_CTL_DEL, sep->se_fd, &ev);
     }
-  memcpy (ptr, *pptr, size);
-  *pptr = ptr;
+  else
+#endif
+    FD_CLR (sep->se_fd, &allsock);
+  sep->se_watched = 0;
+  nsock--;
 }
 
+/* Watch the socket of SEP again, unless a limit still holds.  */
 void
-dupstr (char **pstr)
+service_resume (struct servtab *sep)
 {
-  if (*pstr)
-    dupmem ((void**)pstr, strlen (*pstr) + 1);
+  if (sep->se_fd >= 0 && sep->se_wait <= 1 && !sep->se_paused
+      && !(SE_CHILDREN (sep) && sep->se_children >= SE_CHILDREN (sep)))
+    sock_add (sep);
 }
 
-
 /*
- * print_service:
- *	Dump relevant information to stderr
+ * Children of nowait services are recorded by process ID, so that
+ * reapchild() can count them off their service.  Records are only
+ * allocated with signals blocked, and reused, since reapchild() runs
+ * as a signal handler.
  */
-void
-print_service (const char *action, struct servtab *sep)
+struct child
 {
-  fprintf (stderr,
-	   "%s:%d: %s: %s:%s proto=%s, wait=%d, max=%u, "
-	   "user=%s group=%s builtin=%s server=%s\n",
-	   sep->se_file, sep->se_line,
-	   action,
-	   ISMUX (sep) ? (ISMUXPLUS (sep) ? "tcpmuxplus" : "tcpmux")
-		      : (sep->se_node ? sep->se_node : "*"),
-	   sep->se_service, sep->se_proto,
-	   (int) sep->se_wait, sep->se_max,
-	   sep->se_user, sep->se_group,
-	   sep->se_bi ? sep->se_bi->bi_service : "no",
-	   sep->se_server);
-}
+  pid_t ch_pid;
+  struct servtab *ch_sep;	/* or NULL once the service is gone */
+  struct child *ch_next;
+};
 
-
-/* Configuration */
-int
-setup (struct servtab *sep)
+struct child *children[CHILD_HASH];
+struct child *free_children;
+
+void
+child_add (pid_t pid, struct servtab *sep)
 {
-  int err;
-  int on = 1;
+  struct child *ch = free_children;
 
- tryagain:
-  sep->se_fd = socket (sep->se_family, sep->se_socktype, 0);
-  if (sep->se_fd < 0)
+  if (ch)
+    free_children = ch->ch_next;
+  else
     {
-      /* If we don't support creating AF_INET6 sockets, create AF_INET
-	 sockets.  */
-      if (errno == EAFNOSUPPORT && sep->se_family == AF_INET6
-	  && sep->se_v4mapped)
+      ch = malloc (sizeof (*ch));
+      if (ch == NULL)
 	{
-	  /* Fall back to IPv4 silently.  */
-	  sep->se_family = AF_INET;
-	  goto tryagain;
+	  syslog (LOG_ERR, "Out of memory.");
+	  return;
 	}
-
-      if (debug)
-	fprintf (stderr, "socket failed on %s/%s: %s\n",
-		 sep->se_service, sep->se_proto, strerror (errno));
-      syslog (LOG_ERR, "%s/%s: socket: %m",
-	      sep->se_service, sep->se_proto);
-      return 1;
     }
-#ifdef IPV6
-  if (sep->se_family == AF_INET6)
+  ch->ch_pid = pid;
+  ch->ch_sep = sep;
+  ch->ch_next = children[pid % CHILD_HASH];
+  children[pid % CHILD_HASH] = ch;
+  sep->se_children++;
+}
+
+/* Forget the child PID, and return its service, if known.  */
+struct servtab *
+child_remove (pid_t pid)
+{
+  struct child **pp, *ch;
+
+  for (pp = &children[pid % CHILD_HASH]; (ch = *pp); pp = &ch->ch_next)
+    if (ch->ch_pid == pid)
+      {
+	*pp = ch->ch_next;
+	ch->ch_next = free_children;
+	free_children = ch;
+	return ch->ch_sep;
+      }
+  return NULL;
+}
+
+/* Detach the running children of SEP, which is about to be freed.  */
+void
+child_forget (struct servtab *sep)
+{
+  struct child *ch;
+  int i;
+
+  for (i = 0; i < CHILD_HASH; i++)
+    for (ch = children[i]; ch; ch = ch->ch_next)
+      if (ch->ch_sep == sep)
+	ch->ch_sep = NULL;
+}
+
+/* Refill B, which holds up to MAX tokens, until NOW, and take a
+   token.  Return 0 if there was one, or else the number of seconds
+   until the next is due.  */
+double
+bucket_take (struct bucket *b, unsigned max, struct timeval *now)
+{
+  double secs;
+
+  if (b->bk_stamp.tv_sec == 0)
+    b->bk_tokens = max;
+  else
     {
-      /* Reverse the value of SEP->se_v4mapped, since otherwise if
-	 using `tcp6' as a protocol type, all connections will be
-	 mapped to IPv6, and with `tcp6only', IPv4 gets mapped to
-	 IPv6.  */
-      int val = sep->se_v4mapped ? 0 : 1;
-      if (setsockopt (sep->se_fd, IPPROTO_IPV6, IPV6_V6ONLY,
-		      (char *) &val, sizeof (val)) < 0)
-	syslog (LOG_ERR, "setsockopt (IPV6_V6ONLY): %m");
+      secs = (now->tv_sec - b->bk_stamp.tv_sec)
+	+ (now->tv_usec - b->bk_stamp.tv_usec) / 1e6;
+      if (secs > 0)
+	b->bk_tokens += secs * max / CNT_INTVL;
+      if (b->bk_tokens > max)
+	b->bk_tokens = max;
     }
-#endif
-  if (strncmp (sep->se_proto, "tcp", 3) == 0 && (options & SO_DEBUG))
+  b->bk_stamp = *now;
+
+  if (b->bk_tokens >= 1)
     {
-      if (setsockopt (sep->se_fd, SOL_SOCKET, SO_DEBUG,
-		      (char *) &on, sizeof (on)) < 0
-	  && errno != EACCES)	/* Ignore insufficient permission.  */
-	syslog (LOG_ERR, "setsockopt (SO_DEBUG): %m");
+      b->bk_tokens--;
+      return 0;
     }
+  return (1 - b->bk_tokens) * CNT_INTVL / max;
+}
 
-  err = setsockopt (sep->se_fd, SOL_SOCKET, SO_REUSEADDR,
-		    (char *) &on, sizeof (on));
-  if (err < 0)
-    syslog (LOG_ERR, "setsockopt (SO_REUSEADDR): %m");
+/* Report at most once per CNT_INTVL that SEP reached a limit.  */
+int
+service_warn (struct servtab *sep, struct timeval *now)
+{
+  if (now->tv_sec - sep->se_warned < CNT_INTVL)
+    return 0;
+  sep->se_warned = now->tv_sec;
+  return 1;
+}
 
-  err = bind (sep->se_fd, (struct sockaddr *) &sep->se_ctrladdr,
+/* Stop watching the socket of SEP for SECS seconds, leaving requests
+   queued on it.  */
+void
+service_pause (struct servtab *sep, double secs, struct timeval *now)
+{
+  long usecs = now->tv_usec + (long) (secs * 1e6);
+  SIGSTATUS sigstatus;
+
+  signal_block (&sigstatus);
+  sep->se_resume.tv_sec = now->tv_sec + usecs / 1000000;
+  sep->se_resume.tv_usec = usecs % 1000000;
+  if (!sep->se_paused)
+    {
+      sep->se_paused = 1;
+      npaused++;
+    }
+  sock_del (sep);
+  signal_unblock (&sigstatus);
+
+  if (debug)
+    fprintf (stderr, "%s paused for %.3f s\n", sep->se_service, secs);
+  if (service_warn (sep, now))
+    syslog (LOG_WARNING, "%s/%s: more than %u requests per minute, delayed",
+	    sep->se_service, sep->se_proto, SE_RATE (sep));
+}
+
+/* Resume the services whose pause has ended.  Return the number of
+   milliseconds until the next pause ends, or -1 if none remain.  The
+   signal mask is kept, since the main loop holds SIGHUP blocked from
+   its check for a reload until it waits.  */
+int
+resume_services (void)
+{
+  struct servtab *sep;
+  struct timeval now;
+  SIGSTATUS sigstatus;
+  long ms;
+  int next = -1;
+
+  if (npaused == 0)
+    return -1;
+
+  gettimeofday (&now, NULL);
+  signal_block (&sigstatus);
+  for (sep = servtab; sep; sep = sep->se_next)
+    if (sep->se_paused)
+      {
+	ms = (sep->se_resume.tv_sec - now.tv_sec) * 1000
+	  + (sep->se_resume.tv_usec - now.tv_usec + 999) / 1000;
+	if (ms <= 0)
+	  {
+	    sep->se_paused = 0;
+	    npaused--;
+	    service_resume (sep);
+	  }
+	else if (next < 0 || ms < next)
+	  next = ms;
+      }
+  signal_unblock (&sigstatus);
+  return next;
+}
+
+/* Discard the clients of SEP, or those idle for CNT_INTVL seconds,
+   whose buckets are full again, when NOW is given.  */
+void
+client_sweep (struct servtab *sep, struct timeval *now)
+{
+  struct client **pp, *cl;
+  int i;
+
+  if (sep->se_clients == NULL)
+    return;
+  for (i = 0; i < CLIENT_HASH; i++)
+    for (pp = &sep->se_clients[i]; (cl = *pp); )
+      if (now == NULL
+	  || now->tv_sec - cl->cl_bucket.bk_stamp.tv_sec > CNT_INTVL)
+	{
+	  *pp = cl->cl_next;
+	  free (cl);
+	  sep->se_nclients--;
+	}
+      else
+	pp = &cl->cl_next;
+}
+
+void
+client_free (struct servtab *sep)
+{
+  client_sweep (sep, NULL);
+  free (sep->se_clients);
+  sep->se_clients = NULL;
+}
+
+/* Take a token from the bucket of the client at SA, of length SALEN,
+   for SEP.  Return 1 if the request may go on, and 0 if it is to be
+   rejected.  */
+int
+client_take (struct servtab *sep, struct sockaddr *sa, socklen_t salen,
+	     struct timeval *now)
+{
+  unsigned char *addr;
+  unsigned hash = 0;
+  size_t len, i;
+  struct client **pp, *cl;
+
+  switch (sa->sa_family)
+    {
+    case AF_INET:
+      addr = (unsigned char *) &((struct sockaddr_in *) sa)->sin_addr;
+      len = sizeof (struct in_addr);
+      break;
+#ifdef IPV6
+    case AF_INET6:
+      addr = (unsigned char *) &((struct sockaddr_in6 *) sa)->sin6_addr;
+      len = sizeof (struct in6_addr);
+      break;
+#endif
+    default:
+      return 1;
+    }
+
+  if (sep->se_clients == NULL)
+    {
+      sep->se_clients = calloc (CLIENT_HASH, sizeof (*sep->se_clients));
+      if (sep->se_clients == NULL)
+	return 1;
+    }
+
+  for (i = 0; i < len; i++)
+    hash = hash * 31 + addr[i];
+  for (pp = &sep->se_clients[hash % CLIENT_HASH]; (cl = *pp);
+       pp = &cl->cl_next)
+    if (cl->cl_family == sa->sa_family && memcmp (cl->cl_addr, addr, len) == 0)
+      break;
+
+  if (cl == NULL)
+    {
+      if (sep->se_nclients >= CLIENT_MAX)
+	client_sweep (sep, now);
+      /* Beyond that, only the rate of the service applies.  */
+      if (sep->se_nclients >= CLIENT_MAX)
+	return 1;
+      cl = calloc (1, sizeof (*cl));
+      if (cl == NULL)
+	return 1;
+      cl->cl_family = sa->sa_family;
+      memcpy (cl->cl_addr, addr, len);
+      cl->cl_next = sep->se_clients[hash % CLIENT_HASH];
+      sep->se_clients[hash % CLIENT_HASH] = cl;
+      sep->se_nclients++;
+    }
+
+  if (bucket_take (&cl->cl_bucket, SE_CLIENTS (sep), now) == 0)
+    {
+      cl->cl_warned = 0;
+      return 1;
+    }
+  if (!cl->cl_warned)
+    {
+      char host[NI_MAXHOST];
+
+      if (getnameinfo (sa, salen, host, sizeof (host), NULL, 0,
+		       NI_NUMERICHOST))
+	strcpy (host, "unknown");
+      syslog (LOG_WARNING, "%s/%s: more than %u requests per minute from %s, "
+	      "rejected", sep->se_service, sep->se_proto, SE_CLIENTS (sep),
+	      host);
+      cl->cl_warned = 1;
+    }
+  return 0;
+}
+
+/* Note the end of PID, with STATUS, if it was a worker.  A worker
+   which fails soon after it started is not replaced before the next
+   reload.  */
+bool
+worker_reaped (pid_t pid, int status)
+{
+  unsigned k;
+
+  for (k = 1; k < MAXACCEPTORS; k++)
+    if (workers[k] == pid)
+      {
+	workers[k] = 0;
+	workers_lost = 1;
+	if (time (NULL) - worker_start[k] < WORKER_MINLIFE)
+	  worker_failed[k] = 1;
+	syslog (LOG_WARNING, "acceptor %u: exit status 0x%x%s", k, status,
+		worker_failed[k] ? ", not restarted" : "");
+	return true;
+      }
+  return false;
+}
+
+void
+reapchild (int signo MAYBE_UNUSED)
+{
+  int status;
+  pid_t pid;
+  struct servtab *sep;
+
+  for (;;)
+    {
+#ifdef HAVE_WAIT3
+      pid = wait3 (&status, WNOHANG, NULL);
+#else
+      pid = wait (&status);
+#endif
+      if (pid <= 0)
+	break;
+      if (debug)
+	fprintf (stderr, "%d reaped, status %#x\n", (int) pid, status);
+      if (worker_reaped (pid, status))
+	continue;
+      sep = child_remove (pid);
+      if (sep)
+	{
+	  sep->se_children--;
+	  service_resume (sep);
+	  continue;
+	}
+      for (sep = servtab; sep; sep = sep->se_next)
+	if (sep->se_wait == pid)
+	  {
+	    if (status)
+	      syslog (LOG_WARNING, "%s: exit status 0x%x",
+		      sep->se_server, status);
+	    if (debug)
+	      fprintf (stderr, "restored %s, fd %d\n",
+		       sep->se_service, sep->se_fd);
+	    sep->se_wait = 1;
+	    service_resume (sep);
+	  }
+    }
+}
+
+
+
+char *
+newstr (const char *cp)
+{
+  char *s;
+  s = strdup (cp ? cp : "");
+  if (s != NULL)
+    return s;
+  syslog (LOG_ERR, "strdup: %m");
+  exit (-1);
+}
+
+void
+dupmem (void **pptr, size_t size)
+{
+  void *ptr = malloc (size);
+  if (!ptr)
+    {
+      syslog (LOG_ERR, "dupmem: %m");
+      exit (-1);
+    }
+  memcpy (ptr, *pptr, size);
+  *pptr = ptr;
+}
+
+void
+dupstr (char **pstr)
+{
+  if (*pstr)
+    dupmem ((void**)pstr, strlen (*pstr) + 1);
+}
+
+
+/*
+ * print_service:
+ *	Dump relevant information to stderr
+ */
+void
+print_service (const char *action, struct servtab *sep)
+{
+  fprintf (stderr,
+	   "%s:%d: %s: %s:%s proto=%s, wait=%d, max=%u, children=%u, "
+	   "clients=%u, acceptors=%u, user=%s group=%s builtin=%s "
+	   "server=%s\n",
+	   sep->se_file, sep->se_line,
+	   action,
+	   ISMUX (sep) ? (ISMUXPLUS (sep) ? "tcpmuxplus" : "tcpmux")
+		      : (sep->se_node ? sep->se_node : "*"),
+	   sep->se_service, sep->se_proto,
+	   (int) sep->se_wait, SE_RATE (sep), SE_CHILDREN (sep),
+	   SE_CLIENTS (sep), service_acceptors (sep),
+	   sep->se_user, sep->se_group,
+	   sep->se_bi ? sep->se_bi->bi_service : "no",
+	   sep->se_server);
+}
+
+
+/* Configuration */
+int
+setup (struct servtab *sep)
+{
+  int err;
+  int on = 1;
+
+ tryagain:
+  sep->se_fd = socket (sep->se_family, sep->se_socktype, 0);
+  if (sep->se_fd < 0)
+    {
+      /* If we don't support creating AF_INET6 sockets, create AF_INET
+	 sockets.  */
+      if (errno == EAFNOSUPPORT && sep->se_family == AF_INET6
+	  && sep->se_v4mapped)
+	{
+	  /* Fall back to IPv4 silently.  */
+	  sep->se_family = AF_INET;
+	  goto tryagain;
+	}
+
+      if (debug)
+	fprintf (stderr, "socket failed on %s/%s: %s\n",
+		 sep->se_service, sep->se_proto, strerror (errno));
+      syslog (LOG_ERR, "%s/%s: socket: %m",
+	      sep->se_service, sep->se_proto);
+      return 1;
+    }
+  /* Servers only get the socket as standard input.  */
+  fcntl (sep->se_fd, F_SETFD, FD_CLOEXEC);
+#ifdef IPV6
+  if (sep->se_family == AF_INET6)
+    {
+      /* Reverse the value of SEP->se_v4mapped, since otherwise if
+	 using `tcp6' as a protocol type, all connections will be
+	 mapped to IPv6, and with `tcp6only', IPv4 gets mapped to
+	 IPv6.  */
+      int val = sep->se_v4mapped ? 0 : 1;
+      if (setsockopt (sep->se_fd, IPPROTO_IPV6, IPV6_V6ONLY,
+		      (char *) &val, sizeof (val)) < 0)
+	syslog (LOG_ERR, "setsockopt (IPV6_V6ONLY): %m");
+    }
+#endif
+  if (strncmp (sep->se_proto, "tcp", 3) == 0 && (options & SO_DEBUG))
+    {
+      if (setsockopt (sep->se_fd, SOL_SOCKET, SO_DEBUG,
+		      (char *) &on, sizeof (on)) < 0
+	  && errno != EACCES)	/* Ignore insufficient permission.  */
+	syslog (LOG_ERR, "setsockopt (SO_DEBUG): %m");
+    }
+
+  err = setsockopt (sep->se_fd, SOL_SOCKET, SO_REUSEADDR,
+		    (char *) &on, sizeof (on));
+  if (err < 0)
+    syslog (LOG_ERR, "setsockopt (SO_REUSEADDR): %m");
+#ifdef WITH_ACCEPTORS
+  /* Every acceptor binds a socket of its own to the address.  */
+  if (service_acceptors (sep) > 1
+      && setsockopt (sep->se_fd, SOL_SOCKET, SO_REUSEPORT,
+		     (char *) &on, sizeof (on)) < 0)
+    syslog (LOG_ERR, "setsockopt (SO_REUSEPORT): %m");
+#endif
+
+  err = bind (sep->se_fd, (struct sockaddr *) &sep->se_ctrladdr,
 	      sep->se_addrlen);
   if (err < 0)
     {
@@ -679,8 +1384,7 @@ servent_setup (struct servtab *sep)
     {
       if (sep->se_socktype == SOCK_STREAM)
 	listen (sep->se_fd, 10);
-      FD_SET (sep->se_fd, &allsock);
-      nsock++;
+      sock_add (sep);
       if (sep->se_fd > maxsock)
 	maxsock = sep->se_fd;
       if (debug)
@@ -707,12 +1411,15 @@ close_sep (struct servtab *sep)
 {
   if (sep->se_fd >= 0)
     {
-      nsock--;
-      FD_CLR (sep->se_fd, &allsock);
+      sock_del (sep);
       close (sep->se_fd);
       sep->se_fd = -1;
     }
-  sep->se_count = 0;
+  if (sep->se_paused)
+    {
+      sep->se_paused = 0;
+      npaused--;
+    }
   /*
    * Don't keep the pid of this running deamon: when reapchild()
    * reaps this pid, it would erroneously increment nsock.
@@ -721,23 +1428,139 @@ close_sep (struct servtab *sep)
     sep->se_wait = 1;
 }
 
+unsigned
+string_hash (unsigned hash, const char *str)
+{
+  while (*str)
+    hash = hash * 31 + (unsigned char) *str++;
+  return hash;
+}
+
+/* Return the bucket of CP in servhash.  */
+unsigned
+serv_hash (struct servtab *cp)
+{
+  unsigned char *p = (unsigned char *) &cp->se_ctrladdr;
+  unsigned hash = ISMUX (cp);
+  size_t i;
+
+  for (i = 0; i < sizeof (cp->se_ctrladdr); i++)
+    hash = hash * 31 + p[i];
+  hash = string_hash (hash, cp->se_service);
+  hash = string_hash (hash, cp->se_proto);
+  return hash % SERV_HASH;
+}
+
+/* Return a copy of CP, with strings and arrays of its own.  */
 struct servtab *
-enter (struct servtab *cp)
+dup_servtab (struct servtab *cp)
 {
   struct servtab *sep;
-  SIGSTATUS sigstatus;
   size_t i;
 
-  /* Checking/Removing duplicates */
-  for (sep = servtab; sep; sep = sep->se_next)
+  sep = (struct servtab *) malloc (sizeof (*sep));
+  if (sep == NULL)
+    {
+      syslog (LOG_ERR, "Out of memory.");
+      exit (-1);
+    }
+  *sep = *cp;
+  dupstr (&sep->se_node);
+  dupstr (&sep->se_service);
+  dupstr (&sep->se_proto);
+  dupstr (&sep->se_user);
+  dupstr (&sep->se_group);
+  dupstr (&sep->se_server);
+  dupmem ((void**)&sep->se_argv, sep->se_argc * sizeof (sep->se_argv[0]));
+  for (i = 0; i < sep->se_argc; i++)
+    dupstr (&sep->se_argv[i]);
+  if (sep->se_groups)
+    dupmem ((void**)&sep->se_groups,
+	    sep->se_ngroups * sizeof (sep->se_groups[0]));
+  return sep;
+}
+
+/* Return true if the strings A and B, either of which may be NULL,
+   differ.  */
+bool
+strings_differ (const char *a, const char *b)
+{
+  return (a == NULL || b == NULL) ? a != b : strcmp (a, b) != 0;
+}
+
+/* Return true if the entry CP would be served otherwise than SEP,
+   which is the same service.  */
+bool
+service_differs (struct servtab *sep, struct servtab *cp)
+{
+  size_t i;
+
+  if (sep->se_type != cp->se_type || sep->se_bi != cp->se_bi
+      || (sep->se_wait != 0) != (cp->se_wait != 0)
+      || sep->se_max != cp->se_max || sep->se_maxchild != cp->se_maxchild
+      || sep->se_maxclient != cp->se_maxclient
+      || sep->se_acceptors != cp->se_acceptors
+      || sep->se_uid != cp->se_uid || sep->se_gid != cp->se_gid
+      || sep->se_ngroups != cp->se_ngroups
+      || (sep->se_ngroups
+	  && memcmp (sep->se_groups, cp->se_groups,
+		     sep->se_ngroups * sizeof (sep->se_groups[0])))
+      || strings_differ (sep->se_user, cp->se_user)
+      || strings_differ (sep->se_group, cp->se_group)
+      || strings_differ (sep->se_server, cp->se_server)
+      || sep->se_argc != cp->se_argc)
+    return true;
+  for (i = 0; i < sep->se_argc; i++)
+    if (strings_differ (sep->se_argv[i], cp->se_argv[i]))
+      return true;
+  return false;
+}
+
+/* Note that the workers which serve SEP must be replaced.  Every
+   worker keeps the entries of tcpmux.  */
+void
+workers_affected (struct servtab *sep)
+{
+  unsigned n = ISMUX (sep) ? MAXACCEPTORS : service_acceptors (sep);
+
+  if (n > workers_reach)
+    workers_reach = n;
+}
+
+/* Return the entry of servtab for the same service as CP, if any.  */
+struct servtab *
+find_service (struct servtab *cp)
+{
+  struct servtab *sep;
+
+  for (sep = servhash[serv_hash (cp)]; sep; sep = sep->se_hnext)
     if (memcmp (&sep->se_ctrladdr, &cp->se_ctrladdr,
 		sizeof (sep->se_ctrladdr)) == 0
 	&& strcmp (sep->se_service, cp->se_service) == 0
 	&& strcmp (sep->se_proto, cp->se_proto) == 0
 	&& ISMUX (sep) == ISMUX (cp))
       break;
+  return sep;
+}
+
+struct servtab *
+enter (struct servtab *cp)
+{
+  struct servtab *sep;
+  SIGSTATUS sigstatus;
+  unsigned hash = serv_hash (cp);
+
+  /* Checking/Removing duplicates */
+  sep = find_service (cp);
   if (sep != 0)
     {
+      bool shared = service_acceptors (sep) > 1;
+
+      if (service_differs (sep, cp))
+	{
+	  workers_affected (sep);
+	  workers_affected (cp);
+	}
       signal_block (&sigstatus);
       /*
        * sep->se_wait may be holding the pid of a daemon
@@ -747,6 +1570,15 @@ enter (struct servtab *cp)
        */
       if (cp->se_bi == 0 && (sep->se_wait == 1 || cp->se_wait == 0))
 	sep->se_wait = cp->se_wait;
+      sep->se_max = cp->se_max;
+      sep->se_maxchild = cp->se_maxchild;
+      sep->se_maxclient = cp->se_maxclient;
+      /* A socket to be shared by acceptors is bound anew.  One no
+	 longer shared is kept, as the workers still hold theirs.  */
+      if (sep->se_fd >= 0 && !shared && service_acceptors (cp) > 1)
+	close_sep (sep);
+      sep->se_acceptors = cp->se_acceptors;
+      service_resume (sep);
 #define SWAP(a, b) { char *c = a; a = b; b = c; }
       if (cp->se_user)
 	SWAP (sep->se_user, cp->se_user);
@@ -754,11 +1586,22 @@ enter (struct servtab *cp)
 	SWAP (sep->se_group, cp->se_group);
       if (cp->se_server)
 	SWAP (sep->se_server, cp->se_server);
+      sep->se_uid = cp->se_uid;
+      sep->se_gid = cp->se_gid;
+      free (sep->se_groups);
+      sep->se_groups = cp->se_groups;
+      sep->se_ngroups = cp->se_ngroups;
+      if (sep->se_groups)
+	dupmem ((void**)&sep->se_groups,
+		sep->se_ngroups * sizeof (sep->se_groups[0]));
       argcv_free (sep->se_argc, sep->se_argv);
       sep->se_argc = cp->se_argc;
       sep->se_argv = cp->se_argv;
       cp->se_argc = 0;
       cp->se_argv = NULL;
+      sep->se_file = cp->se_file;
+      sep->se_line = cp->se_line;
+      sep->se_conf = cp->se_conf;
       sep->se_checked = 1;
       signal_unblock (&sigstatus);
       if (debug)
@@ -768,28 +1611,16 @@ enter (struct servtab *cp)
 
   if (debug)
     print_service ("ADD ", cp);
+  workers_affected (cp);
 
-  sep = (struct servtab *) malloc (sizeof (*sep));
-  if (sep == NULL)
-    {
-      syslog (LOG_ERR, "Out of memory.");
-      exit (-1);
-    }
-  *sep = *cp;
-  dupstr (&sep->se_node);
-  dupstr (&sep->se_service);
-  dupstr (&sep->se_proto);
-  dupstr (&sep->se_user);
-  dupstr (&sep->se_group);
-  dupstr (&sep->se_server);
-  dupmem ((void**)&sep->se_argv, sep->se_argc * sizeof (sep->se_argv[0]));
-  for (i = 0; i < sep->se_argc; i++)
-    dupstr (&sep->se_argv[i]);
-
+  sep = dup_servtab (cp);
   sep->se_fd = -1;
+  sep->se_watched = 0;
   signal_block (&sigstatus);
   sep->se_next = servtab;
   servtab = sep;
+  sep->se_hnext = servhash[hash];
+  servhash[hash] = sep;
   signal_unblock (&sigstatus);
   return sep;
 }
@@ -840,13 +1671,20 @@ inetd_getaddrinfo (struct servtab *sep, int proto, struct addrinfo **result)
   return getaddrinfo (sep->se_node, sep->se_service, &hints, result);
 }
 
+/* Enter SEP into servtab, and open its socket.  */
+void
+add_service (struct servtab *sep)
+{
+  servent_setup (enter (sep));
+}
+
+/* Call ADD for SEP with each address of its node.  */
 int
-expand_enter (struct servtab *sep)
+expand_enter (struct servtab *sep, void (*add) (struct servtab *))
 {
   int err;
   struct addrinfo *result, *rp;
   struct protoent *proto;
-  struct servtab *cp;
 
   /* Make sure that tcp6 etc also work.  */
   if (strncmp (sep->se_proto, "tcp", 3) == 0)
@@ -905,8 +1743,7 @@ expand_enter (struct servtab *sep)
       memset (&sep->se_ctrladdr, 0, sizeof (sep->se_ctrladdr));
       memcpy (&sep->se_ctrladdr, rp->ai_addr, rp->ai_addrlen);
       sep->se_addrlen = rp->ai_addrlen;
-      cp = enter (sep);
-      servent_setup (cp);
+      add (sep);
     }
 
   freeaddrinfo (result);
@@ -945,7 +1782,9 @@ freeconfig (struct servtab *cp)
   free (cp->se_user);
   free (cp->se_group);
   free (cp->se_server);
+  free (cp->se_groups);
   argcv_free (cp->se_argc, cp->se_argv);
+  client_free (cp);
 }
 
 #define INETD_SERVICE      0	/* service name */
@@ -1155,7 +1994,14 @@ getconfigent (FILE *fconfig, const char *file, size_t *line)
 	  }
 	if (p)
 	  {
-	    sep->se_max = strtoul(p, &q, 10);
+	    /* Rate, running servers, rate per client, and acceptors.  */
+	    sep->se_max = strtoul (p, &q, 10);
+	    if (*q == '.')
+	      sep->se_maxchild = strtoul (q + 1, &q, 10);
+	    if (*q == '.')
+	      sep->se_maxclient = strtoul (q + 1, &q, 10);
+	    if (*q == '.')
+	      sep->se_acceptors = strtoul (q + 1, &q, 10);
 	    if (*q)
 	      syslog (LOG_WARNING, "%s:%lu: invalid number (%s)",
 		      file, (unsigned long) *line, p);
@@ -1254,53 +2100,238 @@ getconfigent (FILE *fconfig, const char *file, size_t *line)
   return next_node_sep (sep);
 }
 
+#ifdef HAVE_GETGROUPLIST
+/* Store the supplementary groups of USER in SEP, so that servers
+   need no lookup in the group database when they are started.  */
 void
-nextconfig (const char *file)
+get_groups (struct servtab *sep, const char *user)
+{
+  int n = 16;
+
+  for (;;)
+    {
+      int size = n;
+      gid_t *groups = malloc (size * sizeof (*groups));
+
+      if (groups == NULL)
+	return;
+      if (getgrouplist (user, sep->se_gid, groups, &n) >= 0)
+	{
+	  sep->se_groups = groups;
+	  sep->se_ngroups = n;
+	  return;
+	}
+      free (groups);
+      /* Systems not reporting the size needed get twice as much.  */
+      n = n > size ? n : 2 * size;
+      if (n > 65536)
+	return;
+    }
+}
+#endif
+
+/*
+ * Configuration files are remembered with the identity and time of
+ * modification they had when last read, and a reload parses only the
+ * files that have changed, or that had entries which failed.  Their
+ * entries are collected apart from servtab, while requests go on
+ * being served, and are then merged into it in a single step.
+ * Services that did not change keep their sockets.
+ */
+struct conffile
+{
+  char *cf_path;
+  dev_t cf_dev;
+  ino_t cf_ino;
+  off_t cf_size;
+  time_t cf_mtime, cf_ctime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+  long cf_mnsec;
+#endif
+  short cf_seen;		/* found by the current reload */
+  short cf_changed;		/* read by the current reload */
+  short cf_failed;		/* some entry could not be entered */
+  struct conffile *cf_next;
+};
+
+struct conffile *conffiles[CONF_HASH];
+
+void wait_events (int timeout, SIGSTATUS *mask);
+
+/* Entries read by the current reload, in order.  */
+struct servtab *staged, **staged_tail = &staged;
+
+/* Entries of files which did not change, staged again.  They are
+   merged first, so that their services stay with them.  */
+struct servtab *restaged, **restaged_tail = &restaged;
+
+/* Keep a copy of SEP until the reload is complete.  */
+void
+stage_service (struct servtab *sep)
+{
+  struct servtab *cp = dup_servtab (sep);
+
+  cp->se_next = NULL;
+  *staged_tail = cp;
+  staged_tail = &cp->se_next;
+}
+
+/* Look up the user and groups SEP is to be run with.  Return 0, or
+   -1 when the service is to be ignored.  */
+int
+service_credentials (struct servtab *sep)
+{
+  struct passwd *pwd;
+  struct group *grp = NULL;
+
+  pwd = getpwnam (sep->se_user);
+  if (pwd == NULL)
+    {
+      syslog (LOG_ERR, "%s/%s: No such user '%s', service ignored",
+	      sep->se_service, sep->se_proto, sep->se_user);
+      return -1;
+    }
+  if (sep->se_group && *sep->se_group)
+    {
+      grp = getgrnam (sep->se_group);
+      if (grp == NULL)
+	{
+	  syslog (LOG_ERR, "%s/%s: No such group '%s', service ignored",
+		  sep->se_service, sep->se_proto, sep->se_group);
+	  return -1;
+	}
+    }
+  sep->se_uid = pwd->pw_uid;
+  sep->se_gid = (grp && grp->gr_gid) ? grp->gr_gid : pwd->pw_gid;
+  free (sep->se_groups);
+  sep->se_groups = NULL;
+#ifdef HAVE_GETGROUPLIST
+  if (sep->se_uid)
+    get_groups (sep, pwd->pw_name);
+#endif
+  return 0;
+}
+
+/* Keep a copy of SEP, an entry of a file which did not change.  */
+void
+restage_service (struct servtab *sep)
+{
+  struct servtab *cp = dup_servtab (sep);
+
+  cp->se_next = NULL;
+  *restaged_tail = cp;
+  restaged_tail = &cp->se_next;
+}
+
+/* Return true if SEP and CP come from the same line, and only differ
+   by the address their node resolved to.  */
+bool
+same_line (struct servtab *sep, struct servtab *cp)
+{
+  return sep->se_conf == cp->se_conf && sep->se_line == cp->se_line
+    && sep->se_type == cp->se_type
+    && !strings_differ (sep->se_node, cp->se_node)
+    && strcmp (sep->se_service, cp->se_service) == 0
+    && strcmp (sep->se_proto, cp->se_proto) == 0;
+}
+
+/* Stage the entries in servtab of the file CF, which did not change,
+   without parsing it again.  Their users, groups and addresses are
+   looked up anew, as when the file is read.  */
+void
+restage_config (struct conffile *cf)
+{
+  struct servtab *sep, *np, tmp;
+
+  for (sep = servtab; sep; sep = sep->se_next)
+    sep->se_checked = 0;
+
+  for (sep = servtab; sep; sep = sep->se_next)
+    {
+      if (sep->se_conf != cf || sep->se_checked)
+	continue;
+      /* Each line is staged once, for all addresses of its node.  */
+      for (np = sep; np; np = np->se_next)
+	if (same_line (sep, np))
+	  np->se_checked = 1;
+
+      /* Only what was read from the file is taken over.  */
+      memset (&tmp, 0, sizeof (tmp));
+      tmp.se_kind = sep->se_kind;
+      tmp.se_file = sep->se_file;
+      tmp.se_line = sep->se_line;
+      tmp.se_conf = cf;
+      tmp.se_node = sep->se_node;
+      tmp.se_service = sep->se_service;
+      tmp.se_socktype = sep->se_socktype;
+      tmp.se_proto = sep->se_proto;
+      tmp.se_wait = sep->se_wait != 0;
+      tmp.se_max = sep->se_max;
+      tmp.se_maxchild = sep->se_maxchild;
+      tmp.se_maxclient = sep->se_maxclient;
+      tmp.se_acceptors = sep->se_acceptors;
+      tmp.se_user = sep->se_user;
+      tmp.se_group = sep->se_group;
+      tmp.se_bi = sep->se_bi;
+      tmp.se_server = sep->se_server;
+      tmp.se_argv = sep->se_argv;
+      tmp.se_argc = sep->se_argc;
+      tmp.se_fd = -1;
+      tmp.se_type = sep->se_type;
+      /* The family may have fallen back to IPv4 since.  */
+      tmp.se_family = AF_INET;
+#ifdef IPV6
+      if ((strncmp (tmp.se_proto, "tcp6", 4) == 0)
+	  || (strncmp (tmp.se_proto, "udp6", 4) == 0))
+	tmp.se_family = AF_INET6;
+#endif
+      tmp.se_v4mapped = sep->se_v4mapped;
+
+      if (service_credentials (&tmp))
+	cf->cf_failed = 1;
+      else if (ISMUX (&tmp))
+	restage_service (&tmp);
+      else if (expand_enter (&tmp, restage_service))
+	cf->cf_failed = 1;
+      free (tmp.se_groups);
+    }
+}
+
+/* Read the entries of the file CF.  */
+void
+nextconfig (struct conffile *cf)
 {
 #ifndef IPV6
   struct servent *sp;
 #endif
-  struct servtab *sep, **sepp;
-  struct passwd *pwd;
-  struct group *grp;
+  struct servtab *sep;
   FILE *fconfig;
-  SIGSTATUS sigstatus;
 
   size_t line = 0;
 
-  fconfig = setconfig (file);
+  cf->cf_failed = 0;
+  fconfig = setconfig (cf->cf_path);
   if (!fconfig)
     {
-      syslog (LOG_ERR, "%s: %m", file);
+      syslog (LOG_ERR, "%s: %m", cf->cf_path);
+      cf->cf_failed = 1;
       return;
     }
-  while ((sep = getconfigent (fconfig, file, &line)))
+  while ((sep = getconfigent (fconfig, cf->cf_path, &line)))
     {
-      pwd = getpwnam (sep->se_user);
-      if (pwd == NULL)
+      sep->se_conf = cf;
+      if (service_credentials (sep))
 	{
-	  syslog (LOG_ERR, "%s/%s: No such user '%s', service ignored",
-		  sep->se_service, sep->se_proto, sep->se_user);
+	  cf->cf_failed = 1;
 	  continue;
 	}
-      if (sep->se_group && *sep->se_group)
-	{
-	  grp = getgrnam (sep->se_group);
-	  if (grp == NULL)
-	    {
-	      syslog (LOG_ERR, "%s/%s: No such group '%s', service ignored",
-		      sep->se_service, sep->se_proto, sep->se_group);
-	      continue;
-	    }
-	}
       if (ISMUX (sep))
 	{
 	  sep->se_fd = -1;
-	  sep->se_checked = 1;
-	  enter (sep);
+	  stage_service (sep);
 	}
-      else
-	expand_enter (sep);
+      else if (expand_enter (sep, stage_service))
+	cf->cf_failed = 1;
 
       if (serv_node)
 	free (sep->se_node);
@@ -1308,27 +2339,52 @@ nextconfig (const char *file)
 	freeconfig (sep);
     }
   endconfig (fconfig);
-  /*
-   * Purge anything not looked at above.
-   */
-  signal_block (&sigstatus);
-  sepp = &servtab;
-  while ((sep = *sepp))
+}
+
+/* Return the bucket of the tcpmux service NAME in muxhash.  */
+unsigned
+mux_hash (const char *name)
+{
+  unsigned hash = 0;
+
+  while (*name)
+    hash = hash * 31 + tolower ((unsigned char) *name++);
+  return hash % MUX_HASH;
+}
+
+/* Rebuild muxhash from servtab.  Each chain keeps the order of
+   servtab, so the first of equal names is found.  */
+void
+tcpmux_index (void)
+{
+  struct servtab *sep, **tails[MUX_HASH];
+  unsigned hash;
+
+  for (hash = 0; hash < MUX_HASH; hash++)
     {
-      if (sep->se_checked)
-	{
-	  sepp = &sep->se_next;
-	  continue;
-	}
-      *sepp = sep->se_next;
-      if (sep->se_fd >= 0)
-	close_sep (sep);
-      if (debug)
-	print_service ("FREE", sep);
-      freeconfig (sep);
-      free (sep);
+      muxhash[hash] = NULL;
+      tails[hash] = &muxhash[hash];
     }
-  signal_unblock (&sigstatus);
+  for (sep = servtab; sep; sep = sep->se_next)
+    if (ISMUX (sep))
+      {
+	hash = mux_hash (sep->se_service);
+	sep->se_mnext = NULL;
+	*tails[hash] = sep;
+	tails[hash] = &sep->se_mnext;
+      }
+}
+
+/* Return the tcpmux service called NAME, or NULL.  */
+struct servtab *
+tcpmux_lookup (const char *name)
+{
+  struct servtab *sep;
+
+  for (sep = muxhash[mux_hash (name)]; sep; sep = sep->se_mnext)
+    if (strcasecmp (name, sep->se_service) == 0)
+      return sep;
+  return NULL;
 }
 
 void
@@ -1392,19 +2448,176 @@ fix_tcpmux (void)
       if (debug)
 	fprintf (stderr, "inserting default tcpmux entry\n");
       syslog (LOG_INFO, "inserting default tcpmux entry");
-      expand_enter (&serv);
+      expand_enter (&serv, add_service);
     }
 }
 
+/* Record the file PATH, with status ST, as part of the configuration,
+   and read it if it is new or has changed.  */
 void
-config (int signo)
+conf_file (const char *path, struct stat *st)
+{
+  unsigned hash = string_hash (0, path) % CONF_HASH;
+  struct conffile *cf;
+
+  for (cf = conffiles[hash]; cf; cf = cf->cf_next)
+    if (strcmp (cf->cf_path, path) == 0)
+      break;
+  if (cf == NULL)
+    {
+      cf = calloc (1, sizeof (*cf));
+      if (cf == NULL || (cf->cf_path = strdup (path)) == NULL)
+	{
+	  syslog (LOG_ERR, "Out of memory.");
+	  exit (-1);
+	}
+      cf->cf_next = conffiles[hash];
+      conffiles[hash] = cf;
+      cf->cf_changed = 1;
+    }
+  else if (cf->cf_seen)
+    return;			/* named twice */
+  else
+    cf->cf_changed = cf->cf_failed
+      || cf->cf_dev != st->st_dev || cf->cf_ino != st->st_ino
+      || cf->cf_size != st->st_size || cf->cf_mtime != st->st_mtime
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+      || cf->cf_mnsec != st->st_mtim.tv_nsec
+#endif
+      || cf->cf_ctime != st->st_ctime;
+
+  cf->cf_seen = 1;
+  cf->cf_dev = st->st_dev;
+  cf->cf_ino = st->st_ino;
+  cf->cf_size = st->st_size;
+  cf->cf_mtime = st->st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+  cf->cf_mnsec = st->st_mtim.tv_nsec;
+#endif
+  cf->cf_ctime = st->st_ctime;
+
+  if (cf->cf_changed)
+    {
+      if (debug)
+	fprintf (stderr, "reading %s\n", path);
+      nextconfig (cf);
+    }
+  else
+    restage_config (cf);
+  /* Serve the requests that arrived meanwhile.  */
+  wait_events (0, NULL);
+}
+
+/*
+ * Merge the staged entries into servtab, those of files that did not
+ * change first.  Entries not staged again are purged, along with the
+ * files that are gone.  A service belongs to a single file: an entry
+ * for one that another current file defines is ignored, and its file
+ * is read again on each reload, so that it takes over the service
+ * once the other file no longer defines it.  Return true if anything
+ * changed.
+ */
+bool
+config_commit (void)
 {
+  struct servtab *sep, *cp, **sepp, **hashp;
+  struct conffile *cf, **cfp;
+  SIGSTATUS sigstatus;
+  bool changed = staged != NULL;
   int i;
-  struct stat stats;
-  struct servtab *sep;
 
+  signal_block (&sigstatus);
+  /* Entries may be freed, so pending events are no longer valid.  */
+  config_gen++;
   for (sep = servtab; sep; sep = sep->se_next)
     sep->se_checked = 0;
+  if (restaged)
+    {
+      *restaged_tail = staged;
+      staged = restaged;
+      restaged = NULL;
+      restaged_tail = &restaged;
+    }
+
+  while ((cp = staged))
+    {
+      staged = cp->se_next;
+      sep = find_service (cp);
+      if (sep && sep->se_checked && sep->se_conf != cp->se_conf)
+	{
+	  syslog (LOG_ERR, "%s/%s: %s:%d: already defined at %s:%d, "
+		  "ignored", cp->se_service, cp->se_proto, cp->se_file,
+		  cp->se_line, sep->se_file, sep->se_line);
+	  cp->se_conf->cf_failed = 1;
+	}
+      else
+	{
+	  sep = enter (cp);
+	  if (ISMUX (sep))
+	    sep->se_checked = 1;
+	  else
+	    servent_setup (sep);
+	}
+      freeconfig (cp);
+      free (cp);
+    }
+  staged_tail = &staged;
+
+  fix_tcpmux ();
+
+  sepp = &servtab;
+  while ((sep = *sepp))
+    {
+      if (sep->se_checked)
+	{
+	  sepp = &sep->se_next;
+	  continue;
+	}
+      changed = true;
+      workers_affected (sep);
+      *sepp = sep->se_next;
+      for (hashp = &servhash[serv_hash (sep)]; *hashp != sep;
+	   hashp = &(*hashp)->se_hnext)
+	;
+      *hashp = sep->se_hnext;
+      if (sep->se_fd >= 0)
+	close_sep (sep);
+      child_forget (sep);
+      if (debug)
+	print_service ("FREE", sep);
+      freeconfig (sep);
+      free (sep);
+    }
+
+  for (i = 0; i < CONF_HASH; i++)
+    for (cfp = &conffiles[i]; (cf = *cfp); )
+      if (cf->cf_seen)
+	cfp = &cf->cf_next;
+      else
+	{
+	  *cfp = cf->cf_next;
+	  free (cf->cf_path);
+	  free (cf);
+	}
+
+  tcpmux_index ();
+  signal_unblock (&sigstatus);
+  return changed || workers_reach > 0;
+}
+
+/* Read the configuration files, on startup when SIGNO is 0.  Return
+   true if any service was added, changed or removed.  */
+bool
+config (int signo)
+{
+  int i;
+  struct stat stats;
+  struct conffile *cf;
+
+  workers_reach = 0;
+  for (i = 0; i < CONF_HASH; i++)
+    for (cf = conffiles[i]; cf; cf = cf->cf_next)
+      cf->cf_seen = 0;
 
   for (i = 0; config_files[i]; i++)
     {
@@ -1431,7 +2644,7 @@ config (int signo)
 			  if (stat (path, &stats) == 0
 			      && S_ISREG (stats.st_mode))
 			    {
-			      nextconfig (path);
+			      conf_file (path, &stats);
 			    }
 			  free (path);
 			}
@@ -1441,7 +2654,7 @@ config (int signo)
 	    }
 	  else if (S_ISREG (statbuf.st_mode))
 	    {
-	      nextconfig (config_files[i]);
+	      conf_file (config_files[i], &statbuf);
 	    }
 	}
       else
@@ -1458,7 +2671,7 @@ config (int signo)
   linebuf = NULL;
   linebufsize = 0;
 
-  fix_tcpmux ();
+  return config_commit ();
 }
 
 
@@ -1506,18 +2719,290 @@ set_proc_title (char *a, int s)
  */
 #define BUFSIZE	8192
 
-/* Echo service -- echo data back */
+/*
+ * The stream services echo, discard and chargen are served by the
+ * main loop, without a process per connection.  Each connection has
+ * a buffer, and makes progress whenever its socket is ready, so a
+ * slow peer holds up no other.  The open connections are kept in the
+ * order of their last progress; when max_conns are open, the one at
+ * the end, idle for the longest time, makes room for a new one.
+ */
+#define CONN_ECHO	0
+#define CONN_DISCARD	1
+#define CONN_CHARGEN	2
+
+#define CONN_IN		1	/* wait for input */
+#define CONN_OUT	2	/* wait for room to send */
+
+struct biconn
+{
+  int bc_kind;			/* WATCH_CONN */
+  int bc_fd;			/* connection, non-blocking */
+  int bc_type;			/* CONN_ECHO, CONN_DISCARD or CONN_CHARGEN */
+  int bc_events;		/* CONN_IN or CONN_OUT */
+  size_t bc_off, bc_len;	/* echo: unsent output in bc_buf;
+				   chargen: position in the cycle */
+  unsigned long long bc_bytes;	/* chargen and discard: data moved */
+  struct timeval bc_start;	/* time of connection */
+  struct sockaddr_storage bc_peer;	/* remote address */
+  socklen_t bc_peerlen;
+  struct biconn *bc_prev, *bc_next;
+  char bc_buf[BUFSIZE];
+};
+
+struct biconn *conns;		/* open connections, most active first */
+struct biconn *conns_last;	/* the least active one */
+struct biconn *free_conns;	/* closed ones, for reuse */
+unsigned nconns;
+
+void conn_close (struct biconn *c);
+ssize_t chargen_send (struct biconn *c);
+ssize_t discard_recv (struct biconn *c);
+
+/* Wait for EVENTS on the socket of C.  */
 void
-echo_stream (int s, struct servtab *sep)
+conn_watch (struct biconn *c, int events)
 {
-  char buffer[BUFSIZE];
-  int i;
+  if (events == c->bc_events)
+    return;
+#ifdef USE_EPOLL
+  if (epfd >= 0)
+    {
+      struct epoll_event ev;
+
+      memset (&ev, 0, sizeof (ev));
+      ev.events = (events == CONN_IN) ? EPOLLIN : EPOLLOUT;
+      ev.data.ptr = c;
+      epoll_ctl (epfd, c->bc_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+		 c->bc_fd, &ev);
+    }
+  else
+#endif
+  if (events == CONN_IN)
+    {
+      FD_CLR (c->bc_fd, &allwrite);
+      FD_SET (c->bc_fd, &allsock);
+    }
+  else
+    {
+      FD_CLR (c->bc_fd, &allsock);
+      FD_SET (c->bc_fd, &allwrite);
+    }
+  c->bc_events = events;
+}
+
+/* Put C at the head of the open connections.  */
+void
+conn_link (struct biconn *c)
+{
+  c->bc_prev = NULL;
+  c->bc_next = conns;
+  if (conns)
+    conns->bc_prev = c;
+  else
+    conns_last = c;
+  conns = c;
+}
+
+/* Take C out of the open connections.  */
+void
+conn_unlink (struct biconn *c)
+{
+  if (c->bc_prev)
+    c->bc_prev->bc_next = c->bc_next;
+  else
+    conns = c->bc_next;
+  if (c->bc_next)
+    c->bc_next->bc_prev = c->bc_prev;
+  else
+    conns_last = c->bc_prev;
+}
+
+/* Serve the connection FD by the main loop, as service TYPE.  */
+void
+conn_open (int fd, int type)
+{
+  struct biconn *c;
+
+#ifdef USE_EPOLL
+  if (epfd < 0)
+#endif
+    if (fd >= FD_SETSIZE)
+      {
+	if (debug)
+	  fprintf (stderr, "refused connection %d, %u open\n", fd, nconns);
+	close (fd);
+	return;
+      }
+
+  /* An event still pending for the connection closed here finds the
+     new one, whose socket is non-blocking.  */
+  if (nconns >= max_conns && conns_last)
+    {
+      if (debug)
+	fprintf (stderr, "closing idle connection %d for %d\n",
+		 conns_last->bc_fd, fd);
+      conn_close (conns_last);
+    }
+
+  c = free_conns;
+  if (c)
+    free_conns = c->bc_next;
+  else
+    {
+      c = malloc (sizeof (*c));
+      if (c == NULL)
+	{
+	  syslog (LOG_ERR, "Out of memory.");
+	  close (fd);
+	  return;
+	}
+    }
+
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+  fcntl (fd, F_SETFD, FD_CLOEXEC);
+  c->bc_kind = WATCH_CONN;
+  c->bc_fd = fd;
+  c->bc_type = type;
+  c->bc_events = 0;
+  c->bc_off = c->bc_len = 0;
+  c->bc_bytes = 0;
+  if (throughput_option)
+    {
+      gettimeofday (&c->bc_start, NULL);
+      /* Once the peer has gone, its address is no longer known.  */
+      c->bc_peerlen = sizeof (c->bc_peer);
+      if (getpeername (fd, (struct sockaddr *) &c->bc_peer,
+		       &c->bc_peerlen) < 0)
+	c->bc_peerlen = 0;
+    }
+  conn_link (c);
+  nconns++;
+  if (fd > maxsock)
+    maxsock = fd;
+
+  conn_watch (c, type == CONN_CHARGEN ? CONN_OUT : CONN_IN);
+}
+
+/* Log the amount of data moved on C, and its rate.  */
+void
+conn_report (struct biconn *c)
+{
+  struct timeval now;
+  char peer[NI_MAXHOST];
+  double secs;
+
+  gettimeofday (&now, NULL);
+  secs = (now.tv_sec - c->bc_start.tv_sec)
+    + (now.tv_usec - c->bc_start.tv_usec) / 1e6;
+  if (c->bc_peerlen == 0
+      || getnameinfo ((struct sockaddr *) &c->bc_peer, c->bc_peerlen,
+		      peer, sizeof (peer), NULL, 0, NI_NUMERICHOST))
+    strcpy (peer, "unknown");
+  syslog (LOG_INFO, "%s for %s: %llu bytes in %.3f s, %.0f bytes/s",
+	  c->bc_type == CONN_CHARGEN ? "chargen" : "discard", peer,
+	  c->bc_bytes, secs, secs > 0 ? c->bc_bytes / secs : 0.0);
+}
+
+void
+conn_close (struct biconn *c)
+{
+  if (throughput_option && c->bc_type != CONN_ECHO)
+    conn_report (c);
+#ifdef USE_EPOLL
+  if (epfd >= 0)
+    {
+      /* A child may still share the socket; see sock_del.  */
+      struct epoll_event ev;
+
+      memset (&ev, 0, sizeof (ev));
+      epoll_ctl (epfd, EPOLL_CTL_DEL, c->bc_fd, &ev);
+    }
+  else
+#endif
+    {
+      FD_CLR (c->bc_fd, &allsock);
+      FD_CLR (c->bc_fd, &allwrite);
+    }
+  close (c->bc_fd);
+
+  conn_unlink (c);
+  c->bc_next = free_conns;
+  free_conns = c;
+  nconns--;
+}
+
+/* Note progress on C, by moving it to the head of the list.  */
+void
+conn_touch (struct biconn *c)
+{
+  if (c != conns)
+    {
+      conn_unlink (c);
+      conn_link (c);
+    }
+}
+
+/* Make progress on the connection C, whose socket is ready.  For
+   echo, output that is not yet sent goes first, and meanwhile no
+   input is taken.  */
+void
+conn_event (struct biconn *c)
+{
+  ssize_t n;
+
+  if (c->bc_type != CONN_ECHO)
+    {
+      if (c->bc_type == CONN_CHARGEN)
+	n = chargen_send (c);
+      else
+	n = discard_recv (c);
+      if (n > 0)
+	{
+	  c->bc_bytes += n;
+	  conn_touch (c);
+	}
+      else if (n == 0 || (errno != EAGAIN && errno != EINTR))
+	conn_close (c);
+      return;
+    }
+
+  if (c->bc_off == c->bc_len)
+    {
+      n = read (c->bc_fd, c->bc_buf, sizeof (c->bc_buf));
+      if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+	{
+	  conn_close (c);
+	  return;
+	}
+      if (n > 0)
+	{
+	  c->bc_off = 0;
+	  c->bc_len = n;
+	  conn_touch (c);
+	}
+    }
+
+  if (c->bc_off < c->bc_len)
+    {
+      n = write (c->bc_fd, c->bc_buf + c->bc_off, c->bc_len - c->bc_off);
+      if (n < 0 && errno != EAGAIN && errno != EINTR)
+	{
+	  conn_close (c);
+	  return;
+	}
+      if (n > 0)
+	c->bc_off += n;
+    }
+
+  conn_watch (c, c->bc_off < c->bc_len ? CONN_OUT : CONN_IN);
+}
 
-  set_proc_title (sep->se_service, s);
-  while ((i = read (s, buffer, sizeof buffer)) > 0
-	 && write (s, buffer, i) > 0)
-    ;
-  exit (EXIT_SUCCESS);
+/* Echo service -- echo data back */
+void
+echo_stream (int s, struct servtab *sep MAYBE_UNUSED)
+{
+  conn_open (s, CONN_ECHO);
 }
 
 /* Echo service -- echo data back */
@@ -1540,22 +3025,97 @@ echo_dg (int s, struct servtab *sep MAYBE_UNUSED)
   sendto (s, buffer, i, 0, (struct sockaddr *) &sa, sizeof sa);
 }
 
-/* Discard service -- ignore data */
+/*
+ * Discarded data is read in large blocks into a buffer shared by all
+ * connections.  Where possible, it is instead moved by splice(2)
+ * through a pipe into the null device, and never copied to inetd.
+ */
+#define DISCARD_SIZE	(256 * 1024)
+
+char *discard_buf;
+#ifdef WITH_SPLICE
+int discard_pipe[2] = { -1, -1 };
+int discard_null = -1;
+
 void
-discard_stream (int s, struct servtab *sep)
+discard_nosplice (void)
 {
-  int ret;
-  char buffer[BUFSIZE];
+  close (discard_pipe[0]);
+  close (discard_pipe[1]);
+  close (discard_null);
+  discard_pipe[0] = discard_pipe[1] = discard_null = -1;
+}
+#endif
 
-  set_proc_title (sep->se_service, s);
-  while (1)
+/* Take the available data on C.  Return its amount, 0 at the end,
+   or -1 on error.  */
+ssize_t
+discard_recv (struct biconn *c)
+{
+  ssize_t n;
+
+#ifdef WITH_SPLICE
+  if (discard_null >= 0)
     {
-      while ((ret = read (s, buffer, sizeof buffer)) > 0)
-	;
-      if (ret == 0 || errno != EINTR)
-	break;
+      ssize_t left, m;
+
+      n = splice (c->bc_fd, NULL, discard_pipe[1], NULL, DISCARD_SIZE,
+		  SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n < 0 && errno == EINVAL)
+	discard_nosplice ();
+      else
+	{
+	  for (left = n; left > 0; left -= m)
+	    {
+	      m = splice (discard_pipe[0], NULL, discard_null, NULL, left,
+			  SPLICE_F_MOVE);
+	      if (m <= 0)
+		m = read (discard_pipe[0], discard_buf,
+			  left < DISCARD_SIZE ? left : DISCARD_SIZE);
+	      if (m <= 0)
+		{
+		  /* The pipe could not be emptied.  */
+		  discard_nosplice ();
+		  break;
+		}
+	    }
+	  return n;
+	}
+    }
+#endif
+  return read (c->bc_fd, discard_buf, DISCARD_SIZE);
+}
+
+/* Discard service -- ignore data */
+void
+discard_stream (int s, struct servtab *sep MAYBE_UNUSED)
+{
+  if (!discard_buf)
+    {
+      discard_buf = malloc (DISCARD_SIZE);
+      if (!discard_buf)
+	{
+	  syslog (LOG_ERR, "Out of memory.");
+	  close (s);
+	  return;
+	}
+#ifdef WITH_SPLICE
+      if (pipe (discard_pipe) == 0)
+	{
+	  fcntl (discard_pipe[0], F_SETFD, FD_CLOEXEC);
+	  fcntl (discard_pipe[1], F_SETFD, FD_CLOEXEC);
+# ifdef F_SETPIPE_SZ
+	  fcntl (discard_pipe[1], F_SETPIPE_SZ, DISCARD_SIZE);
+# endif
+	  discard_null = open ("/dev/null", O_WRONLY);
+	  if (discard_null >= 0)
+	    fcntl (discard_null, F_SETFD, FD_CLOEXEC);
+	  else
+	    discard_nosplice ();
+	}
+#endif
     }
-  exit (EXIT_SUCCESS);
+  conn_open (s, CONN_DISCARD);
 }
 
 void
@@ -1567,7 +3127,6 @@ discard_dg (int s, struct servtab *sep MAYBE_UNUSED)
   read (s, buffer, sizeof buffer);
 }
 
-#include <ctype.h>
 #define LINESIZ 72
 char ring[128];
 char *endring;
@@ -1584,39 +3143,108 @@ initring (void)
       *endring++ = i;
 }
 
-/* Character generator */
-void
-chargen_stream (int s, struct servtab *sep)
+/*
+ * Stream connections all send the same cycle of lines, each starting
+ * one character further in the ring.  The cycle is built once, and
+ * repeated so that at least CHARGEN_CHUNK bytes follow any position
+ * in it.  Where possible it is kept in a memory file, from which
+ * sendfile(2) passes it to the socket without a copy in inetd.
+ */
+#define CHARGEN_CHUNK	65536
+
+char *chargen_text;		/* the cycle, repeated */
+size_t chargen_cycle;		/* length of one cycle */
+size_t chargen_size;		/* length of chargen_text */
+#ifdef WITH_SENDFILE
+int chargen_fd = -1;		/* memory file with chargen_text */
+#endif
+
+int
+chargen_init (void)
 {
+  size_t nlines, i;
+  char *p, *rs;
   int len;
-  char *rs, text[LINESIZ + 2];
-
-  set_proc_title (sep->se_service, s);
 
   if (!endring)
+    initring ();
+  nlines = endring - ring;
+  chargen_cycle = nlines * (LINESIZ + 2);
+  chargen_size = chargen_cycle * (CHARGEN_CHUNK / chargen_cycle + 2);
+  chargen_text = malloc (chargen_size);
+  if (!chargen_text)
+    return -1;
+
+  for (p = chargen_text, i = 0; i < chargen_size / (LINESIZ + 2); i++)
     {
-      initring ();
-      rs = ring;
-    }
-
-  text[LINESIZ] = '\r';
-  text[LINESIZ + 1] = '\n';
-  for (rs = ring;;)
-    {
+      rs = ring + i % nlines;
       len = endring - rs;
       if (len >= LINESIZ)
-	memmove (text, rs, LINESIZ);
+	memcpy (p, rs, LINESIZ);
       else
 	{
-	  memmove (text, rs, len);
-	  memmove (text + len, ring, LINESIZ - len);
+	  memcpy (p, rs, len);
+	  memcpy (p + len, ring, LINESIZ - len);
 	}
-      if (++rs == endring)
-	rs = ring;
-      if (write (s, text, sizeof text) != sizeof text)
-	break;
+      p[LINESIZ] = '\r';
+      p[LINESIZ + 1] = '\n';
+      p += LINESIZ + 2;
+    }
+
+#if defined WITH_SENDFILE && defined HAVE_MEMFD_CREATE
+  chargen_fd = memfd_create ("chargen", MFD_CLOEXEC);
+  if (chargen_fd >= 0
+      && write (chargen_fd, chargen_text, chargen_size)
+	 != (ssize_t) chargen_size)
+    {
+      close (chargen_fd);
+      chargen_fd = -1;
+    }
+#endif
+  return 0;
+}
+
+/* Send the next part of the cycle on C.  Return the amount sent, or
+   -1 on error.  */
+ssize_t
+chargen_send (struct biconn *c)
+{
+  size_t len = chargen_size - c->bc_off;
+  ssize_t n = -1;
+  bool sent = false;
+
+#ifdef WITH_SENDFILE
+  if (chargen_fd >= 0)
+    {
+      off_t off = c->bc_off;
+
+      n = sendfile (c->bc_fd, chargen_fd, &off, len);
+      sent = n >= 0 || (errno != EINVAL && errno != ENOSYS);
+      if (!sent)
+	{
+	  close (chargen_fd);
+	  chargen_fd = -1;
+	}
+    }
+#endif
+  if (!sent)
+    n = write (c->bc_fd, chargen_text + c->bc_off, len);
+  if (n > 0)
+    c->bc_off = (c->bc_off + n) % chargen_cycle;
+  return n;
+}
+
+/* Character generator */
+void
+chargen_stream (int s, struct servtab *sep MAYBE_UNUSED)
+{
+  if (!chargen_text && chargen_init () < 0)
+    {
+      syslog (LOG_ERR, "Out of memory.");
+      close (s);
+      return;
     }
-  exit (EXIT_SUCCESS);
+  conn_open (s, CONN_CHARGEN);
 }
 
 /* Character generator */
@@ -1753,28 +3381,64 @@ daytime_dg (int s, struct servtab *sep MAYBE_UNUSED)
  */
 
 
-/* # of characters upto \r,\n or \0 */
+/* # of characters upto \r,\n or \0, read within TCPMUX_TIMEOUT
+   seconds.  The end of the line is found by peeking, so whatever
+   follows it is left to the server.  */
 static int
 fd_getline (int fd, char *buf, int len)
 {
-  int count = 0, n;
+  time_t deadline = time (NULL) + TCPMUX_TIMEOUT;
+  int flags = fcntl (fd, F_GETFL);
+  int count = 0, n, i;
+  struct pollfd pfd;
 
-  do
+  fcntl (fd, F_SETFL, flags | O_NONBLOCK);
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+
+  while (count < len)
     {
-      n = read (fd, buf, len - count);
+      n = recv (fd, buf + count, len - count, MSG_PEEK);
       if (n == 0)
-	return count;
+	break;
       if (n < 0)
-	return -1;
-      while (--n >= 0)
 	{
-	  if (*buf == '\r' || *buf == '\n' || *buf == '\0')
-	    return count;
-	  count++;
-	  buf++;
+	  if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+	    {
+	      i = deadline - time (NULL);
+	      if (i > 0 && (poll (&pfd, 1, i * 1000) > 0 || errno == EINTR))
+		continue;
+	    }
+	  count = -1;
+	  break;
+	}
+
+      for (i = 0; i < n; i++)
+	if (buf[count + i] == '\r' || buf[count + i] == '\n'
+	    || buf[count + i] == '\0')
+	  break;
+      if (i < n)
+	{
+	  /* Take the end of the line too, and LF after CR.  */
+	  if (buf[count + i] == '\r' && i + 1 < n
+	      && buf[count + i + 1] == '\n')
+	    n = i + 2;
+	  else
+	    n = i + 1;
+	  if (recv (fd, buf + count, n, 0) != n)
+	    count = -1;
+	  else
+	    count += i;
+	  break;
+	}
+      if (recv (fd, buf + count, n, 0) != n)
+	{
+	  count = -1;
+	  break;
 	}
+      count += n;
     }
-  while (count < len);
+  fcntl (fd, F_SETFL, flags);
   return count;
 }
 
@@ -1817,17 +3481,15 @@ tcpmux (int s, struct servtab *sep)
     }
 
   /* Try matching a service in inetd.conf with the request */
-  for (sep = servtab; sep; sep = sep->se_next)
+  sep = tcpmux_lookup (service);
+  if (sep)
     {
-      if (ISMUX (sep) && !strcasecmp (service, sep->se_service))
+      if (ISMUXPLUS (sep))
 	{
-	  if (ISMUXPLUS (sep))
-	    {
-	      strwrite (s, "+Go\r\n");
-	    }
-	  run_service (s, sep);
-	  return;
+	  strwrite (s, "+Go\r\n");
 	}
+      run_service (s, sep);
+      return;
     }
   strwrite (s, "-Service not available\r\n");
   exit (EXIT_FAILURE);
@@ -1920,13 +3582,418 @@ prepenv (int ctrl, struct sockaddr *sa_client, socklen_t sa_len)
 
 
 
+/*
+ * Handle a request arriving on the socket of SEP: accept a stream
+ * connection unless the service waits, and start the server.
+ */
+void
+serve (struct servtab *sep)
+{
+  int ctrl, dofork;
+  pid_t pid;
+  struct timeval now;
+  double wait;
+
+  if (sep->se_fd == -1)
+    return;
+  if (debug)
+    fprintf (stderr, "someone wants %s\n", sep->se_service);
+
+  /* Requests beyond the rate of the service wait on its socket.  */
+  dofork = (sep->se_bi == 0 || sep->se_bi->bi_fork);
+  if (dofork)
+    {
+      gettimeofday (&now, NULL);
+      wait = bucket_take (&sep->se_bucket, SE_RATE (sep), &now);
+      if (wait > 0)
+	{
+	  service_pause (sep, wait, &now);
+	  return;
+	}
+    }
+
+  if (!sep->se_wait && sep->se_socktype == SOCK_STREAM)
+    {
+#ifdef IPV6
+      struct sockaddr_storage sa_client;
+#else
+      struct sockaddr_in sa_client;
+#endif
+      socklen_t len = sizeof (sa_client);
+
+      ctrl = accept (sep->se_fd, (struct sockaddr *) &sa_client, &len);
+      if (debug)
+	fprintf (stderr, "accept, ctrl %d\n", ctrl);
+      if (ctrl < 0)
+	{
+	  if (errno != EINTR)
+	    syslog (LOG_WARNING, "accept (for %s): %m", sep->se_service);
+	  if (dofork)
+	    sep->se_bucket.bk_tokens++;
+	  return;
+	}
+      if (dofork && SE_CLIENTS (sep)
+	  && !client_take (sep, (struct sockaddr *) &sa_client, len, &now))
+	{
+	  /* A single client does not use up the rate of the service.  */
+	  sep->se_bucket.bk_tokens++;
+	  close (ctrl);
+	  return;
+	}
+      if (env_option)
+	prepenv (ctrl, (struct sockaddr *) &sa_client, len);
+    }
+  else
+    ctrl = sep->se_fd;
+
+  signal_block (NULL);
+  pid = 0;
+  if (dofork)
+    {
+#ifdef HAVE_POSIX_SPAWN
+      if (spawnable (sep))
+	{
+	  pid = spawn_service (ctrl, sep);
+	  if (pid < 0)
+	    {
+	      if (!sep->se_wait && sep->se_socktype == SOCK_STREAM)
+		close (ctrl);
+	      signal_unblock (NULL);
+	      return;
+	    }
+	}
+      else
+#endif
+	pid = fork ();
+    }
+  if (pid < 0)
+    {
+      syslog (LOG_ERR, "fork: %m");
+      if (!sep->se_wait && sep->se_socktype == SOCK_STREAM)
+	close (ctrl);
+      signal_unblock (NULL);
+      sleep (1);
+      return;
+    }
+  if (pid && sep->se_wait)
+    {
+      sep->se_wait = pid;
+      if (sep->se_fd >= 0)
+	sock_del (sep);
+    }
+  else if (pid > 0)
+    {
+      /* Further requests wait until a server exits.  */
+      child_add (pid, sep);
+      if (SE_CHILDREN (sep) && sep->se_children >= SE_CHILDREN (sep))
+	{
+	  sock_del (sep);
+	  if (service_warn (sep, &now))
+	    syslog (LOG_WARNING, "%s/%s: %u servers running, delayed",
+		    sep->se_service, sep->se_proto, sep->se_children);
+	}
+    }
+  signal_unblock (NULL);
+  if (pid == 0)
+    {
+      if (debug && dofork)
+	setsid ();
+      if (dofork)
+	{
+	  close_fds (ctrl);
+	  acceptor_unpin ();
+	}
+      run_service (ctrl, sep);
+    }
+  /* The main loop keeps connections of its own services.  */
+  if (!sep->se_wait && sep->se_socktype == SOCK_STREAM
+      && !(sep->se_bi && sep->se_bi->bi_loop))
+    close (ctrl);
+}
+
+/*
+ * Wait up to TIMEOUT milliseconds, or without limit when negative, for
+ * requests and connections, and handle them.  While waiting, the
+ * signal mask is MASK, unless it is NULL.
+ */
+void
+wait_events (int timeout, SIGSTATUS *mask)
+{
+  int n;
+  fd_set readable, writable;
+  struct servtab *sep;
+  struct biconn *c, *next;
+
+#ifdef USE_EPOLL
+  if (epfd >= 0)
+    {
+      struct epoll_event events[EPOLL_EVENTS];
+      sig_atomic_t gen = config_gen;
+      int i;
+
+      n = epoll_pwait (epfd, events, EPOLL_EVENTS, timeout, mask);
+      if (n == 0 || (n < 0 && errno == EINTR))
+	return;
+      if (n < 0)
+	{
+	  syslog (LOG_WARNING, "epoll_wait: %m");
+	  sleep (1);
+	  return;
+	}
+      /* After a reload, the remaining events are dropped; those
+	 still pending are reported again by the next call.  */
+      for (i = 0; i < n && gen == config_gen; i++)
+	if (*(int *) events[i].data.ptr == WATCH_CONN)
+	  conn_event (events[i].data.ptr);
+	else
+	  serve (events[i].data.ptr);
+      return;
+    }
+#endif
+  readable = allsock;
+  writable = allwrite;
+#if defined HAVE_PSELECT && defined HAVE_SIGACTION
+  {
+    struct timespec ts;
+
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = timeout % 1000 * 1000000L;
+    n = pselect (maxsock + 1, &readable, &writable, NULL,
+		 timeout < 0 ? NULL : &ts, mask);
+  }
+#else
+  {
+    struct timeval tv;
+
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = timeout % 1000 * 1000;
+    if (mask)
+      signal_unblock (mask);
+    n = select (maxsock + 1, &readable, &writable, NULL,
+		timeout < 0 ? NULL : &tv);
+  }
+#endif
+  if (n == 0 || (n < 0 && errno == EINTR))
+    return;
+  if (n < 0)
+    {
+      syslog (LOG_WARNING, "select: %m");
+      sleep (1);
+      return;
+    }
+  for (sep = servtab; n && sep; sep = sep->se_next)
+    if (sep->se_watched && FD_ISSET (sep->se_fd, &readable))
+      {
+	n--;
+	serve (sep);
+      }
+  for (c = conns; n && c; c = next)
+    {
+      next = c->bc_next;
+      if (FD_ISSET (c->bc_fd, &readable) || FD_ISSET (c->bc_fd, &writable))
+	{
+	  n--;
+	  conn_event (c);
+	}
+    }
+}
+
+/* Ask the main loop to reload the configuration.  */
+void
+request_reload (int signo MAYBE_UNUSED)
+{
+  reload_pending = 1;
+}
+
+/*
+ * A nowait stream service with more than one acceptor has a socket
+ * for each, all bound to its address with SO_REUSEPORT, so that the
+ * kernel spreads the connections over them.  inetd itself is acceptor
+ * 0, and the others are workers: copies of inetd which run the same
+ * main loop for the services with enough acceptors, with rate limits,
+ * clients, servers and built-in connections of their own.  Workers do
+ * not read the configuration, and are replaced after a reload which
+ * changed one of their services.
+ */
+
+/* Turn this new process into the acceptor K.  */
+void
+worker_init (unsigned k)
+{
+  struct servtab *sep, **sepp;
+  struct biconn *c;
+  struct child *ch;
+  int i;
+
+  worker = k;
+  signal_set_handler (SIGHUP, SIG_IGN);
+  signal_set_handler (SIGTERM, SIG_DFL);
+#if defined HAVE_SYS_PRCTL_H && defined PR_SET_PDEATHSIG
+  prctl (PR_SET_PDEATHSIG, SIGTERM);
+#endif
+  if (getppid () != inetd_pid)
+    _exit (EXIT_SUCCESS);
+  memset (workers, 0, sizeof (workers));
+  reload_pending = 0;
+  timingout = 0;
+  acceptor_pin (k);
+
+  /* Nothing watched by inetd is watched here.  */
+#ifdef USE_EPOLL
+  if (epfd >= 0)
+    {
+      close (epfd);
+      epfd = epoll_create1 (EPOLL_CLOEXEC);
+    }
+#endif
+  FD_ZERO (&allsock);
+  FD_ZERO (&allwrite);
+  nsock = 0;
+  npaused = 0;
+  while ((c = conns))
+    {
+      conns = c->bc_next;
+      close (c->bc_fd);
+      free (c);
+    }
+  conns_last = NULL;
+  nconns = 0;
+  for (i = 0; i < CHILD_HASH; i++)
+    while ((ch = children[i]))
+      {
+	children[i] = ch->ch_next;
+	free (ch);
+      }
+#ifdef WITH_SPLICE
+  if (discard_null >= 0)
+    discard_nosplice ();
+#endif
+  free (discard_buf);
+  discard_buf = NULL;
+
+  /* The entries of tcpmux are kept for its lookups.  */
+  memset (servhash, 0, sizeof (servhash));
+  sepp = &servtab;
+  while ((sep = *sepp))
+    {
+      if (sep->se_fd >= 0)
+	close (sep->se_fd);
+      sep->se_fd = -1;
+      sep->se_watched = 0;
+      sep->se_paused = 0;
+      sep->se_children = 0;
+      if (ISMUX (sep) || service_acceptors (sep) > k)
+	{
+	  memset (&sep->se_bucket, 0, sizeof (sep->se_bucket));
+	  client_free (sep);
+	  sepp = &sep->se_next;
+	}
+      else
+	{
+	  *sepp = sep->se_next;
+	  freeconfig (sep);
+	  free (sep);
+	}
+    }
+  for (sep = servtab; sep; sep = sep->se_next)
+    if (!ISMUX (sep))
+      servent_setup (sep);
+}
+
+/* Start the workers which are missing, except those which failed.  */
+void
+workers_start (void)
+{
+  struct servtab *sep;
+  SIGSTATUS sigstatus;
+  unsigned k, n = 1;
+  pid_t pid;
+
+  workers_lost = 0;
+  for (sep = servtab; sep; sep = sep->se_next)
+    if (sep->se_fd >= 0 && service_acceptors (sep) > n)
+      n = service_acceptors (sep);
+
+  for (k = 1; k < n; k++)
+    {
+      if (workers[k] || worker_failed[k])
+	continue;
+      signal_block (&sigstatus);
+      pid = fork ();
+      if (pid == 0)
+	{
+	  worker_init (k);
+	  signal_unblock (&sigstatus);
+	  return;
+	}
+      if (pid < 0)
+	syslog (LOG_ERR, "fork: %m");
+      else
+	{
+	  workers[k] = pid;
+	  worker_start[k] = time (NULL);
+	  if (debug)
+	    fprintf (stderr, "acceptor %u is process %d\n", k, (int) pid);
+	}
+      signal_unblock (&sigstatus);
+    }
+}
+
+/* After a reload, replace the workers whose services it changed, and
+   stop those no longer needed.  The others go on serving with their
+   sockets.  A new worker is started before the one it replaces is
+   stopped, so that the port keeps a socket listening; what is queued
+   on the socket of the old one is lost.  */
+void
+workers_reload (void)
+{
+  pid_t old[MAXACCEPTORS];
+  unsigned k;
+
+  for (k = 1; k < MAXACCEPTORS; k++)
+    {
+      old[k] = 0;
+      if (k < workers_reach)
+	{
+	  old[k] = workers[k];
+	  workers[k] = 0;
+	}
+      worker_failed[k] = 0;
+    }
+  workers_reach = 0;
+
+  workers_start ();
+  if (worker)
+    return;			/* in a new worker */
+
+  for (k = 1; k < MAXACCEPTORS; k++)
+    if (old[k])
+      {
+	if (debug)
+	  fprintf (stderr, "acceptor %u: replacing process %d\n", k,
+		   (int) old[k]);
+	kill (old[k], SIGTERM);
+      }
+}
+
+/* Take the workers along when inetd is terminated.  */
+void
+terminate (int signo)
+{
+  unsigned k;
+
+  if (getpid () == inetd_pid)
+    for (k = 1; k < MAXACCEPTORS; k++)
+      if (workers[k])
+	kill (workers[k], signo);
+  signal_set_handler (signo, SIG_DFL);
+  raise (signo);
+}
+
 int
 main (int argc, char *argv[], char *envp[])
 {
   int index;
-  struct servtab *sep;
-  int dofork;
-  pid_t pid;
 
   set_program_name (argv[0]);
 
@@ -1971,6 +4038,7 @@ main (int argc, char *argv[], char *envp[])
     }
 
   openlog ("inetd", LOG_PID | LOG_NOWAIT, LOG_DAEMON);
+  inetd_pid = getpid ();
 
   if (pidfile_option)
   {
@@ -1987,11 +4055,19 @@ main (int argc, char *argv[], char *envp[])
 	      strerror (errno));
   }
 
+#ifdef USE_EPOLL
+  epfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (epfd < 0 && debug)
+    fprintf (stderr, "epoll_create1: %s, using select\n", strerror (errno));
+#endif
+
   signal_set_handler (SIGALRM, retry);
   config (0);
-  signal_set_handler (SIGHUP, config);
+  signal_set_handler (SIGHUP, request_reload);
   signal_set_handler (SIGCHLD, reapchild);
   signal_set_handler (SIGPIPE, SIG_IGN);
+  signal_set_handler (SIGTERM, terminate);
+  workers_start ();
 
   {
     /* space for daemons to overwrite environment for ps */
@@ -2005,133 +4081,42 @@ main (int argc, char *argv[], char *envp[])
 
   for (;;)
     {
-      int n, ctrl;
-      fd_set readable;
+      int timeout;
+#ifdef HAVE_SIGACTION
+      sigset_t hup, waitmask;
+
+      /* A reload asked for after the check below interrupts the
+	 wait, during which SIGHUP is unblocked again.  */
+      sigemptyset (&hup);
+      sigaddset (&hup, SIGHUP);
+      sigprocmask (SIG_BLOCK, &hup, &waitmask);
+#endif
+      if (reload_pending)
+	{
+	  reload_pending = 0;
+	  if (config (SIGHUP))
+	    workers_reload ();
+	}
+      if (workers_lost)
+	workers_start ();
 
-      if (nsock == 0)
+      timeout = resume_services ();
+      if (nsock == 0 && nconns == 0 && timeout < 0)
 	{
 	  SIGSTATUS stat;
 	  sigstatus_empty (stat);
 
 	  signal_block (NULL);
-	  while (nsock == 0)
+	  while (nsock == 0 && nconns == 0 && npaused == 0 && !reload_pending)
 	    inetd_pause (stat);
 	  signal_unblock (NULL);
-	}
-      readable = allsock;
-      n = select (maxsock + 1, &readable, NULL, NULL, NULL);
-      if (n <= 0)
-	{
-	  if (n < 0 && errno != EINTR)
-	    syslog (LOG_WARNING, "select: %m");
-	  sleep (1);
 	  continue;
 	}
-      for (sep = servtab; n && sep; sep = sep->se_next)
-	if (sep->se_fd != -1 && FD_ISSET (sep->se_fd, &readable))
-	  {
-	    n--;
-	    if (debug)
-	      fprintf (stderr, "someone wants %s\n", sep->se_service);
-	    if (!sep->se_wait && sep->se_socktype == SOCK_STREAM)
-	      {
-#ifdef IPV6
-		struct sockaddr_storage sa_client;
+#ifdef HAVE_SIGACTION
+      wait_events (timeout, &waitmask);
+      sigprocmask (SIG_SETMASK, &waitmask, NULL);
 #else
-		struct sockaddr_in sa_client;
-#endif
-		socklen_t len = sizeof (sa_client);
-
-		ctrl = accept (sep->se_fd, (struct sockaddr *) &sa_client,
-			       &len);
-		if (debug)
-		  fprintf (stderr, "accept, ctrl %d\n", ctrl);
-		if (ctrl < 0)
-		  {
-		    if (errno != EINTR)
-		      syslog (LOG_WARNING, "accept (for %s): %m",
-			      sep->se_service);
-		    continue;
-		  }
-		if (env_option)
-		  prepenv (ctrl, (struct sockaddr *) &sa_client, len);
-	      }
-	    else
-	      ctrl = sep->se_fd;
-
-	    signal_block (NULL);
-	    pid = 0;
-	    dofork = (sep->se_bi == 0 || sep->se_bi->bi_fork);
-	    if (dofork)
-	      {
-		if (sep->se_count++ == 0)
-		  gettimeofday (&sep->se_time, NULL);
-		else if ((sep->se_max && sep->se_count > sep->se_max)
-			 || sep->se_count >= toomany)
-		  {
-		    struct timeval now;
-
-		    gettimeofday (&now, NULL);
-		    if (now.tv_sec - sep->se_time.tv_sec > CNT_INTVL)
-		      {
-			sep->se_time = now;
-			sep->se_count = 1;
-		      }
-		    else
-		      {
-			syslog (LOG_ERR,
-				"%s/%s server failing (looping), service terminated",
-				sep->se_service, sep->se_proto);
-			close_sep (sep);
-			if (! sep->se_wait && sep->se_socktype == SOCK_STREAM)
-			  close (ctrl);
-			signal_unblock (NULL);
-			if (!timingout)
-			  {
-			    timingout = 1;
-			    alarm (RETRYTIME);
-			  }
-			continue;
-		      }
-		  }
-		pid = fork ();
-	      }
-	    if (pid < 0)
-	      {
-		syslog (LOG_ERR, "fork: %m");
-		if (!sep->se_wait && sep->se_socktype == SOCK_STREAM)
-		  close (ctrl);
-		signal_unblock (NULL);
-		sleep (1);
-		continue;
-	      }
-	    if (pid && sep->se_wait)
-	      {
-		sep->se_wait = pid;
-		if (sep->se_fd >= 0)
-		  {
-		    FD_CLR (sep->se_fd, &allsock);
-		    nsock--;
-		  }
-	      }
-	    signal_unblock (NULL);
-	    if (pid == 0)
-	      {
-		if (debug && dofork)
-		  setsid ();
-		if (dofork)
-		  {
-		    int sock;
-		    if (debug)
-		      fprintf (stderr, "+ Closing from %d\n", maxsock);
-		    for (sock = maxsock; sock > 2; sock--)
-		      if (sock != ctrl)
-			close (sock);
-		  }
-		run_service (ctrl, sep);
-	      }
-	    if (!sep->se_wait && sep->se_socktype == SOCK_STREAM)
-	      close (ctrl);
-	  }
+      wait_events (timeout, NULL);
+#endif
     }
 }
@@ -59,6 +59,8 @@ static char *host = PATH_LOG;
 static char *unixsock = NULL;
 static char *source;
 static char *pidstr;
+static int use_tcp;		/* Send over a stream to a remote host.  */
+static int octet_count;		/* Frame stream messages by length.  */
 
 #if HAVE_IPV6
 static int host_family = AF_UNSPEC;
@@ -195,11 +197,12 @@ open_socket (void)
 	*p++ = 0;
 #endif /* !HAVE_IPV6 */
 
+      /* The service `syslog' is only known for UDP.  */
       if (!p)
-	p = "syslog";
+	p = use_tcp ? "514" : "syslog";
 
       memset (&hints, 0, sizeof (hints));
-      hints.ai_socktype = SOCK_DGRAM;
+      hints.ai_socktype = use_tcp ? SOCK_STREAM : SOCK_DGRAM;
 
       /* This falls back to AF_INET if compilation
        * was made with !HAVE_IPV6.  */
@@ -271,6 +274,9 @@ open_socket (void)
 
   /* Execution arrives here for AF_UNIX.  */
 
+  if (use_tcp)
+    error (EXIT_FAILURE, 0, "TCP needs a remote host");
+
   fd = socket (family, SOCK_DGRAM, 0);
   if (fd < 0)
     error (EXIT_FAILURE, errno, "cannot create socket");
@@ -316,6 +322,25 @@ send_to_syslog (const char *msg)
     error (EXIT_FAILURE, errno, "cannot format message");
   len = strlen (pbuf);
 
+  if (use_tcp)
+    {
+      /* A stream carries each message either behind its length and
+         a space, or terminated by a single newline.  */
+      char *frame;
+
+      while (len > 0 && pbuf[len - 1] == '\n')
+	pbuf[--len] = '\0';
+      if (octet_count)
+	rc = asprintf (&frame, "%lu %s", (unsigned long) len, pbuf);
+      else
+	rc = asprintf (&frame, "%s\n", pbuf);
+      if (rc == -1)
+	error (EXIT_FAILURE, errno, "cannot format message");
+      free (pbuf);
+      pbuf = frame;
+      len = rc;
+    }
+
 #ifdef LOG_PERROR
   if (logflags & LOG_PERROR)
     {
@@ -338,6 +363,18 @@ send_to_syslog (const char *msg)
 #endif /* LOG_PERROR */
 
   rc = send (fd, pbuf, len, 0);
+
+  /* A stream may take a message in several parts.  */
+  if (use_tcp)
+    {
+      size_t sent = 0;
+
+      while (rc > 0 && (sent += rc) < len)
+	rc = send (fd, pbuf + sent, len - sent, 0);
+      if (rc > 0)
+	rc = sent;
+    }
+
   free (pbuf);
   if (rc == -1)
     error (0, errno, "send failed");
@@ -347,6 +384,10 @@ send_to_syslog (const char *msg)
 }
 
 
+enum {
+  OPT_OCTET_COUNT = 256
+};
+
 const char args_doc[] = "[MESSAGE]";
 const char doc[] = "Send messages to syslog";
 
@@ -360,6 +401,10 @@ static struct argp_option argp_options[] = {
     "log to UNIX socket SOCK instead of " PATH_LOG, GRP },
   { "source", 'S', "IP", 0,
     "set source IP address", GRP },
+  { "tcp", 'T', NULL, 0, "log to HOST over TCP", GRP },
+  { "octet-count", OPT_OCTET_COUNT, NULL, 0,
+    "with TCP, precede each message by its length, instead of "
+    "ending it with a newline", GRP },
   { "id", 'i', "PID", OPTION_ARG_OPTIONAL,
     "log the process id with every line", GRP },
 #ifdef LOG_PERROR
@@ -408,6 +453,15 @@ parse_opt (int key, char *arg, struct argp_state *state MAYBE_UNUSED)
       source = arg;
       break;
 
+    case 'T':
+      use_tcp = 1;
+      break;
+
+    case OPT_OCTET_COUNT:
+      use_tcp = 1;
+      octet_count = 1;
+      break;
+
     case 'i':
       logflags |= LOG_PID;
       if (arg)
@@ -76,6 +76,8 @@
 #define DEFSPRI		(LOG_KERN|LOG_CRIT)
 #define TIMERINTVL	30	/* Interval for checking flush, mark.  */
 #define TTYMSGTIME      10	/* Time out passed to ttymsg.  */
+#define OBUFSIZE	(64 * 1024)	/* Output buffer of files and pipes.  */
+#define PIPE_RETRY	100	/* Milliseconds before a full pipe is retried.  */
 
 #include <sys/param.h>
 #include <sys/ioctl.h>
@@ -107,6 +109,12 @@
 #include <unistd.h>
 
 #include <stdarg.h>
+#include <stddef.h>
+
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+# define USE_THREADS 1
+#endif
 
 #define SYSLOG_NAMES
 #include <syslog.h>
@@ -155,6 +163,7 @@ char ctty[] = PATH_CONSOLE;	/* Default console to send message info.  */
 
 static int dbg_output;		/* If true, print debug output in debug mode.  */
 static int restart;		/* If 1, indicates SIGHUP was dropped.  */
+static volatile sig_atomic_t marking;	/* If 1, SIGALRM was dropped.  */
 
 /* Unix socket family to listen.  */
 struct funix
@@ -175,15 +184,32 @@ size_t nfunix;			/* Number of unix sockets in the funix array.  */
 #define MARK		0x008	/* This message is a mark.  */
 
 /* This structure represents the files that will have log copies
-   printed.  */
+   printed.  The fields examined for every message come first, so
+   that they share a cache line, followed by the state of duplicate
+   suppression, and then by what is only needed for output.  */
 
 struct filed
 {
   struct filed *f_next;		/* Next in linked list.  */
   short f_type;			/* Entry type, see below.  */
   short f_file;			/* File descriptor.  */
-  time_t f_time;		/* Time this was last written.  */
+  int f_flags;			/* Additional flags see below.  */
   unsigned char f_pmask[LOG_NFACILITIES + 1];	/* Priority mask.  */
+  int f_prognlen;		/* Length of the same.  */
+  char *f_progname;		/* Submitting program.  */
+  unsigned int f_seq;		/* Position in Files.  */
+  time_t f_time;		/* Time this was last written.  */
+
+  int f_prevlen;		/* Length of f_prevline.  */
+  unsigned int f_prevhash;	/* Hash of the same.  */
+  char *f_prevline;		/* Last message logged, with room for
+				   MAXSVLINE characters.  */
+  const char *f_prevhost;	/* Host from which recd, interned.  */
+  int f_prevpri;		/* Pri of f_prevline.  */
+  int f_prevcount;		/* Repetition cnt of prevline.  */
+  size_t f_repeatcount;		/* Number of "repeated" msgs.  */
+  char f_lasttime[16];		/* Time of last occurrence.  */
+
   union
   {
     struct
@@ -194,26 +220,61 @@ struct filed
     struct
     {
       char *f_hname;
+      char *f_port;		/* NULL for LogForwardPort.  */
       struct sockaddr_storage f_addr;
       socklen_t f_addrlen;
+      int f_stream;		/* Send over TCP.  */
+      struct fwdqueue *f_fq;	/* Messages not yet sent.  */
     } f_forw;			/* Forwarding address.  */
     char *f_fname;		/* Name use for Files|Pipes|TTYs.  */
   } f_un;
-  char f_prevline[MAXSVLINE];	/* Last message logged.  */
-  char f_lasttime[16];		/* Time of last occurrence.  */
-  char *f_prevhost;		/* Host from which recd.  */
-  char *f_progname;		/* Submitting program.  */
-  int f_prognlen;		/* Length of the same.  */
-  int f_prevpri;		/* Pri of f_prevline.  */
-  int f_prevlen;		/* Length of f_prevline.  */
-  int f_prevcount;		/* Repetition cnt of prevline.  */
-  size_t f_repeatcount;		/* Number of "repeated" msgs.  */
-  int f_flags;			/* Additional flags see below.  */
+  char *f_obuf;			/* Lines not yet written.  */
+  size_t f_olen;		/* Length of the same.  */
+  int f_osync;			/* Lines in F_OBUF asking for sync.  */
+  struct timeval f_odeadline;	/* Write F_OBUF by this time.  */
+  unsigned long f_odropped;	/* Lines dropped for a full pipe.  */
+  struct wqueue *f_queue;	/* Lines for the writer thread.  */
+  int f_unsynced;		/* Lines written, but not yet synced.  */
+  struct timeval f_unsynced_since;	/* Time of the first of them.  */
+  unsigned long f_syncs;	/* Number of syncs.  */
+  unsigned long f_synced;	/* Lines made durable by them.  */
+  double f_syncwait;		/* Total and maximal delay of durability  */
+  double f_syncmax;		/* of a line, in seconds.  */
 };
 
 struct filed *Files;		/* Linked list of files to log to.  */
+size_t NFiles;			/* When not zero, the entries of Files
+				   are an array of this length.  */
 struct filed consfile;		/* Console `file'.  */
 
+/* Index of the entries in Files, built by init() so that a message
+   is only offered to the entries which select it.  */
+
+#define DISPATCH_HASH	256	/* Buckets for program names.  */
+#define DISPATCH_MERGE	16	/* Lists merged for a single message.  */
+
+struct dispatch_prog
+{
+  struct dispatch_prog *dp_next;	/* Next in hash chain.  */
+  unsigned int dp_hash;
+  const char *dp_name;		/* Program selector.  */
+  int dp_len;
+  struct filed **dp_files;	/* NULL terminated, in order of Files.  */
+  size_t dp_count;		/* Length of the same.  */
+};
+
+struct dispatch
+{
+  /* Entries without program selector, for each facility and level.
+     Each list is NULL terminated and in order of Files.  */
+  struct filed **d_sel[LOG_NFACILITIES + 1][LOG_PRIMASK + 1];
+  struct dispatch_prog *d_prog[DISPATCH_HASH];
+  int d_maxlen;			/* Length of longest program name.  */
+  size_t d_nprogs;
+};
+
+struct dispatch *Dispatch;	/* Null while Files is being changed.  */
+
 /* Values for f_type.  */
 #define F_UNUSED	0	/* Unused entry.  */
 #define F_FILE		1	/* Regular file.  */
@@ -258,6 +319,29 @@ int repeatinterval[] = { 30, 60 };	/* Number of seconds before flush.  */
 				 (f)->f_repeatcount = MAXREPEAT; \
 			}
 
+/* Reverse lookups of remote senders are cached, successful ones for
+   DNS_POSITIVE_TTL seconds and failed ones for DNS_NEGATIVE_TTL.
+   At most DNS_CACHE_SIZE addresses are remembered, and no more than
+   DNS_QUEUE_MAX of them are waiting for a resolver at any time.  */
+#define DNS_CACHE_SIZE	1024
+#define DNS_HASH_SIZE	2048	/* A power of two.  */
+#define DNS_QUEUE_MAX	64
+#define DNS_POSITIVE_TTL 3600
+#define DNS_NEGATIVE_TTL 300
+
+/* Rate limits keep a token bucket for each of up to RATE_TABLE_SIZE
+   remote hosts, or programs, recycling the least recently used.
+   Suppressed messages are counted and reported every RATE_REPORT
+   seconds.  */
+#define RATE_TABLE_SIZE	4096
+#define RATE_HASH_SIZE	8192	/* A power of two.  */
+#define RATE_KEYLEN	64	/* Longer keys are cut.  */
+#define RATE_REPORT	10
+
+/* String hashing, FNV-1a.  */
+#define HASH_INIT	2166136261U
+#define HASH_STEP(h, c)	(((h) ^ (unsigned char) (c)) * 16777619U)
+
 /* Delimiter in arguments to command line options `-s' and `-l'.  */
 #define LIST_DELIMITER	':'
 
@@ -269,13 +353,46 @@ int decode (const char *, CODE *);
 void die (int);
 void doexit (int);
 void domark (int);
+static void mark_run (void);
 void find_inet_port (const char *);
 void fprintlog (struct filed *, const char *, int, const char *);
+static int buffer_filed (struct filed *, struct iovec *, int, int);
+static void flush_filed (struct filed *);
+static void drop_report (struct filed *);
+static int filed_error (struct filed *, int);
+static long sync_filed (struct filed *, int, int);
+static void sync_report (struct filed *);
+static void fwd_put (struct filed *, const char *, size_t);
+static long fwd_flush (struct filed *);
+static void fwd_stop (struct filed *);
+static void fwd_report (struct filed *);
+static int wqueue_put (struct filed *, struct iovec *, int, int);
+static void wqueue_check (struct filed *);
+static void wqueue_stop (struct filed *);
+static int flush_files (int);
+static void recv_batch (int, int);
 static int load_conffile (const char *, struct filed **);
 static int load_confdir (const char *, struct filed **);
 void init (int);
+static void dns_expire (void);
+static void dns_stats (void);
+static const char *host_intern (const char *);
+static void host_release (const char *);
+static const char *ctime_now (void);
+static struct ratelimit *rate_new (double, double);
+static int rate_source (const struct sockaddr *, socklen_t);
+static int rate_program (const char *, const char *);
+static long rate_flush (int);
 void logerror (const char *);
 void logmsg (int, const char *, const char *, int);
+static void logmsg_filed (struct filed *, int, const char *, int,
+			  const char *, int, const char *, unsigned int *);
+static unsigned int line_hash (const char *, int, unsigned int *);
+static struct filed *filed_compact (struct filed *, size_t *);
+static struct dispatch *dispatch_build (struct filed *);
+static int dispatch_lists (struct dispatch *, const char *, int, int,
+			   struct filed ***);
+static void dispatch_free (struct dispatch *);
 void printline (const char *, const char *);
 void printsys (const char *);
 char *ttymsg (struct iovec *, int, char *, int);
@@ -287,7 +404,11 @@ static void dbg_printf (const char *, ...);
 void trigger_restart (int);
 static void add_funix (const char *path);
 static int create_unix_socket (const char *path);
-static void create_inet_socket (int af, int fd46[2]);
+static void create_inet_socket (int af, int socktype, int fd46[2]);
+static int tcp_pollfds (struct pollfd *);
+static void tcp_accept (int);
+static void tcp_input (int);
+static void tcp_reap (void);
 
 char *LocalHostName;		/* Our hostname.  */
 char *LocalDomain;		/* Our local domain name.  */
@@ -304,11 +425,42 @@ int usefamily = AF_INET;	/* Address family for INET services.
 				 * Each of the values `AF_INET' and `AF_INET6'
 				 * produces a single-stacked server.  */
 int finet[2] = {-1, -1};	/* Internet datagram socket fd.  */
+int ftcp[2] = {-1, -1};		/* Internet stream listening socket fd.  */
 #define IU_FD_IP4	0	/* Indices for the address families.  */
 #define IU_FD_IP6	1
 int fklog = -1;			/* Kernel log device fd.  */
 char *LogPortText = NULL;	/* Service/port for INET connections.  */
 char *LogForwardPort = NULL;	/* Target port for message forwarding.  */
+int AcceptTcp;			/* Receive messages that come via TCP.  */
+char *TcpPortText = NULL;	/* Service/port for TCP, unless the same
+				   as for UDP.  */
+int ReusePort;			/* Let other processes share the ports.  */
+
+/* Connections on the TCP listeners.  Messages are framed either by
+   octet counting, a length and a space in front of each message, or
+   by a trailing LF, as described in RFC 6587.  Each frame is checked
+   for the method on its own.  When all slots are taken, the
+   connection which was quiet for the longest time makes room for a
+   new one, so idle peers cannot lock out the others.  */
+#define TCP_MAXCONN	256	/* Connections served at once.  */
+#define TCP_BUFSIZE	8192	/* Read buffer of each connection.  */
+
+struct tcpconn
+{
+  int c_fd;			/* -1 once closed.  */
+  struct sockaddr_storage c_addr;	/* Peer.  */
+  socklen_t c_addrlen;
+  size_t c_len;			/* Bytes in C_BUF.  */
+  size_t c_skip;		/* Bytes of a truncated frame to discard.  */
+  int c_skipline;		/* Discard up to the next LF.  */
+  int c_lf;			/* Messages have been framed by LF.  */
+  time_t c_last;		/* Time of the last input.  */
+  char c_buf[TCP_BUFSIZE];
+};
+
+static struct tcpconn *tcpconns[TCP_MAXCONN];
+static int ntcpconns;
+static void tcp_frames (struct tcpconn *, int);
 int Initialized;		/* True when we are initialized. */
 int MarkInterval = 20 * 60;	/* Interval between marks in seconds.  */
 int MarkSeq;			/* Mark sequence number.  */
@@ -327,6 +479,41 @@ time_t now;			/* Time use for mark and forward supending.  */
 int force_sync;			/* GNU/Linux behaviour to sync on every line.
 				   This off by default. Set to 1 to enable.  */
 int set_local_time = 0;		/* Record local time, not message time.  */
+int BatchSize = 32;		/* Datagrams taken from a socket at a time.
+				   Output to files is buffered unless 1.  */
+int FlushDelay = 0;		/* Maximal delay of buffered output, in
+				   milliseconds.  */
+int QueueSize = 0;		/* Lines queued for each writer thread.
+				   Zero means writing directly.  */
+int QueuePolicy;		/* What to do when a queue is full.  */
+#define QUEUE_BLOCK	0	/* Wait for the writer.  */
+#define QUEUE_DROP_OLDEST 1	/* Discard the oldest waiting line.  */
+#define QUEUE_DROP_NEW	2	/* Discard the new line.  */
+
+const char *QueuePolicyNames[] = { "block", "drop-oldest", "drop-new", NULL };
+
+int SyncInterval = 0;		/* Maximal delay of a sync, in milliseconds.
+				   Zero means syncing after each line.  */
+int SyncCount = 0;		/* Sync when this many lines wait for it.  */
+int SyncData;			/* Use fdatasync() instead of fsync().  */
+
+int ForwardQueue = 1024;	/* Messages held in memory for each host
+				   which is forwarded to.  */
+char *ForwardSpool = NULL;	/* Directory for spool files, if any.  */
+int ForwardSpoolSize = 10000;	/* Messages in each spool file.  */
+int fforw[2] = {-1, -1};	/* Forwarding sockets, when not finet.  */
+
+struct ratelimit;
+static struct ratelimit *SourceLimit;	/* Messages of each remote host.  */
+static struct ratelimit *ProgramLimit;	/* And of each program on a host.  */
+
+/* Buffers for batched reception.  */
+static char *rb_buf;
+#ifdef HAVE_RECVMMSG
+static struct mmsghdr *rb_msg;
+static struct iovec *rb_iov;
+static struct sockaddr_storage *rb_addr;
+#endif
 
 const char args_doc[] = "";
 const char doc[] = "Log system messages.";
@@ -336,7 +523,21 @@ enum {
   OPT_NO_FORWARD = 256,
   OPT_NO_KLOG,
   OPT_NO_UNIXAF,
-  OPT_IPANY
+  OPT_IPANY,
+  OPT_BATCH,
+  OPT_FLUSH_DELAY,
+  OPT_QUEUE,
+  OPT_QUEUE_POLICY,
+  OPT_SYNC_INTERVAL,
+  OPT_SYNC_COUNT,
+  OPT_SYNC_DATA,
+  OPT_TCP,
+  OPT_REUSEPORT,
+  OPT_FORWARD_QUEUE,
+  OPT_FORWARD_SPOOL,
+  OPT_FORWARD_SPOOL_SIZE,
+  OPT_RATE_LIMIT,
+  OPT_RATE_LIMIT_PROGRAM
 };
 
 static struct argp_option argp_options[] = {
@@ -356,11 +557,23 @@ static struct argp_option argp_options[] = {
   {"ipany", OPT_IPANY, NULL, 0, "allow transport with IPv4 and IPv6", GRP+1},
   {"bind", 'b', "ADDR", 0, "bind listener to this address/name", GRP+1},
   {"bind-port", 'B', "PORT", 0, "bind listener to this port", GRP+1},
+  {"tcp", OPT_TCP, "PORT", OPTION_ARG_OPTIONAL, "receive remote messages "
+   "also via TCP, on PORT or the port of --bind-port", GRP+1},
+#ifdef SO_REUSEPORT
+  {"reuseport", OPT_REUSEPORT, NULL, 0, "share the internet ports with "
+   "other processes", GRP+1},
+#endif
   {"mark", 'm', "INTVL", 0, "specify timestamp interval in minutes"
    " (0 for no timestamping)", GRP+1},
   {"no-detach", 'n', NULL, 0, "do not enter daemon mode", GRP+1},
   {"no-forward", OPT_NO_FORWARD, NULL, 0, "do not forward any messages "
    "(overrides --hop)", GRP+1},
+  {"forward-queue", OPT_FORWARD_QUEUE, "NUM", 0, "hold up to NUM messages "
+   "in memory for each remote host (default 1024)", GRP+1},
+  {"forward-spool", OPT_FORWARD_SPOOL, "DIR", 0, "when a forwarding queue "
+   "is full, keep further messages in a file in DIR", GRP+1},
+  {"forward-spool-size", OPT_FORWARD_SPOOL_SIZE, "NUM", 0, "spool up to NUM "
+   "messages for each remote host (default 10000)", GRP+1},
 #ifdef PATH_KLOG
   {"no-klog", OPT_NO_KLOG, NULL, 0, "do not listen to kernel log device "
    PATH_KLOG, GRP+1},
@@ -377,7 +590,35 @@ static struct argp_option argp_options[] = {
   {"socket", 'p', "FILE", 0, "override default unix domain socket " PATH_LOG,
    GRP+1},
   {"sync", 'S', NULL, 0, "force a file sync on every line", GRP+1},
+  {"sync-interval", OPT_SYNC_INTERVAL, "MSEC", 0, "sync a file at most "
+   "MSEC milliseconds after writing a line which asks for it (default 0, "
+   "at once)", GRP+1},
+  {"sync-count", OPT_SYNC_COUNT, "NUM", 0, "sync a file as soon as NUM "
+   "lines wait for it, even before the sync interval has passed", GRP+1},
+#ifdef HAVE_FDATASYNC
+  {"sync-data", OPT_SYNC_DATA, NULL, 0, "sync file data only, "
+   "with fdatasync()", GRP+1},
+#endif
   {"local-time", 'T', NULL, 0, "set local time on received messages", GRP+1},
+  {"rate-limit", OPT_RATE_LIMIT, "RATE[:BURST]", 0, "accept at most RATE "
+   "messages per second from each remote host, in bursts of up to BURST "
+   "(default RATE)", GRP+1},
+  {"rate-limit-program", OPT_RATE_LIMIT_PROGRAM, "RATE[:BURST]", 0,
+   "accept at most RATE messages per second from each program on a host",
+   GRP+1},
+  {"batch", OPT_BATCH, "NUM", 0, "receive up to NUM messages from a socket "
+   "at a time, and buffer output to files unless NUM is 1 (default 32)",
+   GRP+1},
+  {"flush-delay", OPT_FLUSH_DELAY, "MSEC", 0, "write buffered output to "
+   "files within MSEC milliseconds (default 0, at once after each batch)",
+   GRP+1},
+#ifdef USE_THREADS
+  {"queue", OPT_QUEUE, "NUM", 0, "queue up to NUM lines for each file, "
+   "pipe and terminal, to be written by a thread of its own (default 0, "
+   "no queue)", GRP+1},
+  {"queue-policy", OPT_QUEUE_POLICY, "POLICY", 0, "when a queue is full, "
+   "either block, drop-oldest, or drop-new (default block)", GRP+1},
+#endif
 #undef GRP
   {NULL, 0, NULL, 0, NULL, 0}
 };
@@ -435,6 +676,15 @@ parse_opt (int key, char *arg, struct argp_state *state)
       BindPort = arg;
       break;
 
+    case OPT_TCP:
+      AcceptTcp = 1;
+      TcpPortText = arg;
+      break;
+
+    case OPT_REUSEPORT:
+      ReusePort = 1;
+      break;
+
     case 'm':
       v = strtol (arg, &endptr, 10);
       if (*endptr)
@@ -483,6 +733,89 @@ parse_opt (int key, char *arg, struct argp_state *state)
       set_local_time = 1;
       break;
 
+    case OPT_BATCH:
+      v = strtol (arg, &endptr, 10);
+      if (*endptr || v < 1 || v > 1024)
+        argp_error (state, "invalid batch size: %s", arg);
+      BatchSize = v;
+      break;
+
+    case OPT_FLUSH_DELAY:
+      v = strtol (arg, &endptr, 10);
+      if (*endptr || v < 0 || v > 60000)
+        argp_error (state, "invalid flush delay: %s", arg);
+      FlushDelay = v;
+      break;
+
+    case OPT_SYNC_INTERVAL:
+      v = strtol (arg, &endptr, 10);
+      if (*endptr || v < 0 || v > 3600000)
+        argp_error (state, "invalid sync interval: %s", arg);
+      SyncInterval = v;
+      break;
+
+    case OPT_SYNC_COUNT:
+      v = strtol (arg, &endptr, 10);
+      if (*endptr || v < 0)
+        argp_error (state, "invalid sync count: %s", arg);
+      SyncCount = v;
+      break;
+
+    case OPT_SYNC_DATA:
+      SyncData = 1;
+      break;
+
+    case OPT_QUEUE:
+      v = strtol (arg, &endptr, 10);
+      if (*endptr || v < 0 || v > 1000000)
+        argp_error (state, "invalid queue size: %s", arg);
+      QueueSize = v;
+      break;
+
+    case OPT_FORWARD_QUEUE:
+      v = strtol (arg, &endptr, 10);
+      if (*endptr || v < 1 || v > 1000000)
+        argp_error (state, "invalid forwarding queue size: %s", arg);
+      ForwardQueue = v;
+      break;
+
+    case OPT_FORWARD_SPOOL:
+      ForwardSpool = arg;
+      break;
+
+    case OPT_FORWARD_SPOOL_SIZE:
+      v = strtol (arg, &endptr, 10);
+      if (*endptr || v < 1 || v > 100000000)
+        argp_error (state, "invalid spool size: %s", arg);
+      ForwardSpoolSize = v;
+      break;
+
+    case OPT_RATE_LIMIT:
+    case OPT_RATE_LIMIT_PROGRAM:
+      {
+	double rate, burst;
+
+	rate = burst = strtod (arg, &endptr);
+	if (*endptr == ':')
+	  burst = strtod (endptr + 1, &endptr);
+	if (*endptr || !(rate > 0) || !(burst >= 1))
+	  argp_error (state, "invalid rate limit: %s", arg);
+	if (key == OPT_RATE_LIMIT)
+	  SourceLimit = rate_new (rate, burst);
+	else
+	  ProgramLimit = rate_new (rate, burst);
+      }
+      break;
+
+    case OPT_QUEUE_POLICY:
+      for (v = 0; QueuePolicyNames[v]; v++)
+	if (strcmp (arg, QueuePolicyNames[v]) == 0)
+	  break;
+      if (QueuePolicyNames[v] == NULL)
+        argp_error (state, "invalid queue policy: %s", arg);
+      QueuePolicy = v;
+      break;
+
     default:
       return ARGP_ERR_UNKNOWN;
     }
@@ -499,12 +832,11 @@ main (int argc, char *argv[])
   size_t i;
   FILE *fp;
   char *p;
-  char line[MAXLINE + 1];
   char kline[MAXLINE + 1];
   int kline_len = 0;
   pid_t ppid = 0;		/* We run in debug mode and didn't fork.  */
   struct pollfd *fdarray;
-  unsigned long nfds = 0;
+  unsigned long nfds = 0, nbase;
 #ifdef HAVE_SIGACTION
   struct sigaction sa;
 #endif
@@ -605,14 +937,32 @@ main (int argc, char *argv[])
   signal (SIGALRM, domark);
   signal (SIGUSR1, NoDetach ? dbg_toggle : SIG_IGN);
 #endif
+#ifdef IGNORE_SIGPIPE
+  signal (SIGPIPE, SIG_IGN);
+#endif
 
   alarm (TIMERINTVL);
 
-  /* We add  3 = 1(klog) + 2(inet,inet6), even if they may stay unused.  */
-  fdarray = (struct pollfd *) malloc ((nfunix + 3) * sizeof (*fdarray));
+  /* We add  3 = 1(klog) + 2(inet,inet6), even if they may stay unused,
+     and the TCP listeners and connections when needed.  */
+  fdarray = (struct pollfd *) malloc ((nfunix + 3
+				       + (AcceptTcp ? 2 + TCP_MAXCONN : 0))
+				      * sizeof (*fdarray));
   if (fdarray == NULL)
     error (EXIT_FAILURE, errno, "can't allocate fd table");
 
+  /* Room for a batch of received datagrams.  */
+  rb_buf = malloc (BatchSize * (MAXLINE + 1));
+#ifdef HAVE_RECVMMSG
+  rb_msg = calloc (BatchSize, sizeof (*rb_msg));
+  rb_iov = calloc (BatchSize, sizeof (*rb_iov));
+  rb_addr = calloc (BatchSize, sizeof (*rb_addr));
+  if (rb_msg == NULL || rb_iov == NULL || rb_addr == NULL)
+    rb_buf = NULL;
+#endif
+  if (rb_buf == NULL)
+    error (EXIT_FAILURE, errno, "can't allocate receive buffers");
+
   /* read configuration file */
   init (0);
 
@@ -655,7 +1005,7 @@ main (int argc, char *argv[])
   /* Initialize inet socket and add it to the list.  */
   if (AcceptRemote)
     {
-      create_inet_socket (usefamily, finet);
+      create_inet_socket (usefamily, SOCK_DGRAM, finet);
       if (finet[IU_FD_IP4] >= 0)
 	{
 	  /* IPv4 socket is present.  */
@@ -676,6 +1026,23 @@ main (int argc, char *argv[])
 	dbg_printf ("Can't open UDP port: %s\n", strerror (errno));
     }
 
+  if (AcceptRemote && AcceptTcp)
+    {
+      create_inet_socket (usefamily, SOCK_STREAM, ftcp);
+      for (i = 0; i < 2; i++)
+	if (ftcp[i] >= 0)
+	  {
+	    fdarray[nfds].fd = ftcp[i];
+	    fdarray[nfds].events = POLLIN;
+	    nfds++;
+	    dbg_printf ("Opened syslog TCP/IPv%d port.\n",
+			i == IU_FD_IP4 ? 4 : 6);
+	  }
+      if (ftcp[IU_FD_IP4] < 0 && ftcp[IU_FD_IP6] < 0)
+	dbg_printf ("Can't open TCP port: %s\n", strerror (errno));
+    }
+  nbase = nfds;
+
   /* Tuck my process id away.  */
   fp = fopen (PidFile, "w");
   if (fp != NULL)
@@ -710,8 +1077,20 @@ main (int argc, char *argv[])
   for (;;)
     {
       int nready;
-      nready = poll (fdarray, nfds, -1);
-      if (nready == 0)		/* ??  noop */
+
+      /* Write out what is due, and wait at most until the next
+         buffered output must be written.  */
+      nfds = nbase + tcp_pollfds (fdarray + nbase);
+      nready = poll (fdarray, nfds, flush_files (0));
+
+      /* The timer went off.  */
+      if (marking)
+	{
+	  marking = 0;
+	  mark_run ();
+	}
+
+      if (nready == 0)
 	continue;
 
       /* Sighup was dropped.  */
@@ -733,10 +1112,15 @@ main (int argc, char *argv[])
       /*dbg_printf ("got a message (%d)\n", nready); */
 
       for (i = 0; i < nfds; i++)
-	if (fdarray[i].revents & (POLLIN | POLLPRI))
+	if (i >= nbase)
+	  {
+	    /* TCP connections follow all other descriptors.  */
+	    if (fdarray[i].revents)
+	      tcp_input (i - nbase);
+	  }
+	else if (fdarray[i].revents & (POLLIN | POLLPRI))
 	  {
 	    int result;
-	    socklen_t len;
 	    if (fdarray[i].fd == -1)
 	      continue;
 	    else if (fdarray[i].fd == fklog)
@@ -819,36 +1203,12 @@ main (int argc, char *argv[])
 	      }
 	    else if (fdarray[i].fd == finet[IU_FD_IP4]
 		     || fdarray[i].fd == finet[IU_FD_IP6])
-	      {
-		struct sockaddr_storage frominet;
-		/*dbg_printf ("inet message\n"); */
-		len = sizeof (frominet);
-		memset (line, '\0', sizeof (line));
-		result = recvfrom (fdarray[i].fd, line, MAXLINE, 0,
-				   (struct sockaddr *) &frominet, &len);
-		if (result > 0)
-		  {
-		    line[result] = '\0';
-		    printline (cvthname ((struct sockaddr *) &frominet, len), line);
-		  }
-		else if (result < 0 && errno != EINTR)
-		  logerror ("recvfrom inet");
-	      }
+	      recv_batch (fdarray[i].fd, 1);
+	    else if (fdarray[i].fd == ftcp[IU_FD_IP4]
+		     || fdarray[i].fd == ftcp[IU_FD_IP6])
+	      tcp_accept (fdarray[i].fd);
 	    else
-	      {
-		struct sockaddr_un fromunix;
-		/*dbg_printf ("unix message\n"); */
-		len = sizeof (fromunix);
-		result = recvfrom (fdarray[i].fd, line, MAXLINE, 0,
-				   (struct sockaddr *) &fromunix, &len);
-		if (result > 0)
-		  {
-		    line[result] = '\0';
-		    printline (LocalHostName, line);
-		  }
-		else if (result < 0 && errno != EINTR)
-		  logerror ("recvfrom unix");
-	      }
+	      recv_batch (fdarray[i].fd, 0);
 	  }
 	else if (fdarray[i].revents & POLLNVAL)
 	  {
@@ -859,13 +1219,330 @@ main (int argc, char *argv[])
 	  logerror ("poll err\n");
 	else if (fdarray[i].revents & POLLHUP)
 	  logerror ("poll hup\n");
+
+      tcp_reap ();
     }				/* for (;;) */
 }				/* main */
 
+/* Take up to BatchSize datagrams from the socket FD, which is an
+   Internet socket when INET is set, and log them.  A single call of
+   recvmmsg() suffices where available; otherwise further datagrams
+   are read until the socket would block.  */
+static void
+recv_batch (int fd, int inet)
+{
+  struct sockaddr_storage from;
+  socklen_t len;
+  ssize_t result;
+  char *line;
+  int n;
+
+#ifdef HAVE_RECVMMSG
+  if (BatchSize > 1)
+    {
+      int i;
+
+      for (i = 0; i < BatchSize; i++)
+	{
+	  rb_iov[i].iov_base = rb_buf + i * (MAXLINE + 1);
+	  rb_iov[i].iov_len = MAXLINE;
+	  memset (&rb_msg[i].msg_hdr, 0, sizeof (rb_msg[i].msg_hdr));
+	  rb_msg[i].msg_hdr.msg_name = &rb_addr[i];
+	  rb_msg[i].msg_hdr.msg_namelen = sizeof (rb_addr[i]);
+	  rb_msg[i].msg_hdr.msg_iov = &rb_iov[i];
+	  rb_msg[i].msg_hdr.msg_iovlen = 1;
+	}
+
+      n = recvmmsg (fd, rb_msg, BatchSize, MSG_DONTWAIT, NULL);
+      if (n < 0)
+	{
+	  if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+	    logerror (inet ? "recvmmsg inet" : "recvmmsg unix");
+	  return;
+	}
+
+      for (i = 0; i < n; i++)
+	{
+	  if (rb_msg[i].msg_len == 0)
+	    continue;
+	  line = rb_iov[i].iov_base;
+	  line[rb_msg[i].msg_len] = '\0';
+	  if (inet && SourceLimit
+	      && rate_source ((struct sockaddr *) &rb_addr[i],
+			      rb_msg[i].msg_hdr.msg_namelen))
+	    continue;
+	  if (inet)
+	    printline (cvthname ((struct sockaddr *) &rb_addr[i],
+				 rb_msg[i].msg_hdr.msg_namelen), line);
+	  else
+	    printline (LocalHostName, line);
+	}
+      return;
+    }
+#endif /* HAVE_RECVMMSG */
+
+  line = rb_buf;
+  for (n = 0; n < BatchSize; n++)
+    {
+      len = sizeof (from);
+      result = recvfrom (fd, line, MAXLINE, n ? MSG_DONTWAIT : 0,
+			 (struct sockaddr *) &from, &len);
+      if (result < 0)
+	{
+	  if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+	    logerror (inet ? "recvfrom inet" : "recvfrom unix");
+	  break;
+	}
+      if (result == 0)
+	continue;
+
+      line[result] = '\0';
+      if (inet && SourceLimit
+	  && rate_source ((struct sockaddr *) &from, len))
+	continue;
+      if (inet)
+	printline (cvthname ((struct sockaddr *) &from, len), line);
+      else
+	printline (LocalHostName, line);
+    }
+}
+
+/* Put the descriptors of the TCP connections into FDS, in the order
+   of tcpconns[], and return their number.  */
+static int
+tcp_pollfds (struct pollfd *fds)
+{
+  int i;
+
+  for (i = 0; i < ntcpconns; i++)
+    {
+      fds[i].fd = tcpconns[i]->c_fd;
+      fds[i].events = POLLIN;
+      fds[i].revents = 0;
+    }
+  return ntcpconns;
+}
+
+/* Accept a connection on the listening socket FD.  */
+static void
+tcp_accept (int fd)
+{
+  struct tcpconn *c;
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof (addr);
+  int cfd;
+
+  cfd = accept (fd, (struct sockaddr *) &addr, &len);
+  if (cfd < 0)
+    {
+      if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK
+	  && errno != ECONNABORTED)
+	logerror ("accept");
+      return;
+    }
+
+  if (ntcpconns == TCP_MAXCONN)
+    {
+      /* Take over the slot of the least recently active connection,
+         so that the order of tcpconns[] is kept for the poll loop.
+         Its stale events at most make a read fail with EAGAIN.  */
+      int i, oldest = -1;
+
+      for (i = 0; i < ntcpconns; i++)
+	if (tcpconns[i]->c_fd < 0)
+	  {
+	    oldest = i;
+	    break;
+	  }
+	else if (oldest < 0
+		 || tcpconns[i]->c_last < tcpconns[oldest]->c_last)
+	  oldest = i;
+
+      c = tcpconns[oldest];
+      if (c->c_fd >= 0)
+	{
+	  dbg_printf ("Closing idle TCP connection from %s.\n",
+		      cvthname ((struct sockaddr *) &c->c_addr,
+				c->c_addrlen));
+	  tcp_frames (c, 1);
+	  close (c->c_fd);
+	}
+    }
+  else if ((c = malloc (sizeof (*c))) == NULL)
+    {
+      dbg_printf ("Refusing TCP connection from %s.\n",
+		  cvthname ((struct sockaddr *) &addr, len));
+      close (cfd);
+      return;
+    }
+  else
+    tcpconns[ntcpconns++] = c;
+
+  fcntl (cfd, F_SETFL, O_NONBLOCK);
+  c->c_fd = cfd;
+  memcpy (&c->c_addr, &addr, len);
+  c->c_addrlen = len;
+  c->c_len = c->c_skip = 0;
+  c->c_skipline = c->c_lf = 0;
+  c->c_last = time (NULL);
+
+  dbg_printf ("TCP connection from %s.\n",
+	      cvthname ((struct sockaddr *) &addr, len));
+}
+
+/* Log the message of LEN bytes at MSG, which came over C.  */
+static void
+tcp_deliver (struct tcpconn *c, const char *msg, size_t len)
+{
+  char line[MAXLINE + 1];
+
+  if (SourceLimit
+      && rate_source ((struct sockaddr *) &c->c_addr, c->c_addrlen))
+    return;
+
+  if (len > MAXLINE)
+    len = MAXLINE;
+  memcpy (line, msg, len);
+  line[len] = '\0';
+  printline (cvthname ((struct sockaddr *) &c->c_addr, c->c_addrlen), line);
+}
+
+/* Log every complete frame in the buffer of C, and keep what remains
+   of an incomplete one.  At end of file, also a last message without
+   its LF is logged.  A frame is taken for octet counting only when
+   its digits are followed by a space, and the sender has not yet
+   framed a message by LF.  */
+static void
+tcp_frames (struct tcpconn *c, int eof)
+{
+  char *p = c->c_buf, *end = c->c_buf + c->c_len, *q;
+  size_t n;
+
+  while (p < end)
+    {
+      if (c->c_skip)
+	{
+	  n = end - p < c->c_skip ? end - p : c->c_skip;
+	  p += n;
+	  c->c_skip -= n;
+	  continue;
+	}
+
+      if (c->c_skipline)
+	{
+	  q = memchr (p, '\n', end - p);
+	  p = q ? q + 1 : end;
+	  c->c_skipline = !q;
+	  continue;
+	}
+
+      if (!c->c_lf && isdigit ((unsigned char) *p))
+	{
+	  /* Octet counting: MSG-LEN SP SYSLOG-MSG.  */
+	  for (n = 0, q = p; q < end && isdigit ((unsigned char) *q); q++)
+	    n = 10 * n + (*q - '0');
+	  if (q == end && q - p <= 9 && !eof)
+	    break;		/* Need more.  */
+	}
+      else
+	q = p;
+
+      if (q < end && q > p && q - p <= 9 && *q == ' ')
+	{
+	  q++;
+
+	  /* A message longer than a line is cut.  */
+	  if ((size_t) (end - q) < (n < MAXLINE ? n : MAXLINE))
+	    break;
+	  if (n > 0)
+	    tcp_deliver (c, q, n);
+	  if (n > MAXLINE)
+	    {
+	      c->c_skip = n - MAXLINE;
+	      n = MAXLINE;
+	    }
+	  p = q + n;
+	}
+      else
+	{
+	  /* Non-transparent framing by LF.  */
+	  c->c_lf = 1;
+	  q = memchr (p, '\n', end - p);
+	  if (q == NULL && (eof || end - p >= MAXLINE))
+	    {
+	      /* Cut an overlong line, and drop the rest of it.  */
+	      tcp_deliver (c, p, end - p);
+	      c->c_skipline = !eof;
+	      p = end;
+	      continue;
+	    }
+	  if (q == NULL)
+	    break;		/* Need more.  */
+	  n = q - p;
+	  if (n > 0 && p[n - 1] == '\r')
+	    n--;
+	  if (n > 0)
+	    tcp_deliver (c, p, n);
+	  p = q + 1;
+	}
+    }
+
+  c->c_len = end - p;
+  if (c->c_len && p != c->c_buf)
+    memmove (c->c_buf, p, c->c_len);
+}
+
+/* Read what has arrived on connection number I, and log the complete
+   messages.  The connection is closed at end of file or on error.  */
+static void
+tcp_input (int i)
+{
+  struct tcpconn *c = tcpconns[i];
+  ssize_t n;
+
+  n = read (c->c_fd, c->c_buf + c->c_len, TCP_BUFSIZE - c->c_len);
+  if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+
+  if (n > 0)
+    {
+      c->c_len += n;
+      c->c_last = time (NULL);
+      tcp_frames (c, 0);
+      return;
+    }
+  else if (n == 0)
+    tcp_frames (c, 1);
+  else
+    dbg_printf ("TCP read error: %s\n", strerror (errno));
+
+  close (c->c_fd);
+  c->c_fd = -1;
+}
+
+/* Release the connections which were closed.  */
+static void
+tcp_reap (void)
+{
+  int i, j;
+
+  for (i = j = 0; i < ntcpconns; i++)
+    if (tcpconns[i]->c_fd < 0)
+      free (tcpconns[i]);
+    else
+      tcpconns[j++] = tcpconns[i];
+  ntcpconns = j;
+}
+
 #ifndef SUN_LEN
 # define SUN_LEN(unp) (strlen((unp)->sun_path) + 3)
 #endif
 
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL	0
+# define IGNORE_SIGPIPE	1	/* Lost connections of forwarding.  */
+#endif
+
 static void
 add_funix (const char *name)
 {
@@ -913,16 +1590,22 @@ create_unix_socket (const char *path)
   return fd;
 }
 
+/* Open the listening sockets of type SOCKTYPE, for datagrams or for
+   streams, and store them in FD46.  */
 static void
-create_inet_socket (int af, int fd46[2])
+create_inet_socket (int af, int socktype, int fd46[2])
 {
   int err, fd = -1;
   struct addrinfo hints, *rp, *ai;
+  const char *port = LogPortText;
 
   /* Invalidate old descriptors.  */
   fd46[IU_FD_IP4] = fd46[IU_FD_IP6] = -1;
 
-  if (!LogPortText)
+  if (socktype == SOCK_STREAM && TcpPortText)
+    port = TcpPortText;
+
+  if (!port)
     {
       dbg_printf ("No listen port has been accepted.\n");
       return;
@@ -930,10 +1613,17 @@ create_inet_socket (int af, int fd46[2])
 
   memset (&hints, 0, sizeof (hints));
   hints.ai_family = af;
-  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_socktype = socktype;
   hints.ai_flags = AI_PASSIVE;
 
-  err = getaddrinfo (BindAddress, LogPortText, &hints, &rp);
+  err = getaddrinfo (BindAddress, port, &hints, &rp);
+  if (err == EAI_SERVICE && socktype == SOCK_STREAM)
+    {
+      /* The service `syslog' is only known for UDP.  Take the same
+         port number for TCP.  */
+      hints.ai_socktype = SOCK_DGRAM;
+      err = getaddrinfo (BindAddress, port, &hints, &rp);
+    }
   if (err)
     {
       logerror ("lookup error, suspending inet service");
@@ -944,7 +1634,7 @@ create_inet_socket (int af, int fd46[2])
     {
       int yes = 1;
 
-      fd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      fd = socket (ai->ai_family, socktype, 0);
       if (fd < 0)
 	continue;
 
@@ -952,13 +1642,24 @@ create_inet_socket (int af, int fd46[2])
       if (err < 0)
 	logerror ("failed to set SO_REUSEADDR");
 
+#ifdef SO_REUSEPORT
+      /* The kernel spreads datagrams and connections over all
+         processes which listen on the port.  */
+      if (ReusePort
+	  && setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof (yes)) < 0)
+	logerror ("failed to set SO_REUSEPORT");
+#endif
+
       if (ai->ai_family == AF_INET6)
 	{
 	  /* Avoid dual stacked sockets.  Better to use distinct sockets.  */
 	  (void) setsockopt (fd, IPPROTO_IPV6, IPV6_V6ONLY, &yes, sizeof (yes));
 	}
 
-      if (bind (fd, ai->ai_addr, ai->ai_addrlen) < 0)
+      if (bind (fd, ai->ai_addr, ai->ai_addrlen) < 0
+	  || (socktype == SOCK_STREAM
+	      && (listen (fd, SOMAXCONN) < 0
+		  || fcntl (fd, F_SETFL, O_NONBLOCK) < 0)))
 	{
 	  close (fd);
 	  fd = -1;
@@ -1084,6 +1785,9 @@ printline (const char *hname, const char *msg)
   if (LOG_FAC (pri) == (LOG_KERN >> 3))
     pri = LOG_MAKEPRI (LOG_USER, LOG_PRI (pri));
 
+  if (ProgramLimit && rate_program (hname, p))
+    return;
+
   q = line;
   while ((c = *p++) != '\0' && q < &line[sizeof (line) - 1])
     if (iscntrl (c))
@@ -1171,7 +1875,9 @@ void
 logmsg (int pri, const char *msg, const char *from, int flags)
 {
   struct filed *f;
-  int fac, msglen, prilev;
+  struct filed **lists[DISPATCH_MERGE];
+  int fac, msglen, prilev, nlists = -1, i, k;
+  unsigned int hash = 0;	/* Of the message, once needed.  */
 #ifdef HAVE_SIGACTION
   sigset_t sigs, osigs;
 #else
@@ -1200,11 +1906,11 @@ logmsg (int pri, const char *msg, const char *from, int flags)
 
   time (&now);
   if (flags & ADDDATE)
-    timestamp = ctime (&now) + 4;
+    timestamp = ctime_now () + 4;
   else
     {
       if (set_local_time)
-	timestamp = ctime (&now) + 4;
+	timestamp = ctime_now () + 4;
       else
 	timestamp = msg;
       msg += 16;
@@ -1227,7 +1933,8 @@ logmsg (int pri, const char *msg, const char *from, int flags)
     {
       f = &consfile;
       f->f_file = open (ctty, O_WRONLY, 0);
-      f->f_prevhost = strdup (LocalHostName);
+      host_release (f->f_prevhost);
+      f->f_prevhost = host_intern (LocalHostName);
       if (f->f_file >= 0)
 	{
 	  fprintlog (f, from, flags, msg);
@@ -1240,85 +1947,137 @@ logmsg (int pri, const char *msg, const char *from, int flags)
 #endif
       return;
     }
-  for (f = Files; f; f = f->f_next)
+  if (Dispatch)
+    nlists = dispatch_lists (Dispatch, msg, fac, prilev, lists);
+  if (nlists > 0)
     {
-      /* Skip messages that are incorrect priority. */
-      if (!(f->f_pmask[fac] & LOG_MASK (prilev)))
-	continue;
-
-      if (f->f_type == F_CONSOLE && (flags & IGN_CONS))
-	continue;
-
-      /* Don't output marks to recently written files.  */
-      if ((flags & MARK) && (now - f->f_time) < MarkInterval / 2)
-	continue;
-
-      if (f->f_progname)
+      /* Merge the lists, so that entries are written in the order
+         of the configuration.  */
+      for (;;)
 	{
-	  /* The usual, and desirable, formattings are:
-	   *
-	   *   prg: message text
-	   *   prg[PIDNO]: message text
-	   */
+	  for (k = -1, i = 0; i < nlists; i++)
+	    if (*lists[i]
+		&& (k < 0 || (*lists[i])->f_seq < (*lists[k])->f_seq))
+	      k = i;
+	  if (k < 0)
+	    break;
+	  f = *lists[k]++;
+	  if (f->f_pmask[fac] & LOG_MASK (prilev))
+	    logmsg_filed (f, pri, msg, msglen, from, flags, timestamp, &hash);
+	}
+    }
+  else
+    for (f = Files; f; f = f->f_next)
+      {
+	/* Skip messages that are incorrect priority. */
+	if (!(f->f_pmask[fac] & LOG_MASK (prilev)))
+	  continue;
 
-	  /* Skip on selector mismatch.  */
-	  if (strncmp (msg, f->f_progname, f->f_prognlen))
-	    continue;
+	if (f->f_progname)
+	  {
+	    /* Skip on selector mismatch.  */
+	    if (strncmp (msg, f->f_progname, f->f_prognlen))
+	      continue;
 
-	  /* Avoid matching on prefixes.  */
-	  if (isalnum (msg[f->f_prognlen])
-	      || msg[f->f_prognlen] == '-'
-	      || msg[f->f_prognlen] == '_')
-	    continue;
-	}
+	    /* Avoid matching on prefixes.  */
+	    if (isalnum (msg[f->f_prognlen])
+		|| msg[f->f_prognlen] == '-'
+		|| msg[f->f_prognlen] == '_')
+	      continue;
+	  }
 
-      /* Suppress duplicate lines to this file.  */
-      if ((flags & MARK) == 0 && msglen == f->f_prevlen && f->f_prevhost
-	  && !strcmp (msg, f->f_prevline) && !strcmp (from, f->f_prevhost))
+	logmsg_filed (f, pri, msg, msglen, from, flags, timestamp, &hash);
+      }
+#ifdef HAVE_SIGACTION
+  sigprocmask (SIG_SETMASK, &osigs, 0);
+#else
+  sigsetmask (omask);
+#endif
+}
+
+/* Return the hash of the LEN characters at S, never zero.  The value
+   is cached in *HASH, which must be zero on the first call.  */
+static unsigned int
+line_hash (const char *s, int len, unsigned int *hash)
+{
+  unsigned int h = HASH_INIT;
+
+  if (*hash == 0)
+    {
+      while (len-- > 0)
+	h = HASH_STEP (h, *s++);
+      *hash = h ? h : 1;
+    }
+  return *hash;
+}
+
+/* Log the message MSG of length MSGLEN, with priority PRI, FROM a
+   host, to the selected entry F.  The hash of MSG is kept in *HASH,
+   and shared between entries.  */
+static void
+logmsg_filed (struct filed *f, int pri, const char *msg, int msglen,
+	      const char *from, int flags, const char *timestamp,
+	      unsigned int *hash)
+{
+  if (f->f_type == F_CONSOLE && (flags & IGN_CONS))
+    return;
+
+  /* Don't output marks to recently written files.  */
+  if ((flags & MARK) && (now - f->f_time) < MarkInterval / 2)
+    return;
+
+  /* Suppress duplicate lines to this file.  Only when the length
+     is equal are the hashes compared, and only when these are equal
+     the lines themselves.  */
+  if ((flags & MARK) == 0 && msglen == f->f_prevlen && f->f_prevhost
+      && f->f_prevline
+      && line_hash (msg, msglen, hash) == f->f_prevhash
+      && !memcmp (msg, f->f_prevline, msglen)
+      && !strcmp (from, f->f_prevhost))
+    {
+      strncpy (f->f_lasttime, timestamp, sizeof (f->f_lasttime) - 1);
+      f->f_prevcount++;
+      dbg_printf ("msg repeated %d times, %ld sec of %d\n",
+		  f->f_prevcount, now - f->f_time,
+		  repeatinterval[f->f_repeatcount]);
+      /* If domark would have logged this by now, flush it now (so we
+         don't hold isolated messages), but back off so we'll flush
+         less often in the future.  */
+      if (now > REPEATTIME (f))
 	{
-	  strncpy (f->f_lasttime, timestamp, sizeof (f->f_lasttime) - 1);
-	  f->f_prevcount++;
-	  dbg_printf ("msg repeated %d times, %ld sec of %d\n",
-		      f->f_prevcount, now - f->f_time,
-		      repeatinterval[f->f_repeatcount]);
-	  /* If domark would have logged this by now, flush it now (so we
-	     don't hold isolated messages), but back off so we'll flush
-	     less often in the future.  */
-	  if (now > REPEATTIME (f))
-	    {
-	      fprintlog (f, from, flags, (char *) NULL);
-	      BACKOFF (f);
-	    }
+	  fprintlog (f, from, flags, (char *) NULL);
+	  BACKOFF (f);
+	}
+    }
+  else
+    {
+      /* New line, save it.  */
+      if (f->f_prevcount)
+	fprintlog (f, from, 0, (char *) NULL);
+      f->f_repeatcount = 0;
+      strncpy (f->f_lasttime, timestamp, sizeof (f->f_lasttime) - 1);
+      if (f->f_prevhost == NULL || strcmp (from, f->f_prevhost))
+	{
+	  host_release (f->f_prevhost);
+	  f->f_prevhost = host_intern (from);
+	}
+      if (msglen < MAXSVLINE && f->f_prevline == NULL)
+	f->f_prevline = malloc (MAXSVLINE);
+      if (msglen < MAXSVLINE && f->f_prevline)
+	{
+	  f->f_prevlen = msglen;
+	  f->f_prevhash = line_hash (msg, msglen, hash);
+	  f->f_prevpri = pri;
+	  memcpy (f->f_prevline, msg, msglen + 1);
+	  fprintlog (f, from, flags, (char *) NULL);
 	}
       else
 	{
-	  /* New line, save it.  */
-	  if (f->f_prevcount)
-	    fprintlog (f, from, 0, (char *) NULL);
-	  f->f_repeatcount = 0;
-	  strncpy (f->f_lasttime, timestamp, sizeof (f->f_lasttime) - 1);
-	  free (f->f_prevhost);
-	  f->f_prevhost = strdup (from);
-	  if (msglen < MAXSVLINE)
-	    {
-	      f->f_prevlen = msglen;
-	      f->f_prevpri = pri;
-	      strcpy (f->f_prevline, msg);
-	      fprintlog (f, from, flags, (char *) NULL);
-	    }
-	  else
-	    {
-	      f->f_prevline[0] = 0;
-	      f->f_prevlen = 0;
-	      fprintlog (f, from, flags, msg);
-	    }
+	  f->f_prevlen = 0;
+	  f->f_prevhash = 0;
+	  fprintlog (f, from, flags, msg);
 	}
     }
-#ifdef HAVE_SIGACTION
-  sigprocmask (SIG_SETMASK, &osigs, 0);
-#else
-  sigsetmask (omask);
-#endif
 }
 
 void
@@ -1338,7 +2097,7 @@ fprintlog (struct filed *f, const char *from, int flags, const char *msg)
       v->iov_base = greetings;
       snprintf (greetings, sizeof (greetings),
 		"\r\n\7Message from syslogd@%s at %.24s ...\r\n",
-		f->f_prevhost, ctime (&now));
+		f->f_prevhost, ctime_now ());
       v->iov_len = strlen (greetings);
       v++;
       v->iov_base = (char *) "";
@@ -1356,7 +2115,7 @@ fprintlog (struct filed *f, const char *from, int flags, const char *msg)
     }
   if (f->f_prevhost)
     {
-      v->iov_base = f->f_prevhost;
+      v->iov_base = (char *) f->f_prevhost;
       v->iov_len = strlen (v->iov_base);
       v++;
     }
@@ -1392,22 +2151,6 @@ fprintlog (struct filed *f, const char *from, int flags, const char *msg)
       dbg_printf ("\n");
       break;
 
-    case F_FORW_SUSP:
-      fwd_suspend = time ((time_t *) 0) - f->f_time;
-      if (fwd_suspend >= INET_SUSPEND_TIME)
-	{
-	  dbg_printf ("\nForwarding suspension over, retrying FORW ");
-	  f->f_type = F_FORW;
-	  goto f_forw;
-	}
-      else
-	{
-	  dbg_printf (" %s\n", f->f_un.f_forw.f_hname);
-	  dbg_printf ("Forwarding suspension not over, time left: %d.\n",
-		      INET_SUSPEND_TIME - fwd_suspend);
-	}
-      break;
-
     case F_FORW_UNKN:
       dbg_printf (" %s\n", f->f_un.f_forw.f_hname);
       fwd_suspend = time ((time_t *) 0) - f->f_time;
@@ -1422,17 +2165,21 @@ fprintlog (struct filed *f, const char *from, int flags, const char *msg)
 	  if (usefamily == AF_UNSPEC)
 	    hints.ai_flags |= AI_ADDRCONFIG;
 #endif
-	  err = getaddrinfo (f->f_un.f_forw.f_hname, LogForwardPort,
-			     &hints, &rp);
+	  err = getaddrinfo (f->f_un.f_forw.f_hname,
+			     f->f_un.f_forw.f_port ? f->f_un.f_forw.f_port
+			     : LogForwardPort, &hints, &rp);
 	  if (err)
 	    {
 	      dbg_printf ("Failure: %s\n", gai_strerror (err));
 	      dbg_printf ("Retries: %d\n", f->f_prevcount);
+	      f->f_time = time ((time_t *) 0);
 	      if (--f->f_prevcount < 0)
 		{
+		  fwd_stop (f);
 		  f->f_type = F_UNUSED;
 		  free (f->f_un.f_forw.f_hname);
 		  f->f_un.f_forw.f_hname = NULL;
+		  break;
 		}
 	    }
 	  else
@@ -1443,90 +2190,37 @@ fprintlog (struct filed *f, const char *from, int flags, const char *msg)
 	      freeaddrinfo (rp);
 	      f->f_prevcount = 0;
 	      f->f_type = F_FORW;
-	      goto f_forw;
 	    }
 	}
       else
 	dbg_printf ("Forwarding suspension not over, time left: %d\n",
 		    INET_SUSPEND_TIME - fwd_suspend);
-      break;
+      /* Messages wait in the queue until the host is known.  */
+      goto f_forw;
 
+    case F_FORW_SUSP:
     case F_FORW:
-    f_forw:
       dbg_printf (" %s\n", f->f_un.f_forw.f_hname);
+    f_forw:
       if (strcasecmp (from, LocalHostName) && NoHops)
 	dbg_printf ("Not forwarding remote message.\n");
       else if (NoForward)
 	dbg_printf ("Not forwarding because forwarding is disabled.\n");
       else
 	{
-	  int temp_finet, *pfinet;	/* PFINET points to active fd.  */
-
-	  if (f->f_un.f_forw.f_addr.ss_family == AF_INET)
-	    pfinet = &finet[IU_FD_IP4];
-	  else	/* AF_INET6 */
-	    pfinet = &finet[IU_FD_IP6];
-
-	  temp_finet = *pfinet;
-
-	  if (temp_finet < 0)
-	    {
-	      int err;
-	      struct addrinfo hints, *rp;
-
-	      /* Forwarding needs a temporary socket.
-	       * The source port is fixed!  */
-	      memset (&hints, 0, sizeof (hints));
-	      hints.ai_family = f->f_un.f_forw.f_addr.ss_family;
-	      hints.ai_socktype = SOCK_DGRAM;
-	      hints.ai_flags = AI_PASSIVE;
-
-	      err = getaddrinfo (NULL, LogForwardPort, &hints, &rp);
-	      if (err)
-		{
-		  dbg_printf ("Not forwarding due to lookup failure: %s.\n",
-			      gai_strerror(err));
-		  break;
-		}
-	      temp_finet = socket (rp->ai_family, rp->ai_socktype,
-				   rp->ai_protocol);
-	      if (temp_finet < 0)
-		{
-		  dbg_printf ("Not forwarding due to socket failure.\n");
-		  freeaddrinfo (rp);
-		  break;
-		}
-
-	      err = bind (temp_finet, rp->ai_addr, rp->ai_addrlen);
-	      freeaddrinfo (rp);
-	      if (err)
-		{
-		  dbg_printf ("Not forwarding due to bind error: %s.\n",
-			      strerror (errno));
-		  break;
-		}
-	    } /* Creation of temporary outgoing socket since "finet < 0" */
-
-	  f->f_time = now;
+	  if (f->f_type == F_FORW)
+	    f->f_time = now;
 	  snprintf (line, sizeof (line), "<%d>%.15s %s",
 		    f->f_prevpri, (char *) iov[0].iov_base,
 		    (char *) iov[4].iov_base);
 	  l = strlen (line);
 	  if (l > MAXLINE)
 	    l = MAXLINE;
-	  if (sendto (temp_finet, line, l, 0,
-		      (struct sockaddr *) &f->f_un.f_forw.f_addr,
-		      f->f_un.f_forw.f_addrlen) != l)
-	    {
-	      int e = errno;
-	      dbg_printf ("INET sendto error: %d = %s.\n", e, strerror (e));
-	      f->f_type = F_FORW_SUSP;
-	      errno = e;
-	      logerror ("sendto");
-	    }
 
-	  if (*pfinet < 0)
-	    close (temp_finet);	/* Only temporary socket may be closed.  */
+	  /* Messages are sent after each batch, or at once.  */
+	  fwd_put (f, line, l);
+	  if (BatchSize <= 1)
+	    fwd_flush (f);
 	}
       break;
 
@@ -1553,126 +2247,2121 @@ fprintlog (struct filed *f, const char *from, int flags, const char *msg)
 	  v->iov_base = (char *) "\n";
 	  v->iov_len = 1;
 	}
+      if (QueueSize > 0 && wqueue_put (f, iov, IOVCNT, flags) == 0)
+	break;
+      if (BatchSize > 1 && (f->f_type == F_FILE || f->f_type == F_PIPE)
+	  && buffer_filed (f, iov, IOVCNT, flags) == 0)
+	break;
     again:
       if (writev (f->f_file, iov, IOVCNT) < 0)
 	{
-	  int e = errno;
+	  if (filed_error (f, errno))
+	    goto again;
+	}
+      else
+	{
+	  if ((flags & SYNC_FILE) && !(f->f_flags & OMIT_SYNC))
+	    sync_filed (f, 1, 0);
+	  drop_report (f);
+	}
+      break;
 
-	  /* XXX: If a named pipe is full, ignore it.  */
-	  if (f->f_type == F_PIPE && e == EAGAIN)
-	    break;
+    case F_USERS:
+    case F_WALL:
+      f->f_time = now;
+      dbg_printf ("\n");
+      v->iov_base = (char *) "\r\n";
+      v->iov_len = 2;
+      wallmsg (f, iov);
+      break;
+    }
+
+  if (f->f_type != F_FORW_UNKN)
+    f->f_prevcount = 0;
+}
+
+/* Let the buffered output of F be written within MS milliseconds.  */
+static void
+flush_deadline (struct filed *f, int ms)
+{
+  gettimeofday (&f->f_odeadline, NULL);
+  f->f_odeadline.tv_sec += ms / 1000;
+  f->f_odeadline.tv_usec += (ms % 1000) * 1000;
+  if (f->f_odeadline.tv_usec >= 1000000)
+    {
+      f->f_odeadline.tv_sec++;
+      f->f_odeadline.tv_usec -= 1000000;
+    }
+}
+
+/* Append the line in the vectors IOV[0..CNT-1] to the output buffer
+   of F, a file or a pipe.  Return -1 if the line must be written
+   directly instead.  */
+static int
+buffer_filed (struct filed *f, struct iovec *iov, int cnt, int flags)
+{
+  size_t len = 0;
+  int i;
+
+  if (f->f_obuf == NULL)
+    {
+      f->f_obuf = malloc (OBUFSIZE);
+      if (f->f_obuf == NULL)
+	return -1;
+    }
+
+  for (i = 0; i < cnt; i++)
+    len += iov[i].iov_len;
+
+  if (f->f_olen + len > OBUFSIZE)
+    {
+      flush_filed (f);
+      if (f->f_type == F_UNUSED)
+	return 0;
+
+      /* A full pipe still holds the rest.  */
+      if (f->f_olen + len > OBUFSIZE)
+	{
+	  f->f_odropped++;
+	  return 0;
+	}
+    }
+
+  if (f->f_olen == 0)
+    flush_deadline (f, FlushDelay);
+
+  for (i = 0; i < cnt; i++)
+    {
+      memcpy (f->f_obuf + f->f_olen, iov[i].iov_base, iov[i].iov_len);
+      f->f_olen += iov[i].iov_len;
+    }
+
+  if ((flags & SYNC_FILE) && !(f->f_flags & OMIT_SYNC))
+    f->f_osync++;
+
+  return 0;
+}
+
+/* Write the buffered output of F, with a single system call unless
+   it is cut short.  What a full pipe does not take is kept for the
+   next attempt.  */
+static void
+flush_filed (struct filed *f)
+{
+  size_t off = 0;
+  ssize_t n;
+  int e = 0;
+
+  if (f->f_olen == 0)
+    return;
+
+  while (off < f->f_olen)
+    {
+      n = write (f->f_file, f->f_obuf + off, f->f_olen - off);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	{
+	  e = n < 0 ? errno : EIO;
+	  break;
+	}
+      off += n;
+    }
+
+  if (e == EAGAIN && f->f_type == F_PIPE)
+    {
+      memmove (f->f_obuf, f->f_obuf + off, f->f_olen - off);
+      f->f_olen -= off;
+      flush_deadline (f, FlushDelay > PIPE_RETRY ? FlushDelay : PIPE_RETRY);
+      return;
+    }
+
+  f->f_olen = 0;
+  if (e)
+    filed_error (f, e);
+  else
+    {
+      if (f->f_osync)
+	sync_filed (f, f->f_osync, 0);
+      drop_report (f);
+    }
+  f->f_osync = 0;
+}
+
+/* Log how many lines were dropped for the full pipe F, if any, once
+   it takes lines again.  */
+static void
+drop_report (struct filed *f)
+{
+  char buf[100];
+
+  if (f->f_odropped == 0)
+    return;
+  snprintf (buf, sizeof (buf), "%lu lines for %s dropped, pipe full",
+	    f->f_odropped, f->f_un.f_fname);
+  f->f_odropped = 0;
+  errno = 0;
+  logerror (buf);
+}
+
+/* Take note that LINES lines asking for sync have been written to F,
+   and sync the file when this is due, or at once if FORCE is set.
+   Lines are grouped for a single sync until SyncInterval milliseconds
+   have passed since the first of them was written, or SyncCount of
+   them are waiting.  Return the number of milliseconds until a sync
+   is due, or -1 when none is pending.  */
+static long
+sync_filed (struct filed *f, int lines, int force)
+{
+  struct timeval tv;
+  double secs;
+  long ms;
+
+  if (lines == 0 && f->f_unsynced == 0)
+    return -1;
+
+  gettimeofday (&tv, NULL);
+  if (f->f_unsynced == 0)
+    f->f_unsynced_since = tv;
+  f->f_unsynced += lines;
+
+  ms = SyncInterval - (tv.tv_sec - f->f_unsynced_since.tv_sec) * 1000
+    - (tv.tv_usec - f->f_unsynced_since.tv_usec) / 1000;
+  if (!force && ms > 0 && (SyncCount == 0 || f->f_unsynced < SyncCount))
+    return ms;
+
+#ifdef HAVE_FDATASYNC
+  if (SyncData)
+    fdatasync (f->f_file);
+  else
+#endif
+    fsync (f->f_file);
+
+  /* The first line has waited this long to become durable.  */
+  gettimeofday (&tv, NULL);
+  secs = (tv.tv_sec - f->f_unsynced_since.tv_sec)
+    + (tv.tv_usec - f->f_unsynced_since.tv_usec) / 1e6;
+  f->f_syncs++;
+  f->f_synced += f->f_unsynced;
+  f->f_syncwait += secs;
+  if (secs > f->f_syncmax)
+    f->f_syncmax = secs;
+
+  if (SyncInterval)
+    dbg_printf ("Synced %s: %d lines, %.1f ms after the first.\n",
+		f->f_un.f_fname, f->f_unsynced, 1000 * secs);
+  f->f_unsynced = 0;
+
+  return -1;
+}
+
+/* Sync what remains of F, and show the statistics in debug mode.  */
+static void
+sync_report (struct filed *f)
+{
+  sync_filed (f, 0, 1);
+  if (f->f_syncs)
+    dbg_printf ("Syncs of %s: %lu for %lu lines, first line durable "
+		"after %.1f ms on average, %.1f ms at most.\n",
+		f->f_un.f_fname, f->f_syncs, f->f_synced,
+		1000 * f->f_syncwait / f->f_syncs, 1000 * f->f_syncmax);
+}
+
+/* Deal with the failure E of a write to the file, pipe, or terminal
+   F.  Return 1 when the terminal has been reopened, so the write
+   can be retried.  */
+static int
+filed_error (struct filed *f, int e)
+{
+  /* If a named pipe is full, drop the line.  */
+  if (f->f_type == F_PIPE && e == EAGAIN)
+    {
+      f->f_odropped++;
+      return 0;
+    }
+
+  f->f_unsynced = 0;
+  close (f->f_file);
+  /* Check for errors on TTY's due to loss of tty. */
+  if ((e == EIO || e == EBADF)
+      && (f->f_type == F_TTY || f->f_type == F_CONSOLE))
+    {
+      f->f_file = open (f->f_un.f_fname, O_WRONLY | O_APPEND, 0);
+      if (f->f_file >= 0)
+	return 1;
+    }
+  else
+    errno = e;
+
+  f->f_type = F_UNUSED;
+  logerror (f->f_un.f_fname);
+  free (f->f_un.f_fname);
+  f->f_un.f_fname = NULL;
+  return 0;
+}
+
+/* Writer threads.
+
+   With --queue, each file, pipe, and terminal is written by a thread
+   of its own, which takes lines from a bounded queue filled by the
+   main thread.  A slow or blocked destination then delays only its
+   own output.  A failed write ends the thread, and the main thread
+   handles the error as for a direct write.  */
+
+#define WQ_IOVMAX	64	/* Lines written by a single writev().  */
+#define WQ_STOP_TIME	2	/* Seconds to wait for a stopping writer.  */
+
+struct wslot
+{
+  char *s_buf;
+  size_t s_len;
+  size_t s_size;
+  int s_sync;			/* Sync after writing.  */
+};
+
+struct wqueue
+{
+#ifdef USE_THREADS
+  pthread_t q_thread;
+  pthread_mutex_t q_lock;
+  pthread_cond_t q_more;	/* Signalled when lines are added.  */
+  pthread_cond_t q_room;	/* Signalled when lines are written.  */
+#endif
+  struct wslot **q_slots;	/* Ring of Q_SIZE slots.  */
+  int q_size;
+  int q_head;			/* Oldest line.  */
+  int q_count;			/* Lines in the ring.  */
+  int q_busy;			/* Lines being written, from Q_HEAD.  */
+  int q_fd;
+  struct filed *q_filed;	/* Owner, for sync_filed().  */
+  int q_stop;			/* Write what remains, then exit.  */
+  int q_done;			/* Writer has exited.  */
+  int q_errno;			/* Failure of the last write.  */
+  unsigned long q_enqueued, q_written, q_dropped;
+};
+
+#ifdef USE_THREADS
+/* The main thread may not take a queue lock within a signal handler
+   while it holds one already.  So die() merely records its signal
+   while WQ_INSIDE is set, and the exit follows on leaving.  */
+static volatile sig_atomic_t wq_inside, wq_exit;
+
+static void
+wq_leave (void)
+{
+  int signo;
+
+  /* A signal arriving once WQ_INSIDE is clear is handled at once,
+     so only one which came earlier can be pending here.  */
+  wq_inside = 0;
+  signo = wq_exit;
+  if (signo)
+    {
+      wq_exit = 0;
+      die (signo);
+    }
+}
+
+static void *
+wqueue_writer (void *arg)
+{
+  struct wqueue *q = arg;
+  struct iovec iov[WQ_IOVMAX], *v;
+  struct wslot *s;
+  struct timeval tv;
+  struct timespec ts;
+  ssize_t n;
+  long due = -1;		/* Milliseconds until a sync is due.  */
+  int i, cnt, sync, err;
+
+  /* Only a writer stuck in output may be cancelled.  */
+  pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+
+  pthread_mutex_lock (&q->q_lock);
+  for (;;)
+    {
+      while (q->q_count == 0 && !q->q_stop)
+	{
+	  if (due < 0)
+	    {
+	      pthread_cond_wait (&q->q_more, &q->q_lock);
+	      continue;
+	    }
+
+	  gettimeofday (&tv, NULL);
+	  ts.tv_sec = tv.tv_sec + due / 1000;
+	  ts.tv_nsec = tv.tv_usec * 1000 + (due % 1000) * 1000000;
+	  if (ts.tv_nsec >= 1000000000)
+	    {
+	      ts.tv_sec++;
+	      ts.tv_nsec -= 1000000000;
+	    }
+	  if (pthread_cond_timedwait (&q->q_more, &q->q_lock, &ts)
+	      == ETIMEDOUT)
+	    {
+	      pthread_mutex_unlock (&q->q_lock);
+	      due = sync_filed (q->q_filed, 0, 0);
+	      pthread_mutex_lock (&q->q_lock);
+	    }
+	}
+      if (q->q_count == 0)
+	break;
+
+      cnt = q->q_count < WQ_IOVMAX ? q->q_count : WQ_IOVMAX;
+      for (sync = 0, i = 0; i < cnt; i++)
+	{
+	  s = q->q_slots[(q->q_head + i) % q->q_size];
+	  iov[i].iov_base = s->s_buf;
+	  iov[i].iov_len = s->s_len;
+	  sync += s->s_sync;
+	}
+      q->q_busy = cnt;
+      pthread_mutex_unlock (&q->q_lock);
+      pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
+
+      /* Resume after short writes.  */
+      err = 0;
+      for (v = iov, i = cnt; i > 0;)
+	{
+	  n = writev (q->q_fd, v, i);
+	  if (n < 0)
+	    {
+	      if (errno == EINTR)
+		continue;
+	      err = errno;
+	      break;
+	    }
+	  while (i > 0 && (size_t) n >= v->iov_len)
+	    {
+	      n -= v->iov_len;
+	      v++;
+	      i--;
+	    }
+	  if (i > 0)
+	    {
+	      v->iov_base = (char *) v->iov_base + n;
+	      v->iov_len -= n;
+	    }
+	}
+      pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+
+      /* Lines waiting for a sync are not to wait out a steady
+         stream of others.  */
+      if (!err)
+	due = sync_filed (q->q_filed, sync, 0);
+
+      pthread_mutex_lock (&q->q_lock);
+      q->q_busy = 0;
+      q->q_head = (q->q_head + cnt) % q->q_size;
+      q->q_count -= cnt;
+      if (err)
+	{
+	  q->q_errno = err;
+	  q->q_dropped += cnt + q->q_count;
+	  q->q_count = 0;
+	  pthread_cond_broadcast (&q->q_room);
+	  break;
+	}
+      q->q_written += cnt;
+      pthread_cond_broadcast (&q->q_room);
+    }
+  pthread_mutex_unlock (&q->q_lock);
+
+  if (!q->q_errno)
+    sync_filed (q->q_filed, 0, 1);
+
+  pthread_mutex_lock (&q->q_lock);
+  q->q_done = 1;
+  pthread_cond_broadcast (&q->q_room);
+  pthread_mutex_unlock (&q->q_lock);
+
+  return NULL;
+}
+
+/* Set up the queue of F and start its writer.  Return NULL when
+   this is not possible.  */
+static struct wqueue *
+wqueue_start (struct filed *f)
+{
+  struct wqueue *q;
+  sigset_t all, old;
+  int err, fl;
+
+  q = calloc (1, sizeof (*q));
+  if (q == NULL)
+    return NULL;
+  q->q_size = QueueSize;
+  q->q_slots = calloc (q->q_size, sizeof (*q->q_slots));
+  if (q->q_slots == NULL)
+    {
+      free (q);
+      return NULL;
+    }
+  q->q_fd = f->f_file;
+  q->q_filed = f;
+
+  /* The writer may wait for a slow reader.  */
+  if (f->f_type == F_PIPE)
+    {
+      fl = fcntl (q->q_fd, F_GETFL);
+      if (fl >= 0)
+	fcntl (q->q_fd, F_SETFL, fl & ~O_NONBLOCK);
+    }
+
+  pthread_mutex_init (&q->q_lock, NULL);
+  pthread_cond_init (&q->q_more, NULL);
+  pthread_cond_init (&q->q_room, NULL);
+
+  /* Signals are for the main thread.  */
+  sigfillset (&all);
+  pthread_sigmask (SIG_BLOCK, &all, &old);
+  err = pthread_create (&q->q_thread, NULL, wqueue_writer, q);
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+
+  if (err)
+    {
+      dbg_printf ("Cannot start writer for %s: %s\n",
+		  f->f_un.f_fname, strerror (err));
+      pthread_cond_destroy (&q->q_room);
+      pthread_cond_destroy (&q->q_more);
+      pthread_mutex_destroy (&q->q_lock);
+      free (q->q_slots);
+      free (q);
+      return NULL;
+    }
+
+  f->f_queue = q;
+  return q;
+}
+#endif /* USE_THREADS */
+
+/* Queue the line in IOV[0..CNT-1] for the writer of F, starting it
+   when needed.  Return -1 if the line must be written directly.  */
+static int
+wqueue_put (struct filed *f, struct iovec *iov, int cnt, int flags)
+{
+#ifdef USE_THREADS
+  struct wqueue *q = f->f_queue;
+  struct wslot *s = NULL;
+  struct timeval tv;
+  struct timespec ts;
+  size_t len = 0;
+  int i, n;
+
+  if (q == NULL)
+    {
+      q = wqueue_start (f);
+      if (q == NULL)
+	return -1;
+    }
+
+  for (i = 0; i < cnt; i++)
+    len += iov[i].iov_len;
+
+  wq_inside = 1;
+  pthread_mutex_lock (&q->q_lock);
+  while (q->q_count == q->q_size && !q->q_errno && !wq_exit)
+    {
+      if (QueuePolicy == QUEUE_BLOCK)
+	{
+	  /* Look for a deferred exit every second.  */
+	  gettimeofday (&tv, NULL);
+	  ts.tv_sec = tv.tv_sec + 1;
+	  ts.tv_nsec = tv.tv_usec * 1000;
+	  pthread_cond_timedwait (&q->q_room, &q->q_lock, &ts);
+	}
+      else if (QueuePolicy == QUEUE_DROP_OLDEST && q->q_count > q->q_busy)
+	{
+	  /* Discard the oldest line not being written, keeping the
+	     lines in the hands of the writer at the head.  */
+	  n = (q->q_head + q->q_busy) % q->q_size;
+	  s = q->q_slots[n];
+	  for (i = q->q_busy; i > 0; i--)
+	    {
+	      q->q_slots[n] = q->q_slots[(n + q->q_size - 1) % q->q_size];
+	      n = (n + q->q_size - 1) % q->q_size;
+	    }
+	  q->q_slots[n] = s;
+	  q->q_head = (q->q_head + 1) % q->q_size;
+	  q->q_count--;
+	  q->q_dropped++;
+	}
+      else
+	break;
+    }
+
+  /* The line is dropped as too new, or as the writer has failed and
+     waits for the main thread to notice it.  */
+  if (q->q_count < q->q_size && !q->q_errno)
+    {
+      n = (q->q_head + q->q_count) % q->q_size;
+      s = q->q_slots[n];
+      if (s == NULL || s->s_size < len)
+	{
+	  s = realloc (s, sizeof (*s) + len);
+	  if (s)
+	    {
+	      s->s_buf = (char *) (s + 1);
+	      s->s_size = len;
+	      q->q_slots[n] = s;
+	    }
+	}
+    }
+  else
+    s = NULL;
+
+  if (s)
+    {
+      for (s->s_len = 0, i = 0; i < cnt; i++)
+	{
+	  memcpy (s->s_buf + s->s_len, iov[i].iov_base, iov[i].iov_len);
+	  s->s_len += iov[i].iov_len;
+	}
+      s->s_sync = (flags & SYNC_FILE) && !(f->f_flags & OMIT_SYNC);
+
+      q->q_count++;
+      q->q_enqueued++;
+      pthread_cond_signal (&q->q_more);
+    }
+  else
+    q->q_dropped++;
+  pthread_mutex_unlock (&q->q_lock);
+  wq_leave ();
+
+  return 0;
+#else /* !USE_THREADS */
+  (void) f;
+  (void) iov;
+  (void) cnt;
+  (void) flags;
+  return -1;
+#endif
+}
+
+/* Take note of a failed writer of F.  */
+static void
+wqueue_check (struct filed *f)
+{
+#ifdef USE_THREADS
+  int e;
+
+  wq_inside = 1;
+  pthread_mutex_lock (&f->f_queue->q_lock);
+  e = f->f_queue->q_errno;
+  pthread_mutex_unlock (&f->f_queue->q_lock);
+  wq_leave ();
+
+  if (e)
+    {
+      wqueue_stop (f);
+      filed_error (f, e);
+    }
+#else
+  (void) f;
+#endif
+}
+
+/* Let the writer of F finish its queue, and release it.  A writer
+   which is still blocked after WQ_STOP_TIME seconds is cancelled.  */
+static void
+wqueue_stop (struct filed *f)
+{
+#ifdef USE_THREADS
+  struct wqueue *q = f->f_queue;
+  struct timeval tv;
+  struct timespec ts;
+  int i, done;
+
+  if (q == NULL)
+    return;
+
+  gettimeofday (&tv, NULL);
+  ts.tv_sec = tv.tv_sec + WQ_STOP_TIME;
+  ts.tv_nsec = tv.tv_usec * 1000;
+
+  wq_inside = 1;
+  pthread_mutex_lock (&q->q_lock);
+  q->q_stop = 1;
+  pthread_cond_signal (&q->q_more);
+  while (!q->q_done
+	 && pthread_cond_timedwait (&q->q_room, &q->q_lock, &ts) != ETIMEDOUT)
+    ;
+  done = q->q_done;
+  pthread_mutex_unlock (&q->q_lock);
+  wq_leave ();
+
+  if (!done)
+    pthread_cancel (q->q_thread);
+  pthread_join (q->q_thread, NULL);
+  if (!done)
+    q->q_dropped += q->q_count;
+
+  if (f->f_type == F_PIPE)
+    {
+      int fl = fcntl (q->q_fd, F_GETFL);
+      if (fl >= 0)
+	fcntl (q->q_fd, F_SETFL, fl | O_NONBLOCK);
+    }
+
+  dbg_printf ("Queue of %s: %lu enqueued, %lu written, %lu dropped.\n",
+	      f->f_un.f_fname, q->q_enqueued, q->q_written, q->q_dropped);
+
+  for (i = 0; i < q->q_size; i++)
+    free (q->q_slots[i]);
+  free (q->q_slots);
+  pthread_cond_destroy (&q->q_room);
+  pthread_cond_destroy (&q->q_more);
+  pthread_mutex_destroy (&q->q_lock);
+  free (q);
+  f->f_queue = NULL;
+#else
+  (void) f;
+#endif
+}
+
+/* Forwarding.
+
+   Messages for a remote host pass through a queue of ForwardQueue
+   messages, which is sent after each batch of received messages,
+   with a single sendmmsg() for datagrams where available.  When the
+   host cannot be reached, the queue is kept and sending is retried
+   after a delay, which doubles with each failure up to
+   INET_SUSPEND_TIME.  A full queue overflows into a spool file, if
+   a directory is given with --forward-spool, and beyond that the
+   oldest messages are dropped.  Over TCP, each message is preceded
+   by its length, as described in RFC 6587, and a message which has
+   not been written completely is sent again on a new connection.  */
+
+#define FWD_BATCH	64	/* Messages sent by a single system call.  */
+#define FWD_FRAMELEN	(MAXLINE + 12)	/* Message with its length.  */
+#define FWD_WAIT	100	/* Milliseconds to wait for a busy socket.  */
+
+struct fwdmsg
+{
+  unsigned short m_len;
+  char m_text[FWD_FRAMELEN];
+};
+
+struct fwdqueue
+{
+  struct fwdmsg *q_msgs;	/* Ring of ForwardQueue messages.  */
+  size_t q_head;		/* Index of the oldest message.  */
+  size_t q_count;		/* Messages in the ring.  */
+  size_t q_off;			/* Bytes of the oldest written to TCP.  */
+  int q_connecting;		/* Connection of f_file is in progress.  */
+  int q_spool;			/* Spool file, or -1.  */
+  size_t q_sphead;		/* Record of the oldest spooled message.  */
+  size_t q_spcount;		/* Messages in the spool.  They are newer
+				   than all messages in the ring.  */
+  int q_backoff;		/* Seconds to wait after the next failure.  */
+  time_t q_retry;		/* When a suspended host is tried again.  */
+  unsigned long q_sent;		/* Statistics.  */
+  unsigned long q_spooled;
+  unsigned long q_dropped;
+  unsigned long q_reported;	/* Drops already logged.  */
+  time_t q_rtime;		/* When drops were last looked at.  */
+  size_t q_peak;		/* Most messages waiting at a time.  */
+};
+
+/* Return the queue of F, creating it on first use.  */
+static struct fwdqueue *
+fwd_queue (struct filed *f)
+{
+  struct fwdqueue *q = f->f_un.f_forw.f_fq;
+
+  if (q)
+    return q;
+
+  q = calloc (1, sizeof (*q));
+  if (q == NULL)
+    return NULL;
+  q->q_msgs = malloc (ForwardQueue * sizeof (*q->q_msgs));
+  if (q->q_msgs == NULL)
+    {
+      free (q);
+      return NULL;
+    }
+  q->q_spool = -1;
+  q->q_backoff = 1;
+  f->f_un.f_forw.f_fq = q;
+  return q;
+}
+
+/* Open the spool file of Q, unless done.  The file is removed at
+   once, so it vanishes when closed.  Return -1 if there is none.  */
+static int
+fwd_spool_open (struct filed *f, struct fwdqueue *q)
+{
+  char *name;
+
+  if (q->q_spool >= 0)
+    return 0;
+  if (ForwardSpool == NULL)
+    return -1;
+
+  name = malloc (strlen (ForwardSpool) + sizeof ("/forward.XXXXXX"));
+  if (name == NULL)
+    return -1;
+  sprintf (name, "%s/forward.XXXXXX", ForwardSpool);
+  q->q_spool = mkstemp (name);
+  if (q->q_spool < 0)
+    logerror (name);
+  else
+    {
+      unlink (name);
+      dbg_printf ("Spooling messages to %s in %s.\n",
+		  f->f_un.f_forw.f_hname, name);
+    }
+  free (name);
+
+  /* Only try once.  */
+  if (q->q_spool < 0)
+    ForwardSpool = NULL;
+  return q->q_spool < 0 ? -1 : 0;
+}
+
+/* Move messages from the spool of Q into its ring while there is
+   room.  On a read error, the spooled messages are lost.  */
+static void
+fwd_refill (struct fwdqueue *q)
+{
+  struct fwdmsg *m;
+
+  while (q->q_spcount > 0 && q->q_count < (size_t) ForwardQueue)
+    {
+      m = &q->q_msgs[(q->q_head + q->q_count) % ForwardQueue];
+      if (pread (q->q_spool, m, sizeof (*m),
+		 (off_t) q->q_sphead * sizeof (*m)) != sizeof (*m)
+	  || m->m_len > FWD_FRAMELEN)
+	{
+	  logerror ("spool read");
+	  q->q_dropped += q->q_spcount;
+	  q->q_spcount = 0;
+	  break;
+	}
+      q->q_count++;
+      q->q_sphead = (q->q_sphead + 1) % ForwardSpoolSize;
+      q->q_spcount--;
+    }
+}
+
+/* Discard the oldest message of Q, but not one which is partly
+   written.  Return -1 if there is none.  */
+static int
+fwd_drop (struct fwdqueue *q)
+{
+  if (q->q_count == 0 || (q->q_off && q->q_count == 1))
+    return -1;
+
+  if (q->q_off)
+    q->q_msgs[(q->q_head + 1) % ForwardQueue] = q->q_msgs[q->q_head];
+  q->q_head = (q->q_head + 1) % ForwardQueue;
+  q->q_count--;
+  q->q_dropped++;
+  fwd_refill (q);
+  return 0;
+}
+
+/* Queue the message of LEN bytes at MSG for the host of F.  */
+static void
+fwd_put (struct filed *f, const char *msg, size_t len)
+{
+  struct fwdqueue *q = fwd_queue (f);
+  struct fwdmsg *m, spool;
+  size_t waiting;
+
+  if (q == NULL)
+    return;
+
+  /* Once messages are spooled, newer ones must follow them.  */
+  if (q->q_spcount == 0 && q->q_count == (size_t) ForwardQueue
+      && fwd_spool_open (f, q) < 0)
+    fwd_drop (q);
+
+  if (q->q_spcount == 0 && q->q_count < (size_t) ForwardQueue)
+    m = &q->q_msgs[(q->q_head + q->q_count) % ForwardQueue];
+  else if (q->q_spool >= 0)
+    {
+      if (q->q_spcount == (size_t) ForwardSpoolSize && fwd_drop (q) < 0)
+	{
+	  q->q_dropped++;
+	  return;
+	}
+      m = &spool;
+    }
+  else
+    {
+      /* The oldest message is being written.  */
+      q->q_dropped++;
+      return;
+    }
+
+  if (f->f_un.f_forw.f_stream)
+    m->m_len = snprintf (m->m_text, sizeof (m->m_text), "%lu %.*s",
+			 (unsigned long) len, (int) len, msg);
+  else
+    {
+      memcpy (m->m_text, msg, len);
+      m->m_len = len;
+    }
+
+  if (m == &spool)
+    {
+      if (pwrite (q->q_spool, m, sizeof (*m),
+		  (off_t) ((q->q_sphead + q->q_spcount) % ForwardSpoolSize)
+		  * sizeof (*m)) != sizeof (*m))
+	{
+	  logerror ("spool write");
+	  q->q_dropped++;
+	  return;
+	}
+      q->q_spcount++;
+      q->q_spooled++;
+    }
+  else
+    q->q_count++;
+
+  waiting = q->q_count + q->q_spcount;
+  if (waiting > q->q_peak)
+    q->q_peak = waiting;
+}
+
+/* Return the socket for datagrams to the address family AF.  Without
+   an internet listener, a socket is opened at any free port and kept,
+   so that the syslog port stays available to other servers.  */
+static int
+fwd_socket (int af)
+{
+  int i = (af == AF_INET) ? IU_FD_IP4 : IU_FD_IP6;
+
+  if (finet[i] >= 0)
+    return finet[i];
+  if (fforw[i] < 0)
+    fforw[i] = socket (af, SOCK_DGRAM, 0);
+  return fforw[i];
+}
+
+/* Send datagrams from the ring of Q to the host of F.  Return the
+   number of messages sent, 0 if the socket is busy, or -1.  */
+static int
+fwd_send_dgram (struct filed *f, struct fwdqueue *q)
+{
+  struct iovec iov[FWD_BATCH];
+  struct fwdmsg *m;
+  int fd, i, n, cnt;
+
+  fd = fwd_socket (f->f_un.f_forw.f_addr.ss_family);
+  if (fd < 0)
+    return -1;
+
+  cnt = q->q_count < FWD_BATCH ? q->q_count : FWD_BATCH;
+  for (i = 0; i < cnt; i++)
+    {
+      m = &q->q_msgs[(q->q_head + i) % ForwardQueue];
+      iov[i].iov_base = m->m_text;
+      iov[i].iov_len = m->m_len;
+    }
+
+#ifdef HAVE_SENDMMSG
+  {
+    struct mmsghdr msgs[FWD_BATCH];
+
+    memset (msgs, 0, cnt * sizeof (msgs[0]));
+    for (i = 0; i < cnt; i++)
+      {
+	msgs[i].msg_hdr.msg_name = &f->f_un.f_forw.f_addr;
+	msgs[i].msg_hdr.msg_namelen = f->f_un.f_forw.f_addrlen;
+	msgs[i].msg_hdr.msg_iov = &iov[i];
+	msgs[i].msg_hdr.msg_iovlen = 1;
+      }
+    n = sendmmsg (fd, msgs, cnt, MSG_DONTWAIT);
+  }
+#else
+  for (n = 0; n < cnt; n++)
+    if (sendto (fd, iov[n].iov_base, iov[n].iov_len, MSG_DONTWAIT,
+		(struct sockaddr *) &f->f_un.f_forw.f_addr,
+		f->f_un.f_forw.f_addrlen) < 0)
+      {
+	if (n == 0)
+	  n = -1;
+	break;
+      }
+#endif /* !HAVE_SENDMMSG */
+
+  if (n < 0)
+    return (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS
+	    || errno == EINTR) ? 0 : -1;
+
+  q->q_head = (q->q_head + n) % ForwardQueue;
+  q->q_count -= n;
+  return n;
+}
+
+/* Start a connection to the host of F.  Return -1 on failure.  */
+static int
+fwd_connect (struct filed *f, struct fwdqueue *q)
+{
+  int fd;
+
+  fd = socket (f->f_un.f_forw.f_addr.ss_family, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  fcntl (fd, F_SETFL, O_NONBLOCK);
+
+  if (connect (fd, (struct sockaddr *) &f->f_un.f_forw.f_addr,
+	       f->f_un.f_forw.f_addrlen) < 0 && errno != EINPROGRESS)
+    {
+      int e = errno;
+
+      close (fd);
+      errno = e;
+      return -1;
+    }
+
+  f->f_file = fd;
+  q->q_connecting = 1;
+  q->q_off = 0;
+  return 0;
+}
+
+/* Write messages from the ring of Q to the connection of F, opening
+   it first when needed.  Return the number of messages written, 0
+   if the connection is busy, or -1.  */
+static int
+fwd_send_stream (struct filed *f, struct fwdqueue *q)
+{
+  struct iovec iov[FWD_BATCH];
+  struct msghdr mh;
+  struct pollfd pfd;
+  struct fwdmsg *m;
+  ssize_t n;
+  int i, cnt, done = 0;
+
+  if (f->f_file < 0 && fwd_connect (f, q) < 0)
+    return -1;
+
+  pfd.fd = f->f_file;
+  pfd.events = q->q_connecting ? POLLOUT : POLLIN;
+  if (poll (&pfd, 1, 0) < 0)
+    return 0;
+
+  if (q->q_connecting)
+    {
+      socklen_t len = sizeof (i);
+
+      if (pfd.revents == 0)
+	return 0;
+      if (getsockopt (f->f_file, SOL_SOCKET, SO_ERROR, &i, &len) < 0)
+	return -1;
+      if (i)
+	{
+	  errno = i;
+	  return -1;
+	}
+      q->q_connecting = 0;
+      dbg_printf ("Connected to %s.\n", f->f_un.f_forw.f_hname);
+    }
+  else if (pfd.revents)
+    {
+      /* The server sends nothing, so this is the end of the
+         connection.  Messages written now would be lost.  */
+      errno = ECONNRESET;
+      return -1;
+    }
+
+  cnt = q->q_count < FWD_BATCH ? q->q_count : FWD_BATCH;
+  for (i = 0; i < cnt; i++)
+    {
+      m = &q->q_msgs[(q->q_head + i) % ForwardQueue];
+      iov[i].iov_base = m->m_text;
+      iov[i].iov_len = m->m_len;
+    }
+  iov[0].iov_base = (char *) iov[0].iov_base + q->q_off;
+  iov[0].iov_len -= q->q_off;
+
+  memset (&mh, 0, sizeof (mh));
+  mh.msg_iov = iov;
+  mh.msg_iovlen = cnt;
+  n = sendmsg (f->f_file, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (n < 0)
+    return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      ? 0 : -1;
+
+  for (i = 0; i < cnt && (size_t) n >= iov[i].iov_len; i++)
+    {
+      n -= iov[i].iov_len;
+      done++;
+    }
+  q->q_head = (q->q_head + done) % ForwardQueue;
+  q->q_count -= done;
+  q->q_off = done ? n : q->q_off + n;
+  return done;
+}
+
+/* Log how many messages for the host of F were dropped since the
+   last report, and how many still wait, if any were dropped.  */
+static void
+fwd_report (struct filed *f)
+{
+  struct fwdqueue *q = f->f_un.f_forw.f_fq;
+  unsigned long waiting;
+  char buf[100];
+
+  if (q == NULL || q->q_dropped == q->q_reported)
+    return;
+
+  waiting = q->q_count + q->q_spcount;
+  if (waiting)
+    snprintf (buf, sizeof (buf), "%lu messages for %s dropped, %lu waiting",
+	      q->q_dropped - q->q_reported, f->f_un.f_forw.f_hname, waiting);
+  else
+    snprintf (buf, sizeof (buf), "%lu messages for %s dropped",
+	      q->q_dropped - q->q_reported, f->f_un.f_forw.f_hname);
+  q->q_reported = q->q_dropped;
+  errno = 0;
+  logerror (buf);
+}
+
+/* Send what is queued for the host of F, as far as possible.  Return
+   the number of milliseconds until it shall be tried again, or -1
+   when nothing waits.  */
+static long
+fwd_flush (struct filed *f)
+{
+  struct fwdqueue *q = f->f_un.f_forw.f_fq;
+  time_t t;
+  int n, e;
+
+  if (q == NULL || q->q_count == 0 || f->f_type == F_FORW_UNKN)
+    return -1;
+
+  t = time ((time_t *) 0);
+
+  /* Drops for a host which stays unreachable are otherwise only
+     reported once it takes messages again.  */
+  if (t - q->q_rtime >= TIMERINTVL)
+    {
+      q->q_rtime = t;
+      fwd_report (f);
+    }
+
+  if (f->f_type == F_FORW_SUSP)
+    {
+      if (t < q->q_retry)
+	return (q->q_retry - t) * 1000;
+      dbg_printf ("Forwarding suspension over, retrying %s.\n",
+		  f->f_un.f_forw.f_hname);
+      f->f_type = F_FORW;
+    }
+
+  while (q->q_count > 0)
+    {
+      n = f->f_un.f_forw.f_stream
+	? fwd_send_stream (f, q) : fwd_send_dgram (f, q);
+      if (n == 0)
+	return FWD_WAIT;
+      if (n < 0)
+	break;
+      q->q_sent += n;
+      fwd_refill (q);
+      q->q_backoff = 1;
+    }
+
+  if (q->q_count == 0)
+    {
+      fwd_report (f);
+      return -1;
+    }
+
+  /* The host is not reachable.  */
+  e = errno;
+  if (f->f_file >= 0)
+    {
+      close (f->f_file);
+      f->f_file = -1;
+    }
+  q->q_off = 0;
+  f->f_type = F_FORW_SUSP;
+  q->q_retry = t + q->q_backoff;
+  dbg_printf ("Forwarding to %s suspended for %d s, %lu messages "
+	      "waiting: %s.\n", f->f_un.f_forw.f_hname, q->q_backoff,
+	      (unsigned long) (q->q_count + q->q_spcount), strerror (e));
+  if (q->q_backoff == 1)
+    {
+      errno = e;
+      logerror (f->f_un.f_forw.f_hname);
+    }
+  q->q_backoff *= 2;
+  if (q->q_backoff > INET_SUSPEND_TIME)
+    q->q_backoff = INET_SUSPEND_TIME;
+
+  return (q->q_retry - t) * 1000;
+}
+
+/* Make a last attempt at sending the queue of F, report, and release
+   the queue and connection.  */
+static void
+fwd_stop (struct filed *f)
+{
+  struct fwdqueue *q = f->f_un.f_forw.f_fq;
+
+  if (q == NULL)
+    return;
+
+  if (f->f_type == F_FORW)
+    fwd_flush (f);
+  if (f->f_file >= 0)
+    close (f->f_file);
+  f->f_file = -1;
+
+  q->q_dropped += q->q_count + q->q_spcount;
+  dbg_printf ("Forwarding to %s: %lu sent, %lu spooled, %lu dropped, "
+	      "at most %lu waiting.\n", f->f_un.f_forw.f_hname,
+	      q->q_sent, q->q_spooled, q->q_dropped, (unsigned long) q->q_peak);
+
+  if (q->q_spool >= 0)
+    close (q->q_spool);
+  free (q->q_msgs);
+  free (q);
+  f->f_un.f_forw.f_fq = NULL;
+}
+
+/* Write the buffered output of every file which is due, or of all
+   files when ALL is set.  Return the number of milliseconds until
+   the next buffer is due, or -1 when nothing is buffered.  */
+static int
+flush_files (int all)
+{
+  struct filed *f;
+  struct timeval tv;
+  long ms, timeout = -1;
+#ifdef HAVE_SIGACTION
+  sigset_t sigs, osigs;
+
+  sigemptyset (&sigs);
+  sigaddset (&sigs, SIGHUP);
+  sigaddset (&sigs, SIGALRM);
+  sigprocmask (SIG_BLOCK, &sigs, &osigs);
+#else
+  int omask = sigblock (sigmask (SIGHUP) | sigmask (SIGALRM));
+#endif
+
+  timeout = rate_flush (all);
+
+  gettimeofday (&tv, NULL);
+  for (f = Files; f; f = f->f_next)
+    {
+      if (f->f_queue)
+	{
+	  wqueue_check (f);
+	  continue;
+	}
+
+      if (f->f_type == F_FORW || f->f_type == F_FORW_SUSP)
+	{
+	  ms = fwd_flush (f);
+	  if (ms >= 0 && (timeout < 0 || ms < timeout))
+	    timeout = ms;
+	  continue;
+	}
+
+      if (f->f_olen)
+	{
+	  ms = (f->f_odeadline.tv_sec - tv.tv_sec) * 1000
+	    + (f->f_odeadline.tv_usec - tv.tv_usec) / 1000;
+	  if (all || ms <= 0)
+	    {
+	      flush_filed (f);
+	      if (f->f_olen && (timeout < 0 || PIPE_RETRY < timeout))
+		timeout = PIPE_RETRY;
+	    }
+	  else if (timeout < 0 || ms < timeout)
+	    timeout = ms;
+	}
+
+      /* Syncs postponed by the group commit.  */
+      if (f->f_unsynced)
+	{
+	  ms = sync_filed (f, 0, 0);
+	  if (ms >= 0 && (timeout < 0 || ms < timeout))
+	    timeout = ms;
+	}
+    }
+
+#ifdef HAVE_SIGACTION
+  sigprocmask (SIG_SETMASK, &osigs, 0);
+#else
+  sigsetmask (omask);
+#endif
+
+  return timeout;
+}
+
+/* Write the specified message to either the entire world,
+ * or to a list of approved users.  */
+void
+wallmsg (struct filed *f, struct iovec *iov)
+{
+  static int reenter;		/* Avoid calling ourselves.  */
+  STRUCT_UTMP *utp;
+#if defined UTMP_NAME_FUNCTION || !defined HAVE_GETUTXENT
+  STRUCT_UTMP *utmpbuf;
+  size_t utmp_count;
+#endif /* UTMP_NAME_FUNCTION || !HAVE_GETUTXENT */
+  int i;
+  char *p;
+  char line[sizeof (utp->ut_line) + 1];
+
+  if (reenter++)
+    return;
+
+#if !defined UTMP_NAME_FUNCTION && defined HAVE_GETUTXENT
+  setutxent ();
+
+  while ((utp = getutxent ()))
+#else /* UTMP_NAME_FUNCTION || !HAVE_GETUTXENT */
+  if (read_utmp (UTMP_FILE, &utmp_count, &utmpbuf,
+		 READ_UTMP_USER_PROCESS | READ_UTMP_CHECK_PIDS) < 0)
+    {
+      logerror ("opening utmp file");
+      return;
+    }
+
+  for (utp = utmpbuf; utp < utmpbuf + utmp_count; utp++)
+#endif /* UTMP_NAME_FUNCTION || !HAVE_GETUTXENT */
+    {
+      strncpy (line, utp->ut_line, sizeof (utp->ut_line));
+      line[sizeof (utp->ut_line)] = '\0';
+      if (f->f_type == F_WALL)
+	{
+	  /* Note we're using our own version of ttymsg
+	     which does a double fork () to not have
+	     zombies.  No need to waitpid().  */
+	  p = ttymsg (iov, IOVCNT, line, TTYMSGTIME);
+	  if (p != NULL)
+	    {
+	      errno = 0;	/* Already in message. */
+	      logerror (p);
+	    }
+	  continue;
+	}
+      /* Should we send the message to this user? */
+      for (i = 0; i < f->f_un.f_user.f_nusers; i++)
+	if (!strncmp (f->f_un.f_user.f_unames[i], UT_USER (utp),
+		      sizeof (UT_USER (utp))))
+	  {
+	    p = ttymsg (iov, IOVCNT, line, TTYMSGTIME);
+	    if (p != NULL)
+	      {
+		errno = 0;	/* Already in message. */
+		logerror (p);
+	      }
+	    break;
+	  }
+    }
+#if defined UTMP_NAME_FUNCTION || !defined HAVE_GETUTXENT
+  free (utmpbuf);
+#else /* !UTMP_NAME_FUNCTION && HAVE_GETUTXENT */
+  endutxent ();
+#endif
+  reenter = 0;
+}
+
+/* Cache of reverse lookups for remote senders.
+
+   A name lookup may take seconds when a name server is slow or
+   unreachable, and all the while no message is received.  Lookups
+   are therefore made by a resolver thread, and until the answer has
+   arrived, messages from the address are logged with the numeric
+   address.  Without thread support the lookup is made at once, as
+   before, but its result is still cached.  */
+
+#define DNS_PENDING	0	/* No answer yet.  */
+#define DNS_FOUND	1	/* D_NAME is valid.  */
+#define DNS_FAILED	2	/* Address has no name.  */
+
+struct dns_entry
+{
+  struct dns_entry *d_hnext;	/* Next in hash chain.  */
+  struct dns_entry *d_prev;	/* Neighbours in LRU list.  */
+  struct dns_entry *d_next;
+  struct dns_entry *d_qnext;	/* Next in resolver queue.  */
+  struct sockaddr_storage d_addr;	/* Address, port cleared.  */
+  socklen_t d_addrlen;
+  unsigned int d_hash;
+  int d_state;			/* See above.  */
+  int d_queued;			/* Waiting for, or inside, resolver.  */
+  time_t d_expires;		/* End of validity of D_STATE.  */
+  struct timeval d_start;	/* Time of request.  */
+  char d_name[NI_MAXHOST];	/* Host name when found.  */
+};
+
+static struct dns_entry *dns_hash[DNS_HASH_SIZE];
+static struct dns_entry *dns_lru;	/* Most recently used.  */
+static struct dns_entry *dns_lru_tail;	/* Least recently used.  */
+static struct dns_entry *dns_queue, **dns_queue_tail = &dns_queue;
+static size_t dns_entries, dns_queued;
+
+/* Statistics, shown in debug mode.  */
+static unsigned long dns_hits, dns_neg_hits, dns_pending_hits;
+static unsigned long dns_misses, dns_overflows;
+static unsigned long dns_lookups, dns_failures, dns_reported;
+static double dns_latency, dns_max_latency;	/* In seconds.  */
+
+#ifdef USE_THREADS
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dns_cond = PTHREAD_COND_INITIALIZER;
+static int dns_thread = -1;	/* -1 untried, 0 failed, 1 running.  */
+# define DNS_LOCK()	pthread_mutex_lock (&dns_lock)
+# define DNS_UNLOCK()	pthread_mutex_unlock (&dns_lock)
+#else
+# define DNS_LOCK()
+# define DNS_UNLOCK()
+#endif
+
+/* Build in KEY the address of F with the port removed, and return
+   its length, or zero for an unexpected address family.  */
+static socklen_t
+dns_key (struct sockaddr_storage *key, const struct sockaddr *f)
+{
+  memset (key, 0, sizeof (*key));
+  key->ss_family = f->sa_family;
+
+  switch (f->sa_family)
+    {
+    case AF_INET:
+      ((struct sockaddr_in *) key)->sin_addr =
+	((const struct sockaddr_in *) f)->sin_addr;
+      return sizeof (struct sockaddr_in);
+
+    case AF_INET6:
+      ((struct sockaddr_in6 *) key)->sin6_addr =
+	((const struct sockaddr_in6 *) f)->sin6_addr;
+      ((struct sockaddr_in6 *) key)->sin6_scope_id =
+	((const struct sockaddr_in6 *) f)->sin6_scope_id;
+      return sizeof (struct sockaddr_in6);
+    }
+
+  return 0;
+}
+
+static unsigned int
+dns_hashkey (const struct sockaddr_storage *key, socklen_t len)
+{
+  const unsigned char *p = (const unsigned char *) key;
+  unsigned int h = HASH_INIT;
+
+  while (len-- > 0)
+    h = HASH_STEP (h, *p++);
+
+  return h;
+}
+
+static void
+dns_lru_unlink (struct dns_entry *e)
+{
+  if (e->d_prev)
+    e->d_prev->d_next = e->d_next;
+  else
+    dns_lru = e->d_next;
+  if (e->d_next)
+    e->d_next->d_prev = e->d_prev;
+  else
+    dns_lru_tail = e->d_prev;
+  e->d_prev = e->d_next = NULL;
+}
+
+static void
+dns_lru_push (struct dns_entry *e)
+{
+  e->d_prev = NULL;
+  e->d_next = dns_lru;
+  if (dns_lru)
+    dns_lru->d_prev = e;
+  else
+    dns_lru_tail = e;
+  dns_lru = e;
+}
+
+static void
+dns_hash_unlink (struct dns_entry *e)
+{
+  struct dns_entry **ep;
+
+  for (ep = &dns_hash[e->d_hash & (DNS_HASH_SIZE - 1)]; *ep;
+       ep = &(*ep)->d_hnext)
+    if (*ep == e)
+      {
+	*ep = e->d_hnext;
+	break;
+      }
+}
+
+/* Return a free entry, allocating one while the cache is not full,
+   and otherwise recycling the least recently used entry which is
+   not in the hands of the resolver.  NULL means none is available.  */
+static struct dns_entry *
+dns_alloc (void)
+{
+  struct dns_entry *e;
+
+  if (dns_entries < DNS_CACHE_SIZE)
+    {
+      e = calloc (1, sizeof (*e));
+      if (e)
+	dns_entries++;
+      return e;
+    }
+
+  for (e = dns_lru_tail; e; e = e->d_prev)
+    if (!e->d_queued)
+      {
+	dns_lru_unlink (e);
+	dns_hash_unlink (e);
+	return e;
+      }
+
+  return NULL;
+}
+
+/* Record the outcome ERR of a lookup which produced NAME for the
+   entry E.  The lock must be held.  */
+static void
+dns_store (struct dns_entry *e, int err, const char *name)
+{
+  struct timeval end;
+  double secs;
+
+  gettimeofday (&end, NULL);
+  secs = (end.tv_sec - e->d_start.tv_sec)
+    + (end.tv_usec - e->d_start.tv_usec) / 1e6;
+
+  dns_lookups++;
+  dns_latency += secs;
+  if (secs > dns_max_latency)
+    dns_max_latency = secs;
+
+  if (err == 0)
+    {
+      strcpy (e->d_name, name);
+      e->d_state = DNS_FOUND;
+      e->d_expires = end.tv_sec + DNS_POSITIVE_TTL;
+    }
+  else
+    {
+      /* A failed refresh keeps the name known from before.  */
+      dns_failures++;
+      if (e->d_state != DNS_FOUND)
+	e->d_state = DNS_FAILED;
+      e->d_expires = end.tv_sec + DNS_NEGATIVE_TTL;
+    }
+  e->d_queued = 0;
+}
+
+#ifdef USE_THREADS
+static void *
+dns_resolver (void *arg MAYBE_UNUSED)
+{
+  struct sockaddr_storage addr;
+  struct dns_entry *e;
+  char name[NI_MAXHOST];
+  socklen_t len;
+  int err;
+
+  DNS_LOCK ();
+  for (;;)
+    {
+      while (dns_queue == NULL)
+	pthread_cond_wait (&dns_cond, &dns_lock);
+
+      e = dns_queue;
+      dns_queue = e->d_qnext;
+      if (dns_queue == NULL)
+	dns_queue_tail = &dns_queue;
+      dns_queued--;
+
+      memcpy (&addr, &e->d_addr, sizeof (addr));
+      len = e->d_addrlen;
+      DNS_UNLOCK ();
+
+      err = getnameinfo ((struct sockaddr *) &addr, len, name, sizeof (name),
+			 NULL, 0, NI_NAMEREQD);
+
+      DNS_LOCK ();
+      dns_store (e, err, name);
+    }
+
+  return NULL;
+}
+
+/* Start the resolver thread, with all signals blocked so they are
+   still delivered to the main thread.  */
+static void
+dns_start (void)
+{
+  pthread_attr_t attr;
+  pthread_t tid;
+  sigset_t all, old;
+
+  sigfillset (&all);
+  pthread_sigmask (SIG_BLOCK, &all, &old);
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  dns_thread = (pthread_create (&tid, &attr, dns_resolver, NULL) == 0);
+  pthread_attr_destroy (&attr);
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+
+  if (!dns_thread)
+    dbg_printf ("No resolver thread, names are looked up in line.\n");
+}
+#endif /* USE_THREADS */
+
+/* Ask for the entry E to be looked up.  The lock must be held.  */
+static void
+dns_request (struct dns_entry *e, time_t t)
+{
+  gettimeofday (&e->d_start, NULL);
+
+#ifdef USE_THREADS
+  if (dns_thread < 0)
+    dns_start ();
+
+  if (dns_thread)
+    {
+      if (dns_queued >= DNS_QUEUE_MAX)
+	{
+	  /* Retry with the next message from this address.  */
+	  dns_overflows++;
+	  if (e->d_state == DNS_PENDING)
+	    e->d_state = DNS_FAILED;
+	  e->d_expires = t;
+	  return;
+	}
+
+      e->d_queued = 1;
+      e->d_qnext = NULL;
+      *dns_queue_tail = e;
+      dns_queue_tail = &e->d_qnext;
+      dns_queued++;
+      pthread_cond_signal (&dns_cond);
+      return;
+    }
+#else
+  (void) t;
+#endif /* USE_THREADS */
+
+  {
+    char name[NI_MAXHOST];
+    int err;
+
+    err = getnameinfo ((struct sockaddr *) &e->d_addr, e->d_addrlen,
+		       name, sizeof (name), NULL, 0, NI_NAMEREQD);
+    dns_store (e, err, name);
+  }
+}
+
+/* Copy the cached host name of the address F into NAME, which has
+   room for SIZE characters, and return 1.  Return 0 while the name
+   is unknown, after having requested a lookup when needed.  */
+static int
+dns_lookup (const struct sockaddr *f, char *name, size_t size)
+{
+  struct sockaddr_storage key;
+  struct dns_entry *e;
+  socklen_t len;
+  unsigned int h;
+  time_t t;
+  int found = 0;
+
+  len = dns_key (&key, f);
+  if (len == 0)
+    return 0;
+  h = dns_hashkey (&key, len);
+  time (&t);
+
+  DNS_LOCK ();
+  for (e = dns_hash[h & (DNS_HASH_SIZE - 1)]; e; e = e->d_hnext)
+    if (e->d_hash == h && e->d_addrlen == len
+	&& memcmp (&e->d_addr, &key, len) == 0)
+      break;
+
+  if (e)
+    {
+      dns_lru_unlink (e);
+      dns_lru_push (e);
+
+      switch (e->d_state)
+	{
+	case DNS_FOUND:
+	  dns_hits++;
+	  break;
+	case DNS_FAILED:
+	  dns_neg_hits++;
+	  break;
+	default:
+	  dns_pending_hits++;
+	}
+
+      /* An expired name is still used while it is refreshed.  */
+      if (!e->d_queued && t >= e->d_expires)
+	dns_request (e, t);
+    }
+  else
+    {
+      dns_misses++;
+      e = dns_alloc ();
+      if (e)
+	{
+	  memcpy (&e->d_addr, &key, sizeof (key));
+	  e->d_addrlen = len;
+	  e->d_hash = h;
+	  e->d_state = DNS_PENDING;
+	  e->d_queued = 0;
+	  e->d_hnext = dns_hash[h & (DNS_HASH_SIZE - 1)];
+	  dns_hash[h & (DNS_HASH_SIZE - 1)] = e;
+	  dns_lru_push (e);
+	  dns_request (e, t);
+	}
+      else
+	dns_overflows++;
+    }
+
+  if (e && e->d_state == DNS_FOUND)
+    {
+      strncpy (name, e->d_name, size - 1);
+      name[size - 1] = '\0';
+      found = 1;
+    }
+
+  if (dns_lookups != dns_reported)
+    {
+      dns_reported = dns_lookups;
+      dns_stats ();
+    }
+  DNS_UNLOCK ();
+
+  return found;
+}
+
+/* Let every cached answer expire, so that it is looked up anew
+   when next needed.  */
+static void
+dns_expire (void)
+{
+  struct dns_entry *e;
+
+  DNS_LOCK ();
+  for (e = dns_lru; e; e = e->d_next)
+    e->d_expires = 0;
+  dns_stats ();
+  DNS_UNLOCK ();
+}
+
+/* Print the cache statistics in debug mode.  The lock must be held.  */
+static void
+dns_stats (void)
+{
+  dbg_printf ("DNS cache: %lu entries, %lu hits, %lu negative, "
+	      "%lu pending, %lu misses, %lu overflows\n",
+	      (unsigned long) dns_entries, dns_hits, dns_neg_hits,
+	      dns_pending_hits, dns_misses, dns_overflows);
+  dbg_printf ("DNS cache: %lu lookups, %lu failed, %lu queued, "
+	      "latency %.1f ms average, %.1f ms maximum\n",
+	      dns_lookups, dns_failures, (unsigned long) dns_queued,
+	      dns_lookups ? 1000 * dns_latency / dns_lookups : 0.0,
+	      1000 * dns_max_latency);
+}
+
+/* The host names of the last message logged to each entry of Files
+   are interned, so that entries share them, and a name seen before
+   costs neither an allocation nor a copy.  Names no longer in use
+   are kept for a later message, up to HOST_UNUSED_MAX of them.  */
+#define HOST_HASH_SIZE	256	/* Power of two.  */
+#define HOST_UNUSED_MAX	256
+
+struct host_name
+{
+  struct host_name *h_hnext;	/* Next in hash chain.  */
+  struct host_name *h_prev;	/* Neighbours in list of unused names.  */
+  struct host_name *h_next;
+  unsigned int h_hash;
+  int h_refs;			/* Entries of Files using the name.  */
+  char h_name[];
+};
+
+static struct host_name *host_hash[HOST_HASH_SIZE];
+static struct host_name *host_unused;	/* Most recently released.  */
+static struct host_name *host_unused_tail;
+static size_t host_nunused;
+
+#define HOST_ENTRY(name) \
+  ((struct host_name *) ((name) - offsetof (struct host_name, h_name)))
+
+static void
+host_unused_unlink (struct host_name *h)
+{
+  if (h->h_prev)
+    h->h_prev->h_next = h->h_next;
+  else
+    host_unused = h->h_next;
+  if (h->h_next)
+    h->h_next->h_prev = h->h_prev;
+  else
+    host_unused_tail = h->h_prev;
+  h->h_prev = h->h_next = NULL;
+  host_nunused--;
+}
+
+/* Return the interned copy of NAME, with a reference taken for the
+   caller, or NULL if out of memory.  */
+static const char *
+host_intern (const char *name)
+{
+  struct host_name *h;
+  unsigned int hash = HASH_INIT;
+  const char *p;
+
+  for (p = name; *p; p++)
+    hash = HASH_STEP (hash, *p);
+
+  for (h = host_hash[hash & (HOST_HASH_SIZE - 1)]; h; h = h->h_hnext)
+    if (h->h_hash == hash && strcmp (h->h_name, name) == 0)
+      {
+	if (h->h_refs++ == 0)
+	  host_unused_unlink (h);
+	return h->h_name;
+      }
+
+  h = malloc (sizeof (*h) + (p - name) + 1);
+  if (h == NULL)
+    return NULL;
+  memcpy (h->h_name, name, (p - name) + 1);
+  h->h_hash = hash;
+  h->h_refs = 1;
+  h->h_prev = h->h_next = NULL;
+  h->h_hnext = host_hash[hash & (HOST_HASH_SIZE - 1)];
+  host_hash[hash & (HOST_HASH_SIZE - 1)] = h;
+
+  return h->h_name;
+}
+
+/* Drop a reference to NAME, as returned by host_intern().  */
+static void
+host_release (const char *name)
+{
+  struct host_name *h, **hp;
+
+  if (name == NULL)
+    return;
+
+  h = HOST_ENTRY (name);
+  if (--h->h_refs > 0)
+    return;
+
+  h->h_prev = NULL;
+  h->h_next = host_unused;
+  if (host_unused)
+    host_unused->h_prev = h;
+  else
+    host_unused_tail = h;
+  host_unused = h;
+  host_nunused++;
+
+  if (host_nunused <= HOST_UNUSED_MAX)
+    return;
+
+  /* Forget the name released longest ago.  */
+  h = host_unused_tail;
+  host_unused_unlink (h);
+  for (hp = &host_hash[h->h_hash & (HOST_HASH_SIZE - 1)]; *hp;
+       hp = &(*hp)->h_hnext)
+    if (*hp == h)
+      {
+	*hp = h->h_hnext;
+	break;
+      }
+  free (h);
+}
+
+/* Rate limits.
+
+   With --rate-limit, each remote host is given a token bucket, which
+   fills at the given rate up to the size of a burst, and a message is
+   accepted when it can take a token from it.  With --rate-limit-program
+   the same holds for each program name on each host.  The buckets are
+   kept in a hash table of bounded size, and the one used least
+   recently is recycled when it is full.  Instead of the suppressed
+   messages, their number is logged.  */
+
+struct rate_entry
+{
+  struct rate_entry *r_hnext;	/* Next in hash chain.  */
+  struct rate_entry *r_prev;	/* Neighbours in LRU list.  */
+  struct rate_entry *r_next;
+  unsigned int r_hash;
+  size_t r_keylen;
+  char r_key[RATE_KEYLEN];	/* Address, or host and program.  */
+  double r_tokens;		/* Messages which may pass.  */
+  double r_stamp;		/* When R_TOKENS was computed.  */
+  unsigned long r_suppressed;	/* Not yet reported.  */
+};
+
+struct ratelimit
+{
+  double rl_rate;		/* Messages per second.  */
+  double rl_burst;		/* Size of a bucket.  */
+  struct rate_entry *rl_hash[RATE_HASH_SIZE];
+  struct rate_entry *rl_lru;	/* Most recently used.  */
+  struct rate_entry *rl_lru_tail;	/* Least recently used.  */
+  size_t rl_entries;
+  size_t rl_pending;		/* Entries with suppressed messages.  */
+  time_t rl_report;		/* When to report them.  */
+  unsigned long rl_total;	/* Statistics.  */
+  unsigned long rl_recycled;
+};
+
+static struct ratelimit *
+rate_new (double rate, double burst)
+{
+  struct ratelimit *rl = calloc (1, sizeof (*rl));
+
+  if (rl == NULL)
+    error (EXIT_FAILURE, errno, "can't allocate rate limit");
+  rl->rl_rate = rate;
+  rl->rl_burst = burst;
+  return rl;
+}
+
+static void
+rate_lru_unlink (struct ratelimit *rl, struct rate_entry *e)
+{
+  if (e->r_prev)
+    e->r_prev->r_next = e->r_next;
+  else
+    rl->rl_lru = e->r_next;
+  if (e->r_next)
+    e->r_next->r_prev = e->r_prev;
+  else
+    rl->rl_lru_tail = e->r_prev;
+  e->r_prev = e->r_next = NULL;
+}
+
+static void
+rate_lru_push (struct ratelimit *rl, struct rate_entry *e)
+{
+  e->r_prev = NULL;
+  e->r_next = rl->rl_lru;
+  if (rl->rl_lru)
+    rl->rl_lru->r_prev = e;
+  else
+    rl->rl_lru_tail = e;
+  rl->rl_lru = e;
+}
+
+/* Log the number of messages suppressed for E.  */
+static void
+rate_report (struct ratelimit *rl, struct rate_entry *e)
+{
+  char buf[200], name[INET6_ADDRSTRLEN];
+  const struct sockaddr *sa = (const struct sockaddr *) e->r_key;
 
-	  close (f->f_file);
-	  /* Check for errors on TTY's due to loss of tty. */
-	  if ((e == EIO || e == EBADF)
-	      && (f->f_type == F_TTY || f->f_type == F_CONSOLE))
-	    {
-	      f->f_file = open (f->f_un.f_fname, O_WRONLY | O_APPEND, 0);
-	      if (f->f_file < 0)
-		{
-		  f->f_type = F_UNUSED;
-		  logerror (f->f_un.f_fname);
-		  free (f->f_un.f_fname);
-		  f->f_un.f_fname = NULL;
-		}
-	      else
-		goto again;
-	    }
-	  else
-	    {
-	      f->f_type = F_UNUSED;
-	      errno = e;
-	      logerror (f->f_un.f_fname);
-	      free (f->f_un.f_fname);
-	      f->f_un.f_fname = NULL;
-	    }
-	}
-      else if ((flags & SYNC_FILE) && !(f->f_flags & OMIT_SYNC))
-	fsync (f->f_file);
-      break;
+  if (e->r_suppressed == 0)
+    return;
 
-    case F_USERS:
-    case F_WALL:
-      f->f_time = now;
-      dbg_printf ("\n");
-      v->iov_base = (char *) "\r\n";
-      v->iov_len = 2;
-      wallmsg (f, iov);
-      break;
+  if (rl == SourceLimit)
+    {
+      if (getnameinfo (sa, e->r_keylen, name, sizeof (name), NULL, 0,
+		       NI_NUMERICHOST))
+	strcpy (name, "?");
+      snprintf (buf, sizeof (buf), "syslogd: %lu messages from %s "
+		"suppressed", e->r_suppressed, name);
     }
-
-  if (f->f_type != F_FORW_UNKN)
-    f->f_prevcount = 0;
+  else
+    snprintf (buf, sizeof (buf), "syslogd: %lu messages of %s from %s "
+	      "suppressed", e->r_suppressed,
+	      e->r_key + strlen (e->r_key) + 1, e->r_key);
+
+  rl->rl_total += e->r_suppressed;
+  e->r_suppressed = 0;
+  rl->rl_pending--;
+  logmsg (LOG_SYSLOG | LOG_WARNING, buf, LocalHostName, ADDDATE);
 }
 
-/* Write the specified message to either the entire world,
- * or to a list of approved users.  */
-void
-wallmsg (struct filed *f, struct iovec *iov)
+/* Take a token for the key of LEN bytes at KEY from the bucket in
+   RL.  Return 1 if the message shall be suppressed.  */
+static int
+rate_take (struct ratelimit *rl, const char *key, size_t len)
 {
-  static int reenter;		/* Avoid calling ourselves.  */
-  STRUCT_UTMP *utp;
-#if defined UTMP_NAME_FUNCTION || !defined HAVE_GETUTXENT
-  STRUCT_UTMP *utmpbuf;
-  size_t utmp_count;
-#endif /* UTMP_NAME_FUNCTION || !HAVE_GETUTXENT */
-  int i;
-  char *p;
-  char line[sizeof (utp->ut_line) + 1];
+  struct rate_entry *e;
+  struct timeval tv;
+  unsigned int h = HASH_INIT;
+  double t;
+  size_t i;
 
-  if (reenter++)
-    return;
+  if (len > RATE_KEYLEN)
+    len = RATE_KEYLEN;
+  for (i = 0; i < len; i++)
+    h = HASH_STEP (h, key[i]);
 
-#if !defined UTMP_NAME_FUNCTION && defined HAVE_GETUTXENT
-  setutxent ();
+  gettimeofday (&tv, NULL);
+  t = tv.tv_sec + tv.tv_usec / 1e6;
 
-  while ((utp = getutxent ()))
-#else /* UTMP_NAME_FUNCTION || !HAVE_GETUTXENT */
-  if (read_utmp (UTMP_FILE, &utmp_count, &utmpbuf,
-		 READ_UTMP_USER_PROCESS | READ_UTMP_CHECK_PIDS) < 0)
+  for (e = rl->rl_hash[h & (RATE_HASH_SIZE - 1)]; e; e = e->r_hnext)
+    if (e->r_hash == h && e->r_keylen == len
+	&& memcmp (e->r_key, key, len) == 0)
+      break;
+
+  if (e)
     {
-      logerror ("opening utmp file");
-      return;
+      rate_lru_unlink (rl, e);
+      e->r_tokens += (t - e->r_stamp) * rl->rl_rate;
+      if (e->r_tokens > rl->rl_burst)
+	e->r_tokens = rl->rl_burst;
     }
-
-  for (utp = utmpbuf; utp < utmpbuf + utmp_count; utp++)
-#endif /* UTMP_NAME_FUNCTION || !HAVE_GETUTXENT */
+  else
     {
-      strncpy (line, utp->ut_line, sizeof (utp->ut_line));
-      line[sizeof (utp->ut_line)] = '\0';
-      if (f->f_type == F_WALL)
+      if (rl->rl_entries < RATE_TABLE_SIZE
+	  && (e = calloc (1, sizeof (*e))) != NULL)
+	rl->rl_entries++;
+      else
 	{
-	  /* Note we're using our own version of ttymsg
-	     which does a double fork () to not have
-	     zombies.  No need to waitpid().  */
-	  p = ttymsg (iov, IOVCNT, line, TTYMSGTIME);
-	  if (p != NULL)
-	    {
-	      errno = 0;	/* Already in message. */
-	      logerror (p);
-	    }
-	  continue;
-	}
-      /* Should we send the message to this user? */
-      for (i = 0; i < f->f_un.f_user.f_nusers; i++)
-	if (!strncmp (f->f_un.f_user.f_unames[i], UT_USER (utp),
-		      sizeof (UT_USER (utp))))
-	  {
-	    p = ttymsg (iov, IOVCNT, line, TTYMSGTIME);
-	    if (p != NULL)
+	  struct rate_entry **ep;
+
+	  /* Recycle the least recently used bucket.  */
+	  e = rl->rl_lru_tail;
+	  if (e == NULL)
+	    return 0;
+	  rate_report (rl, e);
+	  rate_lru_unlink (rl, e);
+	  for (ep = &rl->rl_hash[e->r_hash & (RATE_HASH_SIZE - 1)]; *ep;
+	       ep = &(*ep)->r_hnext)
+	    if (*ep == e)
 	      {
-		errno = 0;	/* Already in message. */
-		logerror (p);
+		*ep = e->r_hnext;
+		break;
 	      }
-	    break;
-	  }
+	  rl->rl_recycled++;
+	}
+      e->r_hash = h;
+      e->r_keylen = len;
+      memcpy (e->r_key, key, len);
+      e->r_tokens = rl->rl_burst;
+      e->r_suppressed = 0;
+      e->r_hnext = rl->rl_hash[h & (RATE_HASH_SIZE - 1)];
+      rl->rl_hash[h & (RATE_HASH_SIZE - 1)] = e;
     }
-#if defined UTMP_NAME_FUNCTION || !defined HAVE_GETUTXENT
-  free (utmpbuf);
-#else /* !UTMP_NAME_FUNCTION && HAVE_GETUTXENT */
-  endutxent ();
-#endif
-  reenter = 0;
+  e->r_stamp = t;
+  rate_lru_push (rl, e);
+
+  if (e->r_tokens >= 1)
+    {
+      e->r_tokens -= 1;
+      return 0;
+    }
+
+  if (e->r_suppressed++ == 0 && rl->rl_pending++ == 0)
+    rl->rl_report = tv.tv_sec + RATE_REPORT;
+  return 1;
+}
+
+/* Return 1 if a message from the remote address SA of length LEN
+   exceeds the rate limit of its host.  */
+static int
+rate_source (const struct sockaddr *sa, socklen_t len)
+{
+  struct sockaddr_storage key;
+
+  len = dns_key (&key, sa);
+  if (len == 0)
+    return 0;
+  return rate_take (SourceLimit, (const char *) &key, len);
+}
+
+/* Return 1 if the message MSG, which came from HNAME, exceeds the
+   rate limit of its program.  The time stamp, if any, is skipped,
+   and the name extends to a colon, bracket, or space.  */
+static int
+rate_program (const char *hname, const char *msg)
+{
+  char key[RATE_KEYLEN];
+  size_t hlen, n;
+
+  if (strlen (msg) >= 16 && msg[3] == ' ' && msg[6] == ' '
+      && msg[9] == ':' && msg[12] == ':' && msg[15] == ' ')
+    msg += 16;
+
+  hlen = strlen (hname);
+  if (hlen > RATE_KEYLEN / 2 - 1)
+    hlen = RATE_KEYLEN / 2 - 1;
+  memcpy (key, hname, hlen);
+  key[hlen++] = '\0';
+
+  for (n = 0; hlen + n < RATE_KEYLEN - 1 && msg[n] && msg[n] != ':'
+	 && msg[n] != '[' && msg[n] != ' '; n++)
+    key[hlen + n] = msg[n];
+  if (n == 0)
+    return 0;
+  key[hlen + n] = '\0';
+
+  return rate_take (ProgramLimit, key, hlen + n + 1);
+}
+
+/* Report the suppressed messages of RL, when due or if ALL is set.
+   Return the number of milliseconds until the next report, or -1.  */
+static long
+rate_flush_one (struct ratelimit *rl, int all)
+{
+  struct rate_entry *e;
+  time_t t;
+
+  if (rl == NULL || rl->rl_pending == 0)
+    return -1;
+
+  t = time ((time_t *) 0);
+  if (!all && t < rl->rl_report)
+    return (rl->rl_report - t) * 1000;
+
+  for (e = rl->rl_lru; e && rl->rl_pending; e = e->r_next)
+    rate_report (rl, e);
+
+  dbg_printf ("Rate limit: %lu buckets, %lu recycled, %lu messages "
+	      "suppressed.\n", (unsigned long) rl->rl_entries,
+	      rl->rl_recycled, rl->rl_total);
+  return -1;
+}
+
+static long
+rate_flush (int all)
+{
+  long ms = rate_flush_one (SourceLimit, all);
+  long ms2 = rate_flush_one (ProgramLimit, all);
+
+  if (ms < 0 || (ms2 >= 0 && ms2 < ms))
+    ms = ms2;
+  return ms;
+}
+
+/* Return the current time NOW in the format of ctime().  Messages
+   arrive many to the second, so the text is only renewed when the
+   second has changed.  Unlike ctime(), localtime_r() need not look
+   for changes of the time zone each time; init() calls tzset().  */
+static const char *
+ctime_now (void)
+{
+  static const char days[] = "SunMonTueWedThuFriSat";
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  static time_t cached = (time_t) -1;
+  static char text[64];
+  struct tm tm;
+
+  if (now != cached && localtime_r (&now, &tm))
+    {
+      snprintf (text, sizeof (text), "%.3s %.3s%3d %.2d:%.2d:%.2d %d\n",
+		days + 3 * tm.tm_wday, months + 3 * tm.tm_mon, tm.tm_mday,
+		tm.tm_hour, tm.tm_min, tm.tm_sec, 1900 + tm.tm_year);
+      cached = now;
+    }
+  return text;
 }
 
 /* Return a printable representation of a host address.  */
@@ -1693,9 +4382,7 @@ cvthname (struct sockaddr *f, socklen_t len)
 
   dbg_printf ("cvthname(%s)\n", addrstr);
 
-  err = getnameinfo (f, len, addrname, sizeof (addrname),
-		     NULL, 0, NI_NAMEREQD);
-  if (err)
+  if (!dns_lookup (f, addrname, sizeof (addrname)))
     {
       dbg_printf ("Host name for your address (%s) unknown.\n", addrstr);
       return addrstr;
@@ -1741,8 +4428,22 @@ cvthname (struct sockaddr *f, socklen_t len)
   return addrname;
 }
 
+/* The timer for marks and repeated messages went off.  Their work
+   takes the locks of writer queues, and is left to the main loop,
+   like a restart.  */
 void
 domark (int signo MAYBE_UNUSED)
+{
+  marking = 1;
+#ifndef HAVE_SIGACTION
+  signal (SIGALRM, domark);
+#endif
+  alarm (TIMERINTVL);
+}
+
+/* Log a mark when one is due, and flush repeated messages.  */
+static void
+mark_run (void)
 {
   struct filed *f;
 
@@ -1768,11 +4469,6 @@ domark (int signo MAYBE_UNUSED)
 	  BACKOFF (f);
 	}
     }
-
-#ifndef HAVE_SIGACTION
-  signal (SIGALRM, domark);
-#endif
-  alarm (TIMERINTVL);
 }
 
 /* Print syslogd errors some place.  */
@@ -1804,14 +4500,30 @@ die (int signo)
   char buf[100];
   size_t i;
 
+#ifdef USE_THREADS
+  if (wq_inside)
+    {
+      wq_exit = signo;
+      return;
+    }
+#endif
+
   Initialized = 0;		/* Don't log SIGCHLDs. */
+
+  /* Write directly from now on.  */
+  QueueSize = 0;
+  for (f = Files; f != NULL; f = f->f_next)
+    wqueue_stop (f);
+
   for (f = Files; f != NULL; f = f->f_next)
     {
       /* Flush any pending output.  */
       if (f->f_prevcount)
 	fprintlog (f, LocalHostName, 0, (char *) NULL);
+      flush_filed (f);
     }
   Initialized = was_initialized;
+  rate_flush (1);
   if (signo)
     {
       dbg_printf ("%s: exiting on signal %d\n",
@@ -1821,6 +4533,16 @@ die (int signo)
       logerror (buf);
     }
 
+  for (f = Files; f != NULL; f = f->f_next)
+    {
+      flush_filed (f);
+      if (f->f_type == F_FILE)
+	sync_report (f);
+      if (f->f_type == F_FORW || f->f_type == F_FORW_SUSP
+	  || f->f_type == F_FORW_UNKN)
+	fwd_stop (f);
+    }
+
   if (fklog >= 0)
     close (fklog);
 
@@ -1836,6 +4558,14 @@ die (int signo)
     close (finet[IU_FD_IP4]);
   if (finet[IU_FD_IP6] >= 0)
     close (finet[IU_FD_IP6]);
+  if (ftcp[IU_FD_IP4] >= 0)
+    close (ftcp[IU_FD_IP4]);
+  if (ftcp[IU_FD_IP6] >= 0)
+    close (ftcp[IU_FD_IP6]);
+  if (fforw[IU_FD_IP4] >= 0)
+    close (fforw[IU_FD_IP4]);
+  if (fforw[IU_FD_IP6] >= 0)
+    close (fforw[IU_FD_IP6]);
 
   exit (EXIT_SUCCESS);
 }
@@ -2086,17 +4816,241 @@ load_confdir (const char *dirname, struct filed **nextp)
   return (found ? rc : 1);
 }
 
+/* Store in LISTS the lists of entries of the index D which may take
+   MSG of facility FAC and level PRILEV: first the list of entries
+   without program selector, then those of the selectors matching
+   MSG.  Return their number, or -1 when there are more than
+   DISPATCH_MERGE of them.  */
+static int
+dispatch_lists (struct dispatch *d, const char *msg, int fac, int prilev,
+		struct filed ***lists)
+{
+  struct dispatch_prog *dp;
+  unsigned int h = HASH_INIT;
+  int n, nlists = 0;
+
+  lists[nlists++] = d->d_sel[fac][prilev];
+
+  /* The usual, and desirable, formattings are:
+   *
+   *   prg: message text
+   *   prg[PIDNO]: message text
+   *
+   * A program selector matches an initial part of the message,
+   * provided it is not followed by a character which could
+   * continue a name.  Look up each such candidate in turn.
+   */
+  for (n = 0; n < d->d_maxlen && msg[n]; n++)
+    {
+      h = HASH_STEP (h, msg[n]);
+      if (isalnum (msg[n + 1]) || msg[n + 1] == '-' || msg[n + 1] == '_')
+	continue;
+
+      for (dp = d->d_prog[h % DISPATCH_HASH]; dp; dp = dp->dp_next)
+	if (dp->dp_hash == h && dp->dp_len == n + 1
+	    && strncmp (msg, dp->dp_name, n + 1) == 0)
+	  {
+	    if (nlists == DISPATCH_MERGE)
+	      return -1;
+	    lists[nlists++] = dp->dp_files;
+	  }
+    }
+
+  return nlists;
+}
+
+/* Build the dispatch index of the entries in FILES.  Return NULL
+   when memory is short, in which case logmsg() walks the list.  */
+static struct dispatch *
+dispatch_build (struct filed *files)
+{
+  static size_t count[LOG_NFACILITIES + 1][LOG_PRIMASK + 1];
+  struct dispatch *d;
+  struct dispatch_prog *dp;
+  struct filed *f;
+  unsigned int h, seq = 0;
+  int fac, lev, pass;
+
+  d = calloc (1, sizeof (*d));
+  if (d == NULL)
+    return NULL;
+
+  /* Entries taken from several lists are merged by position.  */
+  for (f = files; f; f = f->f_next)
+    f->f_seq = seq++;
+
+  /* Count the entries of each list, then fill them in.  */
+  for (pass = 0; pass < 2; pass++)
+    {
+      memset (count, 0, sizeof (count));
+      for (h = 0; h < DISPATCH_HASH; h++)
+	for (dp = d->d_prog[h]; dp; dp = dp->dp_next)
+	  dp->dp_count = 0;
+
+      for (f = files; f; f = f->f_next)
+	{
+	  if (f->f_progname == NULL)
+	    {
+	      for (fac = 0; fac <= LOG_NFACILITIES; fac++)
+		for (lev = 0; lev <= LOG_PRIMASK; lev++)
+		  if (f->f_pmask[fac] & LOG_MASK (lev))
+		    {
+		      if (pass)
+			d->d_sel[fac][lev][count[fac][lev]] = f;
+		      count[fac][lev]++;
+		    }
+	      continue;
+	    }
+
+	  for (h = HASH_INIT, lev = 0; lev < f->f_prognlen; lev++)
+	    h = HASH_STEP (h, f->f_progname[lev]);
+
+	  for (dp = d->d_prog[h % DISPATCH_HASH]; dp; dp = dp->dp_next)
+	    if (dp->dp_hash == h && dp->dp_len == f->f_prognlen
+		&& strcmp (dp->dp_name, f->f_progname) == 0)
+	      break;
+
+	  if (dp == NULL)
+	    {
+	      dp = calloc (1, sizeof (*dp));
+	      if (dp == NULL)
+		{
+		  dispatch_free (d);
+		  return NULL;
+		}
+	      dp->dp_hash = h;
+	      dp->dp_name = f->f_progname;
+	      dp->dp_len = f->f_prognlen;
+	      dp->dp_next = d->d_prog[h % DISPATCH_HASH];
+	      d->d_prog[h % DISPATCH_HASH] = dp;
+	      d->d_nprogs++;
+	      if (dp->dp_len > d->d_maxlen)
+		d->d_maxlen = dp->dp_len;
+	    }
+
+	  if (pass)
+	    dp->dp_files[dp->dp_count] = f;
+	  dp->dp_count++;
+	}
+
+      if (pass)
+	break;
+
+      for (fac = 0; fac <= LOG_NFACILITIES; fac++)
+	for (lev = 0; lev <= LOG_PRIMASK; lev++)
+	  {
+	    d->d_sel[fac][lev] = calloc (count[fac][lev] + 1,
+					 sizeof (struct filed *));
+	    if (d->d_sel[fac][lev] == NULL)
+	      {
+		dispatch_free (d);
+		return NULL;
+	      }
+	  }
+
+      for (h = 0; h < DISPATCH_HASH; h++)
+	for (dp = d->d_prog[h]; dp; dp = dp->dp_next)
+	  {
+	    dp->dp_files = calloc (dp->dp_count + 1, sizeof (struct filed *));
+	    if (dp->dp_files == NULL)
+	      {
+		dispatch_free (d);
+		return NULL;
+	      }
+	  }
+    }
+
+  return d;
+}
+
+/* Move the entries of the list FILES into a single array, in order,
+   and return it, with its length in *COUNT.  The links are kept, so
+   the array may still be walked as a list.  When memory is short,
+   return FILES itself and set *COUNT to zero.  */
+static struct filed *
+filed_compact (struct filed *files, size_t *count)
+{
+  struct filed *f, *next, *tab;
+  size_t n = 0;
+
+  *count = 0;
+  for (f = files; f; f = f->f_next)
+    n++;
+  if (n == 0)
+    return files;
+
+  tab = calloc (n, sizeof (*tab));
+  if (tab == NULL)
+    return files;
+
+  for (f = files, n = 0; f; f = next, n++)
+    {
+      next = f->f_next;
+      tab[n] = *f;
+      tab[n].f_next = next ? &tab[n + 1] : NULL;
+      free (f);
+    }
+
+  *count = n;
+  return tab;
+}
+
+static void
+dispatch_free (struct dispatch *d)
+{
+  struct dispatch_prog *dp, *next;
+  int fac, lev;
+  unsigned int h;
+
+  if (d == NULL)
+    return;
+
+  for (fac = 0; fac <= LOG_NFACILITIES; fac++)
+    for (lev = 0; lev <= LOG_PRIMASK; lev++)
+      free (d->d_sel[fac][lev]);
+
+  for (h = 0; h < DISPATCH_HASH; h++)
+    for (dp = d->d_prog[h]; dp; dp = next)
+      {
+	next = dp->dp_next;
+	free (dp->dp_files);
+	free (dp);
+      }
+
+  free (d);
+}
+
 /* INIT -- Initialize syslogd from configuration table.  */
 void
 init (int signo MAYBE_UNUSED)
 {
-  int rc, ret;
+  int rc, ret, i;
   struct filed *f, *next, **nextp;
+#ifdef HAVE_SIGACTION
+  sigset_t sigs, osigs;
+
+  sigemptyset (&sigs);
+  sigaddset (&sigs, SIGHUP);
+  sigaddset (&sigs, SIGALRM);
+  sigprocmask (SIG_BLOCK, &sigs, &osigs);
+#else
+  int omask = sigblock (sigmask (SIGHUP) | sigmask (SIGALRM));
+#endif
 
   dbg_printf ("init\n");
 
+#ifdef HAVE_TZSET
+  /* Take notice of a new time zone.  */
+  tzset ();
+#endif
+
+  /* Names of remote hosts may have changed as well.  */
+  dns_expire ();
+
   /* Close all open log files.  */
   Initialized = 0;
+  dispatch_free (Dispatch);
+  Dispatch = NULL;
   for (f = Files; f != NULL; f = next)
     {
       int j;
@@ -2104,6 +5058,10 @@ init (int signo MAYBE_UNUSED)
       /* Flush any pending output.  */
       if (f->f_prevcount)
 	fprintlog (f, LocalHostName, 0, (char *) NULL);
+      flush_filed (f);
+      wqueue_stop (f);
+      if (f->f_type == F_FILE)
+	sync_report (f);
 
       switch (f->f_type)
 	{
@@ -2117,7 +5075,9 @@ init (int signo MAYBE_UNUSED)
 	case F_FORW:
 	case F_FORW_SUSP:
 	case F_FORW_UNKN:
+	  fwd_stop (f);
 	  free (f->f_un.f_forw.f_hname);
+	  free (f->f_un.f_forw.f_port);
 	  break;
 	case F_USERS:
 	  for (j = 0; j < f->f_un.f_user.f_nusers; ++j)
@@ -2126,12 +5086,25 @@ init (int signo MAYBE_UNUSED)
 	  break;
 	}
       free (f->f_progname);
-      free (f->f_prevhost);
+      free (f->f_prevline);
+      host_release (f->f_prevhost);
+      free (f->f_obuf);
       next = f->f_next;
-      free (f);
+      if (NFiles == 0)
+	free (f);
     }
+  if (NFiles)
+    free (Files);
 
   Files = NULL;		/* Empty the table.  */
+  NFiles = 0;
+
+  for (i = 0; i < 2; i++)
+    if (fforw[i] >= 0)
+      {
+	close (fforw[i]);
+	fforw[i] = -1;
+      }
   nextp = &Files;
   facilities_seen = 0;
 
@@ -2141,8 +5114,22 @@ init (int signo MAYBE_UNUSED)
   if (!ret)
     rc = 0;		/* Some allocation errors were found.  */
 
+  Files = filed_compact (Files, &NFiles);
+  Dispatch = dispatch_build (Files);
+  if (Dispatch)
+    dbg_printf ("Dispatch index with %lu program selectors.\n",
+		(unsigned long) Dispatch->d_nprogs);
+  else
+    dbg_printf ("No dispatch index, using the plain list.\n");
+
   Initialized = 1;
 
+#ifdef HAVE_SIGACTION
+  sigprocmask (SIG_SETMASK, &osigs, 0);
+#else
+  sigsetmask (omask);
+#endif
+
   if (Debug)
     {
       for (f = Files; f; f = f->f_next)
@@ -2166,7 +5153,8 @@ init (int signo MAYBE_UNUSED)
 	    case F_FORW:
 	    case F_FORW_SUSP:
 	    case F_FORW_UNKN:
-	      dbg_printf ("%s", f->f_un.f_forw.f_hname);
+	      dbg_printf ("%s%s", f->f_un.f_forw.f_hname,
+			  f->f_un.f_forw.f_stream ? " (TCP)" : "");
 	      break;
 
 	    case F_USERS:
@@ -2346,7 +5334,39 @@ cfline (const char *line, struct filed *f)
   switch (*p)
     {
     case '@':
-      f->f_un.f_forw.f_hname = strdup (++p);
+      /* Two of them ask for TCP.  */
+      if (*++p == '@')
+	{
+	  f->f_un.f_forw.f_stream = 1;
+	  p++;
+	}
+      f->f_file = -1;
+
+      /* A port may follow the host, after a colon.  A numeric IPv6
+         address then needs brackets.  */
+      f->f_un.f_forw.f_hname = bp = strdup (p);
+      f->f_un.f_forw.f_port = NULL;
+      if (bp)
+	{
+	  char *colon = strrchr (bp, ':'), *end;
+
+	  if (*bp == '[' && (end = strchr (bp, ']'))
+	      && (!end[1] || end + 1 == colon))
+	    {
+	      *end = '\0';
+	      memmove (bp, bp + 1, end - bp);
+	      colon = end[1] ? end : NULL;
+	    }
+	  else if (colon != strchr (bp, ':'))
+	    colon = NULL;	/* Bare IPv6 address.  */
+	  if (colon)
+	    {
+	      *colon = '\0';
+	      if (colon[1])
+		f->f_un.f_forw.f_port = strdup (colon + 1);
+	    }
+	  p = bp;
+	}
       memset (&hints, 0, sizeof (hints));
       hints.ai_family = usefamily;
       hints.ai_socktype = SOCK_DGRAM;
@@ -2358,7 +5378,9 @@ cfline (const char *line, struct filed *f)
       f->f_un.f_forw.f_addrlen = 0;	/* Invalidate address.  */
       memset (&f->f_un.f_forw.f_addr, 0, sizeof (f->f_un.f_forw.f_addr));
 
-      err = getaddrinfo (p, LogForwardPort, &hints, &rp);
+      err = getaddrinfo (p, f->f_un.f_forw.f_port
+			 ? f->f_un.f_forw.f_port : LogForwardPort,
+			 &hints, &rp);
       if (err)
 	{
 	  switch (err)
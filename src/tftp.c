@@ -52,6 +52,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/file.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <time.h>
 
@@ -94,11 +95,13 @@
 #endif
 
 char ackbuf[PKTSIZE];
+char reqbuf[PKTSIZE];
 int timeout;
-jmp_buf timeoutbuf;
+sigjmp_buf timeoutbuf;
 
 static void nak (int);
 static int makerequest (int, const char *, struct tftphdr *, const char *);
+static int getoptions (struct tftphdr *, int);
 static void printstats (const char *, unsigned long);
 static void startclock (void);
 static void stopclock (void);
@@ -106,10 +109,18 @@ static void timer (int);
 static void tpacket (const char *, struct tftphdr *, int);
 
 #define TIMEOUT		5	/* secs between rexmt's */
+#define OPTSPACE	80	/* room for options in a request */
 
 static int rexmtval = TIMEOUT;
 static int maxtimeout = 5 * TIMEOUT;
 
+static int blksize = SEGSIZE;	/* in effect for a transfer */
+static int windowsize = 1;
+static long tsize;		/* announced size, or -1 */
+static int opt_blksize;		/* options to request, unless zero */
+static int opt_windowsize;
+static int opt_tsize;
+
 static struct sockaddr_storage peeraddr;	/* filled in by main */
 static socklen_t peerlen;
 static int f = -1;				/* the opened socket */
@@ -124,7 +135,7 @@ char line[200];
 int margc;
 char *margv[20];
 char *prompt = "tftp";
-jmp_buf toplevel;
+sigjmp_buf toplevel;
 void intr (int signo);
 
 void get (int, char **);
@@ -134,11 +145,14 @@ void put (int, char **);
 void quit (int, char **);
 void setascii (int, char **);
 void setbinary (int, char **);
+void setblksize (int, char **);
 void setpeer (int, char **);
 void setrexmt (int, char **);
 void settimeout (int, char **);
 void settrace (int, char **);
+void settsize (int, char **);
 void setverbose (int, char **);
+void setwindowsize (int, char **);
 void status (int, char **);
 
 static void command (void);
@@ -150,7 +164,7 @@ static void settftpmode (char *);
 static in_port_t get_port (struct sockaddr_storage *);
 static void set_port (struct sockaddr_storage *, in_port_t);
 
-#define HELPINDENT (sizeof("connect"))
+#define HELPINDENT (sizeof("windowsize"))
 
 struct cmd
 {
@@ -172,6 +186,9 @@ char xhelp[] = "set per-packet retransmission timeout";
 char ihelp[] = "set total retransmission timeout";
 char ashelp[] = "set mode to netascii";
 char bnhelp[] = "set mode to octet";
+char bshelp[] = "set block size to negotiate";
+char tshelp[] = "toggle negotiation of transfer size";
+char wshelp[] = "set window size to negotiate";
 
 struct cmd cmdtab[] = {
   {"connect", chelp, setpeer},
@@ -186,6 +203,9 @@ struct cmd cmdtab[] = {
   {"ascii", ashelp, setascii},
   {"rexmt", xhelp, setrexmt},
   {"timeout", ihelp, settimeout},
+  {"blksize", bshelp, setblksize},
+  {"windowsize", wshelp, setwindowsize},
+  {"tsize", tshelp, settsize},
   {"?", hhelp, help},
   {NULL, NULL, NULL}
 };
@@ -289,11 +309,11 @@ main (int argc, char *argv[])
   signal (SIGINT, intr);
   if (hostport_argc > 1)
     {
-      if (setjmp (toplevel) != 0)
+      if (sigsetjmp (toplevel, 1) != 0)
 	exit (EXIT_SUCCESS);
       setpeer (hostport_argc, hostport_argv);
     }
-  if (setjmp (toplevel) != 0)
+  if (sigsetjmp (toplevel, 1) != 0)
     putchar ('\n');
   command ();
 }
@@ -788,6 +808,56 @@ settimeout (int argc, char *argv[])
     maxtimeout = t;
 }
 
+/* Return the value of an option set by command ARGV, or -1 when it
+   lies outside of MIN to MAX.  Zero turns the option off.  */
+static int
+getoptval (int argc, char *argv[], char *prompt, int min, int max)
+{
+  char *ep;
+  long t;
+
+  if (argc < 2)
+    get_args (argv[0], prompt, &argc, &argv);
+
+  if (argc != 2)
+    {
+      printf ("usage: %s value\n", argv[0]);
+      return -1;
+    }
+  t = strtol (argv[1], &ep, 10);
+  if (*ep || (t != 0 && (t < min || t > max)))
+    {
+      printf ("%s: bad value, use 0 or %d to %d\n", argv[1], min, max);
+      return -1;
+    }
+  return t;
+}
+
+void
+setblksize (int argc, char *argv[])
+{
+  int t = getoptval (argc, argv, "(size) ", MINBLKSIZE, MAXBLKSIZE);
+
+  if (t >= 0)
+    opt_blksize = t;
+}
+
+void
+setwindowsize (int argc, char *argv[])
+{
+  int t = getoptval (argc, argv, "(blocks) ", 1, MAXWINDOW);
+
+  if (t >= 0)
+    opt_windowsize = t;
+}
+
+void
+settsize (int argc MAYBE_UNUSED, char *argv[] MAYBE_UNUSED)
+{
+  opt_tsize = !opt_tsize;
+  printf ("Transfer size option %s.\n", opt_tsize ? "on" : "off");
+}
+
 void
 status (int argc MAYBE_UNUSED, char *argv[] MAYBE_UNUSED)
 {
@@ -799,6 +869,11 @@ status (int argc MAYBE_UNUSED, char *argv[] MAYBE_UNUSED)
 	  verbose ? "on" : "off", trace ? "on" : "off");
   printf ("Rexmt-interval: %d seconds, Max-timeout: %d seconds\n",
 	  rexmtval, maxtimeout);
+  if (opt_blksize || opt_windowsize || opt_tsize)
+    printf ("Options: blksize %d, windowsize %d, tsize %s\n",
+	    opt_blksize, opt_windowsize, opt_tsize ? "on" : "off");
+  else
+    printf ("Options: off\n");
 }
 
 void
@@ -806,7 +881,7 @@ intr (int signo MAYBE_UNUSED)
 {
   signal (SIGALRM, SIG_IGN);
   alarm (0);
-  longjmp (toplevel, -1);
+  siglongjmp (toplevel, -1);
 }
 
 char *
@@ -976,111 +1051,185 @@ setverbose (int argc MAYBE_UNUSED, char *argv[] MAYBE_UNUSED)
   printf ("Verbose mode %s.\n", verbose ? "on" : "off");
 }
 
+/* Make room in the socket buffer OPT for a whole window.  Packets
+   may take twice their size in the buffer, and the kernel doubles
+   the size set, for its bookkeeping, and reports the doubled size.  */
+static void
+window_buffer (int opt)
+{
+  int size = 2 * windowsize * (blksize + 4), cur;
+  socklen_t len = sizeof (cur);
+
+  if (getsockopt (f, SOL_SOCKET, opt, &cur, &len) == 0 && cur < 2 * size)
+    setsockopt (f, SOL_SOCKET, opt, &size, sizeof (size));
+}
+
 /*
- * Send the requested file.
+ * Send the requested file, a window of blocks at a time.
  */
 void
 tftp_sendfile (int fd, char *name, char *mode)
 {
   register struct tftphdr *ap;	/* data and ack packets */
-  struct tftphdr *r_init (void), *dp;
+  struct tftphdr *dp;
   register int n;
-  volatile int block, size, convert;
-  volatile unsigned long amount;
+  volatile int size, lastsize, convert;
+  volatile unsigned long amount, base, next, last;
+  unsigned short acked;
   struct sockaddr_storage from;
   socklen_t fromlen;
+  struct stat st;
   FILE *file;
 
   startclock ();		/* start stat's clock */
-  dp = r_init ();		/* reset fillbuf/read-ahead code */
   ap = (struct tftphdr *) ackbuf;
   file = fdopen (fd, "r");
   convert = !strcmp (mode, "netascii");
-  block = 0;
   amount = 0;
+  blksize = SEGSIZE;
+  windowsize = 1;
+  /* The size sent in netascii is not known in advance.  */
+  tsize = (!convert && fstat (fd, &st) == 0) ? st.st_size : -1;
 
   signal (SIGALRM, timer);
-  do
+
+  /* The request is acknowledged as block zero, or by OACK
+     when the server accepts options.  */
+  size = makerequest (WRQ, name, (struct tftphdr *) reqbuf, mode);
+  timeout = 0;
+  sigsetjmp (timeoutbuf, 1);
+  if (trace)
+    tpacket ("sent", (struct tftphdr *) reqbuf, size);
+  if (sendto (f, reqbuf, size, 0, (struct sockaddr *) &peeraddr,
+	      peerlen) != size)
     {
-      if (block == 0)
-	size = makerequest (WRQ, name, dp, mode) - 4;
-      else
+      perror ("tftp: sendto");
+      goto abort;
+    }
+  for (;;)
+    {
+      alarm (rexmtval);
+      do
 	{
-	  /*      size = read(fd, dp->th_data, SEGSIZE);   */
-	  size = readit (file, &dp, convert);
-	  if (size < 0)
+	  fromlen = sizeof (from);
+	  n = recvfrom (f, ackbuf, sizeof (ackbuf), 0,
+			(struct sockaddr *) &from, &fromlen);
+	}
+      while (n <= 0);
+      alarm (0);
+      set_port (&peeraddr, get_port (&from));
+      if (trace)
+	tpacket ("received", ap, n);
+      ap->th_opcode = ntohs (ap->th_opcode);
+      if (ap->th_opcode == OACK)
+	{
+	  if (getoptions (ap, n) < 0)
 	    {
-	      nak (errno + 100);
-	      break;
+	      nak (EOPTNEG);
+	      goto abort;
 	    }
-	  dp->th_opcode = htons ((unsigned short) DATA);
-	  dp->th_block = htons ((unsigned short) block);
+	  break;
 	}
-      timeout = 0;
-      setjmp (timeoutbuf);
-
-    send_data:
-      if (trace)
-	tpacket ("sent", dp, size + 4);
-      n = sendto (f, (const char *) dp, size + 4, 0,
-		  (struct sockaddr *) &peeraddr, peerlen);
-      if (n != size + 4)
+      ap->th_block = ntohs (ap->th_block);
+      if (ap->th_opcode == ERROR)
 	{
-	  perror ("tftp: sendto");
+	  printf ("Error code %d: %s\n", ap->th_code, ap->th_msg);
 	  goto abort;
 	}
-      read_ahead (file, convert);
+      if (ap->th_opcode == ACK && ap->th_block == 0)
+	break;
+    }
 
-      for (;;)
+  if (rw_setsize (blksize, windowsize) < 0 || r_init () == NULL)
+    {
+      nak (ENOSPACE);
+      goto abort;
+    }
+  window_buffer (SO_SNDBUF);
+
+  base = next = 1;		/* oldest unacknowledged, and next block */
+  last = 0;			/* the final block, once read */
+  lastsize = 0;
+  timeout = 0;
+  if (sigsetjmp (timeoutbuf, 1))
+    next = base;		/* send the window again */
+  for (;;)
+    {
+      while (next < base + windowsize && (last == 0 || next <= last))
 	{
-	  alarm (rexmtval);
-	  do
+	  size = readblock (file, &dp, next, convert);
+	  if (size < 0)
 	    {
-	      fromlen = sizeof (from);
-	      n = recvfrom (f, ackbuf, sizeof (ackbuf), 0,
-			    (struct sockaddr *) &from, &fromlen);
+	      nak (errno + 100);
+	      goto abort;
 	    }
-	  while (n <= 0);
-	  alarm (0);
-	  if (n < 0)
+	  if (size < blksize)
 	    {
-	      perror ("tftp: recvfrom");
-	      goto abort;
+	      last = next;
+	      lastsize = size;
 	    }
-	  set_port (&peeraddr, get_port (&from));
+	  dp->th_opcode = htons ((unsigned short) DATA);
+	  dp->th_block = htons ((unsigned short) next);
 	  if (trace)
-	    tpacket ("received", ap, n);
-	  /* should verify packet came from server */
-	  ap->th_opcode = ntohs (ap->th_opcode);
-	  ap->th_block = ntohs (ap->th_block);
-	  if (ap->th_opcode == ERROR)
+	    tpacket ("sent", dp, size + 4);
+	  n = sendto (f, (const char *) dp, size + 4, 0,
+		      (struct sockaddr *) &peeraddr, peerlen);
+	  if (n != size + 4)
 	    {
-	      printf ("Error code %d: %s\n", ap->th_code, ap->th_msg);
+	      perror ("tftp: sendto");
 	      goto abort;
 	    }
-	  if (ap->th_opcode == ACK)
-	    {
-	      int j;
-
-	      if (ap->th_block == block)
-		break;
+	  next++;
+	}
 
-	      /* On an error, try to synchronize
-	       * both sides.
-	       */
-	      j = synchnet (f);
-	      if (j && trace)
-		printf ("discarded %d packets\n", j);
+      alarm (rexmtval);
+      do
+	{
+	  fromlen = sizeof (from);
+	  n = recvfrom (f, ackbuf, sizeof (ackbuf), 0,
+			(struct sockaddr *) &from, &fromlen);
+	}
+      while (n <= 0);
+      alarm (0);
+      set_port (&peeraddr, get_port (&from));
+      if (trace)
+	tpacket ("received", ap, n);
+      /* should verify packet came from server */
+      ap->th_opcode = ntohs (ap->th_opcode);
+      ap->th_block = ntohs (ap->th_block);
+      if (ap->th_opcode == ERROR)
+	{
+	  printf ("Error code %d: %s\n", ap->th_code, ap->th_msg);
+	  goto abort;
+	}
+      if (ap->th_opcode != ACK)
+	continue;
 
-	      if (ap->th_block == (block - 1))
-		goto send_data;
-	    }
+      /* Number of blocks newly acknowledged.  */
+      acked = ap->th_block - (unsigned short) (base - 1);
+      if (acked > next - base)
+	continue;
+      if (acked)
+	timeout = 0;
+      base += acked;
+      amount = (base - 1) * blksize;
+      if (last && base > last)
+	{
+	  amount -= blksize - lastsize;
+	  break;
+	}
+      if (base < next)
+	{
+	  /* On an error, try to synchronize
+	   * both sides.
+	   */
+	  int j = synchnet (f);
+
+	  if (j && trace)
+	    printf ("discarded %d packets\n", j);
+	  next = base;
 	}
-      if (block > 0)
-	amount += size;
-      block++;
     }
-  while (size == SEGSIZE || block == 1);
 
 abort:
   fclose (file);
@@ -1090,53 +1239,69 @@ abort:
 }
 
 /*
- * Receive a file.
+ * Receive a file, acknowledging a window of blocks at a time.
  */
 void
 recvfile (int fd, char *name, char *mode)
 {
   register struct tftphdr *ap;
-  struct tftphdr *dp, *w_init (void);
+  struct tftphdr *dp;
   register int n;
-  volatile int block, size, firsttrip;
-  volatile unsigned long amount;
+  volatile int size, answered, count, reqlen;
+  volatile unsigned long block, amount;
+  unsigned short ahead;
   struct sockaddr_storage from;
   socklen_t fromlen;
   FILE *file;
   volatile int convert;		/* true if converting crlf -> lf */
 
   startclock ();
-  dp = w_init ();
   ap = (struct tftphdr *) ackbuf;
   file = fdopen (fd, "w");
   convert = !strcmp (mode, "netascii");
-  block = 1;
-  firsttrip = 1;
+  block = 0;
+  answered = 0;
   amount = 0;
+  blksize = SEGSIZE;
+  windowsize = 1;
+  tsize = 0;
+  size = 0;
+
+  /* Room for the block size asked for.  */
+  if (rw_setsize (opt_blksize ? opt_blksize : SEGSIZE, 2) < 0
+      || (dp = w_init ()) == NULL)
+    {
+      fprintf (stderr, "tftp: out of memory\n");
+      fclose (file);
+      return;
+    }
+  reqlen = makerequest (RRQ, name, (struct tftphdr *) reqbuf, mode);
 
   signal (SIGALRM, timer);
   do
     {
-      if (firsttrip)
+      timeout = 0;
+      sigsetjmp (timeoutbuf, 1);
+
+    send_ack:
+      /* Until the server answers, the request is sent again.  */
+      if (answered)
 	{
-	  size = makerequest (RRQ, name, ap, mode);
-	  firsttrip = 0;
+	  ap->th_opcode = htons ((unsigned short) ACK);
+	  ap->th_block = htons ((unsigned short) block);
+	  if (trace)
+	    tpacket ("sent", ap, 4);
+	  n = sendto (f, ackbuf, 4, 0, (struct sockaddr *) &peeraddr,
+		      peerlen) != 4;
 	}
       else
 	{
-	  ap->th_opcode = htons ((unsigned short) ACK);
-	  ap->th_block = htons ((unsigned short) (block));
-	  size = 4;
-	  block++;
+	  if (trace)
+	    tpacket ("sent", (struct tftphdr *) reqbuf, reqlen);
+	  n = sendto (f, reqbuf, reqlen, 0, (struct sockaddr *) &peeraddr,
+		      peerlen) != reqlen;
 	}
-      timeout = 0;
-      setjmp (timeoutbuf);
-
-    send_ack:
-      if (trace)
-	tpacket ("sent", ap, size);
-      if (sendto (f, ackbuf, size, 0, (struct sockaddr *) &peeraddr,
-		  peerlen) != size)
+      if (n)
 	{
 	  alarm (0);
 	  perror ("tftp: sendto");
@@ -1144,41 +1309,52 @@ recvfile (int fd, char *name, char *mode)
 	}
       write_behind (file, convert);
 
+      count = 0;
       for (;;)
 	{
 	  alarm (rexmtval);
 	  do
 	    {
 	      fromlen = sizeof (from);
-	      n = recvfrom (f, (char *) dp, PKTSIZE, 0,
+	      n = recvfrom (f, (char *) dp, (opt_blksize ? opt_blksize
+					     : SEGSIZE) + 4, 0,
 			    (struct sockaddr *) &from, &fromlen);
 	    }
 	  while (n <= 0);
 
 	  alarm (0);
-	  if (n < 0)
-	    {
-	      perror ("tftp: recvfrom");
-	      goto abort;
-	    }
 	  set_port (&peeraddr, get_port (&from));
 	  if (trace)
 	    tpacket ("received", dp, n);
 	  /* should verify client address */
 	  dp->th_opcode = ntohs (dp->th_opcode);
+	  if (dp->th_opcode == OACK && !answered)
+	    {
+	      if (getoptions (dp, n) < 0)
+		{
+		  nak (EOPTNEG);
+		  goto abort;
+		}
+	      if (verbose && tsize > 0)
+		printf ("Transfer size %ld bytes.\n", tsize);
+	      window_buffer (SO_RCVBUF);
+	      answered = 1;
+	      goto send_ack;	/* acknowledge as block zero */
+	    }
 	  dp->th_block = ntohs (dp->th_block);
 	  if (dp->th_opcode == ERROR)
 	    {
 	      printf ("Error code %d: %s\n", dp->th_code, dp->th_msg);
 	      goto abort;
 	    }
-	  if (dp->th_opcode == DATA)
+	  if (dp->th_opcode != DATA)
+	    continue;
+	  if (!answered && dp->th_block == 1)
+	    answered = 1;	/* options were ignored */
+	  if (dp->th_block != (unsigned short) (block + 1))
 	    {
 	      int j;
 
-	      if (dp->th_block == block)
-		break;		/* have next packet */
-
 	      /* On an error, try to synchronize
 	       * both sides.
 	       */
@@ -1186,20 +1362,27 @@ recvfile (int fd, char *name, char *mode)
 	      if (j && trace)
 		printf ("discarded %d packets\n", j);
 
-	      if (dp->th_block == (block - 1))
-		goto send_ack;	/* resend ack */
+	      /* Acknowledge again if our last acknowledgement
+	         was lost, or a block of the window.  */
+	      ahead = dp->th_block - (unsigned short) block;
+	      if (answered && ahead <= windowsize)
+		goto send_ack;
+	      continue;
 	    }
+	  /*      size = write(fd, dp->th_data, n - 4); */
+	  size = writeit (file, &dp, n - 4, convert);
+	  if (size < 0)
+	    {
+	      nak (errno + 100);
+	      goto abort;
+	    }
+	  block++;
+	  amount += size;
+	  if (size < blksize || ++count == windowsize)
+	    break;
 	}
-      /*      size = write(fd, dp->th_data, n - 4); */
-      size = writeit (file, &dp, n - 4, convert);
-      if (size < 0)
-	{
-	  nak (errno + 100);
-	  break;
-	}
-      amount += size;
     }
-  while (size == SEGSIZE);
+  while (size == blksize);
 
 abort:				/* ok to ack, since user */
   ap->th_opcode = htons ((unsigned short) ACK);	/* has seen err msg */
@@ -1239,6 +1422,8 @@ makerequest (int request, const char *name, struct tftphdr *tp,
 
   /* Available space for naming the target file.  */
   len = PKTSIZE - sizeof (struct tftphdr) - sizeof ("netascii");
+  if (opt_blksize || opt_windowsize || opt_tsize)
+    len -= OPTSPACE;
   arglen = strlen (name);
 
   strncpy (cp, name, len);
@@ -1251,9 +1436,63 @@ makerequest (int request, const char *name, struct tftphdr *tp,
   strcpy (cp, mode);
   cp += strlen (mode);
   *cp++ = '\0';
+
+  /* Options take at most OPTSPACE.  */
+  if (opt_blksize)
+    cp += sprintf (cp, "blksize%c%d", 0, opt_blksize) + 1;
+  if (opt_windowsize)
+    cp += sprintf (cp, "windowsize%c%d", 0, opt_windowsize) + 1;
+  if (opt_tsize && tsize >= 0)
+    cp += sprintf (cp, "tsize%c%ld", 0, tsize) + 1;
+  if ((opt_blksize || opt_windowsize || opt_tsize)
+      && rexmtval > 0 && rexmtval < 256)
+    cp += sprintf (cp, "timeout%c%d", 0, rexmtval) + 1;
   return cp - (char *) tp;
 }
 
+/* Take the options acknowledged by the server in TP, of N bytes.
+   Return zero, or -1 for an option not asked for, or a value that
+   is not acceptable.  */
+static int
+getoptions (struct tftphdr *tp, int n)
+{
+  char *cp = (char *) tp + 2, *end = (char *) tp + n;
+  char *option, *value, *ep;
+  unsigned long v;
+
+  while (cp < end)
+    {
+      option = cp;
+      value = memchr (option, '\0', end - option);
+      if (value == NULL || ++value >= end)
+	return -1;
+      cp = memchr (value, '\0', end - value);
+      if (cp == NULL)
+	return -1;
+      cp++;
+
+      errno = 0;
+      v = strtoul (value, &ep, 10);
+      if (!*value || *ep || errno)
+	return -1;
+
+      if (strcasecmp (option, "blksize") == 0 && opt_blksize
+	  && v >= MINBLKSIZE && v <= (unsigned long) opt_blksize)
+	blksize = v;
+      else if (strcasecmp (option, "windowsize") == 0 && opt_windowsize
+	       && v >= 1 && v <= (unsigned long) opt_windowsize)
+	windowsize = v;
+      else if (strcasecmp (option, "tsize") == 0 && opt_tsize)
+	tsize = v;
+      else if (strcasecmp (option, "timeout") == 0
+	       && v == (unsigned long) rexmtval)
+	;
+      else
+	return -1;
+    }
+  return 0;
+}
+
 struct errmsg
 {
   int e_code;
@@ -1268,6 +1507,7 @@ struct errmsg
     {EBADID, "Unknown transfer ID"},
     {EEXISTS, "File already exists"},
     {ENOUSER, "No such user"},
+    {EOPTNEG, "Option negotiation failed"},
     {-1, 0}
   };
 
@@ -1305,14 +1545,36 @@ nak (int error)
     perror ("nak");
 }
 
+/* Print the options from CP to END, the first preceded by SEP.  */
+static void
+printoptions (char *cp, char *end, const char *sep)
+{
+  char *value, *next;
+
+  while (cp < end)
+    {
+      value = memchr (cp, '\0', end - cp);
+      if (value == NULL || ++value >= end)
+	break;
+      next = memchr (value, '\0', end - value);
+      if (next == NULL)
+	break;
+      printf ("%s%s=%s", sep, cp, value);
+      sep = ", ";
+      cp = next + 1;
+    }
+}
+
 static void
 tpacket (const char *s, struct tftphdr *tp, int n)
 {
-  static char *opcodes[] = { "#0", "RRQ", "WRQ", "DATA", "ACK", "ERROR" };
+  static char *opcodes[] = { "#0", "RRQ", "WRQ", "DATA", "ACK", "ERROR",
+    "OACK"
+  };
   register char *cp, *file;
   unsigned short op = ntohs (tp->th_opcode);
 
-  if (op < RRQ || op > ERROR)
+  if (op < RRQ || op > OACK)
     printf ("%s opcode=%x ", s, op);
   else
     printf ("%s %s ", s, opcodes[op]);
@@ -1327,7 +1589,15 @@ tpacket (const char *s, struct tftphdr *tp, int n)
       file = cp = (char *) &(tp->th_stuff);
 #endif
       cp = strchr (cp, '\0');
-      printf ("<file=%s, mode=%s>\n", file, cp + 1);
+      printf ("<file=%s, mode=%s", file, cp + 1);
+      printoptions (strchr (cp + 1, '\0') + 1, (char *) tp + n + 2, ", ");
+      printf (">\n");
+      break;
+
+    case OACK:
+      printf ("<");
+      printoptions ((char *) tp + 2, (char *) tp + n, "");
+      printf (">\n");
       break;
 
     case DATA:
@@ -1364,12 +1634,10 @@ printstats (const char *direction, unsigned long amount)
 {
   double delta;
 
-  /* compute delta in 1/10's second units */
-  delta = ((tstop.tv_sec * 10.) + (tstop.tv_usec / 100000)) -
-    ((tstart.tv_sec * 10.) + (tstart.tv_usec / 100000));
-  delta = delta / 10.;		/* back to seconds */
-  printf ("%s %d bytes in %.1f seconds", direction, (int) amount, delta);
-  if (verbose)
+  delta = (tstop.tv_sec - tstart.tv_sec)
+    + (tstop.tv_usec - tstart.tv_usec) / 1000000.;
+  printf ("%s %lu bytes in %.1f seconds", direction, amount, delta);
+  if (verbose && delta > 0)
     printf (" [%.0f bits/sec]", (amount * 8.) / delta);
   putchar ('\n');
 }
@@ -1381,7 +1649,7 @@ timer (int sig MAYBE_UNUSED)
   if (timeout >= maxtimeout)
     {
       printf ("Transfer timed out.\n");
-      longjmp (toplevel, -1);
+      siglongjmp (toplevel, -1);
     }
-  longjmp (timeoutbuf, 1);
+  siglongjmp (timeoutbuf, 1);
 }
@@ -61,6 +61,17 @@
 #endif
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#ifdef HAVE_SYS_RESOURCE_H
+# include <sys/resource.h>
+#endif
+#ifdef HAVE_SYS_PRCTL_H
+# include <sys/prctl.h>
+#endif
+#if defined HAVE_SYS_EPOLL_H && defined HAVE_EPOLL_CREATE1
+# include <sys/epoll.h>
+# define USE_EPOLL 1
+#endif
 
 #include <netinet/in.h>
 #include <arpa/tftp.h>
@@ -70,6 +81,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdio.h>
@@ -94,13 +106,29 @@
 # define LOG_FTP LOG_DAEMON	/* Use generic facility.  */
 #endif
 
+#define DEFPORT		69	/* when the service tftp is unknown */
+#define MAXWORKERS	64	/* processes serving in daemon mode */
+#define MAXTRANSFERS	256	/* transfers served at once by a process */
+#define WINDOW_MEMORY	(64L << 20)	/* bytes of windows of a process */
+#define WHEEL_TICK	100	/* milliseconds per slot of the timer wheel */
+#define WHEEL_SLOTS	512	/* slots of the timer wheel */
+
 static int peer;
 static int rexmtval = TIMEOUT;
 static int maxtimeout = 5 * TIMEOUT;
+static int blksize = SEGSIZE;
+static int windowsize = 1;
 static char *chrootdir = NULL;
 static char *group = NULL;
 static char *user;
 
+static int daemon_mode;		/* serve all transfers in one process */
+static int usefamily = AF_UNSPEC;	/* of the daemon's socket */
+static char *port;		/* of the daemon, if not the service tftp */
+static char *pidfile;
+static int nworkers = 1;
+static int max_transfers = MAXTRANSFERS;
+
 #ifndef DEFAULT_USER
 # define DEFAULT_USER	"nobody"
 #endif
@@ -111,6 +139,8 @@ static char *user;
 #endif
 static char buf[PKTSIZE];
 static char ackbuf[PKTSIZE];
+static char oackbuf[PKTSIZE];
+static int oacklen;		/* zero unless options were accepted */
 static struct sockaddr_storage from;
 static socklen_t fromlen;
 
@@ -134,12 +164,17 @@ static int logging;
 
 static const char *errtomsg (int);
 static void nak (int);
+static void negotiate (char *, char *, int, int);
 static const char *verifyhost (struct sockaddr_storage *, socklen_t);
+static int secure_dir (void);
+static void daemon_run (void);
 
 
 
 static struct argp_option options[] = {
 #define GRP 0
+  { "daemon", 'D', NULL, 0,
+    "run standalone, serving all transfers in a single process", GRP+1},
   { "logging", 'l', NULL, 0,
     "enable logging", GRP+1},
   { "nonexistent", 'n', NULL, 0,
@@ -149,23 +184,49 @@ static struct argp_option options[] = {
 #define GRP 10
   { NULL, 0, NULL, 0, "", GRP},
   { "group", 'g', "GRP", 0,
-    "set explicit group of process owner, used with '-s'", GRP+1},
+    "set explicit group of process owner, used with '-s' or '-D'", GRP+1},
   { "secure-dir", 's', "DIR", 0,
     "change root directory to DIR before searching and "
     "serving content", GRP+1},
   { "user", 'u', "USR", 0,
-    "set name of process owner, used with '-s' and "
+    "set name of process owner, used with '-s' or '-D' and "
     "defaults to 'nobody'", GRP+1},
+#undef GRP
+#define GRP 20
+  { NULL, 0, NULL, 0, "Daemon mode:", GRP},
+  { "ipv4", '4', NULL, 0,
+    "restrict daemon to IPv4", GRP+1},
+  { "ipv6", '6', NULL, 0,
+    "restrict daemon to IPv6", GRP+1},
+  { "max-transfers", 'm', "NUM", 0,
+    "serve at most NUM transfers at once in each process", GRP+1},
+  { "pidfile", 'p', "FILE", 0,
+    "write the process id of the daemon to FILE", GRP+1},
+  { "port", 'P', "PORT", 0,
+    "listen on PORT instead of the tftp port", GRP+1},
+  { "workers", 'w', "NUM", 0,
+    "serve with NUM processes, which share the port", GRP+1},
 #undef GRP
   { NULL, 0, NULL, 0, NULL, 0}
 };
 
 static error_t
-parse_opt (int key, char *arg,
-	   struct argp_state *state MAYBE_UNUSED)
+parse_opt (int key, char *arg, struct argp_state *state)
 {
   switch (key)
     {
+    case '4':
+      usefamily = AF_INET;
+      break;
+
+    case '6':
+      usefamily = AF_INET6;
+      break;
+
+    case 'D':
+      daemon_mode = 1;
+      break;
+
     case 'l':
       logging = 1;
       break;
@@ -175,10 +236,28 @@ parse_opt (int key, char *arg,
       group = xstrdup (arg);
       break;
 
+    case 'm':
+      {
+	char *end;
+
+	max_transfers = strtol (arg, &end, 10);
+	if (*end || max_transfers < 1)
+	  argp_error (state, "invalid number of transfers: %s", arg);
+      }
+      break;
+
     case 'n':
       suppress_naks = 1;
       break;
 
+    case 'p':
+      pidfile = arg;
+      break;
+
+    case 'P':
+      port = arg;
+      break;
+
     case 's':
       chrootdir = xstrdup (arg);
       break;
@@ -188,6 +267,16 @@ parse_opt (int key, char *arg,
       user = xstrdup (arg);
       break;
 
+    case 'w':
+      {
+	char *end;
+
+	nworkers = strtol (arg, &end, 10);
+	if (*end || nworkers < 1 || nworkers > MAXWORKERS)
+	  argp_error (state, "invalid number of workers: %s", arg);
+      }
+      break;
+
     default:
       return ARGP_ERR_UNKNOWN;
     }
@@ -210,7 +299,7 @@ main (int argc, char *argv[])
 {
   int index;
   register struct tftphdr *tp;
-  int on, n;
+  int on, n, ecode;
   struct sockaddr_storage sin;
 
   user = xstrdup (DEFAULT_USER);
@@ -237,6 +326,9 @@ main (int argc, char *argv[])
 	}
     }
 
+  if (daemon_mode)
+    daemon_run ();
+
   on = 1;
   if (ioctl (0, FIONBIO, &on) < 0)
     {
@@ -336,80 +428,89 @@ main (int argc, char *argv[])
       exit (EXIT_FAILURE);
     }
 
-  if (chrootdir && *chrootdir)
+  ecode = secure_dir ();
+  if (ecode)
     {
-      struct passwd *pwd = NULL;
-      struct group *grp = NULL;
+      nak (ecode);
+      exit (EXIT_FAILURE);
+    }
+
+  tp = (struct tftphdr *) buf;
+  tp->th_opcode = ntohs (tp->th_opcode);
+  if (tp->th_opcode == RRQ || tp->th_opcode == WRQ)
+    tftp (tp, n);
+  exit (EXIT_FAILURE);
+}
 
-      /* Ignore user and group setting for non-root invocations.  */
-      if (!getuid())
+/*
+ * Change the root directory to the one given with '-s', and the owner
+ * of the process.  The daemon always gives up being root, since it
+ * serves every client from one process.  Return zero, or the error
+ * code for a nak.
+ */
+static int
+secure_dir (void)
+{
+  struct passwd *pwd = NULL;
+  struct group *grp = NULL;
+  int chrooted = chrootdir && *chrootdir;
+
+  if (!chrooted && !daemon_mode)
+    return 0;
+
+  /* Ignore user and group setting for non-root invocations.  */
+  if (!getuid())
+    {
+      pwd = getpwnam (user);
+      if (!pwd)
 	{
-	  pwd = getpwnam (user);
-	  if (!pwd)
-	    {
-	      syslog (LOG_ERR, "getpwnam('%s'): %m", user);
-	      nak (ENOUSER);
-	      exit (EXIT_FAILURE);
-	    }
+	  syslog (LOG_ERR, "getpwnam('%s'): %m", user);
+	  return ENOUSER;
+	}
 
-	  /* Group names are not portable enough to allow
-	   * for a preset value.  The server inherits
-	   * group membership from owner, in other cases.
-	   */
-	  if (group && *group)
+      /* Group names are not portable enough to allow
+       * for a preset value.  The server inherits
+       * group membership from owner, in other cases.
+       */
+      if (group && *group)
+	{
+	  grp = getgrnam (group);
+	  if (!grp)
 	    {
-	      grp = getgrnam (group);
-	      if (!grp)
-		{
-		  syslog (LOG_ERR, "getgrnam('%s'): %m", group);
-		  nak (ENOUSER);
-		  exit (EXIT_FAILURE);
-		}
+	      syslog (LOG_ERR, "getgrnam('%s'): %m", group);
+	      return ENOUSER;
 	    }
 	}
+    }
+
+  if (chrooted && (chroot (chrootdir) || chdir ("/")))
+    {
+      syslog (LOG_ERR, "chroot('%s'): %m", chrootdir);
+      return EACCESS;
+    }
 
-      if (chroot (chrootdir) || chdir ("/"))
+  if (pwd)
+    {
+      /* Supplementary groups of root are not to be kept.  */
+      if (daemon_mode && setgroups (0, NULL))
 	{
-	  syslog (LOG_ERR, "chroot('%s'): %m", chrootdir);
-	  nak (EACCESS);
-	  exit (EXIT_FAILURE);
+	  syslog (LOG_ERR, "setgroups: %m");
+	  return ENOUSER;
 	}
-
-      if (pwd)
+      if (setgid (grp ? grp->gr_gid : pwd->pw_gid))
 	{
-	  if (grp)
-	    {
-	      if (setgid (grp->gr_gid))
-		{
-		  syslog (LOG_ERR, "setgid: %m");
-		  nak (ENOUSER);
-		  exit (EXIT_FAILURE);
-		}
-	    }
-	  else
-	    {
-	      if (setgid (pwd->pw_gid))
-		{
-		  syslog (LOG_ERR, "setgid: %m");
-		  nak (ENOUSER);
-		  exit (EXIT_FAILURE);
-		}
-	    }
+	  syslog (LOG_ERR, "setgid: %m");
+	  return ENOUSER;
+	}
 
-	  if (setuid (pwd->pw_uid))
-	    {
-	      syslog (LOG_ERR, "setuid: %m");
-	      nak (ENOUSER);
-	      exit (EXIT_FAILURE);
-	    }
+      if (setuid (pwd->pw_uid))
+	{
+	  syslog (LOG_ERR, "setuid: %m");
+	  return ENOUSER;
 	}
     }
 
-  tp = (struct tftphdr *) buf;
-  tp->th_opcode = ntohs (tp->th_opcode);
-  if (tp->th_opcode == RRQ || tp->th_opcode == WRQ)
-    tftp (tp, n);
-  exit (EXIT_FAILURE);
+  return 0;
 }
 
 struct formats;
@@ -432,15 +533,17 @@ struct formats
   };
 
 /*
- * Handle initial connection protocol.
+ * Parse the request TP of SIZE bytes, check access to its file, and
+ * negotiate its options.  Return the format of the transfer, or NULL
+ * when the request was refused.
  */
-void
-tftp (struct tftphdr *tp, int size)
+static struct formats *
+request (struct tftphdr *tp, int size)
 {
   register char *cp;
   int first = 1, ecode;
   register struct formats *pf;
-  char *filename, *mode;
+  char *filename, *mode, *opts;
 
 #if HAVE_STRUCT_TFTPHDR_TH_U
   filename = cp = tp->th_stuff;
@@ -457,7 +560,7 @@ again:
   if (*cp != '\0')
     {
       nak (EBADOP);
-      exit (EXIT_FAILURE);
+      return NULL;
     }
   if (first)
     {
@@ -465,6 +568,7 @@ again:
       first = 0;
       goto again;
     }
+  opts = cp + 1;
   for (cp = mode; *cp; cp++)
     if (isupper (*cp))
       *cp = tolower (*cp);
@@ -474,7 +578,7 @@ again:
   if (pf->f_mode == 0)
     {
       nak (EBADOP);
-      exit (EXIT_FAILURE);
+      return NULL;
     }
   ecode = (*pf->f_validate) (&filename, tp->th_opcode);
   if (logging)
@@ -504,11 +608,25 @@ again:
        * Avoid storms of naks to a RRQ broadcast for a relative
        * bootfile pathname from a diskless Sun.
        */
-      if (suppress_naks && *filename != '/' && ecode == ENOTFOUND)
-	exit (EXIT_SUCCESS);
-      nak (ecode);
-      exit (EXIT_FAILURE);
+      if (!suppress_naks || *filename == '/' || ecode != ENOTFOUND)
+	nak (ecode);
+      return NULL;
     }
+  negotiate (opts, buf + size, tp->th_opcode, pf->f_convert);
+  return pf;
+}
+
+/*
+ * Handle initial connection protocol.
+ */
+void
+tftp (struct tftphdr *tp, int size)
+{
+  struct formats *pf;
+
+  pf = request (tp, size);
+  if (pf == NULL)
+    exit (EXIT_FAILURE);
   if (tp->th_opcode == WRQ)
     (*pf->f_recv) (pf);
   else
@@ -519,6 +637,86 @@ again:
 
 FILE *file;
 
+/* Append option NAME with VALUE to the option acknowledgement.  */
+static void
+oack_add (const char *name, unsigned long value)
+{
+  struct tftphdr *tp = (struct tftphdr *) oackbuf;
+
+  /* Room for the longest value, should a client repeat options.  */
+  if (oacklen + strlen (name) + 22 > sizeof (oackbuf))
+    return;
+  if (oacklen == 0)
+    {
+      tp->th_opcode = htons ((unsigned short) OACK);
+      oacklen = 2;
+    }
+  oacklen += sprintf (oackbuf + oacklen, "%s", name) + 1;
+  oacklen += sprintf (oackbuf + oacklen, "%lu", value) + 1;
+}
+
+/*
+ * Negotiate the options of a request, from CP up to END, as in
+ * RFC 2347.  Unknown options, and values out of range, are ignored,
+ * whereas the block and window sizes are lowered to our limits.
+ * Accepted options are collected in OACKBUF.
+ */
+static void
+negotiate (char *cp, char *end, int opcode, int convert)
+{
+  char *option, *value, *ep;
+  unsigned long n;
+  struct stat st;
+
+  while (cp < end)
+    {
+      option = cp;
+      value = memchr (option, '\0', end - option);
+      if (value == NULL || ++value >= end)
+	break;
+      cp = memchr (value, '\0', end - value);
+      if (cp == NULL)
+	break;
+      cp++;
+
+      errno = 0;
+      n = strtoul (value, &ep, 10);
+      if (!*value || *ep || errno)
+	continue;
+
+      if (strcasecmp (option, "blksize") == 0)
+	{
+	  if (n < MINBLKSIZE)
+	    continue;
+	  blksize = n > MAXBLKSIZE ? MAXBLKSIZE : n;
+	  oack_add ("blksize", blksize);
+	}
+      else if (strcasecmp (option, "windowsize") == 0)
+	{
+	  if (n < 1 || n > 65535)
+	    continue;
+	  windowsize = n > MAXWINDOW ? MAXWINDOW : n;
+	  oack_add ("windowsize", windowsize);
+	}
+      else if (strcasecmp (option, "timeout") == 0)
+	{
+	  if (n < 1 || n > 255)
+	    continue;
+	  rexmtval = n;
+	  maxtimeout = 5 * n;
+	  oack_add ("timeout", n);
+	}
+      else if (strcasecmp (option, "tsize") == 0)
+	{
+	  /* The size sent in netascii is not known in advance.  */
+	  if (opcode == WRQ)
+	    oack_add ("tsize", n);
+	  else if (!convert && fstat (fileno (file), &st) == 0)
+	    oack_add ("tsize", st.st_size);
+	}
+    }
+}
+
 /*
  * Validate file access.  Since we
  * have no uid or gid, for now require
@@ -618,7 +816,9 @@ validate_access (char **filep, int mode)
 	return (err);
       *filep = filename = pathname;
     }
-  fd = open (filename, mode == RRQ ? O_RDONLY : (O_WRONLY | O_TRUNC));
+  /* A file to be written is emptied only once its transfer has
+     been accepted.  */
+  fd = open (filename, mode == RRQ ? O_RDONLY : O_WRONLY);
   if (fd < 0)
     return (errno + 100);
   file = fdopen (fd, (mode == RRQ) ? "r" : "w");
@@ -642,45 +842,55 @@ timer (int sig MAYBE_UNUSED)
   siglongjmp (timeoutbuf, 1);
 }
 
+/* Make room in the socket buffer OPT for a whole window.  Packets
+   may take twice their size in the buffer, and the kernel doubles
+   the size set, for its bookkeeping, and reports the doubled size.  */
+static void
+window_buffer (int opt)
+{
+  int size = 2 * windowsize * (blksize + 4), cur;
+  socklen_t len = sizeof (cur);
+
+  if (getsockopt (peer, SOL_SOCKET, opt, &cur, &len) == 0 && cur < 2 * size)
+    setsockopt (peer, SOL_SOCKET, opt, &size, sizeof (size));
+}
+
 /*
- * Send the requested file.
+ * Send the requested file, a window of blocks at a time as in
+ * RFC 7440.  An option acknowledgement is first acknowledged by
+ * the client as block zero.
  */
 void
 tftpd_sendfile (struct formats *pf)
 {
-  struct tftphdr *dp, *r_init (void);
+  struct tftphdr *dp;
   register struct tftphdr *ap;	/* ack packet */
   register int size, n;
-  volatile int block;
+  volatile unsigned long base, next, last;
+  unsigned short acked;
 
   signal (SIGALRM, timer);
-  dp = r_init ();
   ap = (struct tftphdr *) ackbuf;
-  block = 1;
-  do
+  if (rw_setsize (blksize, windowsize) < 0 || r_init () == NULL)
+    {
+      nak (ENOSPACE);
+      goto abort;
+    }
+  window_buffer (SO_SNDBUF);
+
+  if (oacklen)
     {
-      size = readit (file, &dp, pf->f_convert);
-      if (size < 0)
-	{
-	  nak (errno + 100);
-	  goto abort;
-	}
-      dp->th_opcode = htons ((unsigned short) DATA);
-      dp->th_block = htons ((unsigned short) block);
       timeout = 0;
       sigsetjmp (timeoutbuf, SIGALRM);
-
-    send_data:
-      if (sendto (peer, (const char *) dp, size + 4, 0,
-		 (struct sockaddr *) &from, fromlen) != size + 4)
+      if (sendto (peer, oackbuf, oacklen, 0,
+		  (struct sockaddr *) &from, fromlen) != oacklen)
 	{
 	  syslog (LOG_ERR, "tftpd: write: %m\n");
 	  goto abort;
 	}
-      read_ahead (file, pf->f_convert);
-      for (;;)
+      do
 	{
-	  alarm (rexmtval);	/* read the ack */
+	  alarm (rexmtval);
 	  n = recv (peer, ackbuf, sizeof (ackbuf), 0);
 	  alarm (0);
 	  if (n < 0)
@@ -688,26 +898,76 @@ tftpd_sendfile (struct formats *pf)
 	      syslog (LOG_ERR, "tftpd: read: %m\n");
 	      goto abort;
 	    }
-	  ap->th_opcode = ntohs ((unsigned short) ap->th_opcode);
-	  ap->th_block = ntohs ((unsigned short) ap->th_block);
-
-	  if (ap->th_opcode == ERROR)
+	  if (n >= 4 && ntohs (ap->th_opcode) == ERROR)
 	    goto abort;
+	}
+      while (n < 4 || ntohs (ap->th_opcode) != ACK
+	     || ntohs (ap->th_block) != 0);
+    }
 
-	  if (ap->th_opcode == ACK)
+  base = next = 1;		/* oldest unacknowledged, and next block */
+  last = 0;			/* the final block, once read */
+  timeout = 0;
+  if (sigsetjmp (timeoutbuf, SIGALRM))
+    next = base;		/* send the window again */
+  for (;;)
+    {
+      while (next < base + windowsize && (last == 0 || next <= last))
+	{
+	  size = readblock (file, &dp, next, pf->f_convert);
+	  if (size < 0)
 	    {
-	      if ((unsigned short) ap->th_block == (unsigned short) block)
-		break;
-	      /* Re-synchronize with the other side */
-	      synchnet (peer);
-	      if ((unsigned short) ap->th_block == (unsigned short) (block - 1))
-		goto send_data;
+	      nak (errno + 100);
+	      goto abort;
 	    }
+	  if (size < blksize)
+	    last = next;
+	  dp->th_opcode = htons ((unsigned short) DATA);
+	  dp->th_block = htons ((unsigned short) next);
+	  if (sendto (peer, (const char *) dp, size + 4, 0,
+		      (struct sockaddr *) &from, fromlen) != size + 4)
+	    {
+	      syslog (LOG_ERR, "tftpd: write: %m\n");
+	      goto abort;
+	    }
+	  next++;
+	}
 
+      alarm (rexmtval);		/* read the ack */
+      n = recv (peer, ackbuf, sizeof (ackbuf), 0);
+      alarm (0);
+      if (n < 0)
+	{
+	  syslog (LOG_ERR, "tftpd: read: %m\n");
+	  goto abort;
+	}
+      if (n < 4)
+	continue;
+      ap->th_opcode = ntohs ((unsigned short) ap->th_opcode);
+      ap->th_block = ntohs ((unsigned short) ap->th_block);
+
+      if (ap->th_opcode == ERROR)
+	goto abort;
+      if (ap->th_opcode != ACK)
+	continue;
+
+      /* Number of blocks newly acknowledged.  */
+      acked = ap->th_block - (unsigned short) (base - 1);
+      if (acked > next - base)
+	continue;
+      if (acked)
+	timeout = 0;
+      base += acked;
+      if (last && base > last)
+	break;
+      if (base < next)
+	{
+	  /* The other side missed block BASE, or our last one.
+	     Re-synchronize, and continue from there.  */
+	  synchnet (peer);
+	  next = base;
 	}
-      block++;
     }
-  while (size == SEGSIZE);
 abort:
   fclose (file);
 }
@@ -720,86 +980,116 @@ justquit (int sig MAYBE_UNUSED)
 
 
 /*
- * Receive a file.
+ * Receive a file, acknowledging a window of blocks at a time.
+ * With options, block zero is acknowledged by OACK.
  */
 void
 recvfile (struct formats *pf)
 {
-  struct tftphdr *dp, *w_init (void);
+  struct tftphdr *dp;
   register struct tftphdr *ap;	/* ack buffer */
-  register int n, size;
-  volatile int block;
+  register int n, size, len;
+  volatile unsigned long block;
+  volatile int count;
+  unsigned short ahead;
+  char *rp;
 
   signal (SIGALRM, timer);
-  dp = w_init ();
   ap = (struct tftphdr *) ackbuf;
+  if (rw_setsize (blksize, 2) < 0 || (dp = w_init ()) == NULL)
+    {
+      nak (ENOSPACE);
+      goto abort;
+    }
+  if (ftruncate (fileno (file), 0) < 0)
+    {
+      nak (errno + 100);
+      goto abort;
+    }
+  window_buffer (SO_RCVBUF);
   block = 0;
   do
     {
       timeout = 0;
-      ap->th_opcode = htons ((unsigned short) ACK);
-      ap->th_block = htons ((unsigned short) block);
-      block++;
       sigsetjmp (timeoutbuf, SIGALRM);
     send_ack:
-      if (sendto (peer, ackbuf, 4, 0, (struct sockaddr *) &from, fromlen) != 4)
+      if (block == 0 && oacklen)
+	{
+	  rp = oackbuf;
+	  len = oacklen;
+	}
+      else
+	{
+	  ap->th_opcode = htons ((unsigned short) ACK);
+	  ap->th_block = htons ((unsigned short) block);
+	  rp = ackbuf;
+	  len = 4;
+	}
+      if (sendto (peer, rp, len, 0, (struct sockaddr *) &from, fromlen) != len)
 	{
 	  syslog (LOG_ERR, "tftpd: write: %m\n");
 	  goto abort;
 	}
       write_behind (file, pf->f_convert);
+      count = 0;
       for (;;)
 	{
 	  alarm (rexmtval);
-	  n = recv (peer, (char *) dp, PKTSIZE, 0);
+	  n = recv (peer, (char *) dp, blksize + 4, 0);
 	  alarm (0);
 	  if (n < 0)
 	    {			/* really? */
 	      syslog (LOG_ERR, "tftpd: read: %m\n");
 	      goto abort;
 	    }
+	  if (n < 4)
+	    continue;
 	  dp->th_opcode = ntohs ((unsigned short) dp->th_opcode);
 	  dp->th_block = ntohs ((unsigned short) dp->th_block);
 	  if (dp->th_opcode == ERROR)
 	    goto abort;
-	  if (dp->th_opcode == DATA)
+	  if (dp->th_opcode != DATA)
+	    continue;
+	  if (dp->th_block != (unsigned short) (block + 1))
 	    {
-	      if (dp->th_block == block)
-		{
-		  break;	/* normal */
-		}
-	      /* Re-synchronize with the other side */
+	      /* Re-synchronize with the other side.  Acknowledge
+	         again if our last acknowledgement was lost, or a
+	         block of the window.  */
 	      synchnet (peer);
-	      if (dp->th_block == (block - 1))
-		goto send_ack;	/* rexmit */
+	      ahead = dp->th_block - (unsigned short) block;
+	      if (ahead <= windowsize)
+		goto send_ack;
+	      continue;
 	    }
-	}
-      /*  size = write(file, dp->th_data, n - 4); */
-      size = writeit (file, &dp, n - 4, pf->f_convert);
-      if (size != (n - 4))
-	{			/* ahem */
-	  if (size < 0)
-	    nak (errno + 100);
-	  else
-	    nak (ENOSPACE);
-	  goto abort;
+	  size = writeit (file, &dp, n - 4, pf->f_convert);
+	  if (size != (n - 4))
+	    {			/* ahem */
+	      if (size < 0)
+		nak (errno + 100);
+	      else
+		nak (ENOSPACE);
+	      goto abort;
+	    }
+	  block++;
+	  if (size < blksize || ++count == windowsize)
+	    break;
 	}
     }
-  while (size == SEGSIZE);
+  while (size == blksize);
   write_behind (file, pf->f_convert);
   fclose (file);		/* close data file */
 
   ap->th_opcode = htons ((unsigned short) ACK);	/* send the "final" ack */
-  ap->th_block = htons ((unsigned short) (block));
+  ap->th_block = htons ((unsigned short) block);
   sendto (peer, ackbuf, 4, 0, (struct sockaddr *) &from, fromlen);
 
   signal (SIGALRM, justquit);	/* just quit on timeout */
   alarm (rexmtval);
-  n = recv (peer, buf, sizeof (buf), 0);	/* normally times out and quits */
+  n = recv (peer, (char *) dp, blksize + 4, 0);	/* normally times out and quits */
   alarm (0);
   if (n >= 4 &&			/* if read some data */
-      dp->th_opcode == DATA &&	/* and got a data block */
-      block == dp->th_block)
+      ntohs (dp->th_opcode) == DATA &&	/* and got a data block */
+      ntohs (dp->th_block) == (unsigned short) block)
     {				/* then my last ack was lost */
       sendto (peer, ackbuf, 4, 0, (struct sockaddr *) &from, fromlen);	/* resend final ack */
     }
@@ -807,6 +1097,826 @@ abort:
   return;
 }
 
+/*
+ * Daemon mode.  A single process serves all transfers, each with a
+ * socket of its own as in inetd mode, and with its state kept in a
+ * struct transfer.  The main loop waits for packets with epoll where
+ * available, or else with poll, and runs a timer wheel for the
+ * retransmissions.  A transfer takes the steps of tftpd_sendfile()
+ * or recvfile(), one for each packet received or timeout.
+ */
+
+enum transfer_state
+{
+  T_OACK,			/* waiting for the ACK of an OACK */
+  T_DATA,			/* sending or receiving the file */
+  T_DALLY			/* in case the final ACK was lost */
+};
+
+struct transfer
+{
+  struct transfer *t_next;	/* all transfers */
+  struct transfer **t_prev;
+  struct transfer *t_tnext;	/* a slot of the timer wheel */
+  struct transfer **t_tprev;	/* NULL when no timeout is set */
+  unsigned long t_expire;	/* tick of the timeout */
+  int t_fd;			/* socket, connected to the client */
+  struct sockaddr_storage t_from;	/* the client */
+  FILE *t_file;
+  int t_opcode;			/* RRQ or WRQ */
+  int t_convert;		/* netascii */
+  enum transfer_state t_state;
+  int t_blksize;		/* negotiated options */
+  int t_windowsize;
+  int t_rexmtval;
+  int t_maxtimeout;
+  int t_timeout;		/* seconds waited in vain */
+  char *t_oack;			/* option acknowledgement, if any */
+  int t_oacklen;
+  unsigned long t_base;		/* sending: oldest unacknowledged block */
+  unsigned long t_nextblk;	/* next block to send */
+  unsigned long t_last;		/* final block, once read */
+  unsigned long t_block;	/* receiving: last block in order */
+  int t_count;			/* blocks received of the window */
+  struct tftphdr *t_dp;		/* buffer for the next block */
+  struct rw_state t_rw;		/* buffers and conversion state */
+  long t_memory;		/* bytes of the window buffers */
+};
+
+static struct transfer *transfers;
+static int ntransfers;
+static long window_memory;	/* t_memory of all transfers */
+static struct transfer *wheel[WHEEL_SLOTS];
+static unsigned long wheel_tick;	/* last tick run */
+static unsigned long now_tick;
+static pid_t workers[MAXWORKERS];
+#ifdef USE_EPOLL
+static int epfd = -1;
+#endif
+
+/* Return the number of ticks passed.  Steps of the clock by more
+   than a quarter hour are skipped.  */
+static unsigned long
+clock_tick (void)
+{
+  static struct timeval last;
+  static unsigned long ticks;
+  static long usec;		/* remainder of a tick */
+  struct timeval now;
+  long sec;
+
+  gettimeofday (&now, NULL);
+  sec = now.tv_sec - last.tv_sec;
+  if (last.tv_sec && sec >= 0 && sec < 900)
+    {
+      usec += sec * 1000000L + now.tv_usec - last.tv_usec;
+      if (usec > 0)
+	{
+	  ticks += usec / (1000L * WHEEL_TICK);
+	  usec %= 1000L * WHEEL_TICK;
+	}
+    }
+  last = now;
+  return ticks;
+}
+
+static void
+timer_cancel (struct transfer *t)
+{
+  if (t->t_tprev == NULL)
+    return;
+  *t->t_tprev = t->t_tnext;
+  if (t->t_tnext)
+    t->t_tnext->t_tprev = t->t_tprev;
+  t->t_tprev = NULL;
+}
+
+/* Let the timeout of T expire in SECS seconds.  */
+static void
+timer_set (struct transfer *t, int secs)
+{
+  struct transfer **slot;
+
+  timer_cancel (t);
+  t->t_expire = now_tick + secs * (1000 / WHEEL_TICK);
+  slot = &wheel[t->t_expire % WHEEL_SLOTS];
+  t->t_tnext = *slot;
+  if (*slot)
+    (*slot)->t_tprev = &t->t_tnext;
+  t->t_tprev = slot;
+  *slot = t;
+}
+
+static void
+transfer_end (struct transfer *t)
+{
+  timer_cancel (t);
+  *t->t_prev = t->t_next;
+  if (t->t_next)
+    t->t_next->t_prev = t->t_prev;
+  ntransfers--;
+  window_memory -= t->t_memory;
+
+  close (t->t_fd);
+  if (t->t_file)
+    fclose (t->t_file);
+  rw_select (NULL);
+  rw_free (&t->t_rw);
+  free (t->t_oack);
+  free (t);
+}
+
+/* Send LEN bytes at P to the client of T.  A full socket buffer is
+   taken for a lost packet, which is sent again later.  */
+static int
+transfer_write (struct transfer *t, const char *p, int len)
+{
+  if (send (t->t_fd, p, len, 0) == len
+      || errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+    return 0;
+  syslog (LOG_ERR, "tftpd: write: %m\n");
+  return -1;
+}
+
+static void
+transfer_nak (struct transfer *t, int error)
+{
+  peer = t->t_fd;
+  fromlen = 0;
+  nak (error);
+}
+
+/* Send the blocks of the window of T which are due.  */
+static int
+transfer_send (struct transfer *t)
+{
+  struct tftphdr *dp;
+  int size;
+
+  rw_select (&t->t_rw);
+  while (t->t_nextblk < t->t_base + t->t_windowsize
+	 && (t->t_last == 0 || t->t_nextblk <= t->t_last))
+    {
+      size = readblock (t->t_file, &dp, t->t_nextblk, t->t_convert);
+      if (size < 0)
+	{
+	  transfer_nak (t, errno + 100);
+	  return -1;
+	}
+      if (size < t->t_blksize)
+	t->t_last = t->t_nextblk;
+      dp->th_opcode = htons ((unsigned short) DATA);
+      dp->th_block = htons ((unsigned short) t->t_nextblk);
+      if (transfer_write (t, (const char *) dp, size + 4) < 0)
+	return -1;
+      t->t_nextblk++;
+    }
+  return 0;
+}
+
+/* Acknowledge the blocks received by T, block zero with the OACK.  */
+static int
+transfer_ack (struct transfer *t)
+{
+  struct tftphdr *ap = (struct tftphdr *) ackbuf;
+
+  t->t_count = 0;
+  if (t->t_block == 0 && t->t_oacklen)
+    return transfer_write (t, t->t_oack, t->t_oacklen);
+  ap->th_opcode = htons ((unsigned short) ACK);
+  ap->th_block = htons ((unsigned short) t->t_block);
+  return transfer_write (t, ackbuf, 4);
+}
+
+static void
+transfer_timeout (struct transfer *t)
+{
+  int err;
+
+  t->t_timeout += t->t_rexmtval;
+  if (t->t_state == T_DALLY || t->t_timeout >= t->t_maxtimeout)
+    {
+      transfer_end (t);
+      return;
+    }
+
+  if (t->t_opcode == WRQ)
+    err = transfer_ack (t);
+  else if (t->t_state == T_OACK)
+    err = transfer_write (t, t->t_oack, t->t_oacklen);
+  else
+    {
+      t->t_nextblk = t->t_base;	/* send the window again */
+      err = transfer_send (t);
+    }
+  if (err < 0)
+    transfer_end (t);
+  else
+    timer_set (t, t->t_rexmtval);
+}
+
+/* Run the timeouts which expired by NOW_TICK.  Each slot is visited
+   once at the most, however long the wait was.  */
+static void
+timers_run (void)
+{
+  struct transfer *t, *next;
+
+  if (now_tick - wheel_tick > WHEEL_SLOTS)
+    wheel_tick = now_tick - WHEEL_SLOTS;
+  while (wheel_tick < now_tick)
+    {
+      wheel_tick++;
+      for (t = wheel[wheel_tick % WHEEL_SLOTS]; t; t = next)
+	{
+	  next = t->t_tnext;
+	  if (t->t_expire <= wheel_tick)
+	    {
+	      timer_cancel (t);
+	      transfer_timeout (t);
+	    }
+	}
+    }
+}
+
+/* Handle the packet of N bytes in ACKBUF for T, which sends a file.
+   Return nonzero when the transfer is over.  */
+static int
+transfer_acked (struct transfer *t, int n)
+{
+  struct tftphdr *ap = (struct tftphdr *) ackbuf;
+  unsigned short block, acked;
+
+  if (n < 4)
+    return 0;
+  if (ntohs (ap->th_opcode) == ERROR)
+    return 1;
+  if (ntohs (ap->th_opcode) != ACK)
+    return 0;
+  block = ntohs (ap->th_block);
+
+  if (t->t_state == T_OACK)
+    {
+      if (block != 0)
+	return 0;
+      t->t_state = T_DATA;
+      t->t_timeout = 0;
+    }
+  else
+    {
+      /* Number of blocks newly acknowledged.  */
+      acked = block - (unsigned short) (t->t_base - 1);
+      if (acked > t->t_nextblk - t->t_base)
+	return 0;
+      if (acked)
+	t->t_timeout = 0;
+      t->t_base += acked;
+      if (t->t_last && t->t_base > t->t_last)
+	return 1;
+      if (t->t_base < t->t_nextblk)
+	{
+	  /* The client missed block BASE, or our last one.  */
+	  synchnet (t->t_fd);
+	  t->t_nextblk = t->t_base;
+	}
+    }
+  timer_set (t, t->t_rexmtval);
+  return transfer_send (t);
+}
+
+/* Handle the packet of N bytes in the buffer of T, which receives a
+   file.  Return nonzero when the transfer is over.  */
+static int
+transfer_data (struct transfer *t, int n)
+{
+  struct tftphdr *dp = t->t_dp;
+  unsigned short block, ahead;
+  int size;
+
+  if (n < 4)
+    return 0;
+  if (ntohs (dp->th_opcode) == ERROR)
+    return 1;
+  if (ntohs (dp->th_opcode) != DATA)
+    return 0;
+  block = ntohs (dp->th_block);
+
+  if (t->t_state == T_DALLY)
+    {
+      /* Our final acknowledgement was lost.  */
+      if (block == (unsigned short) t->t_block)
+	return transfer_ack (t);
+      return 0;
+    }
+  if (block != (unsigned short) (t->t_block + 1))
+    {
+      synchnet (t->t_fd);
+      ahead = block - (unsigned short) t->t_block;
+      if (ahead <= t->t_windowsize)
+	return transfer_ack (t);
+      return 0;
+    }
+
+  rw_select (&t->t_rw);
+  size = writeit (t->t_file, &t->t_dp, n - 4, t->t_convert);
+  if (size != n - 4)
+    {
+      transfer_nak (t, size < 0 ? errno + 100 : ENOSPACE);
+      return 1;
+    }
+  t->t_block++;
+  timer_set (t, t->t_rexmtval);
+
+  if (size < t->t_blksize)
+    {
+      write_behind (t->t_file, t->t_convert);
+      fclose (t->t_file);
+      t->t_file = NULL;
+      t->t_state = T_DALLY;
+      return transfer_ack (t);
+    }
+  if (++t->t_count == t->t_windowsize)
+    {
+      t->t_timeout = 0;
+      if (transfer_ack (t) < 0)
+	return 1;
+      write_behind (t->t_file, t->t_convert);
+    }
+  return 0;
+}
+
+/* Handle the packets which arrived for T, at most a window of them,
+   so as not to starve the other transfers.  */
+static void
+transfer_input (struct transfer *t)
+{
+  int i, n;
+
+  for (i = 0; i < MAXWINDOW; i++)
+    {
+      if (t->t_opcode == WRQ)
+	n = recv (t->t_fd, (char *) t->t_dp, t->t_blksize + 4, 0);
+      else
+	n = recv (t->t_fd, ackbuf, sizeof (ackbuf), 0);
+      if (n < 0)
+	{
+	  if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+	    return;
+	  syslog (LOG_ERR, "tftpd: read: %m\n");
+	  transfer_end (t);
+	  return;
+	}
+      if (t->t_opcode == WRQ ? transfer_data (t, n) : transfer_acked (t, n))
+	{
+	  transfer_end (t);
+	  return;
+	}
+    }
+}
+
+/* Wait for packets on FD, for transfer T, or for requests when T is
+   NULL.  Closing FD ends the wait.  */
+static void
+event_add (int fd, struct transfer *t)
+{
+#ifdef USE_EPOLL
+  struct epoll_event ev;
+
+  if (epfd < 0)
+    return;
+  memset (&ev, 0, sizeof (ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = t;
+  if (epoll_ctl (epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    syslog (LOG_ERR, "epoll_ctl: %m");
+#else
+  (void) fd;
+  (void) t;
+#endif
+}
+
+static int
+same_client (struct sockaddr_storage *a, struct sockaddr_storage *b)
+{
+  if (a->ss_family != b->ss_family)
+    return 0;
+  if (a->ss_family == AF_INET)
+    {
+      struct sockaddr_in *x = (struct sockaddr_in *) a;
+      struct sockaddr_in *y = (struct sockaddr_in *) b;
+
+      return x->sin_port == y->sin_port
+	&& x->sin_addr.s_addr == y->sin_addr.s_addr;
+    }
+  if (a->ss_family == AF_INET6)
+    {
+      struct sockaddr_in6 *x = (struct sockaddr_in6 *) a;
+      struct sockaddr_in6 *y = (struct sockaddr_in6 *) b;
+
+      return x->sin6_port == y->sin6_port
+	&& !memcmp (&x->sin6_addr, &y->sin6_addr, sizeof (x->sin6_addr));
+    }
+  return 0;
+}
+
+/* Start a transfer in format PF for the request OPCODE, negotiated
+   by request().  It takes over PEER, FROM and FILE.  */
+static void
+transfer_start (struct formats *pf, int opcode)
+{
+  struct transfer *t;
+  int on = 1, err;
+  long memory;
+
+  /* A request costs as much when its sender is spoofed, so the
+     windows of all transfers are limited.  */
+  memory = (long) (blksize + 4)
+    * (opcode == RRQ && windowsize > 2 ? windowsize : 2);
+  if (window_memory + memory > WINDOW_MEMORY)
+    {
+      if (logging)
+	syslog (LOG_WARNING, "window buffers exhausted, request refused");
+      nak (ENOSPACE);
+      fclose (file);
+      close (peer);
+      return;
+    }
+
+  t = calloc (1, sizeof (*t));
+  if (t == NULL)
+    {
+      nak (ENOSPACE);
+      fclose (file);
+      close (peer);
+      return;
+    }
+  t->t_fd = peer;
+  t->t_from = from;
+  t->t_file = file;
+  t->t_opcode = opcode;
+  t->t_convert = pf->f_convert;
+  t->t_blksize = blksize;
+  t->t_windowsize = windowsize;
+  t->t_rexmtval = rexmtval;
+  t->t_maxtimeout = maxtimeout;
+  t->t_base = t->t_nextblk = 1;
+
+  t->t_next = transfers;
+  if (transfers)
+    transfers->t_prev = &t->t_next;
+  t->t_prev = &transfers;
+  transfers = t;
+  ntransfers++;
+  t->t_memory = memory;
+  window_memory += memory;
+
+  rw_select (&t->t_rw);
+  if ((oacklen && (t->t_oack = malloc (oacklen)) == NULL)
+      || rw_setsize (blksize, opcode == RRQ ? windowsize : 2) < 0
+      || (t->t_dp = opcode == RRQ ? r_init () : w_init ()) == NULL)
+    {
+      nak (ENOSPACE);
+      transfer_end (t);
+      return;
+    }
+  if (opcode == WRQ && ftruncate (fileno (file), 0) < 0)
+    {
+      nak (errno + 100);
+      transfer_end (t);
+      return;
+    }
+  if (oacklen)
+    {
+      memcpy (t->t_oack, oackbuf, oacklen);
+      t->t_oacklen = oacklen;
+    }
+  window_buffer (opcode == RRQ ? SO_SNDBUF : SO_RCVBUF);
+
+  /* The system now drops packets of other senders.  */
+  if (connect (peer, (struct sockaddr *) &from, fromlen) < 0
+      || ioctl (peer, FIONBIO, &on) < 0)
+    {
+      syslog (LOG_ERR, "tftpd: connect: %m\n");
+      transfer_end (t);
+      return;
+    }
+  event_add (peer, t);
+
+  if (opcode == WRQ)
+    {
+      t->t_state = T_DATA;
+      err = transfer_ack (t);
+    }
+  else if (t->t_oacklen)
+    {
+      t->t_state = T_OACK;
+      err = transfer_write (t, t->t_oack, t->t_oacklen);
+    }
+  else
+    {
+      t->t_state = T_DATA;
+      err = transfer_send (t);
+    }
+  if (err < 0)
+    transfer_end (t);
+  else
+    timer_set (t, t->t_rexmtval);
+}
+
+/* Read a request from SOCK, and start its transfer.  Return -1 when
+   there is none.  */
+static int
+daemon_request (int sock)
+{
+  register struct tftphdr *tp = (struct tftphdr *) buf;
+  struct sockaddr_storage sin;
+  struct formats *pf;
+  struct transfer *t;
+  int n;
+
+  fromlen = sizeof (from);
+  n = recvfrom (sock, buf, sizeof (buf), 0, (struct sockaddr *) &from,
+		&fromlen);
+  if (n < 0)
+    return -1;
+  if (n < 4)
+    return 0;
+  tp->th_opcode = ntohs (tp->th_opcode);
+  if (tp->th_opcode != RRQ && tp->th_opcode != WRQ)
+    return 0;
+
+  /* A client repeating its request is already being served.  */
+  for (t = transfers; t; t = t->t_next)
+    if (same_client (&t->t_from, &from))
+      return 0;
+
+  peer = socket (from.ss_family, SOCK_DGRAM, 0);
+  if (peer < 0)
+    {
+      syslog (LOG_ERR, "socket: %m\n");
+      return 0;
+    }
+  memset (&sin, 0, sizeof (sin));
+  sin.ss_family = from.ss_family;
+#if HAVE_STRUCT_SOCKADDR_STORAGE_SS_LEN
+  sin.ss_len = from.ss_len;
+#endif
+  if (bind (peer, (struct sockaddr *) &sin, fromlen) < 0)
+    {
+      syslog (LOG_ERR, "bind: %m\n");
+      close (peer);
+      return 0;
+    }
+
+  /* Refused before the file is looked at.  */
+  if (ntransfers >= max_transfers)
+    {
+      if (logging)
+	syslog (LOG_WARNING, "%d transfers busy, request refused",
+		ntransfers);
+      nak (ENOSPACE);
+      close (peer);
+      return 0;
+    }
+
+  /* Every request starts out from the defaults.  */
+  blksize = SEGSIZE;
+  windowsize = 1;
+  rexmtval = TIMEOUT;
+  maxtimeout = 5 * TIMEOUT;
+  oacklen = 0;
+  file = NULL;
+
+  pf = request (tp, n);
+  if (pf)
+    transfer_start (pf, tp->th_opcode);
+  else
+    {
+      if (file)
+	fclose (file);
+      close (peer);
+    }
+  return 0;
+}
+
+/* Handle the requests arriving at SOCK, and the transfers they start,
+   until terminated.  */
+static void
+daemon_serve (int sock)
+{
+  struct pollfd *pfds = NULL;
+  struct transfer **polled = NULL, *t;
+  int npfds = 0, n, i, k;
+#ifdef USE_EPOLL
+  struct epoll_event events[MAXWINDOW];
+
+  epfd = epoll_create1 (0);
+  if (epfd < 0)
+    syslog (LOG_WARNING, "epoll_create1: %m, falling back to poll");
+  event_add (sock, NULL);
+#endif
+
+  for (;;)
+    {
+#ifdef USE_EPOLL
+      if (epfd >= 0)
+	{
+	  n = epoll_wait (epfd, events, MAXWINDOW,
+			  ntransfers ? WHEEL_TICK : -1);
+	  now_tick = clock_tick ();
+	  for (i = 0; i < n; i++)
+	    if (events[i].data.ptr)
+	      transfer_input (events[i].data.ptr);
+	    else
+	      for (k = 0; k < MAXWINDOW; k++)
+		if (daemon_request (sock) < 0)
+		  break;
+	  timers_run ();
+	  continue;
+	}
+#endif
+
+      if (npfds < ntransfers + 1)
+	{
+	  npfds = 2 * ntransfers + 16;
+	  pfds = xrealloc (pfds, npfds * sizeof (*pfds));
+	  polled = xrealloc (polled, npfds * sizeof (*polled));
+	}
+      for (i = 0, t = transfers; t; t = t->t_next, i++)
+	{
+	  pfds[i].fd = t->t_fd;
+	  pfds[i].events = POLLIN;
+	  polled[i] = t;
+	}
+      pfds[i].fd = sock;
+      pfds[i].events = POLLIN;
+
+      n = poll (pfds, i + 1, ntransfers ? WHEEL_TICK : -1);
+      now_tick = clock_tick ();
+      if (n > 0)
+	{
+	  /* Requests come last, as they add to TRANSFERS.  */
+	  for (k = 0; k < i; k++)
+	    if (pfds[k].revents)
+	      transfer_input (polled[k]);
+	  if (pfds[i].revents)
+	    for (k = 0; k < MAXWINDOW; k++)
+	      if (daemon_request (sock) < 0)
+		break;
+	}
+      timers_run ();
+    }
+}
+
+/* Return a socket bound to the port of the daemon, or -1.  Workers
+   share the port with SO_REUSEPORT, and the system spreads requests
+   over them by the address of the client.  */
+static int
+daemon_socket (void)
+{
+  struct addrinfo hints, *res, *ai;
+  struct servent *sv;
+  char portstr[8];
+  int fd = -1, err, on = 1, off = 0;
+
+  if (port == NULL)
+    {
+      sv = getservbyname ("tftp", "udp");
+      snprintf (portstr, sizeof (portstr), "%u",
+		sv ? ntohs (sv->s_port) : DEFPORT);
+    }
+
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_PASSIVE;
+  /* A dual stacked socket is built from one of AF_INET6.  */
+  hints.ai_family = (usefamily != AF_UNSPEC) ? usefamily : AF_INET6;
+
+  err = getaddrinfo (NULL, port ? port : portstr, &hints, &res);
+  if (err)
+    {
+      syslog (LOG_ERR, "%s: %s", port ? port : portstr, gai_strerror (err));
+      return -1;
+    }
+  for (ai = res; ai; ai = ai->ai_next)
+    {
+      fd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (fd < 0)
+	continue;
+      if (usefamily == AF_UNSPEC && ai->ai_family == AF_INET6
+	  && setsockopt (fd, IPPROTO_IPV6, IPV6_V6ONLY,
+			 (char *) &off, sizeof (off)) < 0)
+	syslog (LOG_DEBUG, "setsockopt bindv6only: %m");
+#ifdef SO_REUSEPORT
+      if (nworkers > 1
+	  && setsockopt (fd, SOL_SOCKET, SO_REUSEPORT,
+			 (char *) &on, sizeof (on)) < 0)
+	syslog (LOG_ERR, "setsockopt (SO_REUSEPORT): %m");
+#endif
+      if (bind (fd, ai->ai_addr, ai->ai_addrlen) == 0
+	  && ioctl (fd, FIONBIO, &on) == 0)
+	break;
+      syslog (LOG_ERR, "bind: %m");
+      close (fd);
+      fd = -1;
+    }
+  freeaddrinfo (res);
+  return fd;
+}
+
+/* Take the workers along when the daemon is terminated.  */
+static void
+daemon_quit (int signo)
+{
+  int k;
+
+  for (k = 1; k < nworkers; k++)
+    if (workers[k] > 0)
+      kill (workers[k], signo);
+  _exit (EXIT_SUCCESS);
+}
+
+/* Run standalone, with NWORKERS processes serving transfers.  */
+static void
+daemon_run (void)
+{
+  int socks[MAXWORKERS], j, k;
+  pid_t parent;
+#ifdef HAVE_SYS_RESOURCE_H
+  struct rlimit rl;
+
+  /* Every transfer holds a socket and a file.  */
+  if (getrlimit (RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+      rl.rlim_cur = rl.rlim_max;
+      setrlimit (RLIMIT_NOFILE, &rl);
+    }
+#endif
+#ifndef SO_REUSEPORT
+  nworkers = 1;
+#endif
+
+  /* Bound before privileges are given up.  */
+  for (k = 0; k < nworkers; k++)
+    {
+      socks[k] = daemon_socket ();
+      if (socks[k] < 0)
+	exit (EXIT_FAILURE);
+    }
+
+  /* The working directory is left only once a relative name of the
+     pid file has been used.  */
+  if (daemon (1, 0) < 0)
+    {
+      syslog (LOG_ERR, "failed to become a daemon: %m");
+      exit (EXIT_FAILURE);
+    }
+  if (pidfile)
+    {
+      FILE *fp = fopen (pidfile, "w");
+
+      if (fp == NULL)
+	syslog (LOG_ERR, "can't open %s: %m", pidfile);
+      else
+	{
+	  fprintf (fp, "%d\n", (int) getpid ());
+	  fclose (fp);
+	}
+    }
+  if (chdir ("/") < 0 || secure_dir ())
+    exit (EXIT_FAILURE);
+
+  /* Workers are not replaced.  The port is served as long as one
+     of them is left.  */
+  signal (SIGCHLD, SIG_IGN);
+  parent = getpid ();
+  for (k = 1; k < nworkers; k++)
+    {
+      workers[k] = fork ();
+      if (workers[k] < 0)
+	syslog (LOG_ERR, "fork: %m");
+      else if (workers[k] == 0)
+	{
+#if defined HAVE_SYS_PRCTL_H && defined PR_SET_PDEATHSIG
+	  prctl (PR_SET_PDEATHSIG, SIGTERM);
+	  /* The parent may have gone before it was asked for.  */
+	  if (getppid () != parent)
+	    _exit (EXIT_SUCCESS);
+#endif
+	  for (j = 0; j < nworkers; j++)
+	    if (j != k && socks[j] >= 0)
+	      close (socks[j]);
+	  daemon_serve (socks[k]);
+	}
+      close (socks[k]);
+      socks[k] = -1;
+    }
+  signal (SIGTERM, daemon_quit);
+  signal (SIGINT, daemon_quit);
+
+  daemon_serve (socks[0]);
+}
+
 struct errmsg
 {
   int e_code;
@@ -821,6 +1931,7 @@ struct errmsg
     {EBADID, "Unknown transfer ID"},
     {EEXISTS, "File already exists"},
     {ENOUSER, "No such user"},
+    {EOPTNEG, "Option negotiation failed"},
     {-1, 0}
   };
 
@@ -866,7 +1977,9 @@ nak (int error)
   memcpy (tp->th_msg, pe->e_msg, length);
   tp->th_msg[length] = '\0';
   length += 5;
-  if (sendto (peer, buf, length, 0, (struct sockaddr *) &from, fromlen) != length)
+  /* The socket of a running transfer is connected, and FROMLEN zero.  */
+  if (sendto (peer, buf, length, 0,
+	      fromlen ? (struct sockaddr *) &from : NULL, fromlen) != length)
     syslog (LOG_ERR, "nak: %m\n");
 }
 
@@ -876,8 +1989,10 @@ verifyhost (struct sockaddr_storage *fromp, socklen_t frlen)
   int rc;
   static char host[NI_MAXHOST];
 
+  /* The daemon must not wait for the name service.  */
   rc = getnameinfo ((struct sockaddr *) fromp, frlen,
-		    host, sizeof (host), NULL, 0, 0);
+		    host, sizeof (host), NULL, 0,
+		    daemon_mode ? NI_NUMERICHOST : 0);
   if (rc == 0)
     return host;
   else
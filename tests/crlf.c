@@ -0,0 +1,305 @@
+/* crlf - Check block oriented line end conversion against the per byte one.
+  Copyright (C) 2026 Free Software Foundation, Inc.
+
+  This file is part of GNU Inetutils.
+
+  GNU Inetutils is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at
+  your option) any later version.
+
+  GNU Inetutils is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see `http://www.gnu.org/licenses/'. */
+
+/*
+ * The routines crlf_write() and crlf_strip() from libinetutils are
+ * used by ftpd for ASCII mode transfers.  They replace loops built
+ * on getc() and putc(), which are reproduced here as references.
+ * Random text, with lines of varying length and stray CR, LF, and
+ * NUL characters, is converted both ways, and with varying block
+ * sizes in order to catch errors at block boundaries.
+ *
+ * When the environment variable VERBOSE is set, the program also
+ * acts as a micro-benchmark, reporting the throughput of each
+ * method on a larger text written to the null device.
+ */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libinetutils.h>
+
+#define CHECK_SIZE	(256 * 1024)
+#define BENCH_SIZE	(32 * 1024 * 1024)
+#define BENCH_ROUNDS	4
+
+static int verbose;
+
+/* Fill BUF with LEN bytes of text.  Lines average LINE characters,
+   and when STRAY is set, an occasional CR or NUL is inserted.  */
+static void
+fill_text (char *buf, size_t len, size_t line, int stray)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    {
+      long r = random ();
+
+      if (r % line == 0)
+	buf[i] = '\n';
+      else if (stray && r % 97 == 1)
+	buf[i] = '\r';
+      else if (stray && r % 211 == 2)
+	buf[i] = '\0';
+      else
+	buf[i] = ' ' + r % 95;
+    }
+}
+
+/* The sending loop of ftpd, one character at a time.  */
+static void
+ref_write (FILE *out, const char *buf, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    {
+      if (buf[i] == '\n')
+	putc ('\r', out);
+      putc (buf[i], out);
+    }
+  fflush (out);
+}
+
+/* The receiving loop of ftpd, one character at a time.  Return the
+   number of bytes stored in DST.  */
+static size_t
+ref_strip (char *dst, const char *src, size_t len, size_t *bare_lfs)
+{
+  const char *end = src + len;
+  char *out = dst;
+  int c;
+
+#define NEXT() (src < end ? (unsigned char) *src++ : EOF)
+  while ((c = NEXT ()) != EOF)
+    {
+      if (c == '\n')
+	++*bare_lfs;
+      while (c == '\r')
+	{
+	  c = NEXT ();
+	  if (c != '\n')
+	    {
+	      *out++ = '\r';
+	      if (c == '\0' || c == EOF)
+		goto contin2;
+	    }
+	}
+      *out++ = c;
+    contin2:;
+    }
+#undef NEXT
+
+  return out - dst;
+}
+
+/* Read back the temporary file FP into BUF, returning its length.  */
+static size_t
+slurp (FILE *fp, char *buf, size_t size)
+{
+  size_t len;
+
+  rewind (fp);
+  len = fread (buf, 1, size, fp);
+  rewind (fp);
+  if (ftruncate (fileno (fp), 0) < 0)
+    {
+      perror ("ftruncate");
+      exit (EXIT_FAILURE);
+    }
+  return len;
+}
+
+static int
+check_write (const char *text, size_t len, char *expect, char *got)
+{
+  FILE *fp = tmpfile ();
+  size_t elen, glen;
+
+  if (fp == NULL)
+    {
+      perror ("tmpfile");
+      exit (EXIT_FAILURE);
+    }
+
+  ref_write (fp, text, len);
+  elen = slurp (fp, expect, 2 * len);
+
+  if (crlf_write (fileno (fp), text, len) != (ssize_t) len)
+    {
+      perror ("crlf_write");
+      exit (EXIT_FAILURE);
+    }
+  glen = slurp (fp, got, 2 * len);
+  fclose (fp);
+
+  if (elen != glen || memcmp (expect, got, elen))
+    {
+      fprintf (stderr, "crlf_write: output differs from reference\n");
+      return 1;
+    }
+  return 0;
+}
+
+static int
+check_strip (const char *text, size_t len, size_t block,
+	     char *expect, char *got)
+{
+  size_t elen, glen = 0, done, n, m, ebare = 0, gbare = 0;
+  int pending = 0;
+  char *work = malloc (block + 1);
+
+  if (work == NULL)
+    {
+      perror ("malloc");
+      exit (EXIT_FAILURE);
+    }
+
+  elen = ref_strip (expect, text, len, &ebare);
+
+  /* Convert in place, as ftpd does, one block at a time.  */
+  for (done = 0; done < len; done += n)
+    {
+      n = len - done < block ? len - done : block;
+      memcpy (work + 1, text + done, n);
+      m = crlf_strip (work, work + 1, n, &pending, &gbare);
+      memcpy (got + glen, work, m);
+      glen += m;
+    }
+  if (pending)
+    got[glen++] = '\r';
+  free (work);
+
+  if (elen != glen || memcmp (expect, got, elen) || ebare != gbare)
+    {
+      fprintf (stderr, "crlf_strip: block size %lu differs from reference\n",
+	       (unsigned long) block);
+      return 1;
+    }
+  return 0;
+}
+
+static double
+elapsed (struct timeval *start)
+{
+  struct timeval now;
+
+  gettimeofday (&now, NULL);
+  return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1e6;
+}
+
+static void
+report (const char *what, double secs)
+{
+  printf ("%-28s %8.1f MB/s\n", what,
+	  BENCH_ROUNDS * (BENCH_SIZE / 1048576.0) / secs);
+}
+
+static void
+benchmark (size_t line)
+{
+  char *text = malloc (BENCH_SIZE), *out = malloc (BENCH_SIZE + 1);
+  struct timeval start;
+  FILE *null;
+  size_t bare = 0;
+  int i, pending = 0;
+
+  null = fopen ("/dev/null", "w");
+  if (text == NULL || out == NULL || null == NULL)
+    {
+      perror ("benchmark");
+      exit (EXIT_FAILURE);
+    }
+
+  fill_text (text, BENCH_SIZE, line, 0);
+  printf ("Average line length %lu:\n", (unsigned long) line);
+
+  gettimeofday (&start, NULL);
+  for (i = 0; i < BENCH_ROUNDS; i++)
+    ref_write (null, text, BENCH_SIZE);
+  report ("  LF to CRLF, per byte", elapsed (&start));
+
+  gettimeofday (&start, NULL);
+  for (i = 0; i < BENCH_ROUNDS; i++)
+    crlf_write (fileno (null), text, BENCH_SIZE);
+  report ("  LF to CRLF, crlf_write", elapsed (&start));
+
+  gettimeofday (&start, NULL);
+  for (i = 0; i < BENCH_ROUNDS; i++)
+    fwrite (out, 1, ref_strip (out, text, BENCH_SIZE, &bare), null);
+  report ("  CRLF to LF, per byte", elapsed (&start));
+
+  gettimeofday (&start, NULL);
+  for (i = 0; i < BENCH_ROUNDS; i++)
+    fwrite (out, 1, crlf_strip (out, text, BENCH_SIZE, &pending, &bare),
+	    null);
+  report ("  CRLF to LF, crlf_strip", elapsed (&start));
+
+  fclose (null);
+  free (out);
+  free (text);
+}
+
+int
+main (void)
+{
+  static const size_t lines[] = { 2, 13, 80, 4000 };
+  static const size_t blocks[] = { 1, 2, 3, 7, 512, 4096, CHECK_SIZE };
+  char *text, *expect, *got;
+  size_t i, j;
+  int err = 0;
+
+  verbose = getenv ("VERBOSE") != NULL;
+
+  text = malloc (CHECK_SIZE);
+  expect = malloc (2 * CHECK_SIZE);
+  got = malloc (2 * CHECK_SIZE);
+  if (text == NULL || expect == NULL || got == NULL)
+    {
+      perror ("malloc");
+      return EXIT_FAILURE;
+    }
+
+  srandom (4711);
+  for (i = 0; i < sizeof (lines) / sizeof (lines[0]); i++)
+    {
+      fill_text (text, CHECK_SIZE, lines[i], 1);
+      err |= check_write (text, CHECK_SIZE, expect, got);
+      for (j = 0; j < sizeof (blocks) / sizeof (blocks[0]); j++)
+	err |= check_strip (text, CHECK_SIZE, blocks[j], expect, got);
+    }
+
+  free (got);
+  free (expect);
+  free (text);
+
+  if (verbose && !err)
+    for (i = 0; i < sizeof (lines) / sizeof (lines[0]); i++)
+      benchmark (lines[i]);
+
+  return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -40,6 +40,11 @@
 #   TARGET46	IPv4-mapped-IPv6 address.  Defaults to ::ffff:127.0.0.1.
 #   VERBOSE	Whenever defined, test runs in verbose mode.
 #   LOGGING	When defined, let `ftpd' do system logging.
+#   RATETEST	When defined, measure the connection rate of `ftpd'
+#		in daemon mode, with and without `--prefork'.
+#		This needs the standard FTP port to be free.
+#   RATECOUNT	Number of sessions in each rate measurement.
+#		Defaults to 200.
 #
 # FIXME: Better test coverage!
 #
@@ -214,6 +219,10 @@ posttesting () {
 	&& test -r "$TMPDIR/inetd.pid" \
 	&& { kill "`cat $TMPDIR/inetd.pid`" \
 	     || kill -9 "`cat $TMPDIR/inetd.pid`"; }
+    test -n "$TMPDIR" && test -f "$TMPDIR/ftpd.pid" \
+	&& test -r "$TMPDIR/ftpd.pid" \
+	&& { kill "`cat $TMPDIR/ftpd.pid`" \
+	     || kill -9 "`cat $TMPDIR/ftpd.pid`"; }
     test -n "$TMPDIR" && test -d "$TMPDIR" && rm -rf "$TMPDIR"
     $do_transfer && test -n "$FTPHOME" \
 	&& test -f "$FTPHOME$DLDIR/$PUTME" && rm -f "$FTPHOME$DLDIR/$PUTME" \
@@ -787,4 +796,55 @@ if test "$TEST_IPV6" != "no" && test -n "$TARGET6" && $do_transfer; then
     fi
 fi # TEST_IPV6 && TARGET6 && do_transfer
 
+# Connection rate of the standalone daemon, with and without
+# a pool of pre-forked processes.  Informational only.
+#
+# rate_test  [option]
+#
+rate_test () {
+    rm -f "$TMPDIR/ftpd.pid"
+    $FTPD -D -A -4 -p"$TMPDIR/ftpd.pid" $1 ||
+	{
+	    echo >&2 "Not able to start '$FTPD' in daemon mode."
+	    exit 1
+	}
+    sleep 2
+
+    start=`date +%s`
+    count=0
+    while test $count -lt $RATECOUNT; do
+	echo rstatus |
+	HOME=$TMPDIR \
+	    $FTP "$TARGET" -4 -v -p -t >$TMPDIR/ftp.stdout 2>&1
+	count=`expr $count + 1`
+    done
+    stop=`date +%s`
+
+    $GREP 'FTP server status' "$TMPDIR/ftp.stdout" >/dev/null 2>&1 ||
+	{
+	    echo >&2 "No server status from daemon with '$1'."
+	    exit 1
+	}
+
+    kill "`cat $TMPDIR/ftpd.pid`"
+    rm -f "$TMPDIR/ftpd.pid"
+    sleep 1
+
+    secs=`expr $stop - $start`
+    test $secs -gt 0 || secs=1
+    echo "Daemon mode ${1:-without pool}: $RATECOUNT sessions in" \
+	 "$secs seconds, `expr $RATECOUNT / $secs` per second."
+}
+
+if test "${RATETEST+yes}" = "yes" && test "$TEST_IPV4" != "no" &&
+   test -n "$TARGET"; then
+    RATECOUNT=${RATECOUNT:-200}
+    if locate_port 21; then
+	echo 'The FTP port is in use.  Skipping rate test.' >&2
+    else
+	rate_test
+	rate_test --prefork=8
+    fi
+fi # RATETEST && TEST_IPV4 && TARGET
+
 exit 0
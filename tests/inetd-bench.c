@@ -0,0 +1,350 @@
+/* inetd-bench - Measure how fast inetd starts a server.
+  Copyright (C) 2026 Free Software Foundation, Inc.
+
+  This file is part of GNU Inetutils.
+
+  GNU Inetutils is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at
+  your option) any later version.
+
+  GNU Inetutils is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see `http://www.gnu.org/licenses/'. */
+
+/*
+ * The server itself is compiled into this program, which runs it in
+ * daemon mode with configurations of a growing number of stream
+ * services on consecutive ports of the loopback address.  Each of
+ * them executes this very program, which answers with a single byte.
+ * The time from connect() until that byte arrives is measured for
+ * services picked across the whole configuration, once with epoll,
+ * where available, and once with select.
+ *
+ * Usage: inetd-bench [ROUNDS]
+ *
+ * With an argument, or when the environment variable VERBOSE is set,
+ * the results are reported.  Otherwise only a few rounds are run, up
+ * to BENCH_QUICK services, to check that every configuration answers.
+ * Each configuration is placed on a range of ports which are all free,
+ * and every request must be answered.  The test is skipped when no
+ * free range is found, or when no service can be reached at all.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* The epoll instance is refused for runs with select.  */
+static int bench_select;
+
+#if defined HAVE_SYS_EPOLL_H && defined HAVE_EPOLL_CREATE1
+# include <sys/epoll.h>
+# define epoll_create1(flags) \
+  (bench_select ? (errno = ENOSYS, -1) : epoll_create1 (flags))
+#endif
+
+#define main inetd_main
+#include "inetd.c"
+#undef main
+
+#define BENCH_PORT	10000	/* lowest port used */
+#define BENCH_ROUNDS	20	/* connections per configuration */
+#define BENCH_WAIT	10	/* seconds to wait for the server */
+#define BENCH_QUICK	128	/* most services without VERBOSE */
+#define BENCH_TRIES	10	/* port ranges to try */
+
+static const int sizes[] = { 1, 16, 128, 512 };
+
+static int verbose;
+static char *self;
+static char conf[] = "/tmp/inetd-bench.XXXXXX";
+static char pidfile[sizeof (conf) + 4];
+
+static double
+now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int
+compare (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+
+  return (x > y) - (x < y);
+}
+
+/* Connect to PORT on the loopback address and wait for the answer.
+   Return the time taken, or a negative value on failure.  */
+static double
+request (int port)
+{
+  struct sockaddr_in sin;
+  double start = now ();
+  char c;
+  int fd, n;
+
+  fd = socket (AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    {
+      perror ("socket");
+      exit (EXIT_FAILURE);
+    }
+  memset (&sin, 0, sizeof (sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (port);
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  if (connect (fd, (struct sockaddr *) &sin, sizeof (sin)) < 0)
+    n = -1;
+  else
+    n = read (fd, &c, 1);
+  close (fd);
+
+  return n == 1 ? now () - start : -1;
+}
+
+/* Return 1 if COUNT ports from BASE onwards are free on the loopback
+   address.  */
+static int
+ports_free (int base, int count)
+{
+  struct sockaddr_in sin;
+  int fd, i, on = 1, ok = 1;
+
+  for (i = 0; ok && i < count; i++)
+    {
+      fd = socket (AF_INET, SOCK_STREAM, 0);
+      if (fd < 0)
+	{
+	  perror ("socket");
+	  exit (EXIT_FAILURE);
+	}
+      setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+      memset (&sin, 0, sizeof (sin));
+      sin.sin_family = AF_INET;
+      sin.sin_port = htons (base + i);
+      sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+      ok = bind (fd, (struct sockaddr *) &sin, sizeof (sin)) == 0;
+      close (fd);
+    }
+  return ok;
+}
+
+/* Write a configuration of COUNT services from port BASE onwards.  */
+static void
+write_conf (int base, int count)
+{
+  struct passwd *pw = getpwuid (getuid ());
+  FILE *fp;
+  int i;
+
+  fp = fopen (conf, "w");
+  if (fp == NULL || pw == NULL)
+    {
+      perror (conf);
+      exit (EXIT_FAILURE);
+    }
+  for (i = 0; i < count; i++)
+    fprintf (fp, "127.0.0.1:%d stream tcp4 nowait %s %s inetd-bench --serve\n",
+	     base + i, pw->pw_name, self);
+  fclose (fp);
+}
+
+/* Run the server in daemon mode, and return its process id.  */
+static pid_t
+start (void)
+{
+  char pidarg[sizeof (pidfile) + 2];
+  char *args[] = { "inetd", pidarg, "-R1000000", conf, NULL };
+  extern char **environ;
+  pid_t pid;
+  FILE *fp;
+  int status, i;
+
+  snprintf (pidarg, sizeof (pidarg), "-p%s", pidfile);
+  unlink (pidfile);
+
+  pid = fork ();
+  if (pid < 0)
+    {
+      perror ("fork");
+      exit (EXIT_FAILURE);
+    }
+  if (pid == 0)
+    exit (inetd_main (4, args, environ));
+  waitpid (pid, &status, 0);
+
+  for (i = 0; i < 10 * BENCH_WAIT; i++)
+    {
+      fp = fopen (pidfile, "r");
+      if (fp)
+	{
+	  int n = fscanf (fp, "%d", &status);
+
+	  fclose (fp);
+	  if (n == 1)
+	    return status;
+	}
+      usleep (100000);
+    }
+  fprintf (stderr, "inetd did not start\n");
+  exit (EXIT_FAILURE);
+}
+
+/* Measure ROUNDS requests to a configuration of COUNT services,
+   using select when USE_SELECT is set.  Return the number of
+   requests answered, or -1 if no range of free ports was found.  */
+static int
+measure (int count, int use_select, int rounds)
+{
+  double *times, deadline;
+  int base = BENCH_PORT + getpid () % 20000, i, n = 0, port;
+  pid_t pid;
+
+  for (i = 0; i < BENCH_TRIES && !ports_free (base, count); i++)
+    base += count;
+  if (i == BENCH_TRIES)
+    {
+      fprintf (stderr, "no %d free ports, skipping %d services\n",
+	       count, count);
+      return -1;
+    }
+
+  times = calloc (rounds, sizeof (*times));
+  if (times == NULL)
+    {
+      perror ("calloc");
+      exit (EXIT_FAILURE);
+    }
+
+  write_conf (base, count);
+  bench_select = use_select;
+  pid = start ();
+
+  /* The last socket is set up last.  */
+  deadline = now () + BENCH_WAIT;
+  while (request (base + count - 1) < 0 && now () < deadline)
+    usleep (10000);
+
+  for (i = 0; i < rounds; i++)
+    {
+      /* Services are spread over the whole table.  */
+      port = base + (int) ((i * 7919L) % count);
+      times[n] = request (port);
+      if (times[n] >= 0)
+	n++;
+    }
+  /* The ports are reused by the next configuration.  */
+  kill (pid, SIGTERM);
+  deadline = now () + BENCH_WAIT;
+  while (kill (pid, 0) == 0 && now () < deadline)
+    usleep (10000);
+
+  if (n < rounds)
+    fprintf (stderr, "%s, %d services: %d of %d requests answered\n",
+	     use_select ? "select" : "epoll", count, n, rounds);
+  else if (verbose)
+    {
+      double sum = 0;
+
+      for (i = 0; i < n; i++)
+	sum += times[i];
+      qsort (times, n, sizeof (*times), compare);
+      printf ("%-6s %4d services  %5d requests  mean %8.1f us"
+	      "  median %8.1f us\n", use_select ? "select" : "epoll",
+	      count, n, 1e6 * sum / n, 1e6 * times[n / 2]);
+    }
+  free (times);
+
+  return n;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int rounds = BENCH_ROUNDS, fds = FD_SETSIZE, answered = 0, measured = 0;
+  int failed = 0, use_select, fd, n;
+  size_t i;
+#ifdef HAVE_SYS_RESOURCE_H
+  struct rlimit rl;
+#endif
+
+  /* Started by inetd.  */
+  if (argc > 1 && strcmp (argv[1], "--serve") == 0)
+    return write (1, "x", 1) == 1 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+  verbose = argc > 1 || getenv ("VERBOSE") != NULL;
+  if (argc > 1)
+    rounds = atoi (argv[1]);
+  if (rounds <= 0)
+    {
+      fprintf (stderr, "usage: %s [ROUNDS]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  self = realpath (argv[0], NULL);
+  if (self == NULL)
+    {
+      perror (argv[0]);
+      return EXIT_FAILURE;
+    }
+
+#ifdef HAVE_SYS_RESOURCE_H
+  if (getrlimit (RLIMIT_NOFILE, &rl) == 0)
+    fds = rl.rlim_cur;
+#endif
+
+  fd = mkstemp (conf);
+  if (fd < 0)
+    {
+      perror (conf);
+      return EXIT_FAILURE;
+    }
+  close (fd);
+  snprintf (pidfile, sizeof (pidfile), "%s.pid", conf);
+
+  for (use_select = 0; use_select < 2; use_select++)
+    {
+#ifndef USE_EPOLL
+      if (!use_select)
+	continue;
+#endif
+      for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++)
+	{
+	  if (sizes[i] + 16 > fds || (!verbose && sizes[i] > BENCH_QUICK))
+	    continue;
+	  n = measure (sizes[i], use_select, rounds);
+	  if (n < 0)
+	    continue;
+	  measured++;
+	  answered += n;
+	  if (n < rounds)
+	    failed = 1;
+	}
+    }
+
+  unlink (conf);
+  unlink (pidfile);
+  free (self);
+
+  if (measured == 0 || answered == 0)
+    {
+      fprintf (stderr, "no service answered, skipping\n");
+      return 77;
+    }
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
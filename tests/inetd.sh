@@ -22,6 +22,21 @@
 # and to send SIGHUP repeatedly.
 #
 # Written by Mats Erik Andersson.
+#
+# A reload of a configuration directory must keep the services of
+# files left alone, and of files which still define them.
+#
+# Requests beyond the rate of a service must be delayed, not lead to
+# the service being shut down, and a client beyond its own rate must
+# be rejected.
+#
+# The built-in stream services echo, discard, and chargen are
+# tested when running as root, since they use their standard ports.
+#
+#   RATETEST	When defined, measure the connection rate of the
+#		built-in echo service.
+#   RATECOUNT	Number of connections in the rate measurement.
+#		Defaults to 500.
 
 . ./tools.sh
 
@@ -128,6 +143,14 @@ fi
 #
 CONF="$IU_TESTDIR"/inetd.conf
 PID="$IU_TESTDIR"/inetd.pid
+BICONF="$IU_TESTDIR"/builtin.conf
+BIPID="$IU_TESTDIR"/builtin.pid
+RLCONF="$IU_TESTDIR"/rate.conf
+RLPID="$IU_TESTDIR"/rate.pid
+ACCONF="$IU_TESTDIR"/acceptors.conf
+ACPID="$IU_TESTDIR"/acceptors.pid
+RDCONF="$IU_TESTDIR"/reload.d
+RDPID="$IU_TESTDIR"/reload.pid
 
 # Are we able to write in IU_TESTDIR?
 # This could happen with preset IU_TESTDIR.
@@ -140,9 +163,12 @@ touch "$CONF" || {
 # Erase the temporary directory.
 #
 clean_testdir () {
-    if test -f "$PID" && kill -0 "`cat "$PID"`" >/dev/null 2>&1; then
-	kill "`cat "$PID"`" || kill -9 "`cat "$PID"`"
-    fi
+    for pidfile in "$PID" "$BIPID" "$RLPID" "$ACPID" "$RDPID"; do
+	if test -f "$pidfile" && kill -0 "`cat "$pidfile"`" >/dev/null 2>&1
+	then
+	    kill "`cat "$pidfile"`" || kill -9 "`cat "$pidfile"`"
+	fi
+    done
     if test -z "${NOCLEAN+no}" && $do_cleandir; then
 	rm -r -f "$IU_TESTDIR"
     fi
@@ -217,6 +243,246 @@ else
     $silence echo "Passed `expr $nn - 1` SIGHUP rounds."
 fi
 
+# Succeed if a service answers at port $1 of TARGET.
+answers () {
+    $TCPGET $TARGET $1 2>/dev/null |
+	$GREP "Your address is $TARGET." >/dev/null 2>&1
+}
+
+# check_reload step served gone
+#
+# The ports in SERVED must answer after STEP, and those in GONE not.
+check_reload () {
+    for port in $2; do
+	answers $port ||
+	    { echo >&2 "After $1, no service at port $port."
+	      errno=`expr $errno + 1`; }
+    done
+    for port in $3; do
+	! answers $port ||
+	    { echo >&2 "After $1, a service remains at port $port."
+	      errno=`expr $errno + 1`; }
+    done
+}
+
+# A reload reads only the files of a directory that changed.  Each
+# file has a service of its own, and one service is added to a second
+# file.  It must survive as long as either file defines it.
+#
+if test "$TEST_IPV4" = "no" || test -z "$TARGET"; then
+    $silence echo 'Reloads are tested with IPv4.  Skipping them.'
+else
+    P1=`expr $PORT + 11`
+    P2=`expr $PORT + 12`
+    P3=`expr $PORT + 13`
+    P4=`expr $PORT + 14`
+    P5=`expr $PORT + 15`
+    P6=`expr $PORT + 16`
+
+    # reload_conf file port...
+    reload_conf () {
+	file="$RDCONF/$1"
+	shift
+	: > "$file"
+	for port in "$@"; do
+	    echo "$TARGET:$port stream tcp4 nowait $USER $ADDRPEEK addrpeek addr" \
+		>> "$file"
+	done
+    }
+
+    mkdir "$RDCONF"
+    reload_conf 1.conf $P1 $P4
+    reload_conf 2.conf $P2
+    reload_conf 3.conf $P3
+    $INETD -p"$RDPID" "$RDCONF"
+    sleep 2
+    check_reload 'start' "$P1 $P2 $P3 $P4" ''
+
+    # Move the service of one file, and define the shared one in it.
+    reload_conf 2.conf $P5 $P4
+    kill -HUP "`cat "$RDPID"`"
+    sleep 1
+    check_reload 'editing a file' "$P1 $P3 $P4 $P5" "$P2"
+
+    reload_conf 4.conf $P6
+    kill -HUP "`cat "$RDPID"`"
+    sleep 1
+    check_reload 'adding a file' "$P1 $P3 $P4 $P5 $P6" "$P2"
+
+    rm -f "$RDCONF/3.conf"
+    kill -HUP "`cat "$RDPID"`"
+    sleep 1
+    check_reload 'removing a file' "$P1 $P4 $P5 $P6" "$P2 $P3"
+
+    # The first file still defines the shared service.
+    reload_conf 2.conf $P5
+    kill -HUP "`cat "$RDPID"`"
+    sleep 1
+    check_reload 'removing a second definition' "$P1 $P4 $P5 $P6" "$P2 $P3"
+
+    reload_conf 1.conf $P1
+    kill -HUP "`cat "$RDPID"`"
+    sleep 1
+    check_reload 'removing the last definition' "$P1 $P5 $P6" "$P2 $P3 $P4"
+
+    kill "`cat "$RDPID"`"
+    $silence echo 'Tested reloads.'
+fi
+
+# Up to 60 connections per minute, and 2 per minute from one client.
+#
+if test "$TEST_IPV4" = "no" || test -z "$TARGET"; then
+    $silence echo 'Rate limits are tested with IPv4.  Skipping them.'
+else
+    RLPORT=`expr $PORT + 1`
+    cat > "$RLCONF" <<-EOT
+	$TARGET:$RLPORT stream tcp4 nowait.60 $USER $ADDRPEEK addrpeek addr
+	$TARGET:`expr $RLPORT + 1` stream tcp4 nowait.0.0.2 $USER $ADDRPEEK addrpeek addr
+	EOT
+    $INETD -p"$RLPID" "$RLCONF"
+    sleep 2
+
+    # The last two have to wait a second each.
+    count=0
+    nn=0
+    while test $nn -lt 62; do
+	$TCPGET $TARGET $RLPORT 2>/dev/null |
+	    $GREP "Your address is $TARGET." >/dev/null 2>&1 &&
+	    count=`expr $count + 1`
+	nn=`expr $nn + 1`
+    done
+    test $count -eq 62 ||
+	{ echo >&2 "Only $count of 62 requests served at the rate limit."
+	  errno=`expr $errno + 1`; }
+
+    count=0
+    for nn in 1 2 3; do
+	$TCPGET $TARGET `expr $RLPORT + 1` 2>/dev/null |
+	    $GREP "Your address is $TARGET." >/dev/null 2>&1 &&
+	    count=`expr $count + 1`
+    done
+    test $count -eq 2 ||
+	{ echo >&2 "$count of 3 requests served at the client rate of 2."
+	  errno=`expr $errno + 1`; }
+
+    kill "`cat "$RLPID"`"
+    $silence echo 'Tested rate limits.'
+fi
+
+# Count the listening sockets of port $1 on TARGET.
+count_listeners () {
+    $NETSTAT -na 2>/dev/null |
+	$GREP "$TARGET[.:]$1 .*LISTEN" | wc -l | tr -d ' '
+}
+
+# Four acceptors have a socket each, serve every request, and end
+# along with inetd.
+#
+if test "$TEST_IPV4" = "no" || test -z "$TARGET"; then
+    $silence echo 'Acceptors are tested with IPv4.  Skipping them.'
+else
+    ACPORT=`expr $PORT + 3`
+    cat > "$ACCONF" <<-EOT
+	$TARGET:$ACPORT stream tcp4 nowait.0.0.0.4 $USER $ADDRPEEK addrpeek addr
+	EOT
+    $INETD -p"$ACPID" "$ACCONF"
+    sleep 2
+
+    listeners=4
+    $need_netstat && listeners=`count_listeners $ACPORT`
+    if test "$listeners" = 1; then
+	$silence echo 'A single acceptor, lacking SO_REUSEPORT.'
+    elif test "$listeners" != 4; then
+	echo >&2 "$listeners sockets listening for four acceptors."
+	errno=`expr $errno + 1`
+    fi
+
+    count=0
+    nn=0
+    while test $nn -lt 20; do
+	$TCPGET $TARGET $ACPORT 2>/dev/null |
+	    $GREP "Your address is $TARGET." >/dev/null 2>&1 &&
+	    count=`expr $count + 1`
+	nn=`expr $nn + 1`
+    done
+    test $count -eq 20 ||
+	{ echo >&2 "Only $count of 20 requests served by four acceptors."
+	  errno=`expr $errno + 1`; }
+
+    kill "`cat "$ACPID"`"
+    sleep 1
+    listeners=0
+    $need_netstat && listeners=`count_listeners $ACPORT`
+    test "$listeners" = 0 ||
+	{ echo >&2 "$listeners acceptors left running after inetd."
+	  errno=`expr $errno + 1`; }
+    $silence echo 'Tested acceptors.'
+fi
+
+# Is one of the standard ports of echo, discard, and chargen in use?
+builtin_ports_busy () {
+    $NETSTAT -na 2>/dev/null |
+	$EGREP '[.:](7|9|19)[^0-9].*LISTEN' >/dev/null 2>&1
+}
+
+# Built-in stream services are served by the main loop of inetd,
+# which must keep answering while other connections are open.
+#
+if test "`func_id_uid`" != 0 || test "$TEST_IPV4" = "no" ||
+   test -z "$TARGET"; then
+    $silence echo 'Built-in services need root and IPv4.  Skipping them.'
+elif builtin_ports_busy; then
+    echo 'A standard port of echo, discard, or chargen is in use.' \
+	 'Skipping built-in services.' >&2
+else
+    cat > "$BICONF" <<-EOT
+	$TARGET:echo stream tcp4 nowait root internal
+	$TARGET:discard stream tcp4 nowait root internal
+	$TARGET:chargen stream tcp4 nowait root internal
+	EOT
+    $INETD -p"$BIPID" "$BICONF"
+    sleep 2
+
+    # Keep some idle connections open meanwhile.
+    for nn in 1 2 3 4 5 6 7 8; do
+	$TCPGET -t 3 $TARGET 9 >/dev/null 2>&1 &
+    done
+    sleep 1
+
+    test "`$TCPGET -s 'Echo me.' $TARGET 7 2>/dev/null`" = 'Echo me.' ||
+	{ echo >&2 'The built-in echo service failed.'
+	  errno=`expr $errno + 1`; }
+
+    test -z "`$TCPGET -s 'Forget me.' $TARGET 9 2>/dev/null`" ||
+	{ echo >&2 'The built-in discard service answered.'
+	  errno=`expr $errno + 1`; }
+
+    line=`$TCPGET -t 2 $TARGET 19 2>/dev/null | $SED -n '2{p;q;}' |
+	  tr -d '\r'`
+    test ${#line} -eq 72 && expr "$line" : '!"#' >/dev/null ||
+	{ echo >&2 'The built-in chargen service failed.'
+	  errno=`expr $errno + 1`; }
+
+    if test "${RATETEST+yes}" = "yes"; then
+	RATECOUNT=${RATECOUNT:-500}
+	start=`date +%s`
+	count=0
+	while test $count -lt $RATECOUNT; do
+	    $TCPGET -s ping $TARGET 7 >/dev/null 2>&1
+	    count=`expr $count + 1`
+	done
+	stop=`date +%s`
+	secs=`expr $stop - $start`
+	test $secs -gt 0 || secs=1
+	echo "Built-in echo: $RATECOUNT connections in $secs seconds," \
+	     "`expr $RATECOUNT / $secs` per second."
+    fi
+
+    wait
+    kill "`cat "$BIPID"`"
+    $silence echo 'Tested built-in stream services.'
+fi
+
 test $errno -ne 0 || $silence echo 'Successful testing.'
 
 clean_testdir
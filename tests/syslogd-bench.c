@@ -0,0 +1,255 @@
+/* syslogd-bench - Measure the message path of syslogd.
+  Copyright (C) 2026 Free Software Foundation, Inc.
+
+  This file is part of GNU Inetutils.
+
+  GNU Inetutils is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at
+  your option) any later version.
+
+  GNU Inetutils is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see `http://www.gnu.org/licenses/'. */
+
+/*
+ * The server itself is compiled into this program, which loads a
+ * configuration of several files below /dev/null, and then hands
+ * synthetic messages from a handful of hosts to printline(), as the
+ * main loop does for received datagrams.  The rate of messages and
+ * the number of memory allocations per message are measured.
+ *
+ * A second, large configuration with BENCH_RULES rules measures how
+ * messages are dispatched to the entries of Files, both through the
+ * index built by init() and by walking the list.
+ *
+ * Once the files are open, logging must not allocate memory, so the
+ * check fails when any allocation is counted.  Counting relies on
+ * replacing malloc() of the GNU C library, and is skipped elsewhere.
+ *
+ * Usage: syslogd-bench [MILLIONS]
+ *
+ * With an argument, or when the environment variable VERBOSE is set,
+ * the results are reported.  The default is a fifth of a million.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define main syslogd_main
+#include "syslogd.c"
+#undef main
+
+#define BENCH_HOSTS	16
+#define BENCH_MSGS	64
+#define BENCH_RULES	300
+
+static unsigned long allocations;
+
+#ifdef __GLIBC__
+# define COUNT_ALLOCATIONS 1
+
+extern void *__libc_malloc (size_t);
+extern void *__libc_calloc (size_t, size_t);
+extern void *__libc_realloc (void *, size_t);
+
+void *
+malloc (size_t size)
+{
+  allocations++;
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+  allocations++;
+  return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+  allocations++;
+  return __libc_realloc (ptr, size);
+}
+#endif /* __GLIBC__ */
+
+static const char bench_conf[] =
+  "*.info;mail.none\t/dev/null\n"
+  "mail.*\t-/dev/null\n"
+  "auth,authpriv.*\t/dev/null\n"
+  "local0.*\t/dev/null\n"
+  "!bench\n"
+  "*.*\t/dev/null\n";
+
+static int verbose;
+static char hosts[BENCH_HOSTS][32], msgs[BENCH_MSGS][128];
+
+static double
+elapsed (struct timeval *start)
+{
+  struct timeval now;
+
+  gettimeofday (&now, NULL);
+  return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1e6;
+}
+
+/* Load the configuration TEXT, as on a restart of the server.  */
+static void
+load (const char *text)
+{
+  char conf[] = "/tmp/syslogd-bench.XXXXXX";
+  int fd;
+
+  fd = mkstemp (conf);
+  if (fd < 0 || write (fd, text, strlen (text)) != (ssize_t) strlen (text))
+    {
+      perror (conf);
+      exit (EXIT_FAILURE);
+    }
+  close (fd);
+
+  ConfFile = conf;
+  init (0);
+  unlink (conf);
+}
+
+/* Return a configuration with BENCH_RULES rules, of which a third
+   select programs, and the others select facilities.  Few of them
+   match a message, so the cost of finding these dominates.  */
+static char *
+large_conf (void)
+{
+  static const char *levels[] = { "debug", "info", "notice", "err" };
+  char *text = malloc (BENCH_RULES * 64), *p = text;
+  int i;
+
+  if (text == NULL)
+    {
+      perror ("malloc");
+      exit (EXIT_FAILURE);
+    }
+
+  for (i = 0; i < BENCH_RULES; i++)
+    if (i % 3 == 0)
+      p += sprintf (p, "!prog%d\n*.*\t-/dev/null\n", i / 3);
+    else if (i % 3 == 1)
+      p += sprintf (p, "!*\nlocal%d.%s\t-/dev/null\n", 1 + i % 7,
+		    levels[i % 4]);
+    else
+      p += sprintf (p, "!*\nnews,uucp.%s\t-/dev/null\n", levels[i % 4]);
+  return text;
+}
+
+/* Pass COUNT messages to printline(), the way the main loop does.  */
+static void
+run (unsigned long count)
+{
+  unsigned long i;
+
+  for (i = 0; i < count; i++)
+    {
+      /* Now and then a message is repeated.  */
+      printline (hosts[(i / 3) % BENCH_HOSTS], msgs[(i / 2) % BENCH_MSGS]);
+      if (i % BatchSize == BatchSize - 1)
+	flush_files (0);
+    }
+  flush_files (1);
+}
+
+/* Log COUNT messages, after a round which opens the files and fills
+   the caches.  Report the rate under the name WHAT, and return the
+   number of allocations.  */
+static unsigned long
+measure (const char *what, unsigned long count)
+{
+  struct timeval start;
+  unsigned long allocs;
+  double secs;
+
+  run (2 * BENCH_HOSTS * BENCH_MSGS);
+
+  allocs = allocations;
+  gettimeofday (&start, NULL);
+  run (count);
+  secs = elapsed (&start);
+  allocs = allocations - allocs;
+
+  if (verbose)
+    {
+      printf ("%-24s %lu messages in %.2f s, %.0f messages/s\n",
+	      what, count, secs, count / secs);
+#ifdef COUNT_ALLOCATIONS
+      printf ("%-24s %lu allocations, %.3f per message\n",
+	      "", allocs, (double) allocs / count);
+#endif
+    }
+  if (allocs)
+    fprintf (stderr, "%s: %lu allocations while logging\n", what, allocs);
+
+  return allocs;
+}
+
+int
+main (int argc, char *argv[])
+{
+  static const int pris[] = { LOG_USER | LOG_INFO, LOG_MAIL | LOG_ERR,
+    LOG_AUTH | LOG_NOTICE, LOG_LOCAL0 | LOG_DEBUG, LOG_DAEMON | LOG_WARNING
+  };
+  unsigned long count = 200000, allocs = 0;
+  char *large;
+  int i;
+
+  verbose = argc > 1 || getenv ("VERBOSE") != NULL;
+  if (argc > 1)
+    count = strtod (argv[1], NULL) * 1000000;
+  if (count == 0)
+    {
+      fprintf (stderr, "usage: %s [MILLIONS]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  for (i = 0; i < BENCH_HOSTS; i++)
+    snprintf (hosts[i], sizeof (hosts[i]), "host%d", i);
+  for (i = 0; i < BENCH_MSGS; i++)
+    if (i % 2)
+      snprintf (msgs[i], sizeof (msgs[i]),
+		"<%d>Jan  1 00:00:00 bench[%d]: message %d of a series",
+		pris[i % 5], 100 + i, i);
+    else
+      snprintf (msgs[i], sizeof (msgs[i]),
+		"<%d>prog%d[%d]: message %d without a time stamp",
+		pris[i % 5], i % 7, 100 + i, i);
+
+  LocalHostName = strdup ("bench");
+  LocalDomain = strdup ("");
+  ConfDir = "/dev/null";
+
+  load (bench_conf);
+  allocs += measure ("small configuration", count);
+
+  large = large_conf ();
+  load (large);
+  free (large);
+  allocs += measure ("large, indexed", count);
+
+  dispatch_free (Dispatch);
+  Dispatch = NULL;
+  allocs += measure ("large, list", count);
+
+#ifndef COUNT_ALLOCATIONS
+  if (verbose)
+    printf ("allocations not counted\n");
+#endif
+  return allocs ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -78,6 +78,7 @@ do_cleandir=false
 do_socket_length=true
 do_unix_socket=true
 do_inet_socket=true
+do_tcp_socket=true
 do_standard_port=true
 
 # The UNIX socket name length is preset by the system
@@ -143,6 +144,9 @@ fi
 CONF="$IU_TESTDIR"/syslog.conf
 CONFD="$IU_TESTDIR"/syslog.d
 PID="$IU_TESTDIR"/syslogd.pid
+FWD_PID="$IU_TESTDIR"/forward.pid
+RCV_PID="$IU_TESTDIR"/receive.pid
+RL_PID="$IU_TESTDIR"/ratelimit.pid
 OUT="$IU_TESTDIR"/messages
 OUT_NOTICE="$IU_TESTDIR"/notice
 : ${SOCKET:=$IU_TESTDIR/log}
@@ -173,9 +177,12 @@ fi
 # Erase the testing directory.
 #
 clean_testdir () {
-    if test -f "$PID" && kill -0 "`cat "$PID"`" >/dev/null 2>&1; then
-	kill "`cat "$PID"`" || kill -9 "`cat "$PID"`"
-    fi
+    for pidfile in "$PID" "$FWD_PID" "$RCV_PID" "$RL_PID"; do
+	if test -f "$pidfile" && kill -0 "`cat "$pidfile"`" >/dev/null 2>&1
+	then
+	    kill "`cat "$pidfile"`" || kill -9 "`cat "$pidfile"`"
+	fi
+    done
     if test -z "${NOCLEAN+no}" && $do_cleandir; then
 	rm -r -f "$IU_TESTDIR"
     fi
@@ -309,6 +316,16 @@ if locate_port $PROTO $PORT; then
     do_inet_socket=false
 fi
 
+# The stream listener shares the port number.
+if $do_inet_socket && locate_port tcp $PORT; then
+    cat <<-EOT >&2
+	The INET port $PORT/tcp is already in use.
+	Skipping test of TCP reception this time.
+	EOT
+    do_tcp_socket=false
+fi
+$do_inet_socket || do_tcp_socket=false
+
 # A minimal, catch-all configuration, with some discarded oddities.
 #
 cat > "$CONF" <<-EOT
@@ -374,6 +391,9 @@ fi
 if $do_inet_socket; then
     IU_OPTIONS="$IU_OPTIONS --ipany --inet -B$PORT --hop"
 fi
+if $do_tcp_socket; then
+    IU_OPTIONS="$IU_OPTIONS --tcp"
+fi
 ## Bring in additional options from command line.
 ## Disable kernel messages otherwise.
 if [ -c /dev/klog ]; then
@@ -573,6 +593,169 @@ if $do_inet_socket; then
     fi # TEST_IPV6 && TARGET6
 fi # do_inet_socket
 
+# Load over TCP: a file of distinct lines is sent on one connection,
+# once with each kind of framing.  Every line must arrive.
+#
+TAG3="syslogd-stream-test"
+TCP_LINES=${TCP_LINES:-500}
+
+if $do_tcp_socket && test "$TEST_IPV4" != "no" && test -n "$TARGET"; then
+    TCP_LOAD="$IU_TESTDIR"/tcp-load
+    : > "$TCP_LOAD"
+    n=1
+    while test $n -le $TCP_LINES; do
+	echo "Line $n of a stream. (pid $$)" >> "$TCP_LOAD"
+	n=`expr $n + 1`
+    done
+
+    TESTCASES=`expr $TESTCASES + 2 \* $TCP_LINES`
+    $LOGGER -4 --tcp -h "$TARGET:$PORT" -t "$TAG3-lf" -f "$TCP_LOAD"
+    $LOGGER -4 --octet-count -h "$TARGET:$PORT" -t "$TAG3-octets" \
+	-f "$TCP_LOAD"
+fi # do_tcp_socket && TARGET
+
+# Forwarding to a second daemon, over TCP and over UDP.  The receiver
+# is started only after the messages for TCP were sent, so they must
+# wait in a short queue, and beyond it in the spool, until it is up.
+#
+TAG4="syslogd-forward-test"
+FWD_LINES=${FWD_LINES:-20}
+FWD_DIR="$IU_TESTDIR"/forward
+FWD_SOCK="$IU_TESTDIR"/fwdlog
+RCV_PORT=`expr $PORT + 1`
+
+if $do_tcp_socket && test "$TEST_IPV4" != "no" && test -n "$TARGET" \
+	&& test `expr X"$FWD_SOCK" : X".*"` -le $iu_socklen_max; then
+    if locate_port udp $RCV_PORT || locate_port tcp $RCV_PORT; then
+	echo "Port $RCV_PORT is in use.  Skipping forwarding test." >&2
+    else
+	FWD_LOAD="$FWD_DIR"/load
+	RCV_OUT="$FWD_DIR"/received
+	mkdir -p "$FWD_DIR"/spool "$FWD_DIR"/empty.d
+	: > "$RCV_OUT"
+
+	cat > "$FWD_DIR"/forward.conf <<-EOT
+		local1.*	@@$TARGET:$RCV_PORT
+		local2.*	@$TARGET:$RCV_PORT
+		EOT
+	cat > "$FWD_DIR"/receive.conf <<-EOT
+		*.*	$RCV_OUT
+		EOT
+
+	: > "$FWD_LOAD"
+	n=1
+	while test $n -le $FWD_LINES; do
+	    echo "Forwarded line $n. (pid $$)" >> "$FWD_LOAD"
+	    n=`expr $n + 1`
+	done
+
+	$SYSLOGD --rcfile="$FWD_DIR"/forward.conf \
+	    --rcdir="$FWD_DIR"/empty.d --pidfile="$FWD_PID" \
+	    --socket="$FWD_SOCK" --forward-queue=4 \
+	    --forward-spool="$FWD_DIR"/spool $OPTIONS
+	sleep 1
+
+	TESTCASES=`expr $TESTCASES + 2 \* $FWD_LINES`
+	$LOGGER -h "$FWD_SOCK" -p local1.info -t "$TAG4-tcp" -f "$FWD_LOAD"
+	sleep 1
+
+	$SYSLOGD --rcfile="$FWD_DIR"/receive.conf \
+	    --rcdir="$FWD_DIR"/empty.d --pidfile="$RCV_PID" --socket='' \
+	    --inet -B$RCV_PORT --tcp $OPTIONS
+	sleep 1
+	$LOGGER -h "$FWD_SOCK" -p local2.info -t "$TAG4-udp" -f "$FWD_LOAD"
+
+	# The forwarder retries after a delay which doubles each time.
+	n=0
+	while test $n -lt 20 &&
+	    test `$GREP -c "$TAG4" "$RCV_OUT"` -lt `expr 2 \* $FWD_LINES`
+	do
+	    sleep 1
+	    n=`expr $n + 1`
+	done
+
+	COUNT_FWD=`$GREP -c "$TAG4" "$RCV_OUT"`
+	SUCCESSES=`expr $SUCCESSES + $COUNT_FWD`
+	test $COUNT_FWD -eq `expr 2 \* $FWD_LINES` ||
+	    echo "Forwarded only $COUNT_FWD messages." >&2
+
+	for pidfile in "$FWD_PID" "$RCV_PID"; do
+	    test -r "$pidfile" && kill "`cat "$pidfile"`"
+	done
+    fi
+fi # do_tcp_socket && TARGET
+
+# Rate limits: a flood far above the rate, once over UDP, limited by
+# host and then by program, and once over a UNIX socket, limited by
+# program.  Some messages must be suppressed, and those which are
+# not logged must be accounted for by the summary at exit.
+#
+TAG5="syslogd-rate-test"
+RL_LINES=${RL_LINES:-200}
+RL_DIR="$IU_TESTDIR"/ratelimit
+RL_SOCK="$IU_TESTDIR"/rllog
+RL_OUT="$RL_DIR"/messages
+RL_PORT=`expr $PORT + 2`
+
+# rl_suppressed pattern
+#
+rl_suppressed () {
+    $SED -n "s/.*syslogd: \([0-9]*\) messages $1 suppressed.*/\1/p" \
+	"$RL_OUT" | $SED -n '$p'
+}
+
+if $do_inet_socket && test "$TEST_IPV4" != "no" && test -n "$TARGET" \
+	&& test `expr X"$RL_SOCK" : X".*"` -le $iu_socklen_max; then
+    if locate_port udp $RL_PORT; then
+	echo "Port $RL_PORT is in use.  Skipping rate limit test." >&2
+    else
+	mkdir -p "$RL_DIR"/empty.d
+	: > "$RL_OUT"
+	cat > "$RL_DIR"/syslog.conf <<-EOT
+		*.*	$RL_OUT
+		EOT
+
+	RL_LOAD="$RL_DIR"/load
+	: > "$RL_LOAD"
+	n=1
+	while test $n -le $RL_LINES; do
+	    echo "Flood line $n. (pid $$)" >> "$RL_LOAD"
+	    n=`expr $n + 1`
+	done
+
+	$SYSLOGD --rcfile="$RL_DIR"/syslog.conf --rcdir="$RL_DIR"/empty.d \
+	    --pidfile="$RL_PID" --socket="$RL_SOCK" --inet -B$RL_PORT \
+	    --rate-limit=5:10 --rate-limit-program=5:10 $OPTIONS
+	sleep 1
+
+	$LOGGER -4 -h "$TARGET:$RL_PORT" -p user.info -t "$TAG5-udp" \
+	    -f "$RL_LOAD"
+	$LOGGER -h "$RL_SOCK" -p user.info -t "$TAG5-unix" -f "$RL_LOAD"
+	sleep 1
+
+	# The summary of what is suppressed is also logged at exit.
+	test -r "$RL_PID" && kill "`cat "$RL_PID"`"
+	sleep 1
+
+	logged=`$GREP -c "$TAG5-udp.*Flood" "$RL_OUT"`
+	by_host=`rl_suppressed "from $TARGET"`
+	by_prog=`rl_suppressed "of $TAG5-udp from .*"`
+	TESTCASES=`expr $TESTCASES + 2`
+	test $logged -lt $RL_LINES && test -n "$by_host" &&
+	    SUCCESSES=`expr $SUCCESSES + 1`
+	test `expr $logged + ${by_host:-0} + ${by_prog:-0}` -eq $RL_LINES &&
+	    SUCCESSES=`expr $SUCCESSES + 1`
+
+	logged=`$GREP -c "$TAG5-unix.*Flood" "$RL_OUT"`
+	by_prog=`rl_suppressed "of $TAG5-unix from .*"`
+	TESTCASES=`expr $TESTCASES + 2`
+	test $logged -lt $RL_LINES && test -n "$by_prog" &&
+	    SUCCESSES=`expr $SUCCESSES + 1`
+	test `expr $logged + ${by_prog:-0}` -eq $RL_LINES &&
+	    SUCCESSES=`expr $SUCCESSES + 1`
+    fi
+fi # do_inet_socket && TARGET
+
 # Remove previous SYSLOG daemon.
 test -r "$PID" && kill -0 "`cat "$PID"`" >/dev/null 2>&1 &&
     kill "`cat "$PID"`"
@@ -653,11 +836,15 @@ COUNT5_user=`$GREP -c "$TAG2.*user" "$OUT_LOCAL0"`
 COUNT5_local=`cat "$OUT_USER" "$OUT_UNOTICE" "$OUT_DEBUG" | \
 	      $GREP -c "$TAG2.*local0"`
 
+# Lines received over TCP.
+COUNT_TCP=`$GREP -c "$TAG3" "$OUT"`
+
 SUCCESSES=`expr $SUCCESSES + $COUNT + $COUNT_WRAP \
 		+ 2 \* $COUNT2 - $COUNT2_debug \
 		+ 2 \* $COUNT3 - $COUNT3_info \
 		+ 2 \* $COUNT4 - $COUNT4_notice - $COUNT4_illegal \
-		+ 2 \* $COUNT5 - $COUNT5_user - $COUNT5_local`
+		+ 2 \* $COUNT5 - $COUNT5_user - $COUNT5_local \
+		+ $COUNT_TCP`
 
 if [ -n "${VERBOSE+yes}" ]; then
     cat <<-EOT
@@ -687,6 +874,8 @@ test $SUCCESSES -eq $TESTCASES && $silence false \
 # Report incomplete test setup.
 $do_inet_socket ||
     echo 'NOTICE: Port specified INET socket test was not run' >&2
+$do_tcp_socket ||
+    echo 'NOTICE: TCP reception test was not run' >&2
 $do_standard_port ||
     echo 'NOTICE: Standard port test was not run.' >&1
 
@@ -24,9 +24,12 @@
  * can be set to another value with a command line switch, starting
  * at one second, but limited upwards to one hour!
  *
+ * With the switch `-s', a text is first sent to the server, after
+ * which the client ends its sending direction of the connection.
+ *
  * Invocation:
  *
- *   tcpget [-t secs] host tcp-port
+ *   tcpget [-s text] [-t secs] host tcp-port
  */
 
 #include <config.h>
@@ -50,6 +53,7 @@ main (int argc, char *argv[])
   int fd, opt, rc;
   int timeout = 5;	/* Defaulting to five seconds of waiting time.  */
   char buffer[256];
+  const char *text = NULL;
   struct addrinfo hints, *ai, *res;
 
   set_program_name (argv[0]);
@@ -58,12 +62,16 @@ main (int argc, char *argv[])
   setlocale (LC_ALL, "");
 #endif
 
-  while ((opt = getopt (argc, argv, "t:")) != -1)
+  while ((opt = getopt (argc, argv, "s:t:")) != -1)
     {
       int t;
 
       switch (opt)
 	{
+	case 's':
+	  text = optarg;
+	  break;
+
 	case 't':
 	  t = atoi (optarg);
 	  if (t > 0 && t <= 3600 /* on hour */)
@@ -71,7 +79,8 @@ main (int argc, char *argv[])
 	  break;
 
 	default:
-	  fprintf (stderr, "Usage: %s [-t secs] host port\n", argv[0]);
+	  fprintf (stderr, "Usage: %s [-s text] [-t secs] host port\n",
+		   argv[0]);
 	  exit (EXIT_FAILURE);
 	}
     }
@@ -111,6 +120,13 @@ main (int argc, char *argv[])
 
       alarm (timeout);
 
+      if (text)
+	{
+	  if (send (fd, text, strlen (text), 0) < 0)
+	    perror ("send");
+	  shutdown (fd, SHUT_WR);
+	}
+
       while ((n = recv (fd, buffer, sizeof (buffer), 0)))
 	write (STDOUT_FILENO, buffer, n);
 
@@ -38,12 +38,20 @@
 #
 #  * Read one moderate size ascii file from 127.0.0.1 and ::1.
 #
+#  * Read a large binary file with negotiated block and window
+#    sizes, and write it back, from 127.0.0.1 and ::1.  In verbose
+#    mode the throughput of each transfer is reported.
+#
 #  * Reload configuration and read a small binary file twice.
 #
 #  * (root only) Reload configuration for chrooted mode.
 #    Read one binary file with a relative name, and one ascii
 #    file with absolute location.
 #
+#  * Run `tftpd' standalone with two workers, and read all files
+#    four times over at once, while writing the large one back,
+#    from 127.0.0.1 and ::1.
+#
 # The values of TARGET and TARGET6 replace the loopback addresses
 # 127.0.0.1 and ::1, whenever the variables are set.  However,
 # setting the variable ADDRESSES to a list of addresses takes
@@ -119,6 +127,7 @@ USER=`func_id_user`
 # Late supplimentary subtest.
 do_conf_reload=true
 do_secure_setting=true
+do_daemon=true
 
 # Disable chrooted mode for non-root invocation.
 test `func_id_uid` -eq 0 || do_secure_setting=false
@@ -132,15 +141,18 @@ TMPDIR=`$MKTEMP -d $PWD/tmp.XXXXXXXXXX` ||
 
 INETD_CONF="$TMPDIR/inetd.conf.tmp"
 INETD_PID="$TMPDIR/inetd.pid.$$"
+TFTPD_PID="$TMPDIR/tftpd.pid.$$"
 
 posttesting () {
-    if test -n "$TMPDIR" && test -f "$INETD_PID" \
-	&& test -r "$INETD_PID" \
-	&& kill -0 "`cat $INETD_PID`" >/dev/null 2>&1
-    then
-	kill "`cat $INETD_PID`" 2>/dev/null ||
-	kill -9 "`cat $INETD_PID`" 2>/dev/null
-    fi
+    for pidfile in "$INETD_PID" "$TFTPD_PID"; do
+	if test -n "$TMPDIR" && test -f "$pidfile" \
+	    && test -r "$pidfile" \
+	    && kill -0 "`cat $pidfile`" >/dev/null 2>&1
+	then
+	    kill "`cat $pidfile`" 2>/dev/null ||
+	    kill -9 "`cat $pidfile`" 2>/dev/null
+	fi
+    done
     test -n "$TMPDIR" && test -d "$TMPDIR" \
 	&& rm -rf "$TMPDIR" $FILELIST
 }
@@ -331,7 +343,8 @@ test -d "$TMPDIR" && mkdir -p "$TMPDIR/tftp-test" \
 
 FILEDATA="file-small 320 1
 file-medium 320 2
-tftp-test-file 1024 170"
+tftp-test-file 1024 170
+file-large 1000 4099"
 
 echo "$FILEDATA" |
 while read name bsize count; do
@@ -422,6 +435,40 @@ get $name" | \
     fi
 
     rm -f file-small _file-small_ missing-file
+
+    # Negotiate options, RFC 2347 to 2349 and 7440.  The
+    # sizes are chosen so that the last block is partial.
+    # A write request needs an existing, writable file.
+    for opts in 'blksize 1428;windowsize 8' \
+		'blksize 65464;windowsize 4;tsize' \
+		'blksize 8192;windowsize 16;tsize;put'; do
+	EFFORTS=`expr $EFFORTS + 1`
+	rm -f file-large
+	upload="$TMPDIR/tftp-test/upload"
+	: > "$upload" && chmod 666 "$upload"
+	case $opts in
+	    *put) cp "$TMPDIR/tftp-test/file-large" file-large
+		  cmd="put file-large $upload"
+		  src="$upload" ;;
+	    *)    cmd="get file-large"
+		  src=file-large ;;
+	esac
+	echo "binary
+verbose
+`echo "$opts" | $SED 's/;put$//' | tr ';' '\n'`
+$cmd" | \
+	"$TFTP" "$addr" $PORT > "$TMPDIR/tftp.out"
+	$silence $GREP 'bytes in' "$TMPDIR/tftp.out" >&2
+
+	if cmp "$TMPDIR/tftp-test/file-large" "$src" 2>/dev/null; then
+	    SUCCESSES=`expr $SUCCESSES + 1`
+	    test -z "$VERBOSE" || echo "Successful options '$opts'." >&2
+	else
+	    echo "Failed transfer with options '$opts' for $addr." >&2
+	    RESULT=1
+	fi
+	rm -f file-large "$upload"
+    done
 done
 
 # Test the ability of inetd to reload configuration:
@@ -535,6 +582,81 @@ else
     $silence echo >&2 'Informational: Inhibiting chroot test.'
 fi
 
+# Run tftpd standalone on a port of its own, and let it serve
+# many transfers at once, half of them with options.  Started by
+# root, it serves as `nobody', so files must be open to others.
+#
+DPORT=`expr $PORT + 1`
+locate_port $PROTO $DPORT &&
+    {
+	DPORT=`expr $DPORT + 89 + ${RANDOM:-$$} % 401`
+	locate_port $PROTO $DPORT && do_daemon=false
+    }
+
+if $do_daemon; then
+    $silence echo >&2 'Testing tftpd in daemon mode.'
+    chmod g=rx,o=rx $TMPDIR
+    "$TFTPD" -D -P $DPORT -p "$TFTPD_PID" -w 2 ${LOGGING+"-l"} \
+	"$TMPDIR/tftp-test"
+    sleep 1
+    mkdir "$TMPDIR/daemon"
+
+    for addr in $ADDRESSES; do
+	pids=
+	for n in 1 2 3 4; do
+	    case $n in
+		1|3) opts= ;;
+		*)   opts='blksize 1024
+windowsize 4' ;;
+	    esac
+	    for name in $FILELIST; do
+		test "$name" = $ASCIIFILE && type=ascii || type=binary
+		echo "$type
+$opts
+get $name $TMPDIR/daemon/$name.$n" | \
+		"$TFTP" "$addr" $DPORT >/dev/null 2>&1 &
+		pids="$pids $!"
+	    done
+	done
+	upload="$TMPDIR/tftp-test/upload"
+	: > "$upload" && chmod 666 "$upload"
+	echo "binary
+blksize 1024
+windowsize 4
+put $TMPDIR/tftp-test/file-large $upload" | \
+	"$TFTP" "$addr" $DPORT >/dev/null 2>&1 &
+	pids="$pids $!"
+	wait $pids
+
+	EFFORTS=`expr $EFFORTS + 1`
+	if cmp "$TMPDIR/tftp-test/file-large" "$upload" 2>/dev/null; then
+	    SUCCESSES=`expr $SUCCESSES + 1`
+	else
+	    echo >&2 "Failed daemon mode write to $addr:$upload."
+	    RESULT=1
+	fi
+	rm -f "$upload"
+
+	for n in 1 2 3 4; do
+	    for name in $FILELIST; do
+		EFFORTS=`expr $EFFORTS + 1`
+		if cmp "$TMPDIR/tftp-test/$name" "$TMPDIR/daemon/$name.$n" \
+		    2>/dev/null; then
+		    SUCCESSES=`expr $SUCCESSES + 1`
+		else
+		    echo >&2 "Failed daemon mode transfer of $addr:$name."
+		    RESULT=1
+		fi
+	    done
+	done
+	rm -f "$TMPDIR"/daemon/*
+    done
+
+    kill "`cat $TFTPD_PID`"
+else
+    $silence echo >&2 'Informational: Inhibiting daemon mode test.'
+fi
+
 # Minimal clean up. Main work in posttesting().
 $silence echo
 test $RESULT -eq 0 && test $SUCCESSES -eq $EFFORTS && $silence false \